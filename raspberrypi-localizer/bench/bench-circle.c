@@ -0,0 +1,88 @@
+/*
+ ============================================================================
+ Name        : bench-circle.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Circular ROI count against the bounding square count, for
+               random centres over the whole frame (edges included) at
+               several LED radii. The circle must match the per pixel
+               reference exactly, the ratio shows what the masks cost
+               against the square; the mean background counted shows what
+               the corners added.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include "bench-common.h"
+#include "led-roi.h"
+
+#define CENTRES     4096
+#define ITERATIONS  50
+
+static uint8_t frame[BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+static uint16_t centres[CENTRES][2];
+
+static void run(uint16_t radius)
+{
+  static uint32_t square[CENTRES], circle[CENTRES];
+  led_roi_circle c;
+  uint32_t mismatches = 0;
+  uint64_t square_ones = 0, circle_ones = 0;
+  double t0, t_square, t_circle;
+
+  if (led_roi_circle_init(&c, radius) != 0)
+  {
+    fprintf(stderr, "radius %2u: out of memory\n", radius);
+    return;
+  }
+
+  t0 = bench_now_ns();
+  for (uint32_t n = 0; n < ITERATIONS; n++) {
+    for (uint32_t i = 0; i < CENTRES; i++) {
+      uint32_t x = centres[i][0], y = centres[i][1], r = radius;
+
+      square[i] = led_roi_count(frame, (x > r) ? (x - r) : 0, (y > r) ? (y - r) : 0,
+        ((x + r) < FRAME_WIDTH) ? (x + r + 1) : FRAME_WIDTH, ((y + r) < FRAME_HEIGHT) ? (y + r + 1) : FRAME_HEIGHT);
+    }
+  }
+  t_square = (bench_now_ns() - t0) / (ITERATIONS * CENTRES);
+
+  t0 = bench_now_ns();
+  for (uint32_t n = 0; n < ITERATIONS; n++) {
+    for (uint32_t i = 0; i < CENTRES; i++) {
+      circle[i] = led_roi_count_circle(frame, &c, centres[i][0], centres[i][1]);
+    }
+  }
+  t_circle = (bench_now_ns() - t0) / (ITERATIONS * CENTRES);
+
+  for (uint32_t i = 0; i < CENTRES; i++) {
+    mismatches += circle[i] != led_roi_count_circle_reference(frame, centres[i][0], centres[i][1], radius);
+    square_ones += square[i];
+    circle_ones += circle[i];
+  }
+
+  fprintf(stdout, "radius %2u: square %6.1f ns, circle %6.1f ns (%4.2fx), mean ones square %7.1f circle %7.1f%s\n",
+    radius, t_square, t_circle, t_square / t_circle,
+    (double)square_ones / CENTRES, (double)circle_ones / CENTRES, mismatches ? ", MISMATCH" : "");
+
+  led_roi_circle_destroy(&c);
+}
+
+int main(int argc, char **argv)
+{
+  uint16_t radii[] = {0, 1, 3, 5, 10, 25, 50};
+  uint32_t seed = 0x1B873593;
+
+  bench_scatter(frame, 20000, &seed);
+  for (uint32_t i = 0; i < CENTRES; i++) {
+    centres[i][0] = bench_rand(&seed) % FRAME_WIDTH;
+    centres[i][1] = bench_rand(&seed) % FRAME_HEIGHT;
+  }
+
+  for (int r = 0; r < 7; r++) {
+    run(radii[r]);
+  }
+
+  return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ ============================================================================
+ Name        : bench-common.h
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Helpers shared by the host side benchmarks
+ ============================================================================
+ */
+
+#ifndef BENCH_COMMON_H_
+#define BENCH_COMMON_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "configurations.h"
+
+#define BENCH_FRAME_BYTES   (FRAME_HEIGHT * FRAME_WIDTH / 8)
+
+static inline double bench_now_ns(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (t.tv_sec * 1000000000.0) + t.tv_nsec;
+}
+
+/* xorshift32, deterministic so every run sees the same frames. */
+static inline uint32_t bench_rand(uint32_t *seed)
+{
+  uint32_t x = *seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *seed = x;
+  return x;
+}
+
+/* Pixel (x, y) in the packed 16-row column-interleaved bit frame. */
+static inline void bench_set_pixel(uint8_t *frame, uint32_t x, uint32_t y)
+{
+  uint32_t index = ((y/16) * (FRAME_WIDTH*2)) + (x*2) + ((y%16)>7);
+  frame[index] |= 1 << (y&7);
+}
+
+static inline uint8_t bench_get_pixel(const uint8_t *frame, uint32_t x, uint32_t y)
+{
+  uint32_t index = ((y/16) * (FRAME_WIDTH*2)) + (x*2) + ((y%16)>7);
+  return !!(frame[index] & (1 << (y&7)));
+}
+
+static inline void bench_draw_disk(uint8_t *frame, int cx, int cy, int r)
+{
+  for (int y = cy - r; y <= cy + r; y++) {
+    for (int x = cx - r; x <= cx + r; x++) {
+      if (x >= 0 && y >= 0 && x < FRAME_WIDTH && y < FRAME_HEIGHT &&
+          (x - cx)*(x - cx) + (y - cy)*(y - cy) <= r*r) {
+        bench_set_pixel(frame, x, y);
+      }
+    }
+  }
+}
+
+/* Light roughly ppm pixels per million at random positions. */
+static inline void bench_scatter(uint8_t *frame, uint32_t ppm, uint32_t *seed)
+{
+  for (uint32_t y = 0; y < FRAME_HEIGHT; y++) {
+    for (uint32_t x = 0; x < FRAME_WIDTH; x++) {
+      if ((bench_rand(seed) % 1000000) < ppm) {
+        bench_set_pixel(frame, x, y);
+      }
+    }
+  }
+}
+
+/*
+ State at frame f of an LED repeating message, MESSAGE_LENGTH bits MSB first,
+ each bit b sent as half_bit frames of b then half_bit frames of !b, with
+ idle dark frames between repeats.
+ */
+static inline uint8_t bench_manchester_state(uint32_t message, uint32_t f, uint32_t half_bit, uint32_t idle)
+{
+  uint32_t period = (MESSAGE_LENGTH * 2 * half_bit) + idle;
+  uint32_t half = (f % period) / half_bit;
+  uint8_t bit;
+
+  if (half >= MESSAGE_LENGTH * 2)
+    return 0;
+
+  bit = (message >> (MESSAGE_LENGTH - 1 - (half / 2))) & 1;
+  return (half & 1) ? !bit : bit;
+}
+
+/* glReadPixels image of a packed frame, each column word in the first two bytes of an RGBA pixel. */
+static inline void bench_readback(uint8_t *readback, const uint8_t *frame)
+{
+  const uint16_t *words = (const uint16_t*) frame;
+
+  for (uint32_t i = 0; i < FRAME_WIDTH * (FRAME_HEIGHT / 16); i++) {
+    readback[(i * 4) + 0] = words[i] & 0xFF;
+    readback[(i * 4) + 1] = words[i] >> 8;
+    readback[(i * 4) + 2] = 0;
+    readback[(i * 4) + 3] = 0xFF;
+  }
+}
+
+#endif /* BENCH_COMMON_H_ */
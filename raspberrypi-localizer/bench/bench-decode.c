@@ -0,0 +1,220 @@
+/*
+ ============================================================================
+ Name        : bench-decode.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : ns/frame of led_process over the tracker table against the
+               previous layout (one struct per tracker, double times,
+               walked through a linked list), for 1 to 500 trackers.
+               Every tracker replays a Manchester coded ID; both layouts
+               are fed the same ROI sums and must agree on every status.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include "bench-common.h"
+#include "led-detector.h"
+
+#define FRAMES          2000
+#define HALF_BIT_FRAMES 2
+#define IDLE_FRAMES     12
+
+/* struct led_t and the decode part of led_process before the tracker table. */
+typedef struct legacy_led_t {
+  uint32_t raw_data;
+  uint8_t  prev_frame_state;
+  uint8_t  last_flip_was_data;
+  uint8_t  is_first_frame;
+  double   transmission_start_time;
+  double   current_bit_start_time;
+  double   prev_state_end_time;
+  double   prev_frame_time;
+  uint32_t start_frame_index;
+
+  uint16_t x;
+  uint16_t y;
+  uint16_t id;
+
+  uint16_t one_zero_thresh;
+  uint16_t led_radius;
+  uint32_t area;
+  uint32_t area_sum;
+  uint32_t ones;
+  uint32_t sum;
+
+  struct legacy_led_t *next;
+  struct legacy_led_t *grid_next;
+  struct legacy_led_t *grid_prev;
+  uint32_t grid_cell;
+  uint32_t grid_serial;
+  struct legacy_led_t *pool_next;
+} legacy_led;
+
+static void legacy_init(legacy_led *l, double frame_time)
+{
+  l -> id = 0;
+  l -> current_bit_start_time = frame_time;
+  l -> transmission_start_time = frame_time;
+  l -> prev_state_end_time = frame_time;
+  l -> one_zero_thresh = LED_ONE_ZERO_THRESHOLD;
+  l -> led_radius = LED_RADIUS;
+  l -> area_sum = LED_ONE_ZERO_THRESHOLD;
+  l -> ones = 1;
+  l -> is_first_frame = 1;
+  l -> prev_frame_state = 0;
+  l -> raw_data = 0;
+}
+
+static uint8_t legacy_process(legacy_led *l, double frame_time)
+{
+  uint32_t sum = l -> sum;
+  uint8_t status = 0;
+  uint8_t current_frame_state = sum > l -> one_zero_thresh;
+  uint8_t is_state_flip = (l -> prev_frame_state != current_frame_state);
+  uint8_t state_based_end_transmission = 0;
+  uint8_t bit_based_end_transmission = (frame_time - l -> current_bit_start_time) > (BIT_TRANSFER_TIME + 2*FRAME_TRANSFER_TIME_F + 10);
+  double state_elapsed_time = frame_time - l -> prev_state_end_time;
+
+  if (l -> id)
+    return 1;
+
+  if (l -> prev_frame_state)
+    state_based_end_transmission = state_elapsed_time > (BIT_TRANSFER_TIME + 2*FRAME_TRANSFER_TIME_F + 10);
+  else
+    state_based_end_transmission = state_elapsed_time > (BIT_TRANSFER_TIME + FRAME_TRANSFER_TIME_F + 10);
+
+  if (is_state_flip)
+  {
+    if (!state_based_end_transmission && l -> prev_frame_state)
+      state_based_end_transmission = state_elapsed_time < (2*FRAME_TRANSFER_TIME_F - 10);
+    l -> prev_state_end_time = frame_time;
+  }
+
+  state_based_end_transmission = (state_based_end_transmission && (l -> ones > 3));
+
+  if ((!is_state_flip && bit_based_end_transmission) || state_based_end_transmission)
+    status = 2;
+
+  if (!l -> is_first_frame && (is_state_flip || bit_based_end_transmission))
+  {
+    double elapsed_time = frame_time - l -> current_bit_start_time;
+    uint8_t is_data;
+
+    if (current_frame_state == 1)
+      is_data = elapsed_time > BIT_TRANSFER_TIME/2;
+    else
+      is_data = elapsed_time > (BIT_TRANSFER_TIME/2 + FRAME_TRANSFER_TIME_F);
+
+    if ((l -> raw_data == 0) || is_data) {
+      l -> raw_data <<= 1;
+      l -> raw_data |= !current_frame_state;
+      l -> current_bit_start_time = frame_time;
+    }
+  }
+
+  if (current_frame_state) {
+    l -> area_sum += sum;
+    l -> ones++;
+  }
+
+  if (l -> raw_data & 0x100000) {
+    uint32_t data = (l -> raw_data >> 4) & 0xFFFF;
+
+    if (data && led_calculate_checksum(data) == (l -> raw_data & 0xF)) {
+      l -> id = data;
+      status = 1;
+    }
+  }
+
+  l -> prev_frame_state = current_frame_state;
+  l -> prev_frame_time = frame_time;
+  l -> is_first_frame = 0;
+
+  return status;
+}
+
+/* Preamble, 16 data bits and checksum. */
+static uint8_t led_state(uint16_t id, uint32_t frame)
+{
+  return bench_manchester_state((1u << 20) | ((uint32_t)id << 4) | led_calculate_checksum(id), frame, HALF_BIT_FRAMES, IDLE_FRAMES);
+}
+
+static void run(uint32_t trackers)
+{
+  legacy_led *legacy = (legacy_led*)malloc(trackers * sizeof(legacy_led));
+  legacy_led *head = NULL;
+  uint16_t *ids = (uint16_t*)malloc(trackers * sizeof(uint16_t));
+  uint32_t *phase = (uint32_t*)malloc(trackers * sizeof(uint32_t));
+  uint8_t *status = (uint8_t*)malloc(trackers * sizeof(uint8_t));
+  uint32_t seed = 0x2545F491;
+  uint32_t decoded = 0, mismatches = 0;
+  double t0, t_legacy = 0, t_table = 0;
+  led_table t;
+
+  led_table_init(&t, trackers);
+  for (uint32_t i = 0; i < trackers; i++) {
+    ids[i] = (bench_rand(&seed) & 0x7FFF) | 1;
+    phase[i] = bench_rand(&seed) % 1000;
+    legacy_init(&legacy[i], 0.0);
+    led_init_vals(&t, t.count++, 0, 0, LED_ONE_ZERO_THRESHOLD, LED_RADIUS, 0, 0, 0);
+  }
+  /* The queue was walked newest first. */
+  for (uint32_t i = 0; i < trackers; i++) {
+    legacy[i].next = head;
+    head = &legacy[i];
+  }
+
+  for (uint32_t f = 1; f <= FRAMES; f++) {
+    double frame_ms = f * FRAME_TRANSFER_TIME_F;
+    uint32_t frame_us = f * FRAME_TRANSFER_TIME * 1000;
+
+    for (uint32_t i = 0; i < trackers; i++) {
+      uint32_t sum = led_state(ids[i], f + phase[i]) ? (LED_ONE_ZERO_THRESHOLD * 2) : (bench_rand(&seed) % (LED_ONE_ZERO_THRESHOLD / 2));
+
+      legacy[i].sum = sum;
+      t.sum[i] = sum;
+    }
+
+    t0 = bench_now_ns();
+    for (legacy_led *l = head; l; l = l -> next) {
+      status[l - legacy] = legacy_process(l, frame_ms);
+    }
+    t_legacy += bench_now_ns() - t0;
+
+    t0 = bench_now_ns();
+    led_process(&t, frame_us);
+    t_table += bench_now_ns() - t0;
+
+    /* Both layouts restart a tracker once its transmission ends or its ID is decoded. */
+    for (uint32_t i = 0; i < trackers; i++) {
+      mismatches += status[i] != t.status[i];
+      decoded += t.status[i] == 1 && t.id[i] == ids[i];
+      if (t.status[i]) {
+        legacy_init(&legacy[i], frame_ms);
+        led_init_vals(&t, i, 0, 0, LED_ONE_ZERO_THRESHOLD, LED_RADIUS, f, frame_us, 0);
+      }
+    }
+  }
+
+  fprintf(stdout, "%4u trackers: legacy %9.1f ns/frame, table %9.1f ns/frame (%4.1fx), %u IDs decoded%s\n",
+    trackers, t_legacy / FRAMES, t_table / FRAMES, t_legacy / t_table, decoded,
+    mismatches ? ", MISMATCH" : "");
+
+  led_table_destroy(&t);
+  free(legacy);
+  free(ids);
+  free(phase);
+  free(status);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t counts[] = {1, 10, 50, 100, 200, 500};
+
+  for (int c = 0; c < 6; c++) {
+    run(counts[c]);
+  }
+
+  return 0;
+}
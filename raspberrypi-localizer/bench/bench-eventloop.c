@@ -0,0 +1,306 @@
+/*
+ ============================================================================
+ Name        : bench-eventloop.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : CPU time and context switches per frame of the threaded
+               localizer against the -event_loop mode, on a host model of
+               both: a camera thread queues a frame every PERIOD_US like
+               the MMAL callback. Threaded, a preview thread polls that
+               queue with usleep(0) as preview_worker does (or blocks on it,
+               to tell the polling from the thread hops), copies frames
+               into the detector's ring, and the detector worker and the log
+               writer run on threads of their own. With the event loop one
+               thread waits in epoll on the frame eventfd, a report timer
+               and a signalfd, processes inline and drains the log. Every
+               mode must report exactly the same IDs.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "bench-common.h"
+#include "led-detector.h"
+#include "rt-thread.h"
+
+#define LEDS            200
+#define FRAMES          480
+#define PERIOD_US       2000
+#define HALF_BIT_FRAMES 2
+#define IDLE_FRAMES     12
+
+#define MODE_POLLING    0
+#define MODE_BLOCKING   1
+#define MODE_LOOP       2
+
+static uint8_t frames[FRAMES][BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+static uint8_t readbacks[FRAMES][LED_READBACK_BYTES] __attribute__((aligned(64)));
+
+/* Stands in for the MMAL preview queue and callback. */
+typedef struct camera_t {
+  pthread_mutex_t lock;
+  uint32_t        queued;
+  uint32_t        taken;
+  int             frame_fd;
+  uint8_t         done;
+  pthread_t       thread;
+} camera;
+
+static void* camera_run(void *args)
+{
+  camera *c = (camera*)args;
+  struct timespec next;
+  uint64_t one = 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (uint32_t f = 0; f < FRAMES; f++) {
+    next.tv_nsec += PERIOD_US * 1000L;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000L;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    pthread_mutex_lock(&c->lock);
+    c->queued++;
+    pthread_mutex_unlock(&c->lock);
+    if (write(c->frame_fd, &one, sizeof(one)) < 0)
+      break;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  c->done = 1;
+  pthread_mutex_unlock(&c->lock);
+  if (write(c->frame_fd, &one, sizeof(one)) < 0)
+    return NULL;
+  /* The event loop is stopped by a signal, like the localizer. */
+  kill(getpid(), SIGUSR1);
+  return NULL;
+}
+
+/* Next queued frame, -1 when there is none, -2 once the camera is done and everything was taken. */
+static int32_t camera_get(camera *c)
+{
+  int32_t f = -1;
+
+  pthread_mutex_lock(&c->lock);
+  if (c->taken < c->queued)
+    f = c->taken++;
+  else if (c->done)
+    f = -2;
+  pthread_mutex_unlock(&c->lock);
+  return f;
+}
+
+static void state_init(RASPITEX_STATE *state, uint8_t event_loop)
+{
+  memset(state, 0, sizeof(*state));
+  state->led_find_radius = 10;
+  state->led_blob_size = 8;
+  state->led_radius = 5;
+  state->led_one_zero_thresh = 10;
+  state->led_capacity = 256;
+  state->led_decode_threads = 1;
+  /* Every frame must go through, the ring waits rather than drops. */
+  state->led_drop_policy = FRAME_RING_BLOCK;
+  state->event_loop = event_loop;
+}
+
+static void publish(led_detector *ld, int32_t f)
+{
+  uint8_t *readback = led_detector_frame_acquire(ld);
+
+  memcpy(readback, readbacks[f], LED_READBACK_BYTES);
+  led_detector_frame_publish(ld, (f + 1) * FRAME_TRANSFER_TIME, f);
+}
+
+static void run_threaded(camera *c, led_detector *ld, int polling)
+{
+  int32_t f;
+
+  for (;;) {
+    uint64_t count;
+
+    if (!polling && read(c->frame_fd, &count, sizeof(count)) < 0)
+      break;
+    while ((f = camera_get(c)) >= 0)
+      publish(ld, f);
+    if (f == -2)
+      break;
+    if (polling)
+      usleep(0);
+  }
+}
+
+static void run_loop(camera *c, led_detector *ld, const sigset_t *signals, uint32_t *reports)
+{
+  struct epoll_event e, events[4];
+  struct itimerspec period = { { 0, 100000000L }, { 0, 100000000L } };
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  int signal_fd = signalfd(-1, signals, SFD_CLOEXEC | SFD_NONBLOCK);
+  int report_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  int stop = 0;
+
+  timerfd_settime(report_fd, 0, &period, NULL);
+  e.events = EPOLLIN;
+  e.data.fd = c->frame_fd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, c->frame_fd, &e);
+  e.data.fd = signal_fd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, signal_fd, &e);
+  e.data.fd = report_fd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, report_fd, &e);
+  log_ring_start_polled(&ld->log);
+
+  while (!stop) {
+    int n = epoll_wait(epfd, events, 4, -1);
+
+    for (int i = 0; i < n; i++) {
+      uint64_t count;
+      int32_t f;
+
+      if (events[i].data.fd == c->frame_fd) {
+        if (read(c->frame_fd, &count, sizeof(count)) > 0) {
+          while ((f = camera_get(c)) >= 0)
+            publish(ld, f);
+        }
+      } else if (events[i].data.fd == signal_fd) {
+        struct signalfd_siginfo info;
+
+        if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+          stop = 1;
+      } else if (read(report_fd, &count, sizeof(count)) > 0) {
+        (*reports)++;
+      }
+    }
+    log_ring_drain(&ld->log);
+  }
+
+  close(epfd);
+  close(signal_fd);
+  close(report_fd);
+}
+
+/* Output of one replay in the given mode, with the usage it took. */
+static char* replay(int mode, rt_usage *used, size_t *length, uint32_t *reports)
+{
+  RASPITEX_STATE state;
+  led_detector *ld;
+  camera c;
+  rt_usage u0, u1;
+  sigset_t signals;
+  FILE *out = tmpfile();
+  char *text;
+
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  state_init(&state, mode == MODE_LOOP);
+  ld = led_detector_create(&state);
+  ld->log.out = out;
+
+  memset(&c, 0, sizeof(c));
+  pthread_mutex_init(&c.lock, NULL);
+  c.frame_fd = eventfd(0, EFD_CLOEXEC | ((mode == MODE_LOOP) ? EFD_NONBLOCK : 0));
+  *reports = 0;
+
+  rt_usage_get(&u0);
+  pthread_create(&c.thread, NULL, camera_run, &c);
+  if (mode == MODE_LOOP)
+    run_loop(&c, ld, &signals, reports);
+  else
+    run_threaded(&c, ld, mode == MODE_POLLING);
+  pthread_join(c.thread, NULL);
+  /* Threaded, the worker and the writer drain what is still queued. */
+  led_detector_free(ld);
+  rt_usage_get(&u1);
+
+  used->cpu_us = u1.cpu_us - u0.cpu_us;
+  used->voluntary_switches = u1.voluntary_switches - u0.voluntary_switches;
+  used->involuntary_switches = u1.involuntary_switches - u0.involuntary_switches;
+
+  /* Take the SIGUSR1 the threaded modes left pending. */
+  if (mode != MODE_LOOP) {
+    int sig;
+    sigwait(&signals, &sig);
+  }
+
+  close(c.frame_fd);
+  pthread_mutex_destroy(&c.lock);
+
+  fflush(out);
+  *length = ftell(out);
+  text = (char*)malloc(*length + 1);
+  rewind(out);
+  *length = fread(text, 1, *length, out);
+  fclose(out);
+  return text;
+}
+
+int main(int argc, char **argv)
+{
+  const char *names[] = {"threaded, polling", "threaded, blocking", "event loop"};
+  uint32_t seed = 0x7A3F0C15;
+  uint32_t messages[LEDS];
+  uint16_t x[LEDS], y[LEDS];
+  uint8_t r[LEDS];
+  uint32_t phase[LEDS];
+  char *expected = NULL;
+  size_t expected_length = 0;
+  int failed = 0;
+
+  /* 20 x 10 grid, jittered, 16 px apart across and 24 px down. */
+  for (uint32_t i = 0; i < LEDS; i++) {
+    uint16_t id = (bench_rand(&seed) & 0x7FFF) | 1;
+
+    messages[i] = (1u << 20) | ((uint32_t)id << 4) | led_calculate_checksum(id);
+    x[i] = 8 + ((i % 20) * 16) + (bench_rand(&seed) % 5) - 2;
+    y[i] = 12 + ((i / 20) * 24) + (bench_rand(&seed) % 7) - 3;
+    r[i] = 2 + (bench_rand(&seed) % 2);
+    phase[i] = bench_rand(&seed) % 1000;
+  }
+
+  for (uint32_t f = 0; f < FRAMES; f++) {
+    bench_scatter(frames[f], 300, &seed);
+    for (uint32_t i = 0; i < LEDS; i++) {
+      if (bench_manchester_state(messages[i], f + phase[i], HALF_BIT_FRAMES, IDLE_FRAMES))
+        bench_draw_disk(frames[f], x[i], y[i], r[i]);
+    }
+    bench_readback(readbacks[f], frames[f]);
+  }
+
+  fprintf(stdout, "%ld cpus online, a frame every %u us\n", sysconf(_SC_NPROCESSORS_ONLN), PERIOD_US);
+  for (int mode = MODE_POLLING; mode <= MODE_LOOP; mode++) {
+    rt_usage used;
+    size_t length;
+    uint32_t reports, lines = 0;
+    char *text = replay(mode, &used, &length, &reports);
+    int same;
+
+    for (size_t k = 0; k < length; k++)
+      lines += text[k] == '\n';
+    if (mode == MODE_POLLING) {
+      expected = text;
+      expected_length = length;
+    }
+    same = (length == expected_length) && !memcmp(text, expected, length);
+    failed |= !same;
+
+    fprintf(stdout, "%-18s cpu %7.1f us/frame, switches %5.2f voluntary + %5.2f involuntary per frame, %u IDs reported%s\n",
+      names[mode], (double)used.cpu_us / FRAMES, (double)used.voluntary_switches / FRAMES,
+      (double)used.involuntary_switches / FRAMES, lines, same ? "" : ", MISMATCH");
+    if (text != expected)
+      free(text);
+  }
+
+  free(expected);
+  return failed;
+}
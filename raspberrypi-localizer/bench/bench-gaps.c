@@ -0,0 +1,115 @@
+/*
+ ============================================================================
+ Name        : bench-gaps.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : IDs decoded by led_process when frames are dropped before
+               the decoder, at random and in bursts, with the trackers
+               blind to the drops (only the frame times jump) against
+               told of them through led_table_gap. Counts the IDs decoded
+               right and the ones that passed the checksum with the
+               wrong value.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include "bench-common.h"
+#include "led-detector.h"
+
+#define TRACKERS        200
+#define FRAMES          20000
+#define HALF_BIT_FRAMES 2
+#define IDLE_FRAMES     12
+
+typedef struct result_t {
+  uint32_t right;
+  uint32_t wrong;
+  uint32_t missed;
+} result;
+
+/* Preamble, 16 data bits and checksum. */
+static uint8_t led_state(uint16_t id, uint32_t frame)
+{
+  return bench_manchester_state((1u << 20) | ((uint32_t)id << 4) | led_calculate_checksum(id), frame, HALF_BIT_FRAMES, IDLE_FRAMES);
+}
+
+/* Replay with each frame dropped with probability ppm / 1e6, and the frames after a drop with probability burst_ppm. */
+static result run(uint32_t ppm, uint32_t burst_ppm, int aware)
+{
+  led_table t;
+  uint16_t ids[TRACKERS];
+  uint32_t phase[TRACKERS];
+  uint32_t seed = 0x3C6EF372, drop_seed = 0x9E3779B9;
+  uint32_t prev_us = 0, prev_f = 0;
+  uint8_t dropping = 0;
+  result r = {0, 0, 0};
+
+  led_table_init(&t, TRACKERS);
+  for (uint32_t i = 0; i < TRACKERS; i++) {
+    ids[i] = (bench_rand(&seed) & 0x7FFF) | 1;
+    phase[i] = bench_rand(&seed) % 1000;
+    led_init_vals(&t, t.count++, 0, 0, LED_ONE_ZERO_THRESHOLD, LED_RADIUS, 0, 0, 0);
+  }
+
+  for (uint32_t f = 1; f <= FRAMES; f++) {
+    uint32_t frame_us = f * FRAME_TRANSFER_TIME * 1000;
+
+    /* The noise on the sums is drawn for every frame, dropped or not, so all runs see the same frames. */
+    for (uint32_t i = 0; i < TRACKERS; i++) {
+      t.sum[i] = led_state(ids[i], f + phase[i]) ? (LED_ONE_ZERO_THRESHOLD * 2) : (bench_rand(&seed) % (LED_ONE_ZERO_THRESHOLD / 2));
+    }
+
+    dropping = (bench_rand(&drop_seed) % 1000000) < (dropping ? burst_ppm : ppm);
+    if (dropping) {
+      r.missed++;
+      continue;
+    }
+
+    led_table_gap(&t, aware ? (f - prev_f - 1) : 0, frame_us - prev_us);
+    led_process(&t, frame_us);
+    prev_f = f;
+    prev_us = frame_us;
+
+    for (uint32_t i = 0; i < TRACKERS; i++) {
+      r.right += t.status[i] == 1 && t.id[i] == ids[i];
+      r.wrong += t.status[i] == 1 && t.id[i] != ids[i];
+      if (t.status[i])
+        led_init_vals(&t, i, 0, 0, LED_ONE_ZERO_THRESHOLD, LED_RADIUS, f, frame_us, 0);
+    }
+  }
+
+  led_table_destroy(&t);
+  return r;
+}
+
+int main(int argc, char **argv)
+{
+  const struct {
+    const char  *name;
+    uint32_t    ppm;
+    uint32_t    burst_ppm;
+  } cases[] = {
+    {"no drops",      0,      0},
+    {"1% random",     10000,  0},
+    {"5% random",     50000,  0},
+    {"10% random",    100000, 0},
+    {"1% bursts",     5000,   500000},
+  };
+  int failed = 0;
+
+  for (uint32_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    result blind = run(cases[c].ppm, cases[c].burst_ppm, 0);
+    result aware = run(cases[c].ppm, cases[c].burst_ppm, 1);
+
+    /* Without drops both must decode exactly the same. */
+    if (cases[c].ppm == 0)
+      failed |= (blind.right != aware.right) || (blind.wrong != aware.wrong);
+
+    fprintf(stdout, "%-11s %5u frames missed: blind %5u right, %4u wrong; gap aware %5u right, %4u wrong%s\n",
+      cases[c].name, aware.missed, blind.right, blind.wrong, aware.right, aware.wrong,
+      (cases[c].ppm == 0 && failed) ? ", MISMATCH" : "");
+  }
+
+  return failed;
+}
@@ -0,0 +1,141 @@
+/*
+ ============================================================================
+ Name        : bench-instances.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Aggregate frames per second of 1 to 4 independent detectors,
+               each created with led_detector_create and replaying the
+               same synthetic 200 LED recording on its own thread into its
+               own output stream. Every instance must print exactly what a
+               lone instance prints.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "bench-common.h"
+#include "led-detector.h"
+
+#define LEDS            200
+#define FRAMES          480
+#define REPEAT          4
+#define HALF_BIT_FRAMES 2
+#define IDLE_FRAMES     12
+#define INSTANCES_MAX   4
+
+static uint8_t frames[FRAMES][BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+static led_frame_occupancy occupancy[FRAMES];
+
+typedef struct instance_t {
+  pthread_t thread;
+  FILE      *out;
+  char      *text;
+  size_t    length;
+} instance;
+
+/* One replay job: a detector of its own fed every frame, REPEAT times. */
+static void* replay(void *args)
+{
+  instance *in = (instance*)args;
+  RASPITEX_STATE state;
+
+  /* Small LEDs, the debug defaults are for the large test board. */
+  memset(&state, 0, sizeof(state));
+  state.led_find_radius = 10;
+  state.led_blob_size = 8;
+  state.led_radius = 5;
+  state.led_one_zero_thresh = 10;
+  state.led_capacity = 256;
+  state.led_decode_threads = 1;
+
+  in->out = tmpfile();
+  for (uint32_t r = 0; r < REPEAT; r++) {
+    led_detector *ld = led_detector_create(&state);
+
+    ld->log.out = in->out;
+    for (uint32_t f = 0; f < FRAMES; f++) {
+      frame_info info;
+
+      info.frame_time = (f + 1) * FRAME_TRANSFER_TIME * 1000;
+      info.frame_number = f;
+      info.occupancy = occupancy[f];
+      led_detector_process_internal(ld, frames[f], &info);
+    }
+    led_detector_free(ld);
+  }
+
+  in->length = ftell(in->out);
+  in->text = (char*)malloc(in->length + 1);
+  rewind(in->out);
+  in->length = fread(in->text, 1, in->length, in->out);
+  fclose(in->out);
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t seed = 0x1B873593;
+  uint32_t messages[LEDS];
+  uint16_t x[LEDS], y[LEDS];
+  uint8_t r[LEDS];
+  uint32_t phase[LEDS];
+  char *expected = NULL;
+  size_t expected_length = 0;
+  double fps1 = 0;
+  int failed = 0;
+
+  /* 20 x 10 grid, jittered, 16 px apart across and 24 px down. */
+  for (uint32_t i = 0; i < LEDS; i++) {
+    uint16_t id = (bench_rand(&seed) & 0x7FFF) | 1;
+
+    messages[i] = (1u << 20) | ((uint32_t)id << 4) | led_calculate_checksum(id);
+    x[i] = 8 + ((i % 20) * 16) + (bench_rand(&seed) % 5) - 2;
+    y[i] = 12 + ((i / 20) * 24) + (bench_rand(&seed) % 7) - 3;
+    r[i] = 2 + (bench_rand(&seed) % 2);
+    phase[i] = bench_rand(&seed) % 1000;
+  }
+
+  for (uint32_t f = 0; f < FRAMES; f++) {
+    bench_scatter(frames[f], 300, &seed);
+    for (uint32_t i = 0; i < LEDS; i++) {
+      if (bench_manchester_state(messages[i], f + phase[i], HALF_BIT_FRAMES, IDLE_FRAMES))
+        bench_draw_disk(frames[f], x[i], y[i], r[i]);
+    }
+    led_detector_frame_occupancy(&occupancy[f], frames[f]);
+  }
+
+  fprintf(stdout, "%ld cpus online\n", sysconf(_SC_NPROCESSORS_ONLN));
+  for (uint32_t n = 1; n <= INSTANCES_MAX; n++) {
+    instance instances[INSTANCES_MAX];
+    uint32_t lines = 0, same = 1;
+    double t0 = bench_now_ns(), fps;
+
+    for (uint32_t i = 0; i < n; i++)
+      pthread_create(&instances[i].thread, NULL, replay, &instances[i]);
+    for (uint32_t i = 0; i < n; i++)
+      pthread_join(instances[i].thread, NULL);
+    fps = (n * FRAMES * REPEAT) / ((bench_now_ns() - t0) / 1e9);
+
+    if (n == 1) {
+      expected = instances[0].text;
+      expected_length = instances[0].length;
+      fps1 = fps;
+    }
+    for (size_t k = 0; k < expected_length; k++)
+      lines += expected[k] == '\n';
+    for (uint32_t i = 0; i < n; i++) {
+      same &= (instances[i].length == expected_length) && !memcmp(instances[i].text, expected, expected_length);
+      if (instances[i].text != expected)
+        free(instances[i].text);
+    }
+    failed |= !same;
+
+    fprintf(stdout, "%u instances: %8.0f frames/s in total (%4.2fx), %u IDs reported each%s\n",
+      n, fps, fps / fps1, lines / REPEAT, same ? "" : ", MISMATCH");
+  }
+
+  free(expected);
+  return failed;
+}
@@ -0,0 +1,145 @@
+/*
+ ============================================================================
+ Name        : bench-jitter.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Frame interval histogram of a thread woken every
+               FRAME_TRANSFER_TIME ms to run the detector on a frame,
+               while two busy threads per CPU compete with it, under the
+               default policy and then with the -rt_detector settings
+               given on the command line (default 50:0) and mlockall.
+               Without CAP_SYS_NICE the second run reports why it could
+               not switch and is left out.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "bench-common.h"
+#include "led-detector.h"
+#include "rt-thread.h"
+
+#define TICKS           100
+#define LEDS            50
+
+static uint8_t frame[BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+static atomic_int stop;
+
+/* Stands in for the wrapper, cron and logging: never sleeps, touches memory. */
+static void* hog(void *args)
+{
+  static __thread uint8_t scratch[1 << 16];
+  uint32_t seed = (uint32_t)(uintptr_t)args;
+
+  while (!atomic_load_explicit(&stop, memory_order_relaxed))
+  {
+    for (uint32_t i = 0; i < sizeof(scratch); i += 64)
+      scratch[i] += bench_rand(&seed);
+  }
+  return NULL;
+}
+
+typedef struct periodic_t {
+  rt_thread_config  config;
+  rt_jitter         jitter;
+  int               applied;
+} periodic;
+
+static void* tick(void *args)
+{
+  periodic *p = (periodic*)args;
+  RASPITEX_STATE state;
+  led_detector *ld;
+  struct timespec next;
+
+  p -> applied = rt_thread_apply(& p -> config, "periodic", stdout);
+
+  memset(&state, 0, sizeof(state));
+  state.led_find_radius = 10;
+  state.led_blob_size = 8;
+  state.led_radius = 5;
+  state.led_one_zero_thresh = 10;
+  state.led_capacity = 256;
+  state.led_decode_threads = 1;
+  ld = led_detector_create(&state);
+  ld -> log.out = fopen("/dev/null", "w");
+
+  rt_jitter_reset(& p -> jitter);
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (uint32_t f = 0; f < TICKS; f++)
+  {
+    frame_info info;
+
+    next.tv_nsec += FRAME_TRANSFER_TIME * 1000000L;
+    if (next.tv_nsec >= 1000000000L)
+    {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000L;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    rt_jitter_add(& p -> jitter, bench_now_ns() / 1e6);
+
+    info.frame_time = (f + 1) * FRAME_TRANSFER_TIME * 1000;
+    info.frame_number = f;
+    led_detector_frame_occupancy(&info.occupancy, frame);
+    led_detector_process_internal(ld, frame, &info);
+  }
+
+  fclose(ld -> log.out);
+  led_detector_free(ld);
+  return NULL;
+}
+
+static int run(const char *name, const rt_thread_config *config)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t hogs = (cpus > 0) ? (2 * cpus) : 2;
+  pthread_t threads[2 * 64], periodic_thread;
+  periodic p;
+
+  if (hogs > sizeof(threads) / sizeof(threads[0]))
+    hogs = sizeof(threads) / sizeof(threads[0]);
+
+  p.config = *config;
+  atomic_store(&stop, 0);
+  for (uint32_t i = 0; i < hogs; i++)
+    pthread_create(&threads[i], NULL, hog, (void*)(uintptr_t)(i + 1));
+  pthread_create(&periodic_thread, NULL, tick, &p);
+  pthread_join(periodic_thread, NULL);
+  atomic_store(&stop, 1);
+  for (uint32_t i = 0; i < hogs; i++)
+    pthread_join(threads[i], NULL);
+
+  if (p.applied == 0)
+    rt_jitter_print(&p.jitter, name, stdout);
+  return p.applied;
+}
+
+int main(int argc, char **argv)
+{
+  rt_thread_config fifo;
+  uint32_t seed = 0x2545F491;
+
+  if (rt_thread_parse(&fifo, (argc > 1) ? argv[1] : "50:0") != 0)
+  {
+    fprintf(stderr, "usage: %s [priority[:cpu]]\n", argv[0]);
+    return 1;
+  }
+
+  bench_scatter(frame, 300, &seed);
+  for (uint32_t i = 0; i < LEDS; i++)
+    bench_draw_disk(frame, bench_rand(&seed) % FRAME_WIDTH, bench_rand(&seed) % FRAME_HEIGHT, 3);
+
+  fprintf(stdout, "%ld cpus online, %u ms period\n", sysconf(_SC_NPROCESSORS_ONLN), FRAME_TRANSFER_TIME);
+  run("default", &(rt_thread_config){0, 0, 0});
+  if (rt_lock_memory(stdout) == 0)
+    run("fifo+mlock", &fifo);
+  else
+    run("fifo", &fifo);
+
+  return 0;
+}
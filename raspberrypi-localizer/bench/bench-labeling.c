@@ -0,0 +1,207 @@
+/*
+ ============================================================================
+ Name        : bench-labeling.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Compare explicit-stack and run based blob labeling against
+               the old recursive flood fill on synthetic sparse and dense
+               frames.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include "bench-common.h"
+#include "led-detector.h"
+
+#define ITERATIONS 200
+
+/* Recursive flood fill as it was in led-detector.c, kept as the reference. */
+typedef struct flood_state_t {
+  uint8_t  *frame;
+  uint16_t minx;
+  uint16_t miny;
+  uint16_t maxx;
+  uint16_t maxy;
+  uint32_t area;
+} flood_state;
+
+static void flood_check(flood_state *fs, uint16_t x, uint16_t y)
+{
+  uint32_t index = ((y/16) * (FRAME_WIDTH*2)) + (x*2) + ((y%16)>7);
+
+  uint8_t bit = fs -> frame[index] & (1 << (y&7));
+
+  if (bit)
+  {
+    fs -> frame[index] &= ~bit;
+    fs -> area++;
+
+    if (fs -> area > 10000)
+      return;
+
+    if (x < fs -> minx)
+      fs -> minx = x;
+    else if (x > fs -> maxx)
+      fs -> maxx = x;
+    if (y < fs -> miny)
+      fs -> miny = y;
+    else if (y > fs -> maxy)
+      fs -> maxy = y;
+
+    if (y > 0)
+    {
+      if (x > 0)
+        flood_check(fs, x - 1, y - 1);
+      flood_check(fs, x , y - 1);
+      if (x < (FRAME_WIDTH - 1))
+        flood_check(fs, x + 1, y - 1);
+    }
+    if (x > 0)
+      flood_check(fs, x - 1, y);
+    if (x < (FRAME_WIDTH - 1))
+      flood_check(fs, x + 1, y);
+    if (y < (FRAME_HEIGHT - 1))
+    {
+      if (x > 0)
+        flood_check(fs, x - 1, y + 1);
+      flood_check(fs, x, y + 1);
+      if (x < (FRAME_WIDTH - 1))
+        flood_check(fs, x + 1, y + 1);
+    }
+  }
+}
+
+/* Walk the frame in the same order as led_detector_detect_leds. */
+static void scan_recursive(uint8_t *frame, uint32_t *blobs, uint32_t *area)
+{
+  flood_state fs;
+  uint32_t *worker = (uint32_t*) frame;
+
+  fs.frame = frame;
+  for (uint32_t i = 0; i < FRAME_HEIGHT; i+=16)
+  {
+    for (uint32_t j = 0; j < FRAME_WIDTH*2; j+=4)
+    {
+      for (uint32_t k = 0; *worker && k < 32; k++)
+      {
+        if (*worker & (1 << k))
+        {
+          fs.minx = fs.maxx = j/2 + k/16;
+          fs.miny = fs.maxy = i + k%16;
+          fs.area = 0;
+          flood_check(&fs, j/2 + k/16, i + k%16);
+          (*blobs)++;
+          *area += fs.area;
+        }
+      }
+      worker++;
+    }
+  }
+}
+
+static uint32_t scan_labeling(led_detector *ld, led_blob *out, uint32_t *blobs, uint32_t *area)
+{
+  uint32_t n = 0;
+  uint32_t *worker = (uint32_t*) ld -> prev_bit_frame;
+
+  for (uint32_t i = 0; i < FRAME_HEIGHT; i+=16)
+  {
+    for (uint32_t j = 0; j < FRAME_WIDTH*2; j+=4)
+    {
+      for (uint32_t k = 0; *worker && k < 32; k++)
+      {
+        if (*worker & (1 << k))
+        {
+          led_detector_label_blob(ld, j/2 + k/16, i + k%16, &out[n]);
+          *area += out[n].area;
+          n++;
+        }
+      }
+      worker++;
+    }
+  }
+  *blobs += n;
+  return n;
+}
+
+static void run(const char *name, led_detector *ld, const uint8_t *frame)
+{
+  static uint8_t work[BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+  static led_blob stack_blobs[FRAME_WIDTH * FRAME_HEIGHT / 4];
+  uint32_t rblobs = 0, rarea = 0, lblobs = 0, larea = 0, ublobs = 0, uarea = 0;
+  uint32_t n = 0, m = 0;
+  double t0, t_recursive, t_labeling, t_runs;
+  led_frame_occupancy occ;
+
+  led_detector_frame_occupancy(&occ, frame);
+
+  t0 = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    memcpy(work, frame, BENCH_FRAME_BYTES);
+    scan_recursive(work, &rblobs, &rarea);
+  }
+  t_recursive = (bench_now_ns() - t0) / ITERATIONS;
+
+  t0 = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    memcpy(ld -> prev_bit_frame, frame, BENCH_FRAME_BYTES);
+    n = scan_labeling(ld, stack_blobs, &lblobs, &larea);
+  }
+  t_labeling = (bench_now_ns() - t0) / ITERATIONS;
+
+  t0 = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    memcpy(work, frame, BENCH_FRAME_BYTES);
+    m = led_detector_label_runs(ld, work, &occ, ld -> blobs);
+    ublobs += m;
+    for (uint32_t b = 0; b < m; b++) {
+      uarea += ld -> blobs[b].area;
+    }
+  }
+  t_runs = (bench_now_ns() - t0) / ITERATIONS;
+
+  fprintf(stdout, "%-8s recursive: %8.1f us/frame (%u blobs, %u px)\n", name, t_recursive / 1000.0, rblobs / ITERATIONS, rarea / ITERATIONS);
+  fprintf(stdout, "%-8s stack:     %8.1f us/frame (%u blobs, %u px) %6.2fx\n", name, t_labeling / 1000.0, lblobs / ITERATIONS, larea / ITERATIONS, t_recursive / t_labeling);
+  fprintf(stdout, "%-8s runs:      %8.1f us/frame (%u blobs, %u px) %6.2fx\n", name, t_runs / 1000.0, ublobs / ITERATIONS, uarea / ITERATIONS, t_recursive / t_runs);
+
+  /* Both labelers must report the same blobs in the same order. */
+  if (n != m || memcmp(stack_blobs, ld -> blobs, n * sizeof(led_blob))) {
+    fprintf(stdout, "%-8s MISMATCH between stack and run labeling\n", name);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  static uint8_t sparse[BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+  static uint8_t dense[BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+  static led_detector ld;
+  RASPITEX_STATE state;
+  uint32_t seed = 0x2545F491;
+
+  memset(&state, 0, sizeof(state));
+  state.led_find_radius = LED_FIND_RADIUS;
+  state.led_blob_size = LED_BLOB_SIZE;
+  state.led_radius = LED_RADIUS;
+  state.led_one_zero_thresh = LED_ONE_ZERO_THRESHOLD;
+  state.led_capacity = LED_CAPACITY;
+  led_detector_init(&ld, &state);
+
+  /* A handful of LEDs over a little sensor noise. */
+  for (int i = 0; i < 8; i++) {
+    bench_draw_disk(sparse, 20 + (bench_rand(&seed) % (FRAME_WIDTH - 40)), 20 + (bench_rand(&seed) % (FRAME_HEIGHT - 40)), 6);
+  }
+  bench_scatter(sparse, 2000, &seed);
+
+  /* Reflections: large lit regions in heavy noise. */
+  for (int i = 0; i < 4; i++) {
+    bench_draw_disk(dense, bench_rand(&seed) % FRAME_WIDTH, bench_rand(&seed) % FRAME_HEIGHT, 40);
+  }
+  bench_scatter(dense, 350000, &seed);
+
+  run("sparse", &ld, sparse);
+  run("dense", &ld, dense);
+
+  led_detector_destroy(&ld);
+  return 0;
+}
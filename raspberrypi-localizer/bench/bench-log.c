@@ -0,0 +1,181 @@
+/*
+ ============================================================================
+ Name        : bench-log.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Time per log call of three threads reporting into a pipe
+               whose reader, like a busy wrapper, drains it slowly and
+               stalls now and then: fprintf + fflush on the calling thread
+               against log_printf into a log_ring. Every line that arrives
+               must be whole and in order per thread, and the lines that
+               arrive plus the overflows counted must be all lines.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "bench-common.h"
+#include "log-ring.h"
+
+#define PRODUCERS       3
+#define LINES           6000
+#define LINE_PACE_US    40
+#define READ_BYTES      4096
+#define READ_PAUSE_US   2000
+#define STALL_EVERY     200
+#define STALL_US        100000
+
+typedef struct reader_t {
+  int       fd;
+  uint32_t  lines;
+  uint32_t  broken;
+  uint32_t  next[PRODUCERS];
+} reader;
+
+typedef struct producer_t {
+  pthread_t thread;
+  uint32_t  id;
+  FILE      *out;
+  log_ring  *log;
+  double    us[LINES];
+} producer;
+
+static void pause_us(uint32_t us)
+{
+  struct timespec t = { us / 1000000, (us % 1000000) * 1000 };
+  nanosleep(&t, NULL);
+}
+
+/* Lines are "p<id> <n> <length> <length x's>", most short, every 16th long enough to span records. */
+static void* drain(void *args)
+{
+  reader *rd = (reader*)args;
+  static char buffer[1 << 16];
+  size_t used = 0;
+  uint32_t reads = 0;
+  ssize_t n;
+
+  while ((n = read(rd -> fd, buffer + used, sizeof(buffer) - used < READ_BYTES ? sizeof(buffer) - used : READ_BYTES)) > 0)
+  {
+    char *start = buffer, *end;
+
+    used += n;
+    while ((end = memchr(start, '\n', used - (start - buffer))))
+    {
+      uint32_t id, seq, length;
+      int at = 0;
+
+      *end = 0;
+      if (sscanf(start, "p%u %u %u %n", &id, &seq, &length, &at) != 3 || id >= PRODUCERS ||
+          seq < rd -> next[id] || (uint32_t)(end - (start + at)) != length || strspn(start + at, "x") != length)
+        rd -> broken++;
+      else
+        rd -> next[id] = seq + 1;
+      rd -> lines++;
+      start = end + 1;
+    }
+    used -= start - buffer;
+    memmove(buffer, start, used);
+
+    pause_us((++reads % STALL_EVERY) ? READ_PAUSE_US : STALL_US);
+  }
+  return NULL;
+}
+
+static void* produce(void *args)
+{
+  producer *p = (producer*)args;
+  char payload[700];
+
+  memset(payload, 'x', sizeof(payload) - 1);
+  payload[sizeof(payload) - 1] = 0;
+
+  for (uint32_t i = 0; i < LINES; i++)
+  {
+    int length = (i % 16 == 0) ? 600 : (20 + (i % 40));
+    double t0 = bench_now_ns();
+
+    if (p -> log)
+    {
+      log_printf(p -> log, "p%u %u %d %.*s\n", p -> id, i, length, length, payload);
+    }
+    else
+    {
+      fprintf(p -> out, "p%u %u %d %.*s\n", p -> id, i, length, length, payload);
+      fflush(p -> out);
+    }
+    p -> us[i] = (bench_now_ns() - t0) / 1000.0;
+    pause_us(LINE_PACE_US);
+  }
+  return NULL;
+}
+
+static int compare(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static int run(const char *name, int use_ring)
+{
+  static producer producers[PRODUCERS];
+  static double all[PRODUCERS * LINES];
+  pthread_t reader_thread;
+  reader rd;
+  log_ring log;
+  int fds[2];
+  FILE *out;
+  uint32_t overflows = 0, lost;
+  double t0, elapsed;
+
+  if (pipe(fds) != 0)
+    return 1;
+  out = fdopen(fds[1], "w");
+  memset(&rd, 0, sizeof(rd));
+  rd.fd = fds[0];
+  pthread_create(&reader_thread, NULL, drain, &rd);
+
+  log_ring_init(&log, 256, out);
+  if (use_ring)
+    log_ring_start(&log);
+
+  t0 = bench_now_ns();
+  for (uint32_t i = 0; i < PRODUCERS; i++)
+  {
+    producers[i].id = i;
+    producers[i].out = out;
+    producers[i].log = use_ring ? &log : NULL;
+    pthread_create(&producers[i].thread, NULL, produce, &producers[i]);
+  }
+  for (uint32_t i = 0; i < PRODUCERS; i++)
+    pthread_join(producers[i].thread, NULL);
+  elapsed = (bench_now_ns() - t0) / 1e9;
+
+  overflows = atomic_load(&log.stats.overflows);
+  log_ring_destroy(&log);
+  fclose(out);
+  pthread_join(reader_thread, NULL);
+  close(fds[0]);
+
+  for (uint32_t i = 0; i < PRODUCERS; i++)
+    memcpy(all + (i * LINES), producers[i].us, sizeof(producers[i].us));
+  qsort(all, PRODUCERS * LINES, sizeof(double), compare);
+
+  lost = PRODUCERS * LINES - rd.lines - overflows;
+  fprintf(stdout, "%-6s %5.2f s, per call p50 %7.1f us, p99 %8.1f us, max %9.1f us, %u lines arrived, %u overflowed%s\n",
+    name, elapsed, all[(PRODUCERS * LINES) / 2], all[(PRODUCERS * LINES) * 99 / 100], all[PRODUCERS * LINES - 1],
+    rd.lines, overflows, (rd.broken || lost) ? ", MISMATCH" : "");
+  return rd.broken || lost;
+}
+
+int main(int argc, char **argv)
+{
+  int failed = 0;
+
+  failed |= run("direct", 0);
+  failed |= run("ring", 1);
+  return failed;
+}
@@ -0,0 +1,139 @@
+/*
+ ============================================================================
+ Name        : bench-parallel.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Frames per second of led_detector_process_internal with 1 to
+               4 decode threads, over a synthetic replay of 200 LEDs each
+               repeating a Manchester coded ID, many of them straddling
+               the stripe borders. Every thread count must print exactly
+               what one thread prints.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench-common.h"
+#include "led-detector.h"
+
+#define LEDS            200
+#define FRAMES          480
+#define REPEAT          4
+#define HALF_BIT_FRAMES 2
+#define IDLE_FRAMES     12
+
+static uint8_t frames[FRAMES][BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+static led_frame_occupancy occupancy[FRAMES];
+
+/* Output of one replay, the IDs printed by led_detector_process_internal. */
+static char *replay(uint32_t threads, double *fps, size_t *length)
+{
+  static led_detector ld;
+  RASPITEX_STATE state;
+  FILE *out = tmpfile();
+  int saved = dup(STDOUT_FILENO);
+  char *text;
+  double t0, elapsed = 0;
+
+  /* Small LEDs, the debug defaults are for the large test board. */
+  memset(&state, 0, sizeof(state));
+  state.led_find_radius = 10;
+  state.led_blob_size = 8;
+  state.led_radius = 5;
+  state.led_one_zero_thresh = 10;
+  state.led_capacity = 256;
+  state.led_decode_threads = threads;
+
+  fflush(stdout);
+  dup2(fileno(out), STDOUT_FILENO);
+
+  for (uint32_t r = 0; r < REPEAT; r++) {
+    led_detector_init(&ld, &state);
+    t0 = bench_now_ns();
+    for (uint32_t f = 0; f < FRAMES; f++) {
+      frame_info info;
+
+      info.frame_time = (f + 1) * FRAME_TRANSFER_TIME * 1000;
+      info.frame_number = f;
+      info.occupancy = occupancy[f];
+      led_detector_process_internal(&ld, frames[f], &info);
+    }
+    elapsed += bench_now_ns() - t0;
+    led_detector_destroy(&ld);
+  }
+
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+
+  *length = ftell(out);
+  text = (char*)malloc(*length + 1);
+  rewind(out);
+  *length = fread(text, 1, *length, out);
+  fclose(out);
+
+  *fps = (FRAMES * REPEAT) / (elapsed / 1e9);
+  return text;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t seed = 0x7F4A7C15;
+  uint32_t messages[LEDS];
+  uint16_t x[LEDS], y[LEDS];
+  uint8_t r[LEDS];
+  uint32_t phase[LEDS];
+  char *expected = NULL;
+  size_t expected_length = 0;
+  double fps1 = 0;
+  int failed = 0;
+
+  /* 20 x 10 grid, jittered, 16 px apart across and 24 px down. */
+  for (uint32_t i = 0; i < LEDS; i++) {
+    uint16_t id = (bench_rand(&seed) & 0x7FFF) | 1;
+
+    messages[i] = (1u << 20) | ((uint32_t)id << 4) | led_calculate_checksum(id);
+    x[i] = 8 + ((i % 20) * 16) + (bench_rand(&seed) % 5) - 2;
+    y[i] = 12 + ((i / 20) * 24) + (bench_rand(&seed) % 7) - 3;
+    r[i] = 2 + (bench_rand(&seed) % 2);
+    phase[i] = bench_rand(&seed) % 1000;
+  }
+
+  for (uint32_t f = 0; f < FRAMES; f++) {
+    bench_scatter(frames[f], 300, &seed);
+    for (uint32_t i = 0; i < LEDS; i++) {
+      if (bench_manchester_state(messages[i], f + phase[i], HALF_BIT_FRAMES, IDLE_FRAMES))
+        bench_draw_disk(frames[f], x[i], y[i], r[i]);
+    }
+    led_detector_frame_occupancy(&occupancy[f], frames[f]);
+  }
+
+  fprintf(stdout, "%ld cpus online\n", sysconf(_SC_NPROCESSORS_ONLN));
+  for (uint32_t threads = 1; threads <= 4; threads++) {
+    double fps;
+    size_t length;
+    char *text = replay(threads, &fps, &length);
+    uint32_t lines = 0;
+    int same;
+
+    for (size_t i = 0; i < length; i++)
+      lines += text[i] == '\n';
+
+    if (threads == 1) {
+      expected = text;
+      expected_length = length;
+      fps1 = fps;
+    }
+    same = (length == expected_length) && !memcmp(text, expected, length);
+    failed |= !same;
+
+    fprintf(stdout, "%u threads: %8.0f frames/s (%4.2fx), %u IDs reported%s\n",
+      threads, fps, fps / fps1, lines / REPEAT, same ? "" : ", MISMATCH");
+    if (text != expected)
+      free(text);
+  }
+
+  free(expected);
+  return failed;
+}
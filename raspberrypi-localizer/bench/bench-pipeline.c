@@ -0,0 +1,183 @@
+/*
+ ============================================================================
+ Name        : bench-pipeline.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Frames per second through the frame ring with the single
+               worker against the two stage pipeline (labeling ahead of
+               association and decoding), with its per stage busy time
+               and stage ring occupancy, over a synthetic replay of 200
+               blinking LEDs. Every mode must print exactly what
+               led_detector_process_internal prints when called directly.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench-common.h"
+#include "led-detector.h"
+
+#define LEDS            200
+#define FRAMES          480
+#define REPEAT          4
+#define HALF_BIT_FRAMES 2
+#define IDLE_FRAMES     12
+
+static uint8_t frames[FRAMES][BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+static uint8_t readbacks[FRAMES][LED_READBACK_BYTES] __attribute__((aligned(64)));
+static led_frame_occupancy occupancy[FRAMES];
+
+typedef struct mode_t {
+  const char  *name;
+  uint8_t     direct;
+  uint8_t     pipeline;
+  uint32_t    threads;
+} mode;
+
+static void mode_state(RASPITEX_STATE *state, const mode *m)
+{
+  /* Small LEDs, the debug defaults are for the large test board. */
+  memset(state, 0, sizeof(*state));
+  state->led_find_radius = 10;
+  state->led_blob_size = 8;
+  state->led_radius = 5;
+  state->led_one_zero_thresh = 10;
+  state->led_capacity = 256;
+  state->led_decode_threads = m->threads;
+  state->led_pipeline = m->pipeline;
+  /* Wait for the worker instead of missing frames, the replay must go through whole. */
+  state->led_drop_policy = FRAME_RING_BLOCK;
+}
+
+/* Output of one replay, the IDs printed while the frames are processed. */
+static char *replay(const mode *m, double *fps, size_t *length, led_stage_stats *stages, frame_ring_stats *stage_ring)
+{
+  static led_detector ld;
+  RASPITEX_STATE state;
+  FILE *out = tmpfile();
+  int saved = dup(STDOUT_FILENO);
+  char *text;
+  double t0, elapsed = 0;
+
+  mode_state(&state, m);
+  fflush(stdout);
+  dup2(fileno(out), STDOUT_FILENO);
+
+  for (uint32_t r = 0; r < REPEAT; r++) {
+    led_detector_init(&ld, &state);
+    t0 = bench_now_ns();
+    for (uint32_t f = 0; f < FRAMES; f++) {
+      if (m->direct) {
+        frame_info info;
+
+        info.frame_time = (f + 1) * FRAME_TRANSFER_TIME * 1000;
+        info.frame_number = f;
+        info.occupancy = occupancy[f];
+        led_detector_process_internal(&ld, frames[f], &info);
+      } else {
+        memcpy(led_detector_frame_acquire(&ld), readbacks[f], LED_READBACK_BYTES);
+        led_detector_frame_publish(&ld, (f + 1) * FRAME_TRANSFER_TIME, f);
+      }
+    }
+    /* Joins the worker (and decoder) once the rings are drained. */
+    led_detector_destroy(&ld);
+    elapsed += bench_now_ns() - t0;
+  }
+
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+
+  memcpy(stages, ld.stages, sizeof(ld.stages));
+  memcpy(stage_ring, &ld.stage_ring.stats, sizeof(*stage_ring));
+  if (!ld.pipeline)
+    memset(stage_ring, 0, sizeof(*stage_ring));
+
+  *length = ftell(out);
+  text = (char*)malloc(*length + 1);
+  rewind(out);
+  *length = fread(text, 1, *length, out);
+  fclose(out);
+
+  *fps = (FRAMES * REPEAT) / (elapsed / 1e9);
+  return text;
+}
+
+int main(int argc, char **argv)
+{
+  const mode modes[] = {
+    {"direct",          1, 0, 1},
+    {"worker",          0, 0, 1},
+    {"pipeline",        0, 1, 1},
+    {"pipeline + 2 dt", 0, 1, 2},
+  };
+  uint32_t seed = 0x2C1B3C6D;
+  uint32_t messages[LEDS];
+  uint16_t x[LEDS], y[LEDS];
+  uint8_t r[LEDS];
+  uint32_t phase[LEDS];
+  char *expected = NULL;
+  size_t expected_length = 0;
+  double fps1 = 0;
+  int failed = 0;
+
+  /* 20 x 10 grid, jittered, 16 px apart across and 24 px down. */
+  for (uint32_t i = 0; i < LEDS; i++) {
+    uint16_t id = (bench_rand(&seed) & 0x7FFF) | 1;
+
+    messages[i] = (1u << 20) | ((uint32_t)id << 4) | led_calculate_checksum(id);
+    x[i] = 8 + ((i % 20) * 16) + (bench_rand(&seed) % 5) - 2;
+    y[i] = 12 + ((i / 20) * 24) + (bench_rand(&seed) % 7) - 3;
+    r[i] = 2 + (bench_rand(&seed) % 2);
+    phase[i] = bench_rand(&seed) % 1000;
+  }
+
+  for (uint32_t f = 0; f < FRAMES; f++) {
+    bench_scatter(frames[f], 300, &seed);
+    for (uint32_t i = 0; i < LEDS; i++) {
+      if (bench_manchester_state(messages[i], f + phase[i], HALF_BIT_FRAMES, IDLE_FRAMES))
+        bench_draw_disk(frames[f], x[i], y[i], r[i]);
+    }
+    led_detector_frame_occupancy(&occupancy[f], frames[f]);
+    bench_readback(readbacks[f], frames[f]);
+  }
+
+  fprintf(stdout, "%ld cpus online\n", sysconf(_SC_NPROCESSORS_ONLN));
+  for (uint32_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    led_stage_stats stages[2];
+    frame_ring_stats ring;
+    double fps;
+    size_t length;
+    char *text = replay(&modes[i], &fps, &length, stages, &ring);
+    uint32_t lines = 0;
+    int same;
+
+    for (size_t k = 0; k < length; k++)
+      lines += text[k] == '\n';
+
+    if (i == 0) {
+      expected = text;
+      expected_length = length;
+      fps1 = fps;
+    }
+    same = (length == expected_length) && !memcmp(text, expected, length);
+    failed |= !same;
+
+    fprintf(stdout, "%-15s %8.0f frames/s (%4.2fx), %u IDs reported%s\n",
+      modes[i].name, fps, fps / fps1, lines / REPEAT, same ? "" : ", MISMATCH");
+    for (uint32_t s = 0; s < 2; s++) {
+      if (stages[s].frames)
+        fprintf(stdout, "  %-8s %6u frames, busy mean %7.1f us, max %6u us\n", s == LED_STAGE_DISCOVER ? "discover" : "decode",
+          stages[s].frames, (double)stages[s].busy_us_sum / stages[s].frames, stages[s].busy_us_max);
+    }
+    if (ring.published)
+      fprintf(stdout, "  stage ring depth mean %4.2f, max %u, discover blocked %u times\n",
+        (double)ring.depth_sum / ring.published, ring.depth_max, ring.blocks);
+    if (text != expected)
+      free(text);
+  }
+
+  free(expected);
+  return failed;
+}
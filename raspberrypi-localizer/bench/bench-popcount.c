@@ -0,0 +1,134 @@
+/*
+ ============================================================================
+ Name        : bench-popcount.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : led_roi_count (NEON / AVX2 / SSSE3 when built for them)
+               against the per pixel reference, a byte lookup table loop
+               and the old bitfield counter, over random boxes at every
+               row and column alignment. Every box must match the
+               reference exactly.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include "bench-common.h"
+#include "led-roi.h"
+
+#define BOXES       4096
+#define ITERATIONS  50
+
+static uint8_t frame[BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+static uint16_t boxes[BOXES][4];
+
+/* led_get_roi_sum before the exact counters: whole bytes through a bitfield, 8 rows at a time from y1. */
+typedef struct bit_access_field_t {
+  uint8_t a0:1;
+  uint8_t a1:1;
+  uint8_t a2:1;
+  uint8_t a3:1;
+  uint8_t a4:1;
+  uint8_t a5:1;
+  uint8_t a6:1;
+  uint8_t a7:1;
+} bit_access_field;
+
+static uint32_t legacy_roi_sum(const uint8_t *frame, uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2)
+{
+  uint32_t sum = 0;
+
+  for (uint32_t i = y1; i < y2; i += 8) {
+    for (uint32_t j = x1; j < x2; j++) {
+      const bit_access_field *sa = (const bit_access_field*) (frame + (i/16 * (FRAME_WIDTH*2)) + j*2 + (i%16>7));
+      sum += (sa->a0 + sa->a1 + sa->a2 + sa->a3 + sa->a4 + sa->a5 + sa->a6 + sa->a7);
+    }
+  }
+  return sum;
+}
+
+/* led_roi_count with the span loop left to the byte lookup table. */
+static uint32_t lut_roi_count(const uint8_t *frame, uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2)
+{
+  uint32_t sum = 0;
+
+  for (uint32_t g = y1 / 16; g * 16 < y2; g++) {
+    uint32_t r1 = (g * 16 < y1) ? (y1 - (g * 16)) : 0;
+    uint32_t r2 = ((g + 1) * 16 > y2) ? (y2 - (g * 16)) : 16;
+    uint16_t mask = led_roi_row_mask(r1, r2);
+    const uint16_t *w = led_roi_group(frame, g);
+
+    for (uint32_t x = x1; x < x2; x++) {
+      uint16_t v = w[x] & mask;
+      sum += led_popcount8[v & 0xFF] + led_popcount8[v >> 8];
+    }
+  }
+  return sum;
+}
+
+typedef uint32_t (*roi_counter)(const uint8_t *frame, uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2);
+
+static double run(roi_counter count, uint32_t *sums)
+{
+  double t0 = bench_now_ns();
+
+  for (uint32_t n = 0; n < ITERATIONS; n++) {
+    for (uint32_t b = 0; b < BOXES; b++) {
+      sums[b] = count(frame, boxes[b][0], boxes[b][1], boxes[b][2], boxes[b][3]);
+    }
+  }
+  return (bench_now_ns() - t0) / (ITERATIONS * BOXES);
+}
+
+int main(int argc, char **argv)
+{
+  static uint32_t reference[BOXES], sums[BOXES];
+  uint32_t seed = 0x68E31DA4;
+  uint32_t mismatches = 0, legacy_off = 0;
+  double t_reference, t_legacy, t_lut, t_simd;
+
+  bench_scatter(frame, 150000, &seed);
+  for (uint32_t b = 0; b < BOXES; b++) {
+    uint16_t w = 1 + bench_rand(&seed) % 100;
+    uint16_t h = 1 + bench_rand(&seed) % 100;
+
+    boxes[b][0] = bench_rand(&seed) % (FRAME_WIDTH - w + 1);
+    boxes[b][1] = bench_rand(&seed) % (FRAME_HEIGHT - h + 1);
+    boxes[b][2] = boxes[b][0] + w;
+    boxes[b][3] = boxes[b][1] + h;
+  }
+
+  t_reference = run(led_roi_count_reference, reference);
+
+  t_legacy = run(legacy_roi_sum, sums);
+  for (uint32_t b = 0; b < BOXES; b++) {
+    legacy_off += sums[b] != reference[b];
+  }
+
+  t_lut = run(lut_roi_count, sums);
+  for (uint32_t b = 0; b < BOXES; b++) {
+    mismatches += sums[b] != reference[b];
+  }
+
+  t_simd = run(led_roi_count, sums);
+  for (uint32_t b = 0; b < BOXES; b++) {
+    mismatches += sums[b] != reference[b];
+  }
+
+#if defined(__ARM_NEON)
+  const char *kernel = "neon";
+#elif defined(__AVX2__)
+  const char *kernel = "avx2";
+#elif defined(__SSSE3__)
+  const char *kernel = "ssse3";
+#else
+  const char *kernel = "scalar";
+#endif
+
+  fprintf(stdout, "reference %8.1f ns/box\n", t_reference);
+  fprintf(stdout, "bitfield  %8.1f ns/box (%5.1fx), %u of %u boxes off the exact count\n", t_legacy, t_reference / t_legacy, legacy_off, BOXES);
+  fprintf(stdout, "lut       %8.1f ns/box (%5.1fx)\n", t_lut, t_reference / t_lut);
+  fprintf(stdout, "%-9s %8.1f ns/box (%5.1fx)%s\n", kernel, t_simd, t_reference / t_simd, mismatches ? ", MISMATCH" : "");
+
+  return mismatches != 0;
+}
@@ -0,0 +1,247 @@
+/*
+ ============================================================================
+ Name        : bench-record.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Cost of recording the packed frames. A threaded detector
+               runs a synthetic scene at 8x the camera's frame rate with
+               and without a recorder, comparing the worker's time per
+               frame. Then the writer alone records a long capture as
+               fast as it can, for its headroom over 25 fps and the page
+               cache it leaves behind. Both recordings are read back and
+               must match what was recorded frame for frame.
+ ============================================================================
+ */
+
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "bench-common.h"
+#include "led-detector.h"
+#include "frame-record.h"
+
+#define LEDS            100
+#define FRAMES          1000
+#define SCENE_FRAMES    64
+#define PERIOD_US       5000
+#define HALF_BIT_FRAMES 2
+#define IDLE_FRAMES     12
+#define LONG_FRAMES     20000
+
+static uint8_t frames[SCENE_FRAMES][BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+static uint8_t readbacks[SCENE_FRAMES][LED_READBACK_BYTES] __attribute__((aligned(64)));
+
+static uint64_t pts_of(uint32_t f)
+{
+  /* Past the 32 bits of frame_time, so the index has to keep all of it. */
+  return 0x100000000ull + ((uint64_t)(f + 1) * FRAME_TRANSFER_TIME * 1000);
+}
+
+/* Frames of the recording against the scene, -1 on the first one that differs. */
+static int verify(const char *path, uint32_t expected)
+{
+  uint8_t bits[FRAME_RECORD_BYTES];
+  frame_record f;
+  uint32_t count;
+
+  if (frame_record_open(&f, path) != 0)
+  {
+    fprintf(stdout, "  could not open %s, MISMATCH\n", path);
+    return -1;
+  }
+  count = atomic_load(&f.header.count);
+  if (count + f.header.dropped != expected)
+  {
+    fprintf(stdout, "  %u frames and %u dropped of %u, MISMATCH\n", count, f.header.dropped, expected);
+    frame_record_close(&f);
+    return -1;
+  }
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint32_t n = f.index[i].frame_number;
+
+    if (frame_record_read(&f, i, bits) != 0 || f.index[i].pts != pts_of(n) || memcmp(bits, frames[n % SCENE_FRAMES], FRAME_RECORD_BYTES) != 0
+      || (i && n <= f.index[i - 1].frame_number))
+    {
+      fprintf(stdout, "  frame %u (%u) differs, MISMATCH\n", i, n);
+      frame_record_close(&f);
+      return -1;
+    }
+  }
+  fprintf(stdout, "  read back %u frames, %u dropped\n", count, f.header.dropped);
+  frame_record_close(&f);
+  return 0;
+}
+
+/* Worker time per frame of a threaded detector over the scene, recording to path unless it is NULL. */
+static int run_detector(const char *path)
+{
+  RASPITEX_STATE state;
+  frame_recorder *recorder = NULL;
+  led_stage_stats *s;
+  struct timespec next;
+  led_detector *ld;
+  FILE *out;
+
+  memset(&state, 0, sizeof(state));
+  state.led_find_radius = 10;
+  state.led_blob_size = 8;
+  state.led_radius = 5;
+  state.led_one_zero_thresh = 10;
+  state.led_capacity = LED_CAPACITY;
+  state.led_decode_threads = 1;
+  state.led_drop_policy = FRAME_RING_BLOCK;
+  ld = led_detector_create(&state);
+  out = tmpfile();
+  ld->log.out = out;
+  if (path)
+  {
+    recorder = frame_recorder_open(path, FRAMES);
+    if (!recorder)
+    {
+      fprintf(stderr, "Could not open the recording %s\n", path);
+      return -1;
+    }
+    ld->recorder = recorder;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (uint32_t f = 0; f < FRAMES; f++)
+  {
+    uint8_t *readback;
+
+    next.tv_nsec += PERIOD_US * 1000L;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000L;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    readback = led_detector_frame_acquire(ld);
+    memcpy(readback, readbacks[f % SCENE_FRAMES], LED_READBACK_BYTES);
+    led_detector_frame_publish(ld, pts_of(f) / 1000.0, f);
+  }
+
+  /* Joins the worker once the ring is drained. */
+  led_detector_destroy(ld);
+  s = &ld->stages[LED_STAGE_DISCOVER];
+  fprintf(stdout, "%-18s worker avg %5.1f us, max %5u us per frame\n", path ? "with recorder" : "without recorder",
+    (double)s->busy_us_sum / s->frames, s->busy_us_max);
+  free(ld);
+  fclose(out);
+  if (recorder)
+  {
+    frame_recorder_stats *st = &recorder->stats;
+
+    while (atomic_load(&st->frames) + recorder->ring.stats.dropped < FRAMES)
+      usleep(1000);
+
+    fprintf(stdout, "  writer: %u frames, dropped %u, write avg %.1f us, max %u us, windows %u, remap max %u us\n",
+      atomic_load(&st->frames), recorder->ring.stats.dropped, (double)atomic_load(&st->write_us_sum) / atomic_load(&st->frames),
+      atomic_load(&st->write_us_max), atomic_load(&st->windows), atomic_load(&st->remap_us_max));
+    frame_recorder_close(recorder);
+    return verify(path, FRAMES);
+  }
+  return 0;
+}
+
+/* Pages of the file in the page cache. */
+static uint64_t resident_bytes(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  off_t size = lseek(fd, 0, SEEK_END);
+  long page = sysconf(_SC_PAGESIZE);
+  uint64_t pages = (size + page - 1) / page, resident = 0;
+  unsigned char *vec = (unsigned char*)malloc(pages);
+  void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+  if (m != MAP_FAILED && mincore(m, size, vec) == 0)
+  {
+    for (uint64_t i = 0; i < pages; i++)
+      resident += vec[i] & 1;
+  }
+  if (m != MAP_FAILED)
+    munmap(m, size);
+  free(vec);
+  close(fd);
+  return resident * page;
+}
+
+/* The writer on its own, the recorder's ring waiting for it instead of dropping frames. */
+static int run_long(const char *path)
+{
+  frame_recorder *recorder = frame_recorder_open(path, LONG_FRAMES);
+  frame_recorder_stats *st;
+  uint64_t cached;
+  double t0, seconds;
+
+  if (!recorder)
+  {
+    fprintf(stderr, "Could not open the recording %s\n", path);
+    return -1;
+  }
+  recorder->ring.policy = FRAME_RING_BLOCK;
+
+  t0 = bench_now_ns();
+  for (uint32_t f = 0; f < LONG_FRAMES; f++)
+  {
+    const uint8_t *bits = frames[f % SCENE_FRAMES];
+
+    frame_recorder_add(recorder, bits, pts_of(f), f, 0);
+  }
+  st = &recorder->stats;
+  while (atomic_load(&st->frames) < LONG_FRAMES)
+    usleep(100);
+  seconds = (bench_now_ns() - t0) / 1e9;
+
+  fprintf(stdout, "long capture       %u frames (%.0f s at 25 fps, %.0f MB) in %.2f s, %.0f frames/s, %.0fx real time\n",
+    LONG_FRAMES, LONG_FRAMES * FRAME_TRANSFER_TIME / 1000.0, (double)LONG_FRAMES * FRAME_RECORD_BYTES / 1e6, seconds,
+    LONG_FRAMES / seconds, (LONG_FRAMES / seconds) / (1000.0 / FRAME_TRANSFER_TIME));
+  fprintf(stdout, "  writer: write avg %.1f us, max %u us, windows %u, remap max %u us\n",
+    (double)atomic_load(&st->write_us_sum) / LONG_FRAMES, atomic_load(&st->write_us_max), atomic_load(&st->windows), atomic_load(&st->remap_us_max));
+  cached = resident_bytes(path);
+  frame_recorder_close(recorder);
+  fprintf(stdout, "  page cache at the end: %.1f MB of the file, %.1f MB after close\n", cached / 1e6, resident_bytes(path) / 1e6);
+  return verify(path, LONG_FRAMES);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t seed = 0x6A09E667;
+  uint32_t messages[LEDS];
+  uint16_t x[LEDS], y[LEDS];
+  uint8_t r[LEDS];
+  uint32_t phase[LEDS];
+  char path[64];
+  int failed = 0;
+
+  for (uint32_t i = 0; i < LEDS; i++) {
+    uint16_t id = (bench_rand(&seed) & 0x7FFF) | 1;
+
+    messages[i] = (1u << 20) | ((uint32_t)id << 4) | led_calculate_checksum(id);
+    x[i] = 8 + ((i % 20) * 16) + (bench_rand(&seed) % 5) - 2;
+    y[i] = 12 + ((i / 20) * 40) + (bench_rand(&seed) % 7) - 3;
+    r[i] = 2 + (bench_rand(&seed) % 2);
+    phase[i] = bench_rand(&seed) % 1000;
+  }
+  for (uint32_t f = 0; f < SCENE_FRAMES; f++) {
+    bench_scatter(frames[f], 300, &seed);
+    for (uint32_t i = 0; i < LEDS; i++) {
+      if (bench_manchester_state(messages[i], f + phase[i], HALF_BIT_FRAMES, IDLE_FRAMES))
+        bench_draw_disk(frames[f], x[i], y[i], r[i]);
+    }
+    bench_readback(readbacks[f], frames[f]);
+  }
+
+  snprintf(path, sizeof(path), "/tmp/led-bench-record-%d.ledr", (int)getpid());
+  fprintf(stdout, "%u frames, one every %u us, %u bytes each recorded\n", FRAMES, PERIOD_US, FRAME_RECORD_BYTES);
+  failed |= run_detector(NULL) != 0;
+  failed |= run_detector(path) != 0;
+  failed |= run_long(path) != 0;
+  unlink(path);
+
+  return failed;
+}
@@ -0,0 +1,192 @@
+/*
+ ============================================================================
+ Name        : bench-replay.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Replay of a recording against the live run that made it.
+               A threaded detector records a synthetic scene, with frames
+               the camera skipped now and then, once on its own and once
+               pipelined. Each recording is replayed on this thread and
+               the replay's log has to be the live log byte for byte. The
+               replay's rate is reported against the camera's 25 fps.
+ ============================================================================
+ */
+
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench-common.h"
+#include "led-detector.h"
+#include "frame-record.h"
+#include "replay.h"
+
+#define LEDS            100
+#define FRAMES          1000
+#define SCENE_FRAMES    64
+#define PERIOD_US       5000
+#define HALF_BIT_FRAMES 2
+#define IDLE_FRAMES     12
+#define SKIP_EVERY      97            /* A frame number the camera skipped */
+#define REPLAYS         20
+
+static uint8_t frames[SCENE_FRAMES][BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+static uint8_t readbacks[SCENE_FRAMES][LED_READBACK_BYTES] __attribute__((aligned(64)));
+
+static void default_state(RASPITEX_STATE *state, int pipeline)
+{
+  memset(state, 0, sizeof(*state));
+  state->led_find_radius = 10;
+  state->led_blob_size = 8;
+  state->led_radius = 5;
+  state->led_one_zero_thresh = 10;
+  state->led_capacity = LED_CAPACITY;
+  state->led_decode_threads = 1;
+  state->led_pipeline = pipeline;
+  state->led_drop_policy = FRAME_RING_BLOCK;
+}
+
+/* All of a log, NUL terminated, its length in size. */
+static char* read_log(FILE *out, long *size)
+{
+  char *log;
+
+  fflush(out);
+  *size = ftell(out);
+  log = (char*)malloc(*size + 1);
+  rewind(out);
+  if (fread(log, 1, *size, out) != (size_t)*size)
+    *size = 0;
+  log[*size] = 0;
+  return log;
+}
+
+/* The live run, recording to path, its log in out. */
+static int run_live(const char *path, int pipeline, FILE *out)
+{
+  RASPITEX_STATE state;
+  frame_recorder *recorder;
+  struct timespec next;
+  led_detector *ld;
+  uint32_t number = 0;
+
+  default_state(&state, pipeline);
+  ld = led_detector_create(&state);
+  ld->log.out = out;
+  recorder = frame_recorder_open(path, FRAMES);
+  if (!recorder)
+  {
+    fprintf(stderr, "Could not open the recording %s\n", path);
+    return -1;
+  }
+  ld->recorder = recorder;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (uint32_t f = 0; f < FRAMES; f++, number++)
+  {
+    uint8_t *readback;
+
+    next.tv_nsec += PERIOD_US * 1000L;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000L;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    if ((f % SKIP_EVERY) == SKIP_EVERY - 1)
+      number++;
+    readback = led_detector_frame_acquire(ld);
+    memcpy(readback, readbacks[number % SCENE_FRAMES], LED_READBACK_BYTES);
+    /* Past the 32 bits of frame_time, the replay has to unwrap it the same way. */
+    led_detector_frame_publish(ld, (0x100000000ull + ((uint64_t)(number + 1) * FRAME_TRANSFER_TIME * 1000)) / 1000.0, number);
+  }
+
+  led_detector_free(ld);
+  while (atomic_load(&recorder->stats.frames) + recorder->ring.stats.dropped < FRAMES)
+    usleep(1000);
+  frame_recorder_close(recorder);
+  return 0;
+}
+
+static int run(const char *path, int pipeline)
+{
+  RASPITEX_STATE state;
+  replay_stats stats;
+  FILE *live = tmpfile(), *replayed = tmpfile();
+  char *live_log, *replay_log;
+  long live_size, replay_size;
+  double seconds = 0;
+  int rc = 0;
+
+  if (run_live(path, pipeline, live) != 0)
+    return -1;
+  live_log = read_log(live, &live_size);
+
+  for (uint32_t i = 0; i < REPLAYS && rc == 0; i++)
+  {
+    rewind(replayed);
+    if (ftruncate(fileno(replayed), 0) != 0)
+      break;
+    default_state(&state, pipeline);
+    rc = replay_recording(path, &state, NULL, replayed, &stats);
+    seconds += stats.seconds;
+  }
+  replay_log = read_log(replayed, &replay_size);
+
+  fprintf(stdout, "%-10s %u frames, %u dropped, live log %ld bytes, replay %.0f frames/s, %.0fx real time\n",
+    pipeline ? "pipelined" : "worker", stats.frames, stats.dropped, live_size,
+    (stats.frames * REPLAYS) / seconds, ((stats.frames * REPLAYS) / seconds) / (1000.0 / FRAME_TRANSFER_TIME));
+  if (rc != 0 || stats.dropped || live_size == 0 || replay_size != live_size || memcmp(live_log, replay_log, live_size) != 0)
+  {
+    long at = 0;
+
+    while (at < live_size && at < replay_size && live_log[at] == replay_log[at])
+      at++;
+    fprintf(stdout, "  replay log (%ld bytes) differs from byte %ld, MISMATCH\n", replay_size, at);
+    rc = -1;
+  }
+
+  free(live_log);
+  free(replay_log);
+  fclose(live);
+  fclose(replayed);
+  return rc;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t seed = 0x6A09E667;
+  uint32_t messages[LEDS];
+  uint16_t x[LEDS], y[LEDS];
+  uint8_t r[LEDS];
+  uint32_t phase[LEDS];
+  char path[64];
+  int failed = 0;
+
+  for (uint32_t i = 0; i < LEDS; i++) {
+    uint16_t id = (bench_rand(&seed) & 0x7FFF) | 1;
+
+    messages[i] = (1u << 20) | ((uint32_t)id << 4) | led_calculate_checksum(id);
+    x[i] = 8 + ((i % 20) * 16) + (bench_rand(&seed) % 5) - 2;
+    y[i] = 12 + ((i / 20) * 40) + (bench_rand(&seed) % 7) - 3;
+    r[i] = 2 + (bench_rand(&seed) % 2);
+    phase[i] = bench_rand(&seed) % 1000;
+  }
+  for (uint32_t f = 0; f < SCENE_FRAMES; f++) {
+    bench_scatter(frames[f], 300, &seed);
+    for (uint32_t i = 0; i < LEDS; i++) {
+      if (bench_manchester_state(messages[i], f + phase[i], HALF_BIT_FRAMES, IDLE_FRAMES))
+        bench_draw_disk(frames[f], x[i], y[i], r[i]);
+    }
+    bench_readback(readbacks[f], frames[f]);
+  }
+
+  snprintf(path, sizeof(path), "/tmp/led-bench-replay-%d.ledr", (int)getpid());
+  fprintf(stdout, "%u frames, one every %u us, every %uth frame number skipped, each recording replayed %u times\n",
+    FRAMES, PERIOD_US, SKIP_EVERY, REPLAYS);
+  failed |= run(path, 0) != 0;
+  failed |= run(path, 1) != 0;
+  unlink(path);
+
+  return failed;
+}
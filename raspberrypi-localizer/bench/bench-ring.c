@@ -0,0 +1,226 @@
+/*
+ ============================================================================
+ Name        : bench-ring.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Producer to consumer latency of the frame hand-off at a
+               sustained 90 fps, the old usleep(1000) polled queue against
+               frame_ring, with the consumer's context switches and CPU
+               time. A free running pass then pushes frames as fast as
+               possible under each drop policy and checks no frame is
+               torn or reordered, and none is lost but the oldest ones
+               dropped to make room.
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "bench-common.h"
+#include "frame-ring.h"
+
+#define FPS             90
+#define FRAMES          450
+#define WORK_NS         3000000
+#define STRESS_FRAMES   200000
+
+typedef struct bench_slot_t {
+  uint32_t  sequence;
+  double    published_ns;
+  uint8_t   frame[FRAME_HEIGHT * FRAME_WIDTH / 8];
+} bench_slot;
+
+static double latency[FRAMES];
+static uint32_t received;
+static struct rusage consumer_usage;
+
+/* The hand-off before frame_ring: __sync counter, plain indices, 1 ms poll. */
+static bench_slot legacy_queue[128];
+static uint32_t fq_start, fq_end, fq_size;
+static uint8_t keep_alive;
+
+static void work(void)
+{
+  double t0 = bench_now_ns();
+
+  while (bench_now_ns() - t0 < WORK_NS)
+    ;
+}
+
+static void* legacy_consumer(void *args)
+{
+  while (fq_size || keep_alive) {
+    if (fq_size) {
+      __sync_fetch_and_sub(&fq_size, 1);
+      latency[received++] = bench_now_ns() - legacy_queue[fq_end].published_ns;
+      work();
+      fq_end = (fq_end + 1) & 127;
+    } else {
+      usleep(1000);
+    }
+  }
+  getrusage(RUSAGE_THREAD, &consumer_usage);
+  return NULL;
+}
+
+static void* ring_consumer(void *args)
+{
+  frame_ring *r = (frame_ring*)args;
+  bench_slot *slot;
+
+  while ((slot = (bench_slot*)frame_ring_wait(r))) {
+    latency[received++] = bench_now_ns() - slot -> published_ns;
+    work();
+    frame_ring_release(r);
+  }
+  getrusage(RUSAGE_THREAD, &consumer_usage);
+  return NULL;
+}
+
+static void next_frame(struct timespec *t)
+{
+  t -> tv_nsec += 1000000000 / FPS;
+  if (t -> tv_nsec >= 1000000000) {
+    t -> tv_nsec -= 1000000000;
+    t -> tv_sec++;
+  }
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL);
+}
+
+static int compare(const void *a, const void *b)
+{
+  double d = *(const double*)a - *(const double*)b;
+  return (d > 0) - (d < 0);
+}
+
+static void report(const char *name)
+{
+  double sum = 0;
+
+  qsort(latency, received, sizeof(double), compare);
+  for (uint32_t i = 0; i < received; i++)
+    sum += latency[i];
+
+  fprintf(stdout, "%-7s %u frames: latency mean %7.1f us, p50 %7.1f us, p99 %7.1f us, max %7.1f us; consumer %4ld context switches, %6.1f ms cpu\n",
+    name, received, sum / received / 1000, latency[received / 2] / 1000, latency[(received * 99) / 100] / 1000, latency[received - 1] / 1000,
+    consumer_usage.ru_nvcsw + consumer_usage.ru_nivcsw,
+    (consumer_usage.ru_utime.tv_sec + consumer_usage.ru_stime.tv_sec) * 1000.0 + (consumer_usage.ru_utime.tv_usec + consumer_usage.ru_stime.tv_usec) / 1000.0);
+}
+
+static void run_legacy(void)
+{
+  pthread_t consumer;
+  struct timespec t;
+
+  received = 0;
+  keep_alive = 1;
+  pthread_create(&consumer, NULL, legacy_consumer, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  for (uint32_t f = 0; f < FRAMES; f++) {
+    next_frame(&t);
+    if (fq_size < 127) {
+      legacy_queue[fq_start].sequence = f;
+      legacy_queue[fq_start].published_ns = bench_now_ns();
+      fq_start = (fq_start + 1) & 127;
+      __sync_fetch_and_add(&fq_size, 1);
+    }
+  }
+  keep_alive = 0;
+  pthread_join(consumer, NULL);
+  report("polled");
+}
+
+static void run_ring(void)
+{
+  frame_ring r;
+  pthread_t consumer;
+  struct timespec t;
+
+  received = 0;
+  frame_ring_init(&r, 128, sizeof(bench_slot));
+  pthread_create(&consumer, NULL, ring_consumer, &r);
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  for (uint32_t f = 0; f < FRAMES; f++) {
+    bench_slot *slot;
+
+    next_frame(&t);
+    if ((slot = (bench_slot*)frame_ring_acquire(&r))) {
+      slot -> sequence = f;
+      slot -> published_ns = bench_now_ns();
+      frame_ring_publish(&r);
+    }
+  }
+  frame_ring_close(&r);
+  pthread_join(consumer, NULL);
+  report("ring");
+  fprintf(stdout, "        depth max %u, mean %.2f, dropped %u, waits %u, wait mean %.1f us, max %u us\n",
+    r.stats.depth_max, (double)r.stats.depth_sum / r.stats.published, r.stats.dropped,
+    r.stats.waits, (double)r.stats.wait_us_sum / (r.stats.waits ? r.stats.waits : 1), r.stats.wait_us_max);
+  frame_ring_destroy(&r);
+}
+
+static uint32_t stress_errors;
+static uint32_t stress_received;
+
+/* Frames must come in order, whole, and all of them unless the oldest are dropped. */
+static void* stress_consumer(void *args)
+{
+  frame_ring *r = (frame_ring*)args;
+  uint32_t *slot;
+  uint32_t next = 0;
+
+  while ((slot = (uint32_t*)frame_ring_wait(r))) {
+    uint32_t sequence = slot[0];
+
+    /* Give the producer a chance to write over a slot it should not. */
+    for (volatile uint32_t k = 0; k < 20; k++);
+    stress_errors += (sequence < next) || (slot[1] != ~sequence) || (r -> policy != FRAME_RING_DROP_OLDEST && sequence != next);
+    next = sequence + 1;
+    stress_received++;
+    frame_ring_release(r);
+  }
+  return NULL;
+}
+
+static void run_stress(uint8_t policy, const char *name)
+{
+  frame_ring r;
+  pthread_t consumer;
+  double t0;
+
+  stress_received = 0;
+  frame_ring_init(&r, 8, 2 * sizeof(uint32_t));
+  r.policy = policy;
+  pthread_create(&consumer, NULL, stress_consumer, &r);
+  t0 = bench_now_ns();
+  for (uint32_t f = 0; f < STRESS_FRAMES; ) {
+    uint32_t *slot = (uint32_t*)frame_ring_acquire(&r);
+
+    if (slot) {
+      slot[0] = f;
+      slot[1] = ~f;
+      frame_ring_publish(&r);
+      f++;
+    }
+  }
+  frame_ring_close(&r);
+  pthread_join(consumer, NULL);
+  stress_errors += (stress_received + r.stats.overwritten) != STRESS_FRAMES;
+  fprintf(stdout, "stress  %-11s %u frames through 8 slots: %6.1f ns/frame, %6u received, %6u overwritten, %6u refused, %6u consumer waits%s\n",
+    name, STRESS_FRAMES, (bench_now_ns() - t0) / STRESS_FRAMES, stress_received, r.stats.overwritten, r.stats.dropped, r.stats.waits,
+    stress_errors ? ", MISMATCH" : "");
+  frame_ring_destroy(&r);
+}
+
+int main(int argc, char **argv)
+{
+  run_legacy();
+  run_ring();
+  run_stress(FRAME_RING_DROP_NEWEST, "drop newest");
+  run_stress(FRAME_RING_DROP_OLDEST, "drop oldest");
+  run_stress(FRAME_RING_BLOCK, "block");
+  return stress_errors != 0;
+}
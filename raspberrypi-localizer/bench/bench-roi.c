@@ -0,0 +1,107 @@
+/*
+ ============================================================================
+ Name        : bench-roi.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : ns/frame of the per tracker ROI sums, the old byte stepping
+               count of every box against led_detector_roi_sums, for 1 to
+               500 trackers at two LED radii. led_detector_roi_sums must
+               match led_roi_count_reference exactly.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include "bench-common.h"
+#include "led-detector.h"
+#include "led-roi.h"
+
+#define ITERATIONS 200
+
+static uint8_t frame[BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+
+/* led_get_roi_sum before the exact counters: whole bytes, 8 rows at a time from y1. */
+static uint32_t legacy_roi_sum(const uint8_t *frame, uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2)
+{
+  uint32_t sum = 0;
+
+  for (uint32_t i = y1; i < y2; i += 8) {
+    for (uint32_t j = x1; j < x2; j++) {
+      sum += __builtin_popcount(frame[(i/16 * (FRAME_WIDTH*2)) + j*2 + (i%16>7)]);
+    }
+  }
+  return sum;
+}
+
+static void run(uint16_t radius, uint32_t trackers)
+{
+  led_detector ld;
+  RASPITEX_STATE state;
+  led_table *t = &ld.trackers;
+  uint32_t *legacy = (uint32_t*)malloc(trackers * sizeof(uint32_t));
+  uint32_t seed = 0x51ED270B;
+  uint32_t mismatches = 0;
+  double t0, t_box, t_sat;
+
+  memset(&state, 0, sizeof(state));
+  state.led_find_radius = LED_FIND_RADIUS;
+  state.led_blob_size = LED_BLOB_SIZE;
+  state.led_radius = radius;
+  state.led_one_zero_thresh = LED_ONE_ZERO_THRESHOLD;
+  state.led_capacity = trackers;
+  led_detector_init(&ld, &state);
+
+  memset(frame, 0, sizeof(frame));
+  bench_scatter(frame, 20000, &seed);
+  for (uint32_t i = 0; i < trackers; i++) {
+    uint16_t x = bench_rand(&seed) % FRAME_WIDTH;
+    uint16_t y = bench_rand(&seed) % FRAME_HEIGHT;
+
+    led_detector_add_led(&ld, x, y);
+    bench_draw_disk(frame, x, y, 1 + (bench_rand(&seed) % 6));
+  }
+
+  t0 = bench_now_ns();
+  for (uint32_t n = 0; n < ITERATIONS; n++) {
+    for (uint32_t i = 0; i < t -> count; i++) {
+      uint32_t x = t -> x[i], y = t -> y[i], r = t -> led_radius[i];
+
+      legacy[i] = legacy_roi_sum(frame, (x > r) ? (x - r) : 0, (y > r) ? (y - r) : 0,
+        ((x + r) < FRAME_WIDTH) ? (x + r) : FRAME_WIDTH, ((y + r) < FRAME_HEIGHT) ? (y + r) : FRAME_HEIGHT);
+    }
+  }
+  t_box = (bench_now_ns() - t0) / ITERATIONS;
+
+  t0 = bench_now_ns();
+  for (uint32_t n = 0; n < ITERATIONS; n++) {
+    led_detector_roi_sums(&ld, frame);
+  }
+  t_sat = (bench_now_ns() - t0) / ITERATIONS;
+
+  for (uint32_t i = 0; i < t -> count; i++) {
+    uint32_t x = t -> x[i], y = t -> y[i], r = t -> led_radius[i];
+
+    mismatches += t -> sum[i] != led_roi_count_reference(frame, (x > r) ? (x - r) : 0, (y > r) ? (y - r) : 0,
+      ((x + r) < FRAME_WIDTH) ? (x + r) : FRAME_WIDTH, ((y + r) < FRAME_HEIGHT) ? (y + r) : FRAME_HEIGHT);
+  }
+
+  fprintf(stdout, "radius %2u, %4u trackers: box %10.1f ns/frame, integral %8.1f ns/frame (%6.1fx)%s\n",
+    radius, trackers, t_box, t_sat, t_box / t_sat, mismatches ? ", MISMATCH" : "");
+
+  led_detector_destroy(&ld);
+  free(legacy);
+}
+
+int main(int argc, char **argv)
+{
+  uint16_t radii[] = {5, 50};
+  uint32_t counts[] = {1, 10, 50, 100, 200, 500};
+
+  for (int r = 0; r < 2; r++) {
+    for (int c = 0; c < 6; c++) {
+      run(radii[r], counts[c]);
+    }
+  }
+
+  return 0;
+}
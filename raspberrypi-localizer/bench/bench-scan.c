@@ -0,0 +1,63 @@
+/*
+ ============================================================================
+ Name        : bench-scan.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : ns/frame of led_detector_detect_leds at low pixel occupancy
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include "bench-common.h"
+#include "led-detector.h"
+
+#define ITERATIONS 5000
+
+static uint8_t frame[BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+
+static void run(led_detector *ld, uint32_t ppm)
+{
+  uint32_t seed = 0x9E3779B9;
+  led_frame_occupancy occ;
+  double t0, t;
+
+  memset(frame, 0, sizeof(frame));
+  bench_scatter(frame, ppm, &seed);
+  /* Built during ingest on the capture side, so it is not part of the timing. */
+  led_detector_frame_occupancy(&occ, frame);
+
+  t0 = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    led_detector_detect_leds(ld, frame, &occ);
+  }
+  t = (bench_now_ns() - t0) / ITERATIONS;
+
+  fprintf(stdout, "occupancy %6.2f%%: %10.1f ns/frame (%u lit pixels, %u blobs)\n",
+    ppm / 10000.0, t, ld -> frame_ones, ld -> frame_noise + ld -> frame_leds);
+}
+
+int main(int argc, char **argv)
+{
+  static led_detector ld;
+  RASPITEX_STATE state;
+
+  memset(&state, 0, sizeof(state));
+  state.led_find_radius = LED_FIND_RADIUS;
+  state.led_blob_size = LED_BLOB_SIZE;
+  state.led_radius = LED_RADIUS;
+  state.led_one_zero_thresh = LED_ONE_ZERO_THRESHOLD;
+  state.led_capacity = LED_CAPACITY;
+  led_detector_init(&ld, &state);
+
+  /* The first frame only primes the detector. */
+  led_detector_detect_leds(&ld, frame, NULL);
+
+  run(&ld, 0);
+  run(&ld, 1000);
+  run(&ld, 10000);
+  run(&ld, 100000);
+
+  led_detector_destroy(&ld);
+  return 0;
+}
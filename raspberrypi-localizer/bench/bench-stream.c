@@ -0,0 +1,299 @@
+/*
+ ============================================================================
+ Name        : bench-stream.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : End to end latency of the detection stream. A threaded
+               detector replays a synthetic scene with the stream open on
+               shared memory and a Unix socket, and two consumer processes
+               read it with detection-reader, one sleeping on the ring's
+               futex and one on the socket. Latency is taken from the
+               frame being published to the detector, and from the
+               record's own timestamp, to the consumer having it. Both
+               consumers must get every ID of the text log, in order.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "bench-common.h"
+#include "led-detector.h"
+#include "detection-reader.h"
+
+#define LEDS            200
+#define FRAMES          400
+#define PERIOD_US       5000
+#define HALF_BIT_FRAMES 2
+#define IDLE_FRAMES     12
+#define SAMPLES         4096
+
+#define READER_SHM      0
+#define READER_SOCKET   1
+
+static uint8_t frames[FRAMES][BENCH_FRAME_BYTES] __attribute__((aligned(64)));
+static uint8_t readbacks[FRAMES][LED_READBACK_BYTES] __attribute__((aligned(64)));
+
+typedef struct consumer_t {
+  uint32_t  records;
+  uint32_t  lost;
+  uint32_t  hash;
+  uint32_t  samples;
+  uint32_t  from_frame_us[SAMPLES];
+  uint32_t  from_record_us[SAMPLES];
+} consumer;
+
+/* Shared with the consumer processes. */
+typedef struct shared_t {
+  _Atomic uint32_t  ready;
+  _Atomic uint32_t  done;
+  uint64_t          publish_ns[FRAMES];
+  consumer          consumers[2];
+} shared;
+
+static uint64_t now_ns(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((uint64_t)t.tv_sec * 1000000000ull) + t.tv_nsec;
+}
+
+/* FNV-1a over the IDs in the order they are reported. */
+static uint32_t hash_id(uint32_t hash, uint32_t id)
+{
+  hash ^= id;
+  return hash * 16777619u;
+}
+
+static void consume(shared *sh, consumer *c, const detection_record *records, uint32_t n)
+{
+  uint64_t t = now_ns();
+
+  for (uint32_t k = 0; k < n; k++)
+  {
+    const detection_record *r = &records[k];
+
+    c->hash = hash_id(c->hash, r->id);
+    if (c->samples < SAMPLES && r->frame_number < FRAMES)
+    {
+      c->from_frame_us[c->samples] = (t - sh->publish_ns[r->frame_number]) / 1000;
+      c->from_record_us[c->samples] = (t - r->timestamp) / 1000;
+      c->samples++;
+    }
+  }
+  c->records += n;
+}
+
+static void read_shm(shared *sh, const char *name)
+{
+  consumer *c = &sh->consumers[READER_SHM];
+  detection_record records[64];
+  detection_reader r;
+
+  if (detection_reader_open(&r, name) != 0)
+    exit(1);
+  atomic_fetch_add(&sh->ready, 1);
+
+  for (;;)
+  {
+    uint32_t n = detection_reader_read(&r, records, 64);
+
+    consume(sh, c, records, n);
+    if (n)
+      continue;
+    if (atomic_load(&sh->done))
+      break;
+    detection_reader_wait(&r, 100);
+  }
+  c->lost = r.lost;
+  detection_reader_close(&r);
+}
+
+static void read_socket(shared *sh, const char *path)
+{
+  consumer *c = &sh->consumers[READER_SOCKET];
+  detection_record records[LED_CAPACITY];
+  detection_batch batch;
+  uint32_t next = 0;
+  int fd = detection_socket_connect(path);
+  int n;
+
+  if (fd < 0)
+    exit(1);
+  atomic_fetch_add(&sh->ready, 1);
+
+  while ((n = detection_socket_read(fd, &batch, records, LED_CAPACITY)) > 0)
+  {
+    /* The record sequence tells whole messages that were dropped. */
+    c->lost += records[0].sequence - next;
+    next = records[n - 1].sequence + 1;
+    consume(sh, c, records, n);
+  }
+  close(fd);
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+  return (x > y) - (x < y);
+}
+
+static void print_latency(const char *name, uint32_t *us, uint32_t n)
+{
+  if (n == 0)
+  {
+    fprintf(stdout, "  %-12s no records\n", name);
+    return;
+  }
+  qsort(us, n, sizeof(uint32_t), compare_u32);
+  fprintf(stdout, "  %-12s p50 %6u us, p99 %6u us, max %6u us\n", name, us[n / 2], us[(n * 99) / 100], us[n - 1]);
+}
+
+int main(int argc, char **argv)
+{
+  const char *names[] = {"shm futex", "unix socket"};
+  char shm_name[64], socket_path[108];
+  uint32_t seed = 0x2C9E51B7;
+  uint32_t messages[LEDS];
+  uint16_t x[LEDS], y[LEDS];
+  uint8_t r[LEDS];
+  uint32_t phase[LEDS];
+  uint32_t lines = 0, hash = 2166136261u;
+  RASPITEX_STATE state;
+  detection_stream *stream;
+  led_detector *ld;
+  struct timespec next;
+  pid_t readers[2];
+  shared *sh;
+  FILE *out;
+  char line[LOG_LINE_MAX];
+  int failed = 0;
+
+  /* 20 x 10 grid, jittered, 16 px apart across and 24 px down. */
+  for (uint32_t i = 0; i < LEDS; i++) {
+    uint16_t id = (bench_rand(&seed) & 0x7FFF) | 1;
+
+    messages[i] = (1u << 20) | ((uint32_t)id << 4) | led_calculate_checksum(id);
+    x[i] = 8 + ((i % 20) * 16) + (bench_rand(&seed) % 5) - 2;
+    y[i] = 12 + ((i / 20) * 24) + (bench_rand(&seed) % 7) - 3;
+    r[i] = 2 + (bench_rand(&seed) % 2);
+    phase[i] = bench_rand(&seed) % 1000;
+  }
+
+  for (uint32_t f = 0; f < FRAMES; f++) {
+    bench_scatter(frames[f], 300, &seed);
+    for (uint32_t i = 0; i < LEDS; i++) {
+      if (bench_manchester_state(messages[i], f + phase[i], HALF_BIT_FRAMES, IDLE_FRAMES))
+        bench_draw_disk(frames[f], x[i], y[i], r[i]);
+    }
+    bench_readback(readbacks[f], frames[f]);
+  }
+
+  snprintf(shm_name, sizeof(shm_name), "/led-bench-stream-%d", (int)getpid());
+  snprintf(socket_path, sizeof(socket_path), "/tmp/led-bench-stream-%d.sock", (int)getpid());
+  stream = detection_stream_open(shm_name, socket_path, DETECTION_STREAM_LENGTH, LED_CAPACITY);
+  if (!stream)
+  {
+    fprintf(stderr, "Could not open the detection stream\n");
+    return 1;
+  }
+
+  sh = (shared*)mmap(NULL, sizeof(shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  memset(sh, 0, sizeof(*sh));
+  sh->consumers[READER_SHM].hash = sh->consumers[READER_SOCKET].hash = 2166136261u;
+
+  fflush(stdout);
+  for (int k = 0; k < 2; k++)
+  {
+    readers[k] = fork();
+    if (readers[k] == 0)
+    {
+      if (k == READER_SHM)
+        read_shm(sh, shm_name);
+      else
+        read_socket(sh, socket_path);
+      _exit(0);
+    }
+  }
+  while (atomic_load(&sh->ready) < 2)
+    usleep(1000);
+
+  memset(&state, 0, sizeof(state));
+  state.led_find_radius = 10;
+  state.led_blob_size = 8;
+  state.led_radius = 5;
+  state.led_one_zero_thresh = 10;
+  state.led_capacity = LED_CAPACITY;
+  state.led_decode_threads = 1;
+  state.led_drop_policy = FRAME_RING_BLOCK;
+  ld = led_detector_create(&state);
+  out = tmpfile();
+  ld->log.out = out;
+  ld->stream = stream;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (uint32_t f = 0; f < FRAMES; f++)
+  {
+    uint8_t *readback;
+
+    next.tv_nsec += PERIOD_US * 1000L;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000L;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    readback = led_detector_frame_acquire(ld);
+    memcpy(readback, readbacks[f], LED_READBACK_BYTES);
+    sh->publish_ns[f] = now_ns();
+    led_detector_frame_publish(ld, (f + 1) * FRAME_TRANSFER_TIME, f);
+  }
+
+  /* The worker finishes the queued frames, then the socket readers see the stream close. */
+  led_detector_free(ld);
+  fprintf(stdout, "%u records in %u batches, socket_drops: %u\n", stream->stats.records, stream->stats.batches, stream->stats.socket_drops);
+  detection_stream_close(stream);
+  atomic_store(&sh->done, 1);
+  for (int k = 0; k < 2; k++)
+  {
+    int status;
+
+    waitpid(readers[k], &status, 0);
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  }
+
+  rewind(out);
+  while (fgets(line, sizeof(line), out))
+  {
+    uint32_t id;
+
+    if (sscanf(line, "%u: (", &id) == 1)
+    {
+      hash = hash_id(hash, id);
+      lines++;
+    }
+  }
+  fclose(out);
+
+  fprintf(stdout, "%u IDs in the text log, a frame every %u us\n", lines, PERIOD_US);
+  for (int k = 0; k < 2; k++)
+  {
+    consumer *c = &sh->consumers[k];
+    int same = (c->records == lines) && (c->hash == hash) && (c->lost == 0);
+
+    failed |= !same;
+    fprintf(stdout, "%-12s %u records, %u lost%s\n", names[k], c->records, c->lost, same ? "" : ", MISMATCH");
+    print_latency("from frame", c->from_frame_us, c->samples);
+    print_latency("from record", c->from_record_us, c->samples);
+  }
+
+  munmap(sh, sizeof(*sh));
+  return failed;
+}
@@ -0,0 +1,125 @@
+/*
+ ============================================================================
+ Name        : bench-trackers.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Tracker lookup through the spatial grid against a walk of
+               the whole tracker queue, for 10, 100 and 1000 trackers.
+               Large find radii cap how many trackers fit in a frame, from
+               50 on the 3x3 cells cover a quarter of it and the detector
+               walks the table too, within a call of the inlined walk.
+               Grid serials start just short of wrapping, the two must
+               still agree.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include "bench-common.h"
+#include "led-detector.h"
+
+#define LOOKUPS 200000
+
+#define min_clamp(v, m) (((v) <= (m))?0:((v)-(m)))
+
+/* led_detector_find_led as it was before the grid. */
+static uint32_t find_led_linear(led_detector *ld, uint16_t x, uint16_t y)
+{
+  led_table *t = &ld -> trackers;
+  uint32_t found = LED_NONE;
+
+  /* Newest first, as the tracker queue was walked. */
+  for (uint32_t l = t -> count; l-- > 0; )
+  {
+    if ( (t -> x[l] + ld->led_find_radius) >= x &&
+         min_clamp(t -> x[l], ld->led_find_radius) <= x &&
+         (t -> y[l] + ld->led_find_radius) >= y &&
+         min_clamp(t -> y[l], ld->led_find_radius) <= y )
+    {
+      found = l;
+      break;
+    }
+  }
+  return found;
+}
+
+static void run(uint32_t find_radius, uint32_t trackers)
+{
+  static uint16_t qx[LOOKUPS], qy[LOOKUPS];
+  led_detector ld;
+  RASPITEX_STATE state;
+  uint32_t seed = 0x1234567;
+  uint32_t hits = 0, mismatches = 0;
+  double t0, t_linear, t_grid, t_move;
+
+  memset(&state, 0, sizeof(state));
+  state.led_find_radius = find_radius;
+  state.led_blob_size = LED_BLOB_SIZE;
+  state.led_radius = LED_RADIUS;
+  state.led_one_zero_thresh = LED_ONE_ZERO_THRESHOLD;
+  state.led_capacity = trackers;
+  led_detector_init(&ld, &state);
+  ld.grid_serial = 0xFFFFFFFF - (trackers / 2);
+
+  /* Place trackers the way discovery does, never within find radius of an existing one. */
+  for (uint32_t i = 0; i < 100000 && ld.trackers.count < trackers; i++) {
+    uint16_t x = bench_rand(&seed) % FRAME_WIDTH;
+    uint16_t y = bench_rand(&seed) % FRAME_HEIGHT;
+
+    if (led_detector_find_led(&ld, x, y) == LED_NONE) {
+      led_detector_add_led(&ld, x, y);
+    }
+  }
+  trackers = ld.trackers.count;
+  for (uint32_t i = 0; i < LOOKUPS; i++) {
+    qx[i] = bench_rand(&seed) % FRAME_WIDTH;
+    qy[i] = bench_rand(&seed) % FRAME_HEIGHT;
+  }
+
+  t0 = bench_now_ns();
+  for (uint32_t i = 0; i < LOOKUPS; i++) {
+    hits += find_led_linear(&ld, qx[i], qy[i]) != LED_NONE;
+  }
+  t_linear = (bench_now_ns() - t0) / LOOKUPS;
+
+  t0 = bench_now_ns();
+  for (uint32_t i = 0; i < LOOKUPS; i++) {
+    hits += led_detector_find_led(&ld, qx[i], qy[i]) != LED_NONE;
+  }
+  t_grid = (bench_now_ns() - t0) / LOOKUPS;
+
+  for (uint32_t i = 0; i < LOOKUPS; i += 97) {
+    mismatches += find_led_linear(&ld, qx[i], qy[i]) != led_detector_find_led(&ld, qx[i], qy[i]);
+  }
+
+  /* Jitter every tracker the way blob averaging does. */
+  t0 = bench_now_ns();
+  for (uint32_t i = 0; i < LOOKUPS / trackers; i++) {
+    for (uint32_t l = 0; l < ld.trackers.count; l++) {
+      uint16_t x = (ld.trackers.x[l] + (bench_rand(&seed) % 9) + FRAME_WIDTH - 4) % FRAME_WIDTH;
+      uint16_t y = (ld.trackers.y[l] + (bench_rand(&seed) % 9) + FRAME_HEIGHT - 4) % FRAME_HEIGHT;
+      led_detector_move_led(&ld, l, x, y);
+    }
+  }
+  t_move = (bench_now_ns() - t0) / ((LOOKUPS / trackers) * trackers);
+
+  fprintf(stdout, "find radius %3u, %4u trackers: linear %8.1f ns/lookup, detector %7.1f ns/lookup (%5.1fx), move %5.1f ns, hit rate %3.0f%%%s\n",
+    find_radius, trackers, t_linear, t_grid, t_linear / t_grid, t_move, 50.0 * hits / LOOKUPS,
+    mismatches ? ", MISMATCH" : "");
+
+  led_detector_destroy(&ld);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t radii[] = {4, 10, 50, 75, 120};
+  uint32_t counts[] = {10, 100, 1000};
+
+  for (int r = 0; r < 5; r++) {
+    for (int c = 0; c < 3; c++) {
+      run(radii[r], counts[c]);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,477 @@
+/*
+ ============================================================================
+ Name        : bench-uplink.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : The UART uplink against the 6 byte records the wrapper sent.
+               codec: random walks of LEDs encoded and decoded, every
+               position must come out exact, bytes per report.
+               pacing: a link draining at half the configured baud rate,
+               simulated through a file, the drain rate estimate must find
+               it, the driver queue must stay within about a frame and new
+               IDs must overtake the backlog of repeats. The same with the
+               wrapper's 3 bytes/s budget, where no more than a window may
+               go out between two of the mote's samples.
+               pty: the uplink thread reading a shared memory detection
+               stream and writing to a pseudo terminal, the other end
+               reading it at the line rate and corrupting bytes for the
+               first second. It stands in for the Sleepy Pi, answers every
+               frame and refuses one in PTY_REFUSE_EVERY as if the mote's
+               window was full, and one answer in PTY_DROP_EVERY gets lost
+               on its way back. Every LED must end up at its last position.
+ ============================================================================
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include "bench-common.h"
+#include "detection-stream.h"
+#include "uplink.h"
+
+#define CODEC_LEDS        64
+#define CODEC_FRAMES      2000
+
+#define PACING_LEDS       200
+#define PACING_NEW        10
+
+#define PTY_LEDS          100
+#define PTY_BAUD          115200
+#define PTY_FRAMES        100       /* 4 s at 25 fps */
+#define PTY_FRAME_MS      40
+#define PTY_CORRUPT_MS    1000
+#define PTY_DRAIN_MS      1500
+#define PTY_NEW_AT        60
+#define PTY_REFUSE_EVERY  20
+#define PTY_DROP_EVERY    25
+
+#define REPORTS           1024
+
+/* World coordinate whose uplink position is exactly t tenths. */
+static float bench_world(uint16_t t)
+{
+  return (t / UPLINK_SCALE) + 0.02f;
+}
+
+static void bench_record(detection_record *r, uint16_t id, uint16_t x, uint16_t y)
+{
+  memset(r, 0, sizeof(*r));
+  r -> id = id;
+  r -> voltage = id & 1;
+  r -> flags = DETECTION_WORLD;
+  r -> world[0] = bench_world(x);
+  r -> world[1] = bench_world(y);
+}
+
+/* One step of a random walk, mostly within a few tenths and now and then a jump. */
+static uint16_t bench_walk(uint16_t v, uint32_t *seed)
+{
+  uint32_t r = bench_rand(seed) % 100;
+  int step = (r < 80) ? (int)(bench_rand(seed) % 7) - 3 : (r < 97) ? (int)(bench_rand(seed) % 201) - 100 : (int)(bench_rand(seed) % 4001) - 2000;
+  int next = (int)v + step;
+
+  return (next < 0) ? 0 : (next > 60000) ? 60000 : next;
+}
+
+static int bench_temp(char *name, size_t size, const char *what)
+{
+  int fd;
+
+  snprintf(name, size, "/tmp/bench-uplink-%d-%s", (int)getpid(), what);
+  fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  return fd;
+}
+
+/* Every report of every frame encoded and decoded, MISMATCH on any difference. */
+static int bench_codec(void)
+{
+  static uint16_t x[CODEC_LEDS], y[CODEC_LEDS];
+  static uplink_report reports[REPORTS];
+  char name[64];
+  int rd = bench_temp(name, sizeof(name), "codec");
+  uplink *u = uplink_open(name, 115200, 0);
+  uplink_decoder d;
+  uint32_t seed = 0x41C64E6D, sent = 0, decoded = 0, bytes = 0, errors = 0;
+
+  if (rd < 0 || !u || uplink_decoder_init(&d) != 0)
+  {
+    fprintf(stderr, "Could not set up the codec bench\n");
+    return 1;
+  }
+
+  for (uint32_t i = 0; i < CODEC_LEDS; i++)
+  {
+    x[i] = bench_rand(&seed) % 60000;
+    y[i] = bench_rand(&seed) % 60000;
+  }
+
+  for (uint32_t f = 0; f < CODEC_FRAMES; f++)
+  {
+    uint8_t frame[UPLINK_FRAME_MAX];
+    uint32_t length, n;
+
+    for (uint32_t i = 0; i < CODEC_LEDS; i++)
+    {
+      detection_record r;
+
+      x[i] = bench_walk(x[i], &seed);
+      y[i] = bench_walk(y[i], &seed);
+      bench_record(&r, 100 + (i * 37), x[i], y[i]);
+      uplink_update(u, &r, f * 40);
+      sent++;
+    }
+    /* Everything goes out before the next frame, so every report is the LED's latest position. */
+    while ((length = uplink_encode(u, frame, UPLINK_FRAME_MAX, f * 40)) > 0)
+    {
+      n = uplink_decoder_push(&d, frame, length, reports, REPORTS);
+      bytes += length;
+      for (uint32_t k = 0; k < n; k++)
+      {
+        uint32_t i = (reports[k].id - 100) / 37;
+
+        if (i >= CODEC_LEDS || reports[k].x != x[i] || reports[k].y != y[i] || reports[k].voltage != (reports[k].id & 1))
+          errors++;
+      }
+      decoded += n;
+    }
+  }
+
+  errors += (decoded != sent) + d.stats.crc_errors + d.stats.unknown + d.stats.malformed + d.stats.gaps;
+  fprintf(stdout, "codec   %u reports in %u bytes, %.2f bytes/report against 6, %u absolute, %u deltas, %u small deltas%s\n",
+    decoded, bytes, (double)bytes / decoded, u -> stats.absolute, u -> stats.deltas, u -> stats.small_deltas, errors ? ", MISMATCH" : "");
+
+  uplink_decoder_destroy(&d);
+  uplink_close(u);
+  close(rd);
+  unlink(name);
+  return errors != 0;
+}
+
+/*
+ baud configured, the link draining at drain bytes/s, budget as for
+ -uplink_budget. Every LED moves every 40 ms, PACING_NEW more appear half
+ way through. Frames go to a file, the receiver decodes what the simulated
+ link has delivered.
+ */
+static int bench_pacing(const char *what, uint32_t baud, double drain, uint32_t budget, double expected_rate, uint32_t leds_before, uint32_t seconds)
+{
+  static uint16_t x[PACING_LEDS + PACING_NEW], y[PACING_LEDS + PACING_NEW];
+  static uint32_t reported_ms[PACING_LEDS + PACING_NEW];
+  static uplink_report reports[REPORTS];
+  char name[64];
+  int rd = bench_temp(name, sizeof(name), what);
+  uplink *u = uplink_open(name, baud, budget);
+  uplink_decoder d;
+  uint32_t seed = 0x2545F491, written = 0, read_at = 0, queued_max = 0, new_seen = 0, new_at_ms = seconds * 500, failed;
+  uint32_t sampled = 0, sample_max = 0;
+  double delivered = 0, staleness = 0, new_latency = 0;
+  uint32_t staleness_count = 0;
+
+  if (rd < 0 || !u || uplink_decoder_init(&d) != 0)
+  {
+    fprintf(stderr, "Could not set up the pacing bench\n");
+    return 1;
+  }
+
+  for (uint32_t i = 0; i < PACING_LEDS + PACING_NEW; i++)
+  {
+    x[i] = bench_rand(&seed) % 60000;
+    y[i] = bench_rand(&seed) % 60000;
+  }
+
+  memset(reported_ms, 0, sizeof(reported_ms));
+  for (uint32_t t = 0; t <= seconds * 1000; t += 10)
+  {
+    uint32_t leds = (t >= new_at_ms) ? leds_before + PACING_NEW : leds_before;
+    uint32_t queued;
+    uint8_t buffer[4096];
+
+    if (t % 40 == 0)
+    {
+      for (uint32_t i = 0; i < leds; i++)
+      {
+        detection_record r;
+
+        x[i] = bench_walk(x[i], &seed);
+        y[i] = bench_walk(y[i], &seed);
+        bench_record(&r, 1 + i, x[i], y[i]);
+        uplink_update(u, &r, t);
+      }
+    }
+
+    /* The link delivers drain bytes/s of what was written. */
+    delivered += drain * 10 / 1000.0;
+    if (delivered > written)
+      delivered = written;
+    queued = written - (uint32_t)delivered;
+    if (queued > queued_max)
+      queued_max = queued;
+
+    /* The mote samples the Sleepy Pi at a phase of its own, the Sleepy Pi keeps no heartbeats for it. */
+    if (t % UPLINK_WINDOW_MS == 3700)
+    {
+      uint32_t kept = written - (atomic_load(&u -> stats.heartbeats) * UPLINK_OVERHEAD);
+
+      if (kept - sampled > sample_max)
+        sample_max = kept - sampled;
+      sampled = kept;
+    }
+    written += uplink_send(u, t, queued);
+
+    while ((uint32_t)delivered > read_at)
+    {
+      uint32_t want = (uint32_t)delivered - read_at, count;
+      ssize_t n = pread(rd, buffer, (want < sizeof(buffer)) ? want : sizeof(buffer), read_at);
+
+      if (n <= 0)
+        break;
+      read_at += n;
+
+      count = uplink_decoder_push(&d, buffer, n, reports, REPORTS);
+      for (uint32_t k = 0; k < count; k++)
+      {
+        uint32_t i = reports[k].id - 1;
+
+        if (i >= leds_before)
+        {
+          if (reported_ms[i] == 0)
+          {
+            new_seen++;
+            new_latency += t - new_at_ms;
+          }
+        }
+        else if (reported_ms[i] && t >= new_at_ms)
+        {
+          staleness += t - reported_ms[i];
+          staleness_count++;
+        }
+        reported_ms[i] = t;
+      }
+    }
+  }
+
+  new_latency /= new_seen ? new_seen : 1;
+  staleness /= staleness_count ? staleness_count : 1;
+  failed = fabs(u -> rate - expected_rate) > expected_rate * 0.1
+    || queued_max > (2 * UPLINK_FRAME_MAX) + (drain * UPLINK_TICK_MS / 1000.0)
+    || new_seen != PACING_NEW || new_latency >= staleness || sample_max > u -> window_bytes
+    || d.stats.crc_errors || d.stats.unknown || d.stats.malformed;
+
+  fprintf(stdout, "pacing  %-6s %4u baud, link %3.0f B/s, budget %3u B/s: %5.1f B/s delivered, rate estimate %3.0f B/s, driver queue max %3u B, "
+    "new IDs after %6.0f ms against %6.0f ms between repeats, %4u B between samples%s\n",
+    what, baud, drain, u -> budget, delivered / seconds, u -> rate, queued_max,
+    new_latency, staleness, sample_max, failed ? ", MISMATCH" : "");
+
+  uplink_decoder_destroy(&d);
+  uplink_close(u);
+  close(rd);
+  unlink(name);
+  return failed;
+}
+
+/* The Sleepy Pi's end of the pty. */
+typedef struct bench_sleepy_t {
+  uint8_t   buffer[UPLINK_OVERHEAD + UPLINK_PAYLOAD_LIMIT];
+  uint32_t  length;
+  uint32_t  seed;
+} bench_sleepy;
+
+/*
+ Feed n bytes of the uplink. A whole frame with a good CRC goes on to the
+ mote's decoder d and is answered with the window left, unless it is the
+ one in PTY_REFUSE_EVERY that did not fit, any other whole frame with -1,
+ both with the frame's sequence. Heartbeats are neither forwarded nor
+ answered, not even with a bad CRC, like pirotap_base.c does. One answer
+ in PTY_DROP_EVERY is not written. The number of reports.
+ */
+static uint32_t bench_sleepy_push(bench_sleepy *sp, int master, uplink_decoder *d, const uint8_t *bytes, uint32_t n, uplink_report *reports, uint32_t max)
+{
+  uint32_t count = 0;
+
+  for (uint32_t k = 0; k < n; k++)
+  {
+    uint32_t total;
+    char answer[16];
+    int length;
+
+    /* Bytes between frames are skipped. */
+    if (sp -> length == 0 && bytes[k] != UPLINK_SYNC)
+      continue;
+    sp -> buffer[sp -> length++] = bytes[k];
+    if (sp -> length < 2)
+      continue;
+    total = sp -> buffer[1] + UPLINK_OVERHEAD;
+    if (total <= UPLINK_FRAME_MAX + 2 && sp -> length < total)
+      continue;
+
+    if (sp -> buffer[1] == 0)
+    {
+      length = 0;
+    }
+    else if (total > UPLINK_FRAME_MAX + 2 || uplink_crc(sp -> buffer + 1, total - 3) != (uint16_t)((sp -> buffer[total - 2] << 8) | sp -> buffer[total - 1])
+      || bench_rand(&sp -> seed) % PTY_REFUSE_EVERY == 0)
+    {
+      length = snprintf(answer, sizeof(answer), "00-1%02X V7\r\n", sp -> buffer[2]);
+    }
+    else
+    {
+      count += uplink_decoder_push(d, sp -> buffer, total, reports + count, max - count);
+      length = snprintf(answer, sizeof(answer), "00%02u%02X V7\r\n", UPLINK_FRAME_MAX - total, sp -> buffer[2]);
+    }
+    if (length > 0 && bench_rand(&sp -> seed) % PTY_DROP_EVERY == 0)
+      length = 0;
+    if (length > 0 && write(master, answer, length) != length)
+      fprintf(stderr, "Could not answer the uplink\n");
+    sp -> length = 0;
+  }
+  return count;
+}
+
+static double bench_elapsed_ms(double start_ns)
+{
+  return (bench_now_ns() - start_ns) / 1e6;
+}
+
+/* The uplink thread end to end over a pseudo terminal. */
+static int bench_pty(void)
+{
+  static uint16_t x[PTY_LEDS + PACING_NEW], y[PTY_LEDS + PACING_NEW], got_x[PTY_LEDS + PACING_NEW], got_y[PTY_LEDS + PACING_NEW];
+  static uint8_t got[PTY_LEDS + PACING_NEW];
+  static uplink_report reports[REPORTS];
+  char shm_name[64];
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  detection_stream *s;
+  uplink *u;
+  uplink_decoder d;
+  bench_sleepy sleepy;
+  uint32_t seed = 0x6C078965, received = 0, corrupted = 0, errors = 0, frame = 0, new_latency_max = 0, new_seen = 0;
+  double start, new_at = 0, line_rate = PTY_BAUD / 10.0;
+
+  snprintf(shm_name, sizeof(shm_name), "/bench-uplink-%d", (int)getpid());
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0 || uplink_decoder_init(&d) != 0)
+  {
+    fprintf(stderr, "Could not open a pseudo terminal\n");
+    return 1;
+  }
+  fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+  memset(&sleepy, 0, sizeof(sleepy));
+  sleepy.seed = 0x9E3779B9;
+
+  s = detection_stream_open(shm_name, NULL, DETECTION_STREAM_LENGTH, PTY_LEDS + PACING_NEW);
+  u = s ? uplink_open(ptsname(master), PTY_BAUD, 0) : NULL;
+  if (!u || uplink_start(u, shm_name) != 0)
+  {
+    fprintf(stderr, "Could not start the uplink\n");
+    return 1;
+  }
+
+  for (uint32_t i = 0; i < PTY_LEDS + PACING_NEW; i++)
+  {
+    x[i] = bench_rand(&seed) % 60000;
+    y[i] = bench_rand(&seed) % 60000;
+  }
+
+  start = bench_now_ns();
+  for (;;)
+  {
+    double now = bench_elapsed_ms(start);
+    uint8_t buffer[4096];
+    uint32_t want = (uint32_t)(line_rate * now / 1000.0) - received;
+    ssize_t n;
+
+    if (frame < PTY_FRAMES && now >= frame * PTY_FRAME_MS)
+    {
+      uint32_t leds = (frame >= PTY_NEW_AT) ? PTY_LEDS + PACING_NEW : PTY_LEDS;
+
+      if (frame == PTY_NEW_AT)
+        new_at = now;
+      for (uint32_t i = 0; i < leds; i++)
+      {
+        detection_record r;
+
+        x[i] = bench_walk(x[i], &seed);
+        y[i] = bench_walk(y[i], &seed);
+        bench_record(&r, 1 + i, x[i], y[i]);
+        detection_stream_add(s, &r);
+      }
+      detection_stream_commit(s);
+      frame++;
+    }
+    if (frame == PTY_FRAMES && now > (PTY_FRAMES * PTY_FRAME_MS) + PTY_DRAIN_MS)
+      break;
+
+    /* The stand in for the Sleepy Pi's UART, line_rate bytes/s. */
+    n = (want > 0) ? read(master, buffer, (want < sizeof(buffer)) ? want : sizeof(buffer)) : 0;
+    if (n > 0)
+    {
+      uint32_t count;
+
+      received += n;
+      if (now < PTY_CORRUPT_MS)
+      {
+        for (ssize_t k = 0; k < n; k++)
+        {
+          if (bench_rand(&seed) % 300 == 0)
+          {
+            buffer[k] ^= 1 << (bench_rand(&seed) % 8);
+            corrupted++;
+          }
+        }
+      }
+      count = bench_sleepy_push(&sleepy, master, &d, buffer, n, reports, REPORTS);
+      for (uint32_t k = 0; k < count; k++)
+      {
+        uint32_t i = reports[k].id - 1;
+
+        if (i >= PTY_LEDS + PACING_NEW)
+        {
+          errors++;
+          continue;
+        }
+        if (i >= PTY_LEDS && !got[i])
+        {
+          new_seen++;
+          if (now - new_at > new_latency_max)
+            new_latency_max = now - new_at;
+        }
+        got[i] = 1;
+        got_x[i] = reports[k].x;
+        got_y[i] = reports[k].y;
+      }
+    }
+    usleep(2000);
+  }
+
+  for (uint32_t i = 0; i < PTY_LEDS + PACING_NEW; i++)
+    errors += !got[i] || got_x[i] != x[i] || got_y[i] != y[i];
+  errors += new_seen != PACING_NEW;
+
+  fprintf(stdout, "pty     %u baud, %u bytes in %u frames, %u bytes corrupted: %u frames refused, %u unanswered, %u frames lost, %u deltas without a position, "
+    "new ID latency max %u ms, %u LEDs not at their last position%s\n",
+    PTY_BAUD, received, d.stats.frames, corrupted, atomic_load(&u -> stats.refused), atomic_load(&u -> stats.unanswered), d.stats.gaps, d.stats.unknown,
+    new_latency_max, errors, errors ? ", MISMATCH" : "");
+
+  uplink_close(u);
+  detection_stream_close(s);
+  uplink_decoder_destroy(&d);
+  close(master);
+  return errors != 0;
+}
+
+int main(int argc, char **argv)
+{
+  int failed = 0;
+
+  failed |= bench_codec();
+  /* The link drains half of what the baud rate promises, flow control or a busy receiver. */
+  failed |= bench_pacing("slow", 9600, 480, 0, 480, PACING_LEDS, 60);
+  /* The 30 bytes per 10 s the wrapper sent the Sleepy Pi. */
+  failed |= bench_pacing("budget", 9600, 960, 3, 960, 40, 600);
+  failed |= bench_pty();
+  return failed;
+}
@@ -0,0 +1,290 @@
+/*
+ ============================================================================
+ Name        : bench-world.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : ns per detection of world coordinates, the double precision
+               projection the wrapper used to do in numpy (undistortion, two
+               3x3 products and a plane intersection) against the per pixel
+               ray table, for calibration files written the way the wrapper
+               and calibrate_cameras write them. Every pixel of the table
+               must be within 0.01 units of the double precision projection
+               and its undistorted coordinates must distort back to within
+               0.001 pixels of it. Startup is timed building the
+               undistortion table and loading it from the cache.
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "bench-common.h"
+#include "world-map.h"
+
+#define DETECTIONS    4096
+#define ITERATIONS    200
+#define TOLERANCE     0.01
+#define PIXEL_TOLERANCE 0.001
+
+/* Keeps the timed loops from being optimized out. */
+static volatile double sink;
+
+static const double camera_matrix[9] = {
+  331.5, 0.0, 161.2,
+  0.0, 330.8, 118.7,
+  0.0, 0.0, 1.0
+};
+
+static const double distortion[5] = { 0.12, -0.31, 0.001, -0.002, 0.09 };
+
+/* Camera 3 m up, looking down and tilted 20 degrees about x, turned 30 degrees about z. */
+static void camera_rotation(double *r)
+{
+  double a = 20.0 * M_PI / 180.0, b = 30.0 * M_PI / 180.0;
+  double rx[9] = { 1, 0, 0,  0, -cos(a), sin(a),  0, -sin(a), -cos(a) };
+  double rz[9] = { cos(b), -sin(b), 0,  sin(b), cos(b), 0,  0, 0, 1 };
+
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++)
+      r[(3 * i) + j] = (rz[3 * i] * rx[j]) + (rz[(3 * i) + 1] * rx[3 + j]) + (rz[(3 * i) + 2] * rx[6 + j]);
+}
+
+/*
+ saveIntrinsicParameters, with or without the inverse the wrapper appends,
+ or calibrate_cameras' 8 coefficients with the rational ones 0.
+ */
+static void write_intrinsics(const char *name, int with_inverse, double k1)
+{
+  FILE *f = fopen(name, "w");
+  double ki[9] = {
+    1.0 / camera_matrix[0], 0.0, -camera_matrix[2] / camera_matrix[0],
+    0.0, 1.0 / camera_matrix[4], -camera_matrix[5] / camera_matrix[4],
+    0.0, 0.0, 1.0
+  };
+
+  fprintf(f, "# Camera Matrix\n");
+  for (int i = 0; i < 3; i++)
+    fprintf(f, "%.17g, %.17g, %.17g\n", camera_matrix[3 * i], camera_matrix[(3 * i) + 1], camera_matrix[(3 * i) + 2]);
+  fprintf(f, "\n# distortionCoefficients\n");
+  fprintf(f, "%.17g, %.17g, %.17g, %.17g, %.17g", k1, distortion[1], distortion[2], distortion[3], distortion[4]);
+  fprintf(f, with_inverse ? "\n\n" : ", 0, 0, 0\n\n");
+  if (with_inverse)
+  {
+    fprintf(f, "# Camera Matrix Inverse\n");
+    for (int i = 0; i < 3; i++)
+      fprintf(f, "%.17g, %.17g, %.17g\n", ki[3 * i], ki[(3 * i) + 1], ki[(3 * i) + 2]);
+    fprintf(f, "\n");
+  }
+  fclose(f);
+}
+
+static void write_extrinsics(const char *name)
+{
+  FILE *f = fopen(name, "w");
+  double r[9];
+
+  camera_rotation(r);
+  fprintf(f, "# Camera Rotation\n");
+  for (int i = 0; i < 3; i++)
+    fprintf(f, "%.17g, %.17g, %.17g\n", r[3 * i], r[(3 * i) + 1], r[(3 * i) + 2]);
+  fprintf(f, "\n# Camera Translation\n");
+  fprintf(f, "%.17g, %.17g, %.17g\n", 120.0, 340.0, 300.0);
+  fclose(f);
+}
+
+static void write_heights(const char *name)
+{
+  FILE *f = fopen(name, "w");
+
+  fprintf(f, "# LED ID, height\n0, 0.0\n1234, 85.5\n77, 120.0\n");
+  fclose(f);
+}
+
+/* Largest distance between the table and the double precision projection over all pixels, -1 if a pixel failed. */
+static double check(const world_map *m, uint16_t id, double height)
+{
+  double worst = 0;
+
+  for (uint32_t y = 0; y < FRAME_HEIGHT; y++)
+  {
+    for (uint32_t x = 0; x < FRAME_WIDTH; x++)
+    {
+      float w[3];
+      double ref[3];
+
+      if (world_map_project(m, id, x, y, w) != 0 || world_map_project_reference(m, height, x, y, ref) != 0)
+        return -1;
+      for (int k = 0; k < 3; k++)
+        worst = fmax(worst, fabs(w[k] - ref[k]));
+    }
+  }
+  return worst;
+}
+
+/* Largest distance in pixels between a pixel and its undistorted coordinates distorted back. */
+static double check_undistortion(const world_map *m)
+{
+  const float *p = m -> undistorted;
+  double worst = 0;
+
+  for (uint32_t y = 0; y < FRAME_HEIGHT; y++)
+  {
+    for (uint32_t x = 0; x < FRAME_WIDTH; x++)
+    {
+      double u, v;
+
+      world_map_distort_point(m, p[0], p[1], &u, &v);
+      worst = fmax(worst, hypot(u - x, v - y));
+      p += 2;
+    }
+  }
+  return worst;
+}
+
+/* Largest distance, in world units at the default height, undistortion moves a pixel on the frame's edge. */
+static double edge_shift(const world_map *m)
+{
+  const double *ki = m -> camera_matrix_inv, *r = m -> rotation, *t = m -> translation;
+  double worst = 0;
+
+  for (uint32_t i = 0; i < 2 * (FRAME_WIDTH + FRAME_HEIGHT); i++)
+  {
+    double x = (i < FRAME_WIDTH) ? i : (i < 2 * FRAME_WIDTH) ? i - FRAME_WIDTH : (i & 1) * (FRAME_WIDTH - 1);
+    double y = (i < FRAME_WIDTH) ? 0 : (i < 2 * FRAME_WIDTH) ? FRAME_HEIGHT - 1 : (i - (2 * FRAME_WIDTH)) / 2;
+    double c[3], los[3], with[3], scale;
+
+    for (int k = 0; k < 3; k++)
+      c[k] = (ki[3 * k] * x) + (ki[(3 * k) + 1] * y) + ki[(3 * k) + 2];
+    for (int k = 0; k < 3; k++)
+      los[k] = (r[3 * k] * c[0]) + (r[(3 * k) + 1] * c[1]) + (r[(3 * k) + 2] * c[2]);
+    if (world_map_project_reference(m, 0.0, x, y, with) != 0)
+      continue;
+    scale = -t[2] / los[2];
+    worst = fmax(worst, hypot(with[0] - (t[0] + (los[0] * scale)), with[1] - (t[1] + (los[1] * scale))));
+  }
+  return worst;
+}
+
+int main(int argc, char **argv)
+{
+  static uint16_t px[DETECTIONS], py[DETECTIONS];
+  char intrinsics[64], intrinsics_plain[64], extrinsics[64], heights[64], cache[80], cache_plain[80];
+  uint32_t seed = 0x5D0C2E91;
+  world_map m, cached, plain, changed;
+  double t0, t_build, t_cached, t_reference, t_table, sum = 0, worst, worst_default, worst_pixel, shift, inverse_diff = 0, plain_diff = 0;
+  float h;
+  int failed = 0, same_table;
+
+  snprintf(intrinsics, sizeof(intrinsics), "/tmp/bench-world-%d-intrinsics.txt", (int)getpid());
+  snprintf(intrinsics_plain, sizeof(intrinsics_plain), "/tmp/bench-world-%d-intrinsics-plain.txt", (int)getpid());
+  snprintf(extrinsics, sizeof(extrinsics), "/tmp/bench-world-%d-extrinsics.txt", (int)getpid());
+  snprintf(heights, sizeof(heights), "/tmp/bench-world-%d-heights.txt", (int)getpid());
+  snprintf(cache, sizeof(cache), "%s%s", intrinsics, WORLD_MAP_CACHE_SUFFIX);
+  snprintf(cache_plain, sizeof(cache_plain), "%s%s", intrinsics_plain, WORLD_MAP_CACHE_SUFFIX);
+  write_intrinsics(intrinsics, 1, distortion[0]);
+  write_intrinsics(intrinsics_plain, 0, distortion[0]);
+  write_extrinsics(extrinsics);
+  write_heights(heights);
+
+  t0 = bench_now_ns();
+  if (world_map_load(&m, intrinsics, extrinsics, heights) != 0)
+  {
+    fprintf(stderr, "Could not load the calibration\n");
+    return 1;
+  }
+  t_build = (bench_now_ns() - t0) / 1e6;
+  t0 = bench_now_ns();
+  if (world_map_load(&cached, intrinsics, extrinsics, heights) != 0)
+  {
+    fprintf(stderr, "Could not load the calibration\n");
+    return 1;
+  }
+  t_cached = (bench_now_ns() - t0) / 1e6;
+  if (world_map_load(&plain, intrinsics_plain, extrinsics, heights) != 0)
+  {
+    fprintf(stderr, "Could not load the calibration\n");
+    return 1;
+  }
+  same_table = !m.undistorted_cached && cached.undistorted_cached
+    && memcmp(m.undistorted, cached.undistorted, FRAME_WIDTH * FRAME_HEIGHT * 2 * sizeof(float)) == 0;
+
+  /* Another calibration in the same file must not reuse the cache. */
+  write_intrinsics(intrinsics, 1, distortion[0] * 1.01);
+  if (world_map_load(&changed, intrinsics, extrinsics, heights) != 0)
+  {
+    fprintf(stderr, "Could not load the calibration\n");
+    return 1;
+  }
+  same_table = same_table && !changed.undistorted_cached;
+  fprintf(stdout, "load, undistortion and ray tables %.1f ms, from the cache %.1f ms%s\n",
+    t_build, t_cached, same_table ? "" : ", cache MISMATCH");
+
+  /* Without the saved inverse the map inverts the camera matrix itself, and reads all 8 coefficients. */
+  for (int k = 0; k < 9; k++)
+    inverse_diff = fmax(inverse_diff, fabs(m.camera_matrix_inv[k] - plain.camera_matrix_inv[k]));
+  for (uint32_t i = 0; i < FRAME_WIDTH * FRAME_HEIGHT * 2; i++)
+    plain_diff = fmax(plain_diff, fabs(m.undistorted[i] - plain.undistorted[i]));
+
+  for (uint32_t i = 0; i < DETECTIONS; i++)
+  {
+    px[i] = bench_rand(&seed) % FRAME_WIDTH;
+    py[i] = bench_rand(&seed) % FRAME_HEIGHT;
+  }
+
+  world_map_height(&m, 1234, &h);
+  t0 = bench_now_ns();
+  for (uint32_t n = 0; n < ITERATIONS; n++)
+  {
+    for (uint32_t i = 0; i < DETECTIONS; i++)
+    {
+      double w[3];
+      float height;
+
+      world_map_height(&m, 1234, &height);
+      world_map_project_reference(&m, height, px[i], py[i], w);
+      sum += w[0] + w[1];
+    }
+  }
+  t_reference = (bench_now_ns() - t0) / (ITERATIONS * DETECTIONS);
+
+  t0 = bench_now_ns();
+  for (uint32_t n = 0; n < ITERATIONS; n++)
+  {
+    for (uint32_t i = 0; i < DETECTIONS; i++)
+    {
+      float w[3];
+
+      world_map_project(&m, 1234, px[i], py[i], w);
+      sum -= w[0] + w[1];
+    }
+  }
+  t_table = (bench_now_ns() - t0) / (ITERATIONS * DETECTIONS);
+
+  worst = check(&m, 1234, h);
+  worst_default = check(&m, 999, 0.0);
+  worst_pixel = check_undistortion(&m);
+  shift = edge_shift(&m);
+  failed = worst < 0 || worst > TOLERANCE || worst_default < 0 || worst_default > TOLERANCE || inverse_diff > 1e-9
+    || plain_diff > 1e-6 || worst_pixel > PIXEL_TOLERANCE || !same_table;
+
+  fprintf(stdout, "reference %6.1f ns/detection\n", t_reference);
+  fprintf(stdout, "ray table %6.1f ns/detection (%5.1fx), max error %.5f at height %.1f, %.5f at the default height, inverse off by %.2g%s\n",
+    t_table, t_reference / t_table, worst, h, worst_default, inverse_diff, failed ? ", MISMATCH" : "");
+  fprintf(stdout, "undistortion round trip max error %.6f px, moves the frame's edge up to %.1f units at the default height\n",
+    worst_pixel, shift);
+  sink = sum;
+
+  world_map_destroy(&m);
+  world_map_destroy(&cached);
+  world_map_destroy(&plain);
+  world_map_destroy(&changed);
+  unlink(intrinsics);
+  unlink(intrinsics_plain);
+  unlink(cache);
+  unlink(cache_plain);
+  unlink(extrinsics);
+  unlink(heights);
+  return failed;
+}
@@ -45,6 +45,87 @@
 #define LUMINENCE_THRESH_DELTA    0.002
 #define FRAME_ONES_THRESH         500
 
+/* Extract blobs from vertical runs of the packed frame instead of flood filling from each seed pixel. */
+#define LED_RUN_BLOBS             1
+
+/* Default number of tracker slots preallocated by the detector, see -led_capacity. */
+#define LED_CAPACITY              256
+
+/* Count tracker ROIs over a disk of led_radius instead of its bounding square, see -led_roi_circle. */
+#define LED_ROI_CIRCLE            0
+
+/* Frames the GL thread can queue ahead of the detector worker, rounded up to a power of 2. */
+#define LED_FRAME_RING_LENGTH     128
+
+/* Threads labeling and decoding screen stripes of each frame, see -decode_threads. */
+#define LED_DECODE_THREADS        1
+
+/* Associate and decode frame N on a second thread while frame N+1 is labeled, see -pipeline. */
+#define LED_PIPELINE              0
+
+/* Labeled frames the discovery stage can queue ahead of the decode stage, rounded up to a power of 2. */
+#define LED_STAGE_RING_LENGTH     4
+
+/* What the GL thread does when the frame ring is full: 0 drop the new frame, 1 drop the oldest queued, 2 wait, see -drop_policy. */
+#define LED_DROP_POLICY           0
+
+/* Frames a tracker can miss in the middle of a message and still be decoded, a whole half bit must not be lost. */
+#define LED_GAP_MAX_MISSED        ((BIT_TRANSFER_TIME / 2) / FRAME_TRANSFER_TIME - 1)
+
+/* Log records of 256 bytes the hot threads can queue ahead of the log writer, rounded up to a power of 2. A frame reports up to LED_CAPACITY IDs at once. */
+#define LED_LOG_RING_LENGTH       (4 * LED_CAPACITY)
+
+/* Records of the shared memory detection stream, a few seconds of LEDs for a reader to fall behind by. */
+#define DETECTION_STREAM_LENGTH   (16 * LED_CAPACITY)
+
+/* Line rate of the uplink to the Sleepy Pi, see -uplink and -uplink_baud. */
+#define UPLINK_BAUD               9600
+
+/* Largest uplink frame, the 30 bytes the Sleepy Pi forwards to the mote at a time. */
+#define UPLINK_FRAME_MAX          30
+
+/* ms between the uplink's pacing decisions, and of silence after which it sends an empty frame. */
+#define UPLINK_TICK_MS            100
+#define UPLINK_HEARTBEAT_MS       10000
+
+/* ms between the mote's samples of the Sleepy Pi, each takes the UPLINK_FRAME_MAX bytes it buffered. */
+#define UPLINK_WINDOW_MS          10000
+
+/* ms the Sleepy Pi has to acknowledge a frame before it counts as lost, and frames waiting for it at once. */
+#define UPLINK_ACK_MS             2000
+#define UPLINK_UNACKED            16
+
+/* Deltas after which an LED is sent whole again, and ms without a report after which it counts as new. */
+#define UPLINK_REFRESH            16
+#define UPLINK_FORGET_MS          60000
+
+/* Distinct LEDs waiting to be sent at once. */
+#define UPLINK_PENDING_MAX        (4 * LED_CAPACITY)
+
+/* Shared memory detection stream the uplink reads when -stream_shm is not given. */
+#define UPLINK_SHM_NAME           "/localizer-uplink"
+
+/* Default length of a recording of the packed frames in seconds, see -record and -record_seconds. */
+#define FRAME_RECORD_SECONDS      3600
+
+/* Frames the detector can queue ahead of the recording's writer, rounded up to a power of 2. */
+#define FRAME_RECORD_RING_LENGTH  64
+
+/* Frames of a recording mapped at a time, about 2.4 MB at 320x240, and ms between the writer's looks at the ring. */
+#define FRAME_RECORD_WINDOW       256
+#define FRAME_RECORD_POLL_MS      100
+
+/* Frames before the first background is taken and between background refreshes. */
+#define LED_BG_WARMUP_FRAMES      120
+#define LED_BG_REFRESH_FRAMES     1200
+
+/* Period of the jitter and usage report of the event loop, see -event_loop. */
+#define LED_REPORT_INTERVAL_MS    10000
+
+/* Frame intervals in ms outside of which a frame counts as a time anomaly. */
+#define FRAME_INTERVAL_MIN        30
+#define FRAME_INTERVAL_MAX        50
+
 
 #define LED_BUFFER_LENGTH         ((PREAMBLE_LENGTH + DATA_LENGTH + CHECKSUM_LENGTH) * 3)
 #define MESSAGE_LENGTH            (PREAMBLE_LENGTH + DATA_LENGTH + CHECKSUM_LENGTH)
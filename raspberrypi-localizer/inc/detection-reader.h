@@ -0,0 +1,41 @@
+/*
+ * detection-reader.h
+ *
+ *  Consumer side of the detection stream, see detection-stream.h. Builds
+ *  on its own with detection-reader.c, without the rest of the localizer.
+ *
+ *  A shared memory reader starts at the records published when it opens
+ *  the ring and is told how many it lost when the writer laps it. A socket
+ *  reader gets every frame's records as one message.
+ */
+
+#ifndef DETECTION_READER_H_
+#define DETECTION_READER_H_
+
+#include <stddef.h>
+#include "detection-stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct detection_reader_t {
+  detection_shm *shm;
+  size_t    shm_bytes;
+  uint64_t  position;       /* Next record position to read */
+  uint64_t  lost;           /* Records overwritten before they were read */
+} detection_reader;
+
+int       detection_reader_open(detection_reader *r, const char *shm_name);
+void      detection_reader_close(detection_reader *r);
+uint32_t  detection_reader_read(detection_reader *r, detection_record *records, uint32_t max);
+int       detection_reader_wait(detection_reader *r, int timeout_ms);
+
+int       detection_socket_connect(const char *path);
+int       detection_socket_read(int fd, detection_batch *batch, detection_record *records, uint32_t max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DETECTION_READER_H_ */
@@ -0,0 +1,126 @@
+/*
+ * detection-stream.h
+ *
+ *  Identified LEDs as fixed size binary records, published to a shared
+ *  memory ring and to the clients of a Unix domain socket, for consumers
+ *  that would otherwise parse the text log.
+ *
+ *  The shared memory ring has a single writer. Each slot carries a
+ *  sequence number, odd while the writer fills it and even once it holds
+ *  the record of a position, so a reader copies a record and checks the
+ *  sequence again to know it was not overwritten meanwhile. head counts
+ *  the records published, it is advanced once per frame. A reader that
+ *  falls more than capacity records behind loses the oldest ones and is
+ *  told how many. Readers can sleep on the commits futex, the writer only
+ *  makes the wake up call when someone is waiting.
+ *
+ *  Socket clients get one SOCK_SEQPACKET message per frame, a
+ *  detection_batch header followed by its records. Clients are accepted
+ *  and written to without blocking, a client that does not keep up loses
+ *  whole messages.
+ *
+ *  This header describes the wire format and only depends on the C
+ *  library, detection-reader.h is the consumer side.
+ */
+
+#ifndef DETECTION_STREAM_H_
+#define DETECTION_STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DETECTION_MAGIC           0x5344454C    /* "LEDS" */
+#define DETECTION_VERSION         2
+
+/* detection_record flags */
+#define DETECTION_WORLD           0x1           /* world holds the LED's world coordinates */
+
+/* Identified LED, version 2, little endian as the Pi writes it. */
+typedef struct detection_record_t {
+  uint32_t  sequence;           /* Position in the stream, gaps are records a reader lost */
+  uint16_t  id;                 /* LED ID, the voltage bit cleared */
+  uint8_t   voltage;            /* Voltage bit of the received word */
+  uint8_t   confidence;         /* 0 - 255, margin of the LED's lit pixel count over its one / zero threshold */
+  uint16_t  x;
+  uint16_t  y;
+  uint32_t  area;
+  uint32_t  frame_number;
+  uint32_t  frame_time;         /* Camera timestamp of the frame in us, wraps */
+  uint64_t  timestamp;          /* CLOCK_MONOTONIC ns when the frame's LEDs were published */
+  float     world[3];           /* X, Y, Z in the units of the calibration, see world-map.h */
+  uint32_t  flags;
+} detection_record;
+
+/* Leads every socket message. */
+typedef struct detection_batch_t {
+  uint32_t  magic;
+  uint16_t  version;
+  uint16_t  record_size;
+  uint32_t  count;
+  uint32_t  frame_number;
+} detection_batch;
+
+typedef struct detection_slot_t {
+  _Atomic uint64_t  sequence;   /* 2 * position + 1 while written, 2 * position + 2 once published */
+  detection_record  record;
+} detection_slot;
+
+/* Layout of the shared memory object. */
+typedef struct detection_shm_t {
+  uint32_t          magic;
+  uint16_t          version;
+  uint16_t          record_size;
+  uint32_t          capacity;   /* Slots, power of 2 */
+  uint32_t          reserved;
+  _Atomic uint64_t  head __attribute__((aligned(64)));
+  _Atomic uint32_t  commits;    /* Futex readers wait on, bumped with every head update */
+  _Atomic uint32_t  waiters;
+  detection_slot    slots[] __attribute__((aligned(64)));
+} detection_shm;
+
+#define detection_shm_bytes(capacity)   (sizeof(detection_shm) + ((size_t)(capacity) * sizeof(detection_slot)))
+
+typedef struct detection_stream_stats_t {
+  uint32_t  records;
+  uint32_t  batches;
+  uint32_t  clients;            /* Socket clients connected now */
+  uint32_t  socket_drops;       /* Messages a client had no room for */
+} detection_stream_stats;
+
+#define DETECTION_SOCKET_CLIENTS  4
+
+/* Writer side, used from the decoding thread only. */
+typedef struct detection_stream_t {
+  detection_shm     *shm;
+  size_t            shm_bytes;
+  char              *shm_name;
+  uint64_t          position;   /* Next record position */
+
+  int               listen_fd;
+  char              *socket_path;
+  int               clients[DETECTION_SOCKET_CLIENTS];
+
+  /* The frame's records for the socket, header first. */
+  uint8_t           *batch;
+  uint32_t          batch_max;
+  uint32_t          batch_count;
+  uint64_t          batch_time;
+
+  detection_stream_stats  stats;
+} detection_stream;
+
+detection_stream* detection_stream_open(const char *shm_name, const char *socket_path, uint32_t capacity, uint32_t batch_max);
+void  detection_stream_close(detection_stream *s);
+void  detection_stream_add(detection_stream *s, const detection_record *r);
+void  detection_stream_commit(detection_stream *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DETECTION_STREAM_H_ */
@@ -0,0 +1,132 @@
+/*
+ * frame-record.h
+ *
+ *  Recording of the packed bit frames the detector works on, for field
+ *  captures that can be replayed and decoded again later, see -record.
+ *
+ *  A recording is one file, preallocated for its whole length when it is
+ *  opened so a full disk shows at startup rather than hours in:
+ *
+ *    header                  frame_record_header, one page
+ *    index                   frame_record_entry per frame, capacity of them
+ *    frames                  FRAME_RECORD_BYTES each, from data_offset
+ *
+ *  The frames are the detector's bit_frame, 16-row column words as
+ *  led_detector_unpack_frame leaves them, and each index entry has the
+ *  frame's camera timestamp, number and lit pixel count. count in the
+ *  header is only raised once a frame and its entry are in place, so the
+ *  file of a localizer that died is good up to it.
+ *
+ *  The detector only copies each frame into a slot of a frame ring, which
+ *  the recorder's writer thread drains every FRAME_RECORD_POLL_MS, so the
+ *  detector does not even wake it up. The writer maps the index and a
+ *  window of FRAME_RECORD_WINDOW frames at a time, never the whole file,
+ *  and starts writing a window back as it moves to the next one, so
+ *  neither the address space nor the page cache grows with the length of
+ *  the recording. Frames the writer is a whole ring behind on are dropped
+ *  and counted, the detector never waits on the disk.
+ */
+
+#ifndef FRAME_RECORD_H_
+#define FRAME_RECORD_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "configurations.h"
+#include "frame-ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FRAME_RECORD_MAGIC        0x5244454C    /* "LEDR" */
+#define FRAME_RECORD_VERSION      1
+
+#define FRAME_RECORD_BYTES        (FRAME_WIDTH * FRAME_HEIGHT / 8)
+#define FRAME_RECORD_HEADER_BYTES 4096
+
+typedef struct frame_record_header_t {
+  uint32_t          magic;
+  uint16_t          version;
+  uint16_t          entry_size;
+  uint16_t          width;
+  uint16_t          height;
+  uint32_t          frame_bytes;
+  uint32_t          capacity;           /* Frames the file has room for */
+  _Atomic uint32_t  count;              /* Frames recorded */
+  uint32_t          dropped;            /* Frames the writer was too far behind for, set on close */
+  uint32_t          full;               /* Frames after the file was full, set on close */
+  uint64_t          index_offset;
+  uint64_t          data_offset;
+  uint64_t          start_time;         /* CLOCK_REALTIME ns when the recording was opened */
+} frame_record_header;
+
+typedef struct frame_record_entry_t {
+  uint64_t  pts;                        /* Camera timestamp in us, the detector's frame_time unwrapped */
+  uint32_t  frame_number;
+  uint32_t  ones;                       /* Lit pixels */
+} frame_record_entry;
+
+/* One slot of the recorder's ring, what the detector hands over per frame. */
+typedef struct frame_record_slot_t {
+  frame_record_entry  entry;
+  uint8_t             bits[FRAME_RECORD_BYTES] __attribute__((aligned(64)));
+} frame_record_slot;
+
+typedef struct frame_recorder_stats_t {
+  _Atomic uint32_t  frames;             /* Frames written */
+  _Atomic uint32_t  full;
+  _Atomic uint32_t  errors;             /* Frames lost to a window that could not be mapped */
+  _Atomic uint32_t  windows;            /* Windows mapped */
+  _Atomic uint64_t  write_us_sum;
+  _Atomic uint32_t  write_us_max;       /* Longest frame copy, the window's page faults included */
+  _Atomic uint32_t  remap_us_max;       /* Longest move to the next window */
+} frame_recorder_stats;
+
+/* Writer side. frame_recorder_add is called from the detector's decoding thread only. */
+typedef struct frame_recorder_t {
+  int                 fd;
+  char                *path;
+  frame_record_header *header;          /* Header and index, mapped for the whole recording */
+  frame_record_entry  *index;
+  uint64_t            index_bytes;
+  uint32_t            page;
+
+  uint8_t             *window;          /* Mapping of the frames from window_first on, from a page boundary */
+  uint8_t             *window_data;     /* Frame window_first in it */
+  uint64_t            window_offset;
+  uint64_t            window_bytes;
+  uint32_t            window_first;
+  uint32_t            window_frames;
+  uint64_t            flushing_offset;  /* Previous window, still being written back */
+  uint64_t            flushing_bytes;
+  uint64_t            dropped_offset;   /* Where the last drop from the page cache started */
+
+  frame_ring          ring;
+  pthread_t           writer;
+  uint8_t             writer_running;
+
+  frame_recorder_stats  stats;
+} frame_recorder;
+
+/* Reader side. */
+typedef struct frame_record_t {
+  int                 fd;
+  frame_record_header header;
+  frame_record_entry  *index;           /* header.count entries */
+} frame_record;
+
+frame_recorder* frame_recorder_open(const char *path, uint32_t capacity);
+void  frame_recorder_add(frame_recorder *r, const uint8_t *bits, uint64_t pts, uint32_t frame_number, uint32_t ones);
+void  frame_recorder_close(frame_recorder *r);
+
+int   frame_record_open(frame_record *f, const char *path);
+int   frame_record_read(const frame_record *f, uint32_t i, uint8_t *bits);
+void  frame_record_close(frame_record *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FRAME_RECORD_H_ */
@@ -0,0 +1,85 @@
+/*
+ * frame-ring.h
+ *
+ *  Single producer / single consumer ring of fixed size frame slots, the
+ *  hand-off from the GL thread to the detector worker.
+ *
+ *  The producer fills the slot returned by frame_ring_acquire and makes it
+ *  visible with frame_ring_publish; the consumer claims the oldest slot with
+ *  frame_ring_wait, reads it in place and hands it back with
+ *  frame_ring_release. The indices are C11 atomics with release/acquire
+ *  ordering, an idle consumer sleeps on an eventfd the producer only
+ *  signals when someone waits.
+ *
+ *  What frame_ring_acquire does on a full ring is the ring's policy: refuse
+ *  the new frame, discard the oldest unclaimed one, or wait for the consumer.
+ */
+
+#ifndef FRAME_RING_H_
+#define FRAME_RING_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FRAME_RING_DROP_NEWEST  0
+#define FRAME_RING_DROP_OLDEST  1
+#define FRAME_RING_BLOCK        2
+
+/* Counters of the ring, producer and consumer side each written by its own thread only. */
+typedef struct frame_ring_stats_t {
+  uint32_t    published;
+  uint32_t    dropped;                /* New frames refused */
+  uint32_t    overwritten;            /* Queued frames discarded for new ones, FRAME_RING_DROP_OLDEST */
+  uint32_t    depth_max;
+  uint64_t    depth_sum;              /* Frames queued after each publish, sum */
+  uint32_t    waits;                  /* Times the consumer slept */
+  uint64_t    wait_us_sum;
+  uint32_t    wait_us_max;
+  uint32_t    blocks;                 /* Times the producer slept in frame_ring_acquire_wait */
+  uint64_t    block_us_sum;
+} frame_ring_stats;
+
+typedef struct frame_ring_t {
+  uint32_t    capacity;               /* Power of 2 */
+  uint32_t    slot_size;
+  uint8_t     *slots;
+  uint8_t     policy;                 /* FRAME_RING_DROP_NEWEST by default */
+
+  _Atomic uint32_t  head;             /* Next slot the producer publishes */
+  _Atomic uint32_t  tail;             /* Next slot to be claimed, by the consumer or dropped by the producer */
+  _Atomic uint32_t  held;             /* Position + 1 of the slot the consumer reads, 0 when none */
+  _Atomic uint32_t  waiting;
+  _Atomic uint32_t  closed;
+  int         wakeup_fd;
+  _Atomic uint32_t  space_waiting;    /* Producer asleep in frame_ring_acquire_wait */
+  int         space_fd;
+
+  frame_ring_stats  stats;
+} frame_ring;
+
+int       frame_ring_init(frame_ring *r, uint32_t capacity, uint32_t slot_size);
+void      frame_ring_destroy(frame_ring *r);
+
+/* Producer side. */
+void*     frame_ring_acquire(frame_ring *r);
+void*     frame_ring_acquire_wait(frame_ring *r);
+void      frame_ring_publish(frame_ring *r);
+void      frame_ring_close(frame_ring *r);
+
+/* Consumer side. frame_ring_wait returns NULL once the ring is closed and drained. */
+void*     frame_ring_peek(frame_ring *r);
+void*     frame_ring_take(frame_ring *r);
+void*     frame_ring_wait(frame_ring *r);
+void      frame_ring_release(frame_ring *r);
+
+uint32_t  frame_ring_depth(frame_ring *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FRAME_RING_H_ */
@@ -9,6 +9,7 @@
 #define LEDDETECTOR_H_
 
 #include <string.h>
+#include <pthread.h>
 #include "configurations.h"
 #include "raspi-tex.h"
 
@@ -16,46 +17,236 @@
 extern "C" {
 #endif
 
-#include "queue.h"
 #include "led.h"
+#include "led-roi.h"
+#include "frame-ring.h"
+#include "log-ring.h"
+#include "detection-stream.h"
+#include "world-map.h"
+
+/* Connected component of lit pixels found by led_detector_label_blob. */
+typedef struct led_blob_t {
+  uint32_t    area;
+  uint32_t    sumx;
+  uint32_t    sumy;
+  uint16_t    minx;
+  uint16_t    miny;
+  uint16_t    maxx;
+  uint16_t    maxy;
+} led_blob;
+
+/* Vertical run of lit pixels within one 16-row column word. */
+typedef struct led_run_t {
+  uint16_t    x;
+  uint16_t    group;
+  uint16_t    mask;
+  uint32_t    label;                  /* Blob index, up to FRAME_WIDTH*FRAME_HEIGHT/4 of them */
+} led_run;
+
+/* Coarse map of a frame, one bit per 16x16 tile, built while the frame is ingested. */
+#define LED_TILE_SIZE     16
+#define LED_TILES_X       (FRAME_WIDTH / LED_TILE_SIZE)
+#define LED_TILES_Y       (FRAME_HEIGHT / LED_TILE_SIZE)
+
+typedef struct led_frame_occupancy_t {
+  uint32_t    ones;
+  uint64_t    tiles[LED_TILES_Y];
+} led_frame_occupancy;
+
+typedef struct frame_info_t {
+  uint64_t pts;                   /* Camera timestamp in us, frame_time before it wraps */
+  uint32_t frame_time;
+  uint32_t frame_number;
+  led_frame_occupancy occupancy;
+} frame_info;
+
+/*
+ glReadPixels of the binarized frame, FRAME_HEIGHT/16 rows of FRAME_WIDTH
+ RGBA pixels, the first two bytes of each pixel being one column word.
+ */
+#define LED_READBACK_BYTES    (FRAME_WIDTH * (FRAME_HEIGHT / 16) * 4)
+
+/* One slot of the frame ring, read back into by the GL thread and unpacked by the worker. */
+typedef struct led_frame_slot_t {
+  frame_info  info;
+  uint8_t     readback[LED_READBACK_BYTES] __attribute__((aligned(64)));
+} led_frame_slot;
+
+/* One slot of the stage ring, a frame labeled by the discovery stage waiting to be associated and decoded. */
+typedef struct led_stage_slot_t {
+  frame_info  info;
+  uint32_t    blob_count;
+  uint8_t     bit_frame[FRAME_HEIGHT * FRAME_WIDTH / 8] __attribute__((aligned(64)));
+  led_blob    blobs[FRAME_WIDTH * FRAME_HEIGHT / 4];    /* Labeled into in place, see led_detector_discover */
+} led_stage_slot;
+
+/* Frames a pipeline stage went through and the time it was busy with them, waits excluded. */
+typedef struct led_stage_stats_t {
+  uint32_t    frames;
+  uint64_t    busy_us_sum;
+  uint32_t    busy_us_max;
+} led_stage_stats;
+
+#define LED_STAGE_DISCOVER  0
+#define LED_STAGE_DECODE    1
+
+/* Summed area table of the packed frame, one row per 16-row group, see led_detector_roi_sums. */
+#define LED_ROI_GROUPS    (FRAME_HEIGHT / 16)
+#define LED_ROI_STRIDE    (FRAME_WIDTH + 1)
+
+/* First run and blob slot of row group g, at most 8 runs per column word and one blob per 2x2 pixels. */
+#define led_detector_group_runs(g)   ((g) * FRAME_WIDTH * 8)
+#define led_detector_group_blobs(g)  ((g) * FRAME_WIDTH * 4)
+
+/* Union-find over run (or blob) indices, see led_detector_label_runs. */
+static inline uint32_t led_run_find(uint32_t *parent, uint32_t i)
+{
+  while (parent[i] != i)
+  {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+/* The lower index always becomes the root, so a blob's root is its first run in scan order. */
+static inline void led_run_union(uint32_t *parent, uint32_t a, uint32_t b)
+{
+  a = led_run_find(parent, a);
+  b = led_run_find(parent, b);
+
+  if (a < b)
+    parent[b] = a;
+  else if (b < a)
+    parent[a] = b;
+}
+
+#define led_blob_centroid_x(b) ((b)->sumx / (b)->area)
+#define led_blob_centroid_y(b) ((b)->sumy / (b)->area)
 
 typedef struct led_detector_t {
-  queue_node  *leds;
-  uint32_t    leds_queue_size;
-  uint8_t     prev_bit_frame[FRAME_HEIGHT * FRAME_WIDTH / 8];
+  led_table   trackers;
+  uint8_t     prev_bit_frame[FRAME_HEIGHT * FRAME_WIDTH / 8] __attribute__((aligned(64)));
+  /* Packed frame the worker unpacks the current ring slot into. */
+  uint8_t     bit_frame[FRAME_HEIGHT * FRAME_WIDTH / 8] __attribute__((aligned(64)));
   uint8_t     is_new_frame;
   uint32_t    is_first_frame;
   uint32_t    frame_ones;
   uint32_t    frame_leds;
   uint32_t    frame_noise;
-  uint16_t    frame_number;
-  double      frame_time;
+  uint32_t    frame_number;
+  uint32_t    frame_time;
   void        *context;
+
+  /*
+   Where identified LEDs and missed frames are reported, log.out is stdout
+   unless the owner of the detector sets another stream. The threaded
+   detector runs the log's writer thread, used synchronously the detector
+   writes the stream itself.
+   */
+  log_ring    log;
+  /* Binary copy of the identified LEDs, NULL unless the owner of the detector opens one. */
+  detection_stream *stream;
+  /* Calibration the identified LEDs are projected with, NULL unless the owner of the detector loads one. */
+  const world_map *world;
+  /* Every unpacked frame is copied to it, NULL unless the owner of the detector opens one. */
+  struct frame_recorder_t *recorder;
+  uint8_t     led_detected;
+#if DEBUG_LUMINENCE_THRESH
+  uint32_t    luminence_frames;
+  uint32_t    luminence_ones[32];
+#endif /* DEBUG_LUMINENCE_THRESH */
+
+  /* Frame number sequence as seen by the decoder, frames missing from it are passed on to the trackers. */
+  uint32_t    prev_frame_number;
+  uint32_t    prev_frame_time;
+  uint8_t     has_prev_frame;
+  uint32_t    frames_missed;
+  uint32_t    frame_gaps;
+  uint32_t    frame_backsteps;      /* Frame numbers not after the previous one */
   
   uint8_t     led_identified;
 
-  uint16_t    minx;
-  uint16_t    miny;
-  uint16_t    maxx;
-  uint16_t    maxy;
+  /* Frames handed from led_detector_process to the worker thread. */
+  frame_ring  ring;
+  led_frame_slot *acquired;               /* Slot of led_detector_frame_acquire until it is published */
+  pthread_t   worker;
+  uint8_t     worker_running;
+  uint8_t     inline_processing;          /* Published frames are processed on the publishing thread */
+  rt_thread_config rt_worker;             /* Applied by the worker and decoder threads as they start */
+  rt_thread_config rt_decoder;
+
+  /*
+   With pipeline set the worker only unpacks and labels, and hands each frame
+   through the stage ring to the decoder thread, which associates the blobs
+   with the trackers and decodes them. Otherwise the worker does it all and
+   is accounted as the discover stage.
+   */
+  uint8_t     pipeline;
+  frame_ring  stage_ring;
+  pthread_t   decoder;
+  uint8_t     decoder_running;
+  led_stage_stats stages[2];
+
+  /* Stripe parallel labeling and decoding, NULL with a single decode thread. Only decoding when pipelined. */
+  struct led_parallel_t *parallel;
+
+  /* Explicit stack for led_detector_label_blob, one entry per pixel at most. */
+  uint32_t    *label_stack;
+
+  /* Run based labeling, see led_detector_label_runs. */
+  led_run     *runs;
+  uint32_t    *run_parent;
+  led_blob    *blobs;
   uint32_t    area;
+
+  /* (LED_ROI_GROUPS + 1) rows of LED_ROI_STRIDE running sums. */
+  uint32_t    *roi_integral;
+
+  /* Disk mask of led_radius, every tracker's radius, used instead of the table when roi_circle is set. */
+  uint8_t         roi_circle;
+  led_roi_circle  roi_disk;
+
+  /* Uniform grid of trackers with cells led_find_radius wide, see led_detector_find_led. */
+  uint32_t    *grid;
+  uint32_t    grid_cell_size;
+  uint32_t    grid_width;
+  uint32_t    grid_height;
+  uint32_t    grid_serial;
+  uint8_t     grid_linear;          /* Cells too large to pay, led_detector_find_led walks the table */
+
   uint32_t    led_find_radius;
   uint16_t    led_radius;
   uint32_t    led_blob_size;
   uint32_t    one_zero_thresh;
 } led_detector;
 
-struct led_t;
-typedef struct led_t led;
-
-void        led_detector_init(led_detector *ld, RASPITEX_STATE *state);
+led_detector* led_detector_create(RASPITEX_STATE *state);
+void        led_detector_free(led_detector *ld);
+int         led_detector_init(led_detector *ld, RASPITEX_STATE *state);
 void        led_detector_destroy(led_detector *ld);
-void        led_detector_detect_leds(led_detector *ld, uint8_t *bFrame);
+void        led_detector_detect_leds(led_detector *ld, uint8_t *bFrame, const led_frame_occupancy *occ);
+void        led_detector_detect_labeled(led_detector *ld, uint8_t *bFrame, const led_frame_occupancy *occ, const led_blob *blobs, uint32_t count);
+void        led_detector_add_blobs(led_detector *ld, const led_blob *blobs, uint32_t count);
+uint32_t    led_detector_decode(led_detector *ld, uint8_t *diffFrame);
+void        led_detector_frame_occupancy(led_frame_occupancy *occ, const uint8_t *bFrame);
+void        led_detector_roi_sums(led_detector *ld, uint8_t *bFrame);
+uint32_t    led_detector_roi_sum(led_detector *ld, const uint8_t *bFrame, uint32_t i);
 void        led_detector_check_and_add_led(led_detector *ld, uint16_t x, uint16_t y);
-void        led_detector_flood_check(led_detector *ld, uint16_t x, uint16_t y);
+void        led_detector_add_blob(led_detector *ld, const led_blob *b);
+void        led_detector_label_blob(led_detector *ld, uint16_t x, uint16_t y, led_blob *b);
+uint32_t    led_detector_label_runs(led_detector *ld, const uint8_t *bFrame, const led_frame_occupancy *occ, led_blob *blobs);
+uint32_t    led_detector_label_groups(led_detector *ld, const uint8_t *bFrame, const led_frame_occupancy *occ, uint32_t g1, uint32_t g2, led_blob *blobs, uint32_t *nruns);
 uint32_t    led_detector_process(led_detector *ld, uint8_t *bFrame, double frame_time, uint32_t frame_number);
-uint8_t     led_detector_add_led(led_detector *ld, led *l);
-led*        led_detector_find_led(led_detector *ld, uint16_t x, uint16_t y);
+uint32_t    led_detector_process_internal(led_detector *ld, uint8_t *diffFrame, frame_info *finfo);
+uint8_t*    led_detector_frame_acquire(led_detector *ld);
+void        led_detector_frame_publish(led_detector *ld, double frame_time, uint32_t frame_number);
+void        led_detector_process_queued(led_detector *ld);
+void        led_detector_unpack_frame(uint8_t *bFrame, const uint8_t *readback, led_frame_occupancy *occ);
+uint32_t    led_detector_add_led(led_detector *ld, uint16_t x, uint16_t y);
+void        led_detector_remove_leds(led_detector *ld);
+void        led_detector_move_led(led_detector *ld, uint32_t i, uint16_t x, uint16_t y);
+uint32_t    led_detector_find_led(led_detector *ld, uint16_t x, uint16_t y);
 
 #ifdef __cplusplus
 }
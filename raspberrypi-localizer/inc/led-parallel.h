@@ -0,0 +1,71 @@
+/*
+ * led-parallel.h
+ *
+ *  Stripe parallel labeling and decoding. The frame is cut into horizontal
+ *  stripes of whole 16-row groups, one per decode thread. Each thread labels
+ *  the runs of its stripe, and later counts the ROIs of and decodes the
+ *  trackers centred in it, in frame order. Blobs crossing a stripe border
+ *  are joined, and blobs matched to trackers, on the calling thread in a
+ *  fixed order, so the results do not depend on the number of threads.
+ */
+
+#ifndef LED_PARALLEL_H_
+#define LED_PARALLEL_H_
+
+#include <pthread.h>
+#include "led-detector.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LED_DECODE_THREADS_MAX    8
+
+struct led_parallel_t;
+
+typedef struct led_stripe_t {
+  uint32_t    g1;                     /* Row groups [g1, g2) */
+  uint32_t    g2;
+  uint32_t    runs;
+  uint32_t    blobs;
+  uint32_t    *trackers;              /* Table slots of the trackers centred in the stripe */
+  uint32_t    tracker_count;
+  pthread_t   thread;
+  struct led_parallel_t *parallel;
+} led_stripe;
+
+typedef struct led_parallel_t {
+  led_detector  *ld;
+  uint32_t      threads;
+  led_stripe    stripes[LED_DECODE_THREADS_MAX];
+  uint8_t       stripe_of_group[FRAME_HEIGHT / 16];
+
+  /* Held while led_parallel_init sizes the barriers to the threads that started. */
+  pthread_mutex_t gate;
+
+  /* Job of the current frame, published to the stripe threads by the start barrier. */
+  pthread_barrier_t start;
+  pthread_barrier_t done;
+  uint32_t      job;
+  const uint8_t *frame;
+  const led_frame_occupancy *occ;
+
+  /* Border merge, see led_parallel_label. */
+  uint32_t      *blob_parent;
+  uint32_t      *blob_final;
+  uint32_t      border[FRAME_WIDTH];
+
+  /* Stripe tracker lists, t->capacity entries. */
+  uint32_t      *tracker_index;
+} led_parallel;
+
+int       led_parallel_init(led_parallel *p, led_detector *ld, uint32_t threads);
+void      led_parallel_destroy(led_parallel *p);
+uint32_t  led_parallel_label(led_parallel *p, const uint8_t *bFrame, const led_frame_occupancy *occ);
+void      led_parallel_decode(led_parallel *p, const uint8_t *bFrame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LED_PARALLEL_H_ */
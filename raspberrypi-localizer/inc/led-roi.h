@@ -0,0 +1,61 @@
+/*
+ * led-roi.h
+ *
+ *  Counting lit pixels of the packed bit frame inside a region of interest.
+ *
+ *  The frame is stored in 16-row groups, each column of a group being one
+ *  16-bit word (bit n = row n of the group) and the words of consecutive
+ *  columns being contiguous, so a row range within one group is a mask
+ *  and a column span is a run of words.
+ */
+
+#ifndef LED_ROI_H_
+#define LED_ROI_H_
+
+#include <stdint.h>
+#include "configurations.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Number of 1's in each byte value, for targets without a popcount instruction. */
+extern const uint8_t led_popcount8[256];
+
+/* Column words led_roi_count_span counts in the time one word is added to a summed area table. */
+#if defined(__ARM_NEON) || defined(__AVX2__) || defined(__SSSE3__)
+#define LED_ROI_SPAN_SPEEDUP       8
+#else
+#define LED_ROI_SPAN_SPEEDUP       1
+#endif
+
+/* Mask of rows [r1, r2) of a 16-row group. */
+#define led_roi_row_mask(r1, r2)   ((uint16_t)((0xFFFFu >> (16 - ((r2) - (r1)))) << (r1)))
+
+/* First column word of 16-row group g. */
+#define led_roi_group(frame, g)    ((const uint16_t*)(frame) + ((g) * FRAME_WIDTH))
+
+/* Disk of a given radius as per column row masks, one set for each row phase cy % 16. */
+typedef struct led_roi_circle_t {
+  uint16_t  radius;
+  uint16_t  width;
+  uint16_t  groups;
+  int16_t   group0[16];
+  uint16_t  *masks;
+} led_roi_circle;
+
+uint32_t  led_roi_count_span(const uint16_t *words, uint32_t n, uint16_t mask);
+uint32_t  led_roi_count_masked(const uint16_t *words, const uint16_t *masks, uint32_t n);
+uint32_t  led_roi_count(const uint8_t *frame, uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2);
+uint32_t  led_roi_count_reference(const uint8_t *frame, uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2);
+
+int                   led_roi_circle_init(led_roi_circle *c, uint16_t radius);
+void                  led_roi_circle_destroy(led_roi_circle *c);
+uint32_t              led_roi_count_circle(const uint8_t *frame, const led_roi_circle *c, uint32_t cx, uint32_t cy);
+uint32_t              led_roi_count_circle_reference(const uint8_t *frame, uint32_t cx, uint32_t cy, uint32_t r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LED_ROI_H_ */
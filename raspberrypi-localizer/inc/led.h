@@ -13,50 +13,82 @@
 #include <string.h>
 
 #include "configurations.h"
-#include "led-detector.h"
 
 #define DEBUG_LED 0
 
+#define LED_NONE  0xFFFFFFFF
+
+/* Per tracker state that is only touched on discovery, identification and debugging. */
 typedef struct led_t
 {
 #if DEBUG_LED  
   uint32_t debug_prev_bit[LED_BUFFER_LENGTH*3];
   uint32_t debug_buffer[LED_BUFFER_LENGTH*3];
-  double   debug_buffer_time[LED_BUFFER_LENGTH*3];
+  uint32_t debug_buffer_time[LED_BUFFER_LENGTH*3];
   uint32_t debug_buffer_indexes[LED_BUFFER_LENGTH*3];
   uint32_t debug_buffer_index;
   uint32_t debug_prev_bit_index;
 #endif
-  uint32_t raw_data;
-  uint8_t  prev_frame_state;
-  uint8_t  last_flip_was_data;
-  uint8_t  is_first_frame;
-  double   transmission_start_time;
-  double   current_bit_start_time;
-  double   prev_state_end_time;
-  double   prev_frame_time;
+  uint32_t transmission_start_time;
   uint32_t start_frame_index;
-
-  uint16_t x;
-  uint16_t y;
-  uint16_t id;
-
-  uint16_t one_zero_thresh;
-  uint16_t led_radius;
   uint32_t area;
-  uint32_t area_sum;
-  uint32_t ones;
 } led;
 
+/*
+ Tracker table, one slot per tracked LED stored as parallel arrays. Active
+ trackers are packed in slots [0, count) in the order they were added, so
+ the per frame update in led_process is a straight loop over each array.
+ Times are in microseconds; they wrap every ~71 minutes and are only ever
+ compared as differences.
+*/
+typedef struct led_table_t
+{
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t exhausted;
+
+  /* Read and written by led_process every frame. */
+  uint16_t *x;
+  uint16_t *y;
+  uint16_t *led_radius;
+  uint16_t *one_zero_thresh;
+  uint16_t *id;
+  uint8_t  *prev_frame_state;
+  uint8_t  *is_first_frame;
+  uint32_t *raw_data;
+  uint32_t *ones;
+  uint32_t *area_sum;
+  uint32_t *current_bit_start_time;
+  uint32_t *prev_state_end_time;
+
+  /* Per frame input and output of led_process. */
+  uint32_t *sum;
+  uint8_t  *status;
+
+  /* Frames missed right before the current one and the time between frames, see led_table_gap. */
+  uint32_t missed;
+  uint32_t frame_step;
+
+  /* Spatial grid cell lists, maintained by led-detector.c */
+  uint32_t *grid_next;
+  uint32_t *grid_prev;
+  uint32_t *grid_cell;
+  uint32_t *grid_serial;
+
+  led      *cold;
+} led_table;
+
 struct led_detector_t;
 typedef struct led_detector_t led_detector;
 
-void      led_init_vals(led *l, uint16_t x, uint16_t y, uint16_t one_zero_thresh, uint16_t led_radius, uint16_t frame_number, double frame_time, uint32_t area);
-led*      led_create_vals(led_detector *ld, uint16_t x, uint16_t y);
-uint8_t   led_is_packet_valid(led *l);
-uint8_t   led_process(led *l, uint8_t *frame, double frame_time, uint8_t is_new_frame);
+int       led_table_init(led_table *t, uint32_t capacity);
+void      led_table_destroy(led_table *t);
+void      led_table_move(led_table *t, uint32_t dst, uint32_t src);
+void      led_table_gap(led_table *t, uint32_t missed, uint32_t gap_time);
+void      led_init_vals(led_table *t, uint32_t i, uint16_t x, uint16_t y, uint16_t one_zero_thresh, uint16_t led_radius, uint16_t frame_number, uint32_t frame_time, uint32_t area);
+uint32_t  led_create_vals(led_detector *ld, uint16_t x, uint16_t y);
+void      led_process(led_table *t, uint32_t frame_time);
+void      led_process_list(led_table *t, uint32_t frame_time, const uint32_t *index, uint32_t n);
 uint16_t  led_calculate_checksum(uint16_t data);
-uint32_t  led_append_to_raw_data_buffer(led *l, uint8_t v, double frame_time);
-uint32_t  led_get_roi_sum(led *l, uint8_t *frame, uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2);
 
 #endif /* LED_H_ */
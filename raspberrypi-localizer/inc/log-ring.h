@@ -0,0 +1,90 @@
+/*
+ * log-ring.h
+ *
+ *  Bounded lock-free multi producer / single consumer ring of text records
+ *  and the writer thread that drains it, so the capture and decode threads
+ *  never wait on stdout.
+ *
+ *  log_printf formats into a local buffer and copies the line into one or
+ *  more consecutive fixed size records, claimed together with a single
+ *  compare and swap. Each record carries a sequence number telling whether
+ *  it is free for a given position or holds text for it. A line that does
+ *  not fit in the free records is dropped and counted, the caller never
+ *  waits. The writer sleeps on an eventfd while the ring is empty and
+ *  flushes the stream every time it has emptied it.
+ *
+ *  Until log_ring_start, and after log_ring_stop, log_printf writes and
+ *  flushes the stream itself, on the calling thread.
+ *
+ *  An event loop starts the ring with log_ring_start_polled instead and
+ *  drains it with log_ring_drain whenever the stream's descriptor is
+ *  writable, there is no writer thread then.
+ */
+
+#ifndef LOG_RING_H_
+#define LOG_RING_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LOG_RECORD_BYTES        256
+#define LOG_RECORD_TEXT         (LOG_RECORD_BYTES - 6)
+
+/* Longest line log_printf formats, longer ones are cut and counted. */
+#define LOG_LINE_MAX            1024
+
+typedef struct log_record_t {
+  _Atomic uint32_t  sequence;         /* Position the record is free for, position + 1 once it holds its text */
+  uint16_t          length;
+  char              text[LOG_RECORD_TEXT];
+} log_record;
+
+typedef struct log_ring_stats_t {
+  _Atomic uint32_t  lines;            /* Lines queued */
+  _Atomic uint32_t  overflows;        /* Lines dropped on a full ring */
+  _Atomic uint32_t  truncated;        /* Lines cut at LOG_LINE_MAX */
+  uint32_t          flushes;          /* Writer side only */
+  uint32_t          depth_max;        /* Records queued when the writer woke up, writer side only */
+} log_ring_stats;
+
+typedef struct log_ring_t {
+  uint32_t          capacity;         /* Records, power of 2 */
+  log_record        *records;
+  FILE              *out;
+
+  _Atomic uint32_t  head;             /* Next position producers claim */
+  uint32_t          tail;             /* Next position the writer drains */
+  uint16_t          offset;           /* Bytes of the tail record written, log_ring_drain only */
+  _Atomic uint32_t  waiting;          /* Writer asleep on wakeup_fd */
+  _Atomic uint32_t  closed;
+  int               wakeup_fd;
+
+  pthread_t         writer;
+  uint8_t           running;          /* Only changed while no other thread logs */
+  uint8_t           polled;           /* Drained by log_ring_drain, no writer thread */
+
+  log_ring_stats    stats;
+} log_ring;
+
+int   log_ring_init(log_ring *r, uint32_t capacity, FILE *out);
+void  log_ring_destroy(log_ring *r);
+int   log_ring_start(log_ring *r);
+void  log_ring_start_polled(log_ring *r);
+int   log_ring_drain(log_ring *r);
+void  log_ring_stop(log_ring *r);
+
+int   log_vprintf(log_ring *r, const char *format, va_list args);
+int   log_printf(log_ring *r, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LOG_RING_H_ */
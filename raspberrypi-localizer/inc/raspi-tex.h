@@ -30,8 +30,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define RASPITEX_H_
 
 #include <stdio.h>
+#include "rt-thread.h"
+#include "log-ring.h"
 
-#ifndef __MINGW32__
+#if !defined(__MINGW32__) && !defined(LOC_HOST_BUILD)
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 #include <GLES/gl.h>
@@ -61,11 +63,12 @@ typedef struct RASPITEX_STATE
 {
    int version_major;                  /// For binary compatibility
    int version_minor;                  /// Incremented for new features
-#ifndef __MINGW32__
+#if !defined(__MINGW32__) && !defined(LOC_HOST_BUILD)
    MMAL_PORT_T *preview_port;          /// Source port for preview opaque buffers
    MMAL_POOL_T *preview_pool;          /// Pool for storing opaque buffer handles
    MMAL_QUEUE_T *preview_queue;        /// Queue preview buffers to display in order
    VCOS_THREAD_T preview_thread;       /// Preview worker / GL rendering thread
+   int frame_fd;                       /// Signalled for every preview buffer queued, event loop only
 #endif
    uint32_t preview_stop;              /// If zero the worker can continue
 
@@ -83,7 +86,7 @@ typedef struct RASPITEX_STATE
    int opacity;                        /// Alpha value for display element
    int gl_win_defined;                 /// Use rect from --glwin instead of preview
 
-#ifndef __MINGW32__
+#if !defined(__MINGW32__) && !defined(LOC_HOST_BUILD)
    /* DispmanX info. This might be unused if a custom create_native_window
     * does something else. */
    DISPMANX_DISPLAY_HANDLE_T disp;     /// Dispmanx display for GL preview
@@ -106,16 +109,40 @@ typedef struct RASPITEX_STATE
 #endif
 
    void *scene_state;                  /// Pointer to scene specific data
+   log_ring *log;                      /// Output of the scene's detector, set by the scene's init
+   const char *stream_shm;             /// Shared memory object the identified LEDs are published to, or NULL
+   const char *stream_socket;          /// Unix socket path the identified LEDs are sent to, or NULL
+   const char *intrinsics;             /// Calibration files for world coordinates, see world-map.h
+   const char *extrinsics;
+   const char *led_heights;
+   const char *uplink;                 /// Serial port the world coordinates are sent to the Sleepy Pi on, or NULL
+   uint32_t uplink_baud;
+   uint32_t uplink_budget;             /// Bytes/s the uplink may use, 0 for the whole line rate
+   const char *record;                 /// File the packed frames are recorded to, or NULL, see frame-record.h
+   uint32_t record_seconds;            /// Length of the recording the file is preallocated for
    uint32_t save_image;
    uint32_t save_image_warmup;
    uint32_t number_of_images;
    uint32_t led_blob_size;
    uint32_t led_one_zero_thresh;
    uint32_t led_find_radius;
+   uint32_t led_capacity;                   /// Number of preallocated LED trackers
+   uint32_t led_decode_threads;             /// Threads decoding screen stripes
    uint32_t on_pixels_in_frame;
    uint32_t verbose;                        /// Log FPS
    uint16_t led_radius;
+   uint8_t  led_roi_circle;                 /// Count LED ROIs over a disk instead of a square
+   uint8_t  led_pipeline;                   /// Decode on a second thread while the next frame is labeled
+   uint8_t  led_drop_policy;                /// FRAME_RING_DROP_NEWEST, FRAME_RING_DROP_OLDEST or FRAME_RING_BLOCK
+   uint8_t  lock_memory;                    /// mlockall before the camera starts
+   uint8_t  event_loop;                     /// Run preview, detector and output on the main thread, see raspitex_run
+   rt_thread_config rt_preview;             /// Scheduling of the preview / GL thread
+   rt_thread_config rt_detector;            /// Scheduling of the detector worker
+   rt_thread_config rt_decoder;             /// Scheduling of the pipelined decode stage
    uint8_t  is_ready;
+   uint8_t  bg_available;                   /// Background texture[1] holds a frame
+   uint8_t  bg_ready;                       /// Take the next frame as background
+   uint32_t bg_counter;
    uint8_t  enable_dynamic_luminence;
    float    luminence_thresh;
    float    prev_buff_time;
@@ -124,9 +151,10 @@ typedef struct RASPITEX_STATE
 } RASPITEX_STATE;
 
 int raspitex_init(RASPITEX_STATE *state);
-#ifndef __MINGW32__
+#if !defined(__MINGW32__) && !defined(LOC_HOST_BUILD)
 void raspitex_destroy(RASPITEX_STATE *state);
 int raspitex_start(RASPITEX_STATE *state);
+int raspitex_run(RASPITEX_STATE *state);
 void raspitex_stop(RASPITEX_STATE *state);
 void raspitex_set_defaults(RASPITEX_STATE *state);
 int raspitex_configure_preview_port(RASPITEX_STATE *state,
@@ -0,0 +1,42 @@
+/*
+ * replay.h
+ *
+ *  Decoding of recorded packed frames, see frame-record.h, without the
+ *  camera or GL, for localizer-replay and the benches.
+ *
+ *  Each frame is read straight into the detector's bit_frame and goes
+ *  through led_detector_process_internal on the calling thread with the
+ *  camera timestamp and frame number of its index entry, the frame the
+ *  detector worker had after unpacking it live. The trackers only ever
+ *  see those timestamps, so a recording replays to the same log as the
+ *  live run as fast as the CPU goes. Frames the recording dropped are
+ *  the exception, the live detector saw them and the replay cannot.
+ */
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "raspi-tex.h"
+#include "world-map.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct replay_stats_t {
+  uint32_t  frames;
+  uint32_t  dropped;              /* Frames missing from the recording, see frame_record_header */
+  uint64_t  capture_us;           /* Camera time from the first frame to the last */
+  double    seconds;              /* Time the replay took */
+} replay_stats;
+
+int   replay_recording(const char *path, RASPITEX_STATE *state, const world_map *world, FILE *out, replay_stats *stats);
+double replay_now_s(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* REPLAY_H_ */
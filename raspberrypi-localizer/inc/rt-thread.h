@@ -0,0 +1,74 @@
+/*
+ * rt-thread.h
+ *
+ *  Real-time scheduling, CPU pinning and memory locking for the capture
+ *  and detector threads, and a histogram of frame intervals and process
+ *  usage snapshots to measure what they buy.
+ *
+ *  A thread applies its own rt_thread_config when it starts. Priorities
+ *  are SCHED_FIFO priorities, 1 (lowest) to 99; 0 leaves the thread under
+ *  the default time sharing policy. Failures, usually a missing
+ *  CAP_SYS_NICE or a too small RLIMIT_MEMLOCK, are reported and the
+ *  thread carries on as it is.
+ */
+
+#ifndef RT_THREAD_H_
+#define RT_THREAD_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* All zero is the default: time sharing, any CPU. */
+typedef struct rt_thread_config_t {
+  uint8_t   priority;               /* SCHED_FIFO priority, 0 for the default policy */
+  uint8_t   pinned;                 /* Run on cpu only */
+  uint16_t  cpu;
+} rt_thread_config;
+
+/* Intervals of RT_JITTER_BIN_MS each, the last bin takes everything longer. */
+#define RT_JITTER_BINS              48
+#define RT_JITTER_BIN_MS            2
+
+/* Longest line rt_jitter_format writes, every bin set included. */
+#define RT_JITTER_LINE_MAX          1024
+
+typedef struct rt_jitter_t {
+  uint32_t  bins[RT_JITTER_BINS];
+  uint32_t  count;
+  uint32_t  anomalies;              /* Intervals outside [FRAME_INTERVAL_MIN, FRAME_INTERVAL_MAX] */
+  double    min;
+  double    max;
+  double    sum;
+  double    sum_sq;
+  double    prev;                   /* Time of the last sample, < 0 before the first */
+} rt_jitter;
+
+/* CPU time and context switches of the whole process, all threads. */
+typedef struct rt_usage_t {
+  uint64_t  cpu_us;
+  uint64_t  voluntary_switches;     /* Waits */
+  uint64_t  involuntary_switches;   /* Preemptions */
+} rt_usage;
+
+int   rt_thread_parse(rt_thread_config *c, const char *arg);
+int   rt_thread_apply(const rt_thread_config *c, const char *name, FILE *out);
+int   rt_lock_memory(FILE *out);
+
+void  rt_jitter_reset(rt_jitter *j);
+void  rt_jitter_add(rt_jitter *j, double time_ms);
+int   rt_jitter_format(const rt_jitter *j, const char *name, char *line, size_t size);
+void  rt_jitter_print(const rt_jitter *j, const char *name, FILE *out);
+
+void  rt_usage_get(rt_usage *u);
+int   rt_usage_format(const rt_usage *from, const rt_usage *to, uint32_t frames, const char *name, char *line, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RT_THREAD_H_ */
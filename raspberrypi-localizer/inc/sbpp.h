@@ -34,25 +34,41 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define BITS_PER_BYTE       8
 #define BITS_PER_RGBA_PIXEL 8
 
-#define SETUP_FPS \
-\
-    struct timespec __start_time; \
-    struct timespec __prev_time; \
-    struct timespec __time_difference; \
-    const char *__msg; \
-    unsigned int __frames = 0; \
-    unsigned int __interval = 0; \
-    struct timespec __gettime_now;
-
-#define START_FPS(msg, interval) \
-    clock_gettime(CLOCK_REALTIME, &__gettime_now); \
-    __prev_time = __start_time = __gettime_now; \
-    __frames = 0; \
-    __interval = interval; \
-    __msg = msg;
+struct led_detector_t;
+struct world_map_t;
+struct uplink_t;
+
+/* State of one localizer pipeline, kept in RASPITEX_STATE::scene_state by sbpp_init. */
+typedef struct sbpp_context_t {
+   struct led_detector_t *detector;
+   uint8_t  *data;                          /// Readback of frames the detector's ring has no slot for
+   uint32_t current_frame;
+   uint32_t time_anomaly_counter;
+   double   prev_time;
+   rt_jitter frame_interval;                /// Intervals between camera timestamps
+   rt_jitter frame_arrival;                 /// Intervals between frames reaching the GL thread
+   rt_usage usage;                          /// Process usage at sbpp_init
+   struct world_map_t *world;               /// Calibration of the detector's world coordinates, or NULL
+   struct uplink_t *uplink;                 /// Sends the world coordinates to the Sleepy Pi, or NULL
+   struct frame_recorder_t *recorder;       /// Records the detector's packed frames, or NULL
+   uint8_t  shader_ready;
+   double   specific_interval;              /// Frame interval adjust_fps steers towards
+   struct timespec fps_start;               /// Start of adjust_fps's current report interval
+   struct timespec fps_prev;                /// Previous adjust_fps call
+   const char *fps_msg;
+   uint32_t fps_frames;                     /// Frames since fps_start
+   uint32_t fps_interval;                   /// Frames per adjust_fps report
+   uint8_t  *image;                         /// Saved frame, a byte per pixel, LOC_ENABLE_SAVE_IMAGE only
+   uint8_t  *image_data;
+   uint8_t  *image_array;                   /// Readbacks of the last number_of_images frames
+   uint32_t image_array_index;
+   uint8_t  images_saved;
+} sbpp_context;
 
 int sbpp_open(RASPITEX_STATE *state);
 int sbpp_redraw(RASPITEX_STATE *raspitex_state);
 int sbpp_init(RASPITEX_STATE *state);
+void sbpp_term(RASPITEX_STATE *state);
+void sbpp_report(RASPITEX_STATE *state);
 
 #endif /* SBPP_H */
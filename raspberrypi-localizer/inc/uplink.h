@@ -0,0 +1,230 @@
+/*
+ * uplink.h
+ *
+ *  World coordinates of the identified LEDs over the UART to the Sleepy
+ *  Pi, which forwards them to the mote, see -uplink.
+ *
+ *  The uplink has its own thread reading the shared memory detection
+ *  stream, so neither the detector nor the event loop ever waits on the
+ *  serial port. Each LED keeps only its latest position until it is sent,
+ *  a burst of detections coalesces instead of queueing. LEDs the receiver
+ *  has no position of go first, the others in the order they were last
+ *  reported in.
+ *
+ *  Positions are sent in frames of up to UPLINK_FRAME_MAX bytes
+ *
+ *    UPLINK_SYNC, payload length, sequence, payload, CRC-16/CCITT
+ *
+ *  the CRC over length, sequence and payload. The payload is a list of
+ *  entries, each the LED's key (ID | voltage bit << 15) and its X and Y in
+ *  tenths of the calibration's units, either whole or as a delta against
+ *  the position last reported for that ID
+ *
+ *    UPLINK_ABSOLUTE     tag, key, x, y        7 bytes
+ *    UPLINK_DELTA        tag, key, dx, dy      5 bytes, dx and dy int8
+ *    UPLINK_SMALL_DELTA  tag | dx, dy, key     3 bytes, dx and dy -4 .. 3
+ *
+ *  all big endian like the 6 byte records sent before. A receiver that
+ *  sees a sequence gap or a bad CRC forgets every position, deltas of an
+ *  LED are ignored until its next absolute entry, and every LED is sent
+ *  whole again after UPLINK_REFRESH deltas. An empty frame is the
+ *  heartbeat when there is nothing to send, it carries the next sequence
+ *  number without using it up, the Sleepy Pi does not forward it.
+ *
+ *  The Sleepy Pi answers every frame with entries with "00", the bytes
+ *  left of its window to the mote or "-1" when it could not take it, and
+ *  the frame's sequence in 2 hex digits, "0017A3 V7" or "00-1A4 V7".
+ *  Heartbeats are never answered. On a serial port the uplink reads these,
+ *  a frame refused, or without an answer within UPLINK_ACK_MS or by the
+ *  time a later one is answered, is lost. The receiver forgets every
+ *  position at the gap, so every LED goes whole again and the LEDs of the
+ *  frames in flight are sent again. The Sleepy Pi's other lines are
+ *  logged as "sleepy_pi - <line>" for the wrapper.
+ *
+ *  Frames are paced to the rate the serial driver is measured to drain
+ *  its queue at, no more than about a frame is ever queued in the driver,
+ *  so what goes out next is decided as late as possible. The budget given
+ *  with -uplink_budget, at most the baud rate's, holds over every
+ *  UPLINK_WINDOW_MS, the wrapper's 3 bytes/s are the 30 bytes the mote
+ *  takes each time it samples, however the two clocks line up.
+ */
+
+#ifndef UPLINK_H_
+#define UPLINK_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "configurations.h"
+#include "detection-reader.h"
+#include "log-ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UPLINK_SYNC               0xA5
+#define UPLINK_OVERHEAD           5       /* Sync, length, sequence and CRC */
+#define UPLINK_PAYLOAD_LIMIT      255
+
+/* Entry tags */
+#define UPLINK_ABSOLUTE           0x01
+#define UPLINK_DELTA              0x02
+#define UPLINK_SMALL_DELTA        0x80    /* | (dx + 4) << 3 | (dy + 4) */
+
+#define UPLINK_ABSOLUTE_BYTES     7
+#define UPLINK_DELTA_BYTES        5
+#define UPLINK_SMALL_DELTA_BYTES  3
+
+/* Most entries a frame holds, and the UPLINK_TICK_MS slots the budget is counted in. */
+#define UPLINK_FRAME_ENTRIES      ((UPLINK_FRAME_MAX - UPLINK_OVERHEAD) / UPLINK_SMALL_DELTA_BYTES)
+#define UPLINK_WINDOW_SLOTS       ((UPLINK_WINDOW_MS / UPLINK_TICK_MS) + 1)
+
+/* Longest line of the Sleepy Pi kept, the rest of it is skipped. */
+#define UPLINK_REPLY_MAX          64
+
+/* X and Y are sent in tenths of the calibration's units. */
+#define UPLINK_SCALE              10.0f
+
+/* uplink_led state */
+#define UPLINK_LED_KNOWN          0x1     /* The receiver has a position to apply deltas to */
+#define UPLINK_LED_PENDING        0x2     /* next_x, next_y are waiting to be sent */
+
+typedef struct uplink_led_t {
+  uint16_t  x, y;                 /* Last reported, what the receiver's deltas apply to */
+  uint16_t  next_x, next_y;
+  uint32_t  seen_ms;              /* When the LED became pending */
+  uint32_t  sent_ms;              /* When it was last reported */
+  uint8_t   voltage;
+  uint8_t   state;
+  uint8_t   deltas;               /* Deltas since its last absolute entry */
+} uplink_led;
+
+/* A frame waiting for the Sleepy Pi's answer. */
+typedef struct uplink_sent_t {
+  uint32_t  ms;
+  uint8_t   sequence;
+  uint32_t  count;
+  uint16_t  ids[UPLINK_FRAME_ENTRIES];
+} uplink_sent;
+
+typedef struct uplink_order_t {
+  uint64_t  key;
+  uint16_t  id;
+} uplink_order;
+
+typedef struct uplink_stats_t {
+  _Atomic uint32_t  frames;
+  _Atomic uint32_t  bytes;
+  _Atomic uint32_t  absolute;
+  _Atomic uint32_t  deltas;
+  _Atomic uint32_t  small_deltas;
+  _Atomic uint32_t  heartbeats;
+  _Atomic uint32_t  coalesced;    /* Positions replaced by a newer one before they were sent */
+  _Atomic uint32_t  dropped;      /* Detections of IDs beyond UPLINK_PENDING_MAX pending ones */
+  _Atomic uint32_t  lost;         /* Records the stream overwrote before the uplink read them */
+  _Atomic uint32_t  write_errors;
+  _Atomic uint32_t  refused;      /* Frames the Sleepy Pi answered with -1 */
+  _Atomic uint32_t  unanswered;   /* Frames without an answer within UPLINK_ACK_MS */
+  _Atomic uint32_t  rate;         /* Measured drain rate, bytes/s */
+  _Atomic uint32_t  new_latency_max_ms;   /* Longest an LED the receiver did not know waited */
+} uplink_stats;
+
+typedef struct uplink_t {
+  int       fd;
+  uint32_t  line_rate;            /* Bytes/s of the baud rate */
+  uint32_t  budget;               /* Bytes/s allowed, at most line_rate */
+
+  /* Pacing, see uplink_pace */
+  double    rate;                 /* Drain rate estimate, bytes/s */
+  double    tokens;
+  uint32_t  paced_ms;
+  uint32_t  queued;               /* Driver queue at the last uplink_pace */
+  uint32_t  written;              /* Bytes written since */
+  uint32_t  frame_ms;             /* When the last frame was written */
+  uint8_t   sequence;
+
+  /* Budget, bytes of the frames written in each of the last UPLINK_WINDOW_SLOTS ticks */
+  uint32_t  window_bytes;         /* Allowed over UPLINK_WINDOW_MS */
+  uint32_t  window_sum;
+  uint32_t  window_slot;          /* Tick of the newest slot */
+  uint32_t  window[UPLINK_WINDOW_SLOTS];
+
+  /* The Sleepy Pi's answers, read when fd is a serial port */
+  uint8_t       replies;
+  char          reply[UPLINK_REPLY_MAX];
+  uint32_t      reply_length;
+  uplink_sent   sent[UPLINK_UNACKED];
+  uint32_t      sent_first, sent_count;
+  uint16_t      frame_ids[UPLINK_FRAME_ENTRIES];    /* LEDs of the frame uplink_encode built last */
+  uint32_t      frame_entries;
+  log_ring      *log;             /* Where the Sleepy Pi's other lines go, or NULL */
+
+  uplink_led    *leds;            /* LED_DATA_MASK + 1 */
+  uint16_t      *pending;         /* IDs with UPLINK_LED_PENDING */
+  uint32_t      pending_count;
+  uplink_order  *order;
+
+  detection_reader  reader;
+  detection_record  *records;
+  struct timespec   start;
+  pthread_t         thread;
+  _Atomic uint32_t  closed;
+  uint8_t           running;
+
+  uplink_stats  stats;
+} uplink;
+
+/* Position a receiver decoded. */
+typedef struct uplink_report_t {
+  uint16_t  id;
+  uint8_t   voltage;
+  uint16_t  x, y;
+} uplink_report;
+
+typedef struct uplink_base_t {
+  uint16_t  x, y;
+  uint8_t   known;
+} uplink_base;
+
+typedef struct uplink_decoder_stats_t {
+  uint32_t  frames;
+  uint32_t  heartbeats;
+  uint32_t  reports;
+  uint32_t  crc_errors;
+  uint32_t  gaps;                 /* Sequence numbers missing */
+  uint32_t  skipped;              /* Bytes skipped looking for a frame */
+  uint32_t  unknown;              /* Deltas of LEDs without a position */
+  uint32_t  malformed;            /* Frames with an unknown entry tag */
+} uplink_decoder_stats;
+
+/* Receiver side of the protocol, what the mote's end decodes. */
+typedef struct uplink_decoder_t {
+  uint8_t       buffer[UPLINK_OVERHEAD + UPLINK_PAYLOAD_LIMIT];
+  uint32_t      length;
+  int32_t       sequence;         /* Of the last frame, -1 before the first */
+  uplink_base   *bases;           /* LED_DATA_MASK + 1 */
+  uplink_decoder_stats  stats;
+} uplink_decoder;
+
+uint16_t  uplink_crc(const uint8_t *data, uint32_t length);
+
+uplink*   uplink_open(const char *device, uint32_t baud, uint32_t budget);
+int       uplink_start(uplink *u, const char *shm_name);
+void      uplink_close(uplink *u);
+void      uplink_update(uplink *u, const detection_record *r, uint32_t now_ms);
+uint32_t  uplink_pace(uplink *u, uint32_t now_ms, uint32_t queued);
+uint32_t  uplink_encode(uplink *u, uint8_t *frame, uint32_t allowance, uint32_t now_ms);
+void      uplink_receive(uplink *u, const uint8_t *bytes, uint32_t n, uint32_t now_ms);
+uint32_t  uplink_send(uplink *u, uint32_t now_ms, uint32_t queued);
+uint32_t  uplink_pump(uplink *u, uint32_t now_ms);
+
+int       uplink_decoder_init(uplink_decoder *d);
+void      uplink_decoder_destroy(uplink_decoder *d);
+uint32_t  uplink_decoder_push(uplink_decoder *d, const uint8_t *bytes, uint32_t n, uplink_report *reports, uint32_t max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UPLINK_H_ */
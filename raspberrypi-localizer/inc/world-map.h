@@ -0,0 +1,94 @@
+/*
+ * world-map.h
+ *
+ *  World coordinates of identified LEDs from their image position and
+ *  their known height, with the calibration files localizer_wrapper.py and
+ *  calibrate_cameras write.
+ *
+ *  Every pixel is undistorted once, iterating the lens model backwards the
+ *  way cv2.undistortPoints does, into a table of sub-pixel normalized
+ *  camera coordinates. That table is cached next to the intrinsic
+ *  parameters file, keyed by a hash of the file, as it is the slow part of
+ *  starting up. The undistorted coordinates and the camera rotation are
+ *  then folded into a table of line of sight directions, one per pixel,
+ *  each scaled to a unit z step. The LED at height h seen at pixel (x, y)
+ *  is at
+ *
+ *    translation + (h - translation z) * ray(x, y)
+ *
+ *  a lookup and two multiply-adds per detection, undistortion included.
+ */
+
+#ifndef WORLD_MAP_H_
+#define WORLD_MAP_H_
+
+#include <stdint.h>
+#include "configurations.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Height of the LEDs with a given ID, ID 0 being the default of the heights file. */
+typedef struct world_led_height_t {
+  uint16_t  id;
+  float     height;
+} world_led_height;
+
+/* Cache of the undistortion table, the intrinsic parameters file name with this appended. */
+#define WORLD_MAP_CACHE_SUFFIX    ".undistort"
+#define WORLD_MAP_CACHE_MAGIC     0x54534455    /* "UDST" */
+#define WORLD_MAP_CACHE_VERSION   1
+
+/* k1, k2, p1, p2, k3 and the rational model's k4, k5, k6 as calibrate_cameras writes them. */
+#define WORLD_MAP_DISTORTION      8
+
+/* Fixed point iterations undistorting a pixel. */
+#define WORLD_MAP_UNDISTORT_ITERATIONS  20
+
+typedef struct world_map_cache_header_t {
+  uint32_t  magic;
+  uint16_t  version;
+  uint16_t  reserved;
+  uint16_t  width;
+  uint16_t  height;
+  uint32_t  pad;
+  uint64_t  hash;               /* FNV-1a of the intrinsic parameters file */
+} world_map_cache_header;
+
+typedef struct world_map_t {
+  double    camera_matrix[9];
+  double    camera_matrix_inv[9];
+  double    distortion[WORLD_MAP_DISTORTION];
+  double    rotation[9];
+  double    translation[3];
+  uint64_t  intrinsics_hash;
+
+  /* Undistorted normalized camera coordinates, FRAME_WIDTH x FRAME_HEIGHT pairs. */
+  float     *undistorted;
+  uint8_t   undistorted_cached;     /* Loaded from the cache rather than built */
+
+  /* x / z and y / z of the world space line of sight, FRAME_WIDTH x FRAME_HEIGHT pairs. */
+  float     *rays;
+
+  world_led_height  *heights;   /* Sorted by ID */
+  uint32_t  height_count;
+} world_map;
+
+int   world_map_load(world_map *m, const char *intrinsics, const char *extrinsics, const char *heights);
+void  world_map_destroy(world_map *m);
+void  world_map_undistort_point(const world_map *m, double x, double y, double *xn, double *yn);
+void  world_map_distort_point(const world_map *m, double xn, double yn, double *x, double *y);
+void  world_map_build_undistortion(world_map *m);
+int   world_map_load_undistortion(world_map *m, const char *name);
+int   world_map_save_undistortion(const world_map *m, const char *name);
+void  world_map_build_rays(world_map *m);
+int   world_map_height(const world_map *m, uint16_t id, float *height);
+int   world_map_project(const world_map *m, uint16_t id, uint16_t x, uint16_t y, float *world);
+int   world_map_project_reference(const world_map *m, double height, double x, double y, double *world);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WORLD_MAP_H_ */
@@ -0,0 +1,217 @@
+/*
+ ============================================================================
+ Name        : detection-reader.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Reads the detection stream from shared memory or from the
+               localizer's Unix domain socket
+ ============================================================================
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include "detection-reader.h"
+
+/* 0 once mapped, -1 if the ring does not exist or has another version. */
+int detection_reader_open(detection_reader *r, const char *shm_name)
+{
+  detection_shm *shm;
+  struct stat st;
+  /* Writable for the waiters count, a reader does not touch anything else. */
+  int fd = shm_open(shm_name, O_RDWR, 0);
+
+  memset(r, 0, sizeof(*r));
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(detection_shm))
+  {
+    close(fd);
+    return -1;
+  }
+  shm = (detection_shm*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED)
+    return -1;
+
+  r -> shm = shm;
+  r -> shm_bytes = st.st_size;
+  if (shm -> magic != DETECTION_MAGIC || shm -> version != DETECTION_VERSION
+    || shm -> record_size != sizeof(detection_record) || detection_shm_bytes(shm -> capacity) > r -> shm_bytes)
+  {
+    detection_reader_close(r);
+    return -1;
+  }
+  atomic_thread_fence(memory_order_acquire);
+
+  /* Only what is published from now on. */
+  r -> position = atomic_load_explicit(&shm -> head, memory_order_acquire);
+  return 0;
+}
+
+void detection_reader_close(detection_reader *r)
+{
+  if (r -> shm)
+    munmap(r -> shm, r -> shm_bytes);
+  r -> shm = NULL;
+}
+
+/* Copy up to max records published since the last call, oldest first. */
+uint32_t detection_reader_read(detection_reader *r, detection_record *records, uint32_t max)
+{
+  const detection_shm *shm = r -> shm;
+  uint64_t head = atomic_load_explicit(&shm -> head, memory_order_acquire);
+  uint32_t n = 0;
+
+  while (n < max && r -> position < head)
+  {
+    const detection_slot *slot = &shm -> slots[r -> position & (shm -> capacity - 1)];
+    uint64_t expected = (2 * r -> position) + 2;
+    uint64_t s1, s2;
+
+    /* Lapped, skip to the oldest record still in the ring. */
+    if (head - r -> position > shm -> capacity)
+    {
+      r -> lost += head - r -> position - shm -> capacity;
+      r -> position = head - shm -> capacity;
+      continue;
+    }
+
+    s1 = atomic_load_explicit(&slot -> sequence, memory_order_acquire);
+    records[n] = slot -> record;
+    atomic_thread_fence(memory_order_acquire);
+    s2 = atomic_load_explicit(&slot -> sequence, memory_order_relaxed);
+
+    if (s1 != expected || s2 != expected)
+    {
+      /* The writer is past this slot, see where head is now. */
+      head = atomic_load_explicit(&shm -> head, memory_order_acquire);
+      if (head - r -> position <= shm -> capacity)
+      {
+        r -> lost++;
+        r -> position++;
+      }
+      continue;
+    }
+    r -> position++;
+    n++;
+  }
+  return n;
+}
+
+/*
+ Sleep until records newer than the reader's position are published.
+ 1 if there are some, 0 on timeout, a negative timeout waits for ever.
+ */
+int detection_reader_wait(detection_reader *r, int timeout_ms)
+{
+  detection_shm *shm = r -> shm;
+  struct timespec deadline, now, t;
+  int ready;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  if (timeout_ms >= 0)
+  {
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
+
+  /* Pairs with the commits increment in detection_stream_commit. */
+  atomic_fetch_add_explicit(&shm -> waiters, 1, memory_order_seq_cst);
+  for (;;)
+  {
+    uint32_t commits = atomic_load_explicit(&shm -> commits, memory_order_seq_cst);
+
+    ready = atomic_load_explicit(&shm -> head, memory_order_seq_cst) > r -> position;
+    if (ready)
+      break;
+    /* Whatever is left until the deadline, commits of other readers' records wake the wait too. */
+    if (timeout_ms >= 0)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      t.tv_sec = deadline.tv_sec - now.tv_sec;
+      t.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+      if (t.tv_nsec < 0)
+      {
+        t.tv_sec--;
+        t.tv_nsec += 1000000000L;
+      }
+      if (t.tv_sec < 0)
+        break;
+    }
+    /* EAGAIN is a commit since commits was read, see if it was the reader's records. */
+    if (syscall(SYS_futex, &shm -> commits, FUTEX_WAIT, commits, (timeout_ms < 0) ? NULL : &t, NULL, 0) != 0
+      && errno != EAGAIN && errno != EINTR)
+      break;
+  }
+  atomic_fetch_sub_explicit(&shm -> waiters, 1, memory_order_seq_cst);
+  return ready;
+}
+
+/* Socket descriptor, -1 if the localizer is not listening at path. */
+int detection_socket_connect(const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ Blocking read of one frame's message. The number of records, of which at
+ most max are copied, 0 when the localizer closed the socket, -1 on errors
+ and on messages of another version.
+ */
+int detection_socket_read(int fd, detection_batch *batch, detection_record *records, uint32_t max)
+{
+  struct iovec iov[2] = {
+    { batch, sizeof(*batch) },
+    { records, max * sizeof(detection_record) }
+  };
+  struct msghdr msg;
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  do
+    n = recvmsg(fd, &msg, 0);
+  while (n < 0 && errno == EINTR);
+
+  if (n <= 0)
+    return (int)n;
+  if ((size_t)n < sizeof(*batch) || batch -> magic != DETECTION_MAGIC || batch -> version != DETECTION_VERSION
+    || batch -> record_size != sizeof(detection_record))
+    return -1;
+  return (int)batch -> count;
+}
@@ -0,0 +1,243 @@
+/*
+ ============================================================================
+ Name        : detection-stream.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Identified LEDs published as binary records to a shared
+               memory ring and to Unix domain socket clients
+ ============================================================================
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include "detection-stream.h"
+
+static int detection_stream_listen(detection_stream *s, const char *path)
+{
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  /* A socket left behind by an earlier run. */
+  unlink(path);
+  s -> listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (s -> listen_fd < 0)
+    return -1;
+  if (bind(s -> listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(s -> listen_fd, DETECTION_SOCKET_CLIENTS) != 0)
+    return -1;
+  s -> socket_path = strdup(path);
+  return 0;
+}
+
+static int detection_stream_map(detection_stream *s, const char *name, uint32_t capacity)
+{
+  uint32_t c = 1;
+  int fd;
+
+  while (c < capacity)
+    c <<= 1;
+
+  s -> shm_bytes = detection_shm_bytes(c);
+  fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return -1;
+  if (ftruncate(fd, s -> shm_bytes) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  s -> shm = (detection_shm*)mmap(NULL, s -> shm_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (s -> shm == MAP_FAILED)
+  {
+    s -> shm = NULL;
+    return -1;
+  }
+  s -> shm_name = strdup(name);
+
+  /* The object is zero filled, the magic goes last so a reader never sees a half made header. */
+  s -> shm -> version = DETECTION_VERSION;
+  s -> shm -> record_size = sizeof(detection_record);
+  s -> shm -> capacity = c;
+  atomic_thread_fence(memory_order_release);
+  s -> shm -> magic = DETECTION_MAGIC;
+  return 0;
+}
+
+/*
+ Either name may be NULL. capacity is rounded up to a power of 2 and should
+ hold a few seconds of detections, batch_max is the most LEDs a frame
+ reports, normally the tracker capacity. NULL if either could not be set up.
+ */
+detection_stream* detection_stream_open(const char *shm_name, const char *socket_path, uint32_t capacity, uint32_t batch_max)
+{
+  detection_stream *s = (detection_stream*)calloc(1, sizeof(detection_stream));
+
+  if (!s)
+    return NULL;
+
+  s -> listen_fd = -1;
+  for (int i = 0; i < DETECTION_SOCKET_CLIENTS; i++)
+    s -> clients[i] = -1;
+  s -> batch_max = batch_max ? batch_max : 1;
+  s -> batch = (uint8_t*)malloc(sizeof(detection_batch) + (s -> batch_max * sizeof(detection_record)));
+
+  if (!s -> batch
+    || (shm_name && detection_stream_map(s, shm_name, capacity) != 0)
+    || (socket_path && detection_stream_listen(s, socket_path) != 0))
+  {
+    detection_stream_close(s);
+    return NULL;
+  }
+  return s;
+}
+
+void detection_stream_close(detection_stream *s)
+{
+  if (!s)
+    return;
+
+  detection_stream_commit(s);
+  for (int i = 0; i < DETECTION_SOCKET_CLIENTS; i++)
+  {
+    if (s -> clients[i] >= 0)
+      close(s -> clients[i]);
+  }
+  if (s -> listen_fd >= 0)
+    close(s -> listen_fd);
+  if (s -> socket_path)
+    unlink(s -> socket_path);
+  if (s -> shm)
+    munmap(s -> shm, s -> shm_bytes);
+  if (s -> shm_name)
+    shm_unlink(s -> shm_name);
+  free(s -> socket_path);
+  free(s -> shm_name);
+  free(s -> batch);
+  free(s);
+}
+
+/* Queue one record of the current frame, it is published with the frame's detection_stream_commit. */
+void detection_stream_add(detection_stream *s, const detection_record *r)
+{
+  detection_record *record;
+
+  if (s -> batch_count == s -> batch_max)
+    detection_stream_commit(s);
+
+  /* The whole frame shares the time of its first record. */
+  if (s -> batch_count == 0)
+  {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    s -> batch_time = ((uint64_t)t.tv_sec * 1000000000ull) + t.tv_nsec;
+  }
+
+  record = (detection_record*)(s -> batch + sizeof(detection_batch)) + s -> batch_count++;
+  *record = *r;
+  record -> sequence = (uint32_t)s -> position;
+  record -> timestamp = s -> batch_time;
+
+  if (s -> shm)
+  {
+    detection_slot *slot = &s -> shm -> slots[s -> position & (s -> shm -> capacity - 1)];
+
+    /* Readers copying the slot meanwhile see the odd sequence, or a changed one once they are done. */
+    atomic_store_explicit(&slot -> sequence, (2 * s -> position) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot -> record = *record;
+    atomic_store_explicit(&slot -> sequence, (2 * s -> position) + 2, memory_order_release);
+  }
+  s -> position++;
+}
+
+static void detection_stream_send(detection_stream *s, size_t length)
+{
+  int fd;
+
+  while ((fd = accept4(s -> listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+  {
+    int i = 0;
+
+    while (i < DETECTION_SOCKET_CLIENTS && s -> clients[i] >= 0)
+      i++;
+    if (i == DETECTION_SOCKET_CLIENTS)
+    {
+      close(fd);
+      continue;
+    }
+    s -> clients[i] = fd;
+    s -> stats.clients++;
+  }
+
+  for (int i = 0; i < DETECTION_SOCKET_CLIENTS; i++)
+  {
+    if (s -> clients[i] < 0)
+      continue;
+    if (send(s -> clients[i], s -> batch, length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+      {
+        s -> stats.socket_drops++;
+        continue;
+      }
+      close(s -> clients[i]);
+      s -> clients[i] = -1;
+      s -> stats.clients--;
+    }
+  }
+}
+
+/* Publish the records added since the last commit, one socket message and one head update. */
+void detection_stream_commit(detection_stream *s)
+{
+  detection_batch *batch = (detection_batch*)s -> batch;
+
+  if (s -> batch_count == 0)
+    return;
+
+  if (s -> shm)
+  {
+    detection_shm *shm = s -> shm;
+
+    atomic_store_explicit(&shm -> head, s -> position, memory_order_release);
+    /* Pairs with the waiters increment in detection_reader_wait. */
+    atomic_fetch_add_explicit(&shm -> commits, 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&shm -> waiters, memory_order_seq_cst))
+      syscall(SYS_futex, &shm -> commits, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+
+  if (s -> listen_fd >= 0)
+  {
+    batch -> magic = DETECTION_MAGIC;
+    batch -> version = DETECTION_VERSION;
+    batch -> record_size = sizeof(detection_record);
+    batch -> count = s -> batch_count;
+    batch -> frame_number = ((detection_record*)(s -> batch + sizeof(detection_batch))) -> frame_number;
+    detection_stream_send(s, sizeof(detection_batch) + (s -> batch_count * sizeof(detection_record)));
+  }
+
+  s -> stats.records += s -> batch_count;
+  s -> stats.batches++;
+  s -> batch_count = 0;
+}
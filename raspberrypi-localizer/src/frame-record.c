@@ -0,0 +1,311 @@
+/*
+ ============================================================================
+ Name        : frame-record.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Packed bit frames appended to a preallocated, memory mapped
+               recording file by a writer thread of its own, and read back
+ ============================================================================
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+/* Recordings of more than an hour or two pass 2 GB, off_t is 32 bits on the Pi otherwise. */
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "frame-record.h"
+
+static inline uint64_t frame_record_now_us(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((uint64_t)t.tv_sec * 1000000) + (t.tv_nsec / 1000);
+}
+
+static inline void frame_record_max(_Atomic uint32_t *max, uint32_t v)
+{
+  if (v > atomic_load_explicit(max, memory_order_relaxed))
+    atomic_store_explicit(max, v, memory_order_relaxed);
+}
+
+/*
+ Unmap the current window and start writing it back. The window before it,
+ whose write back was started a whole window ago, is waited for and dropped
+ from the page cache, so at most two windows are ever dirty or cached. The
+ page cache only drops its folios whole and they can straddle windows, so
+ every drop reaches back over the window dropped last time.
+ */
+static void frame_recorder_unmap(frame_recorder *r)
+{
+  if (!r -> window)
+    return;
+  munmap(r -> window, r -> window_bytes);
+  r -> window = NULL;
+  sync_file_range(r -> fd, r -> window_offset, r -> window_bytes, SYNC_FILE_RANGE_WRITE);
+
+  if (r -> flushing_bytes)
+  {
+    sync_file_range(r -> fd, r -> flushing_offset, r -> flushing_bytes,
+      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(r -> fd, r -> dropped_offset, (r -> flushing_offset + r -> flushing_bytes) - r -> dropped_offset, POSIX_FADV_DONTNEED);
+    r -> dropped_offset = r -> flushing_offset;
+  }
+  r -> flushing_offset = r -> window_offset;
+  r -> flushing_bytes = r -> window_bytes;
+}
+
+/* Map the window of frames starting with first, from the page it starts in. */
+static int frame_recorder_map(frame_recorder *r, uint32_t first)
+{
+  uint64_t offset = r -> header -> data_offset + ((uint64_t)first * FRAME_RECORD_BYTES);
+  uint64_t aligned = offset & ~((uint64_t)r -> page - 1);
+  uint32_t frames = r -> header -> capacity - first;
+  uint64_t t0 = frame_record_now_us();
+  void *m;
+
+  if (frames > FRAME_RECORD_WINDOW)
+    frames = FRAME_RECORD_WINDOW;
+
+  frame_recorder_unmap(r);
+  r -> window_bytes = (offset - aligned) + ((uint64_t)frames * FRAME_RECORD_BYTES);
+  m = mmap(NULL, r -> window_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, r -> fd, aligned);
+  if (m == MAP_FAILED)
+    return -1;
+
+  r -> window = (uint8_t*)m;
+  r -> window_data = r -> window + (offset - aligned);
+  r -> window_offset = aligned;
+  r -> window_first = first;
+  r -> window_frames = frames;
+  atomic_fetch_add_explicit(& r -> stats.windows, 1, memory_order_relaxed);
+  frame_record_max(& r -> stats.remap_us_max, frame_record_now_us() - t0);
+  return 0;
+}
+
+/* Append one frame and its index entry, then count it. */
+static void frame_recorder_write(frame_recorder *r, const frame_record_slot *slot)
+{
+  uint32_t count = atomic_load_explicit(& r -> header -> count, memory_order_relaxed);
+  uint64_t t0, t;
+
+  if (count == r -> header -> capacity)
+  {
+    atomic_fetch_add_explicit(& r -> stats.full, 1, memory_order_relaxed);
+    return;
+  }
+  if (!r -> window || count >= r -> window_first + r -> window_frames)
+  {
+    if (frame_recorder_map(r, count) != 0)
+    {
+      atomic_fetch_add_explicit(& r -> stats.errors, 1, memory_order_relaxed);
+      return;
+    }
+  }
+
+  t0 = frame_record_now_us();
+  memcpy(r -> window_data + ((uint64_t)(count - r -> window_first) * FRAME_RECORD_BYTES), slot -> bits, FRAME_RECORD_BYTES);
+  r -> index[count] = slot -> entry;
+  atomic_store_explicit(& r -> header -> count, count + 1, memory_order_release);
+  t = frame_record_now_us() - t0;
+
+  atomic_fetch_add_explicit(& r -> stats.frames, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(& r -> stats.write_us_sum, t, memory_order_relaxed);
+  frame_record_max(& r -> stats.write_us_max, t);
+}
+
+/* Drain the ring every FRAME_RECORD_POLL_MS instead of sleeping on it, the detector never makes a wake up call for the writer. */
+static void* frame_recorder_writer(void *args)
+{
+  frame_recorder *r = (frame_recorder*)args;
+  frame_record_slot *slot;
+
+  for (;;)
+  {
+    uint32_t closed = atomic_load(& r -> ring.closed);
+
+    while ((slot = (frame_record_slot*)frame_ring_take(& r -> ring)))
+    {
+      frame_recorder_write(r, slot);
+      frame_ring_release(& r -> ring);
+    }
+    if (closed)
+      break;
+    usleep(FRAME_RECORD_POLL_MS * 1000);
+  }
+
+  return NULL;
+}
+
+/* A recording of capacity frames, the file preallocated and the writer started. NULL and errno set when it cannot be made. */
+frame_recorder* frame_recorder_open(const char *path, uint32_t capacity)
+{
+  frame_recorder *r = (frame_recorder*)calloc(1, sizeof(frame_recorder));
+  uint64_t data_offset, total;
+  struct timespec now;
+  int err;
+
+  if (!r)
+    return NULL;
+  r -> fd = -1;
+  if (frame_ring_init(& r -> ring, FRAME_RECORD_RING_LENGTH, sizeof(frame_record_slot)) != 0)
+    goto error;
+
+  r -> page = (uint32_t)sysconf(_SC_PAGESIZE);
+  r -> path = strdup(path);
+  r -> index_bytes = (uint64_t)capacity * sizeof(frame_record_entry);
+  data_offset = (FRAME_RECORD_HEADER_BYTES + r -> index_bytes + FRAME_RECORD_HEADER_BYTES - 1) & ~(uint64_t)(FRAME_RECORD_HEADER_BYTES - 1);
+  total = data_offset + ((uint64_t)capacity * FRAME_RECORD_BYTES);
+
+  r -> fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (r -> fd < 0)
+    goto error;
+  /* Blocks for the whole recording now, a write to a mapping of a hole on a full disk would be a SIGBUS. */
+  err = posix_fallocate(r -> fd, 0, total);
+  if (err != 0)
+  {
+    errno = err;
+    goto error;
+  }
+
+  r -> header = (frame_record_header*)mmap(NULL, data_offset, PROT_READ | PROT_WRITE, MAP_SHARED, r -> fd, 0);
+  if (r -> header == MAP_FAILED)
+  {
+    r -> header = NULL;
+    goto error;
+  }
+  r -> index = (frame_record_entry*)((uint8_t*)r -> header + FRAME_RECORD_HEADER_BYTES);
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  r -> header -> version = FRAME_RECORD_VERSION;
+  r -> header -> entry_size = sizeof(frame_record_entry);
+  r -> header -> width = FRAME_WIDTH;
+  r -> header -> height = FRAME_HEIGHT;
+  r -> header -> frame_bytes = FRAME_RECORD_BYTES;
+  r -> header -> capacity = capacity;
+  atomic_store(& r -> header -> count, 0);
+  r -> header -> index_offset = FRAME_RECORD_HEADER_BYTES;
+  r -> header -> data_offset = data_offset;
+  r -> dropped_offset = data_offset;
+  r -> header -> start_time = ((uint64_t)now.tv_sec * 1000000000ull) + now.tv_nsec;
+  r -> header -> magic = FRAME_RECORD_MAGIC;
+
+  if (pthread_create(& r -> writer, NULL, frame_recorder_writer, r) != 0)
+    goto error;
+  r -> writer_running = 1;
+  return r;
+
+error:
+  err = errno;
+  frame_recorder_close(r);
+  errno = err;
+  return NULL;
+}
+
+/* Hand a frame to the writer, or drop it when the writer is a whole ring behind. */
+void frame_recorder_add(frame_recorder *r, const uint8_t *bits, uint64_t pts, uint32_t frame_number, uint32_t ones)
+{
+  frame_record_slot *slot = (frame_record_slot*)frame_ring_acquire(& r -> ring);
+
+  if (!slot)
+    return;
+  slot -> entry.pts = pts;
+  slot -> entry.frame_number = frame_number;
+  slot -> entry.ones = ones;
+  memcpy(slot -> bits, bits, FRAME_RECORD_BYTES);
+  frame_ring_publish(& r -> ring);
+}
+
+/* Write what is queued, and cut the file after the last frame. Call once the detector stopped adding frames. */
+void frame_recorder_close(frame_recorder *r)
+{
+  uint32_t count = 0;
+
+  if (!r)
+    return;
+  if (r -> writer_running)
+  {
+    frame_ring_close(& r -> ring);
+    pthread_join(r -> writer, NULL);
+    r -> writer_running = 0;
+  }
+
+  if (r -> window)
+    munmap(r -> window, r -> window_bytes);
+  if (r -> header)
+  {
+    r -> header -> dropped = r -> ring.stats.dropped;
+    r -> header -> full = atomic_load(& r -> stats.full);
+    count = atomic_load(& r -> header -> count);
+    msync(r -> header, r -> header -> data_offset, MS_SYNC);
+    if (ftruncate(r -> fd, r -> header -> data_offset + ((uint64_t)count * FRAME_RECORD_BYTES)) != 0)
+      fprintf(stderr, "Could not trim the recording %s\n", r -> path);
+    munmap(r -> header, r -> header -> data_offset);
+  }
+  if (r -> fd >= 0)
+  {
+    /* Written out, there is no reason to keep any of it cached. */
+    fsync(r -> fd);
+    posix_fadvise(r -> fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(r -> fd);
+  }
+  frame_ring_destroy(& r -> ring);
+  free(r -> path);
+  free(r);
+}
+
+/* Open a recording and load its index, -1 when it is not one of FRAME_WIDTH x FRAME_HEIGHT frames. */
+int frame_record_open(frame_record *f, const char *path)
+{
+  size_t bytes;
+
+  f -> index = NULL;
+  f -> fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (f -> fd < 0)
+    return -1;
+  if (pread(f -> fd, &f -> header, sizeof(f -> header), 0) != sizeof(f -> header)
+    || f -> header.magic != FRAME_RECORD_MAGIC || f -> header.version != FRAME_RECORD_VERSION
+    || f -> header.entry_size != sizeof(frame_record_entry) || f -> header.frame_bytes != FRAME_RECORD_BYTES
+    || f -> header.width != FRAME_WIDTH || f -> header.height != FRAME_HEIGHT)
+  {
+    frame_record_close(f);
+    return -1;
+  }
+
+  bytes = (size_t)atomic_load(&f -> header.count) * sizeof(frame_record_entry);
+  f -> index = (frame_record_entry*)malloc(bytes ? bytes : 1);
+  if (!f -> index || pread(f -> fd, f -> index, bytes, f -> header.index_offset) != (ssize_t)bytes)
+  {
+    frame_record_close(f);
+    return -1;
+  }
+  return 0;
+}
+
+/* Frame i of the recording into bits, FRAME_RECORD_BYTES. */
+int frame_record_read(const frame_record *f, uint32_t i, uint8_t *bits)
+{
+  off_t offset = f -> header.data_offset + ((uint64_t)i * FRAME_RECORD_BYTES);
+
+  if (i >= atomic_load(&f -> header.count))
+    return -1;
+  return (pread(f -> fd, bits, FRAME_RECORD_BYTES, offset) == FRAME_RECORD_BYTES) ? 0 : -1;
+}
+
+void frame_record_close(frame_record *f)
+{
+  if (f -> fd >= 0)
+    close(f -> fd);
+  f -> fd = -1;
+  free(f -> index);
+  f -> index = NULL;
+}
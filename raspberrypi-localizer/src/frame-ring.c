@@ -0,0 +1,256 @@
+/*
+ ============================================================================
+ Name        : frame-ring.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Lock-free single producer / single consumer frame ring with
+               an eventfd wakeup for the idle consumer and a selectable
+               policy for a full ring
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include "frame-ring.h"
+
+static inline uint64_t frame_ring_now_us(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((uint64_t)t.tv_sec * 1000000) + (t.tv_nsec / 1000);
+}
+
+int frame_ring_init(frame_ring *r, uint32_t capacity, uint32_t slot_size)
+{
+  uint32_t c = 1;
+
+  while (c < capacity)
+    c <<= 1;
+
+  memset(&r -> stats, 0, sizeof(r -> stats));
+  r -> capacity = c;
+  /* Whole cache lines per slot so slots never share one. */
+  r -> slot_size = (slot_size + 63) & ~63u;
+  r -> slots = (uint8_t*)aligned_alloc(64, (size_t)c * r -> slot_size);
+  r -> policy = FRAME_RING_DROP_NEWEST;
+  atomic_init(&r -> head, 0);
+  atomic_init(&r -> tail, 0);
+  atomic_init(&r -> held, 0);
+  atomic_init(&r -> waiting, 0);
+  atomic_init(&r -> closed, 0);
+  atomic_init(&r -> space_waiting, 0);
+  r -> wakeup_fd = eventfd(0, EFD_CLOEXEC);
+  r -> space_fd = eventfd(0, EFD_CLOEXEC);
+
+  return (r -> slots && r -> wakeup_fd >= 0 && r -> space_fd >= 0) ? 0 : -1;
+}
+
+void frame_ring_destroy(frame_ring *r)
+{
+  free(r -> slots);
+  r -> slots = NULL;
+  if (r -> wakeup_fd >= 0)
+    close(r -> wakeup_fd);
+  if (r -> space_fd >= 0)
+    close(r -> space_fd);
+  r -> wakeup_fd = -1;
+  r -> space_fd = -1;
+}
+
+uint32_t frame_ring_depth(frame_ring *r)
+{
+  return atomic_load_explicit(&r -> head, memory_order_acquire) - atomic_load_explicit(&r -> tail, memory_order_acquire);
+}
+
+/*
+ Slot at head when it is free: the ring is not full and the consumer does not
+ hold it. The consumer announces the slot it holds before claiming it, so once
+ tail shows the claim, held shows the slot.
+ */
+static inline void* frame_ring_free_slot(frame_ring *r)
+{
+  uint32_t head = atomic_load_explicit(&r -> head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&r -> tail, memory_order_seq_cst);
+  uint32_t position = head & (r -> capacity - 1);
+
+  if (head - tail >= r -> capacity || atomic_load_explicit(&r -> held, memory_order_seq_cst) == position + 1)
+    return NULL;
+
+  return r -> slots + ((size_t)position * r -> slot_size);
+}
+
+/* Discard the oldest unclaimed frame, unless the consumer claims it first. */
+static inline void frame_ring_drop_oldest(frame_ring *r)
+{
+  uint32_t head = atomic_load_explicit(&r -> head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&r -> tail, memory_order_seq_cst);
+
+  if (head - tail >= r -> capacity &&
+      atomic_compare_exchange_strong_explicit(&r -> tail, &tail, tail + 1, memory_order_seq_cst, memory_order_seq_cst))
+    r -> stats.overwritten++;
+}
+
+/*
+ Free slot to fill. On a full ring, by the ring's policy: NULL (counted as
+ dropped), the oldest queued frame discarded to make room, or a wait for the
+ consumer. A dropped oldest frame can still leave the new one without a slot
+ when the consumer holds the slot it would go to, it is then dropped too.
+ */
+void* frame_ring_acquire(frame_ring *r)
+{
+  void *slot;
+
+  if (r -> policy == FRAME_RING_BLOCK)
+    return frame_ring_acquire_wait(r);
+
+  if (r -> policy == FRAME_RING_DROP_OLDEST)
+    frame_ring_drop_oldest(r);
+
+  slot = frame_ring_free_slot(r);
+  if (!slot)
+    r -> stats.dropped++;
+
+  return slot;
+}
+
+/* Write to fd if the other side announced in waiting that it sleeps on it. */
+static inline void frame_ring_wake(_Atomic uint32_t *waiting, int fd)
+{
+  uint64_t one = 1;
+
+  /* Pairs with the sleeper storing waiting before its last look at the ring. */
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(waiting, memory_order_relaxed) &&
+      atomic_exchange_explicit(waiting, 0, memory_order_relaxed))
+  {
+    if (write(fd, &one, sizeof(one)) < 0)
+      return;
+  }
+}
+
+/* Sleep on fd after announcing it in waiting, unless ready() turns true in between; returns the microseconds slept. */
+static uint64_t frame_ring_sleep(frame_ring *r, _Atomic uint32_t *waiting, int fd, void* (*ready)(frame_ring *r))
+{
+  uint64_t t0, count;
+
+  atomic_store_explicit(waiting, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (ready(r) || atomic_load_explicit(&r -> closed, memory_order_acquire))
+  {
+    atomic_store_explicit(waiting, 0, memory_order_relaxed);
+    return 0;
+  }
+
+  t0 = frame_ring_now_us();
+  if (read(fd, &count, sizeof(count)) < 0)
+    atomic_store_explicit(waiting, 0, memory_order_relaxed);
+  return frame_ring_now_us() - t0;
+}
+
+/* Free slot to fill, sleeping until the consumer releases one; NULL once the ring is closed. */
+void* frame_ring_acquire_wait(frame_ring *r)
+{
+  void *slot;
+
+  while (!(slot = frame_ring_free_slot(r)))
+  {
+    if (atomic_load_explicit(&r -> closed, memory_order_acquire))
+      return NULL;
+
+    r -> stats.blocks++;
+    r -> stats.block_us_sum += frame_ring_sleep(r, &r -> space_waiting, r -> space_fd, frame_ring_free_slot);
+  }
+
+  return slot;
+}
+
+void frame_ring_publish(frame_ring *r)
+{
+  uint32_t head = atomic_load_explicit(&r -> head, memory_order_relaxed) + 1;
+  uint32_t depth = head - atomic_load_explicit(&r -> tail, memory_order_relaxed);
+
+  atomic_store_explicit(&r -> head, head, memory_order_release);
+
+  r -> stats.published++;
+  r -> stats.depth_sum += depth;
+  if (depth > r -> stats.depth_max)
+    r -> stats.depth_max = depth;
+
+  frame_ring_wake(&r -> waiting, r -> wakeup_fd);
+}
+
+/* Wakes both sides; the consumer drains what is left, a blocked producer gives up. */
+void frame_ring_close(frame_ring *r)
+{
+  atomic_store_explicit(&r -> closed, 1, memory_order_release);
+  atomic_store_explicit(&r -> waiting, 1, memory_order_relaxed);
+  atomic_store_explicit(&r -> space_waiting, 1, memory_order_relaxed);
+  frame_ring_wake(&r -> waiting, r -> wakeup_fd);
+  frame_ring_wake(&r -> space_waiting, r -> space_fd);
+}
+
+/* Oldest published slot, or NULL when the ring is empty; it is not claimed, the producer may still drop it. */
+void* frame_ring_peek(frame_ring *r)
+{
+  uint32_t tail = atomic_load_explicit(&r -> tail, memory_order_acquire);
+
+  if (atomic_load_explicit(&r -> head, memory_order_acquire) == tail)
+    return NULL;
+
+  return r -> slots + ((size_t)(tail & (r -> capacity - 1)) * r -> slot_size);
+}
+
+/* Claim the oldest published slot, NULL when the ring is empty. The slot is the consumer's until frame_ring_release. */
+void* frame_ring_take(frame_ring *r)
+{
+  uint32_t tail = atomic_load_explicit(&r -> tail, memory_order_acquire);
+
+  while (atomic_load_explicit(&r -> head, memory_order_acquire) != tail)
+  {
+    uint32_t position = tail & (r -> capacity - 1);
+
+    atomic_store_explicit(&r -> held, position + 1, memory_order_seq_cst);
+    if (atomic_compare_exchange_strong_explicit(&r -> tail, &tail, tail + 1, memory_order_seq_cst, memory_order_acquire))
+      return r -> slots + ((size_t)position * r -> slot_size);
+    /* Dropped by the producer meanwhile, tail now holds the next oldest. */
+  }
+
+  atomic_store_explicit(&r -> held, 0, memory_order_release);
+  return NULL;
+}
+
+/*
+ Claim the oldest published slot, sleeping until there is one. The consumer
+ announces itself in waiting and then looks at head once more, so a frame
+ published in between is either seen here or wakes the eventfd.
+ */
+void* frame_ring_wait(frame_ring *r)
+{
+  void *slot;
+
+  while (!(slot = frame_ring_take(r)))
+  {
+    uint64_t waited;
+
+    if (atomic_load_explicit(&r -> closed, memory_order_acquire))
+      return frame_ring_take(r);
+
+    waited = frame_ring_sleep(r, &r -> waiting, r -> wakeup_fd, frame_ring_peek);
+    r -> stats.waits++;
+    r -> stats.wait_us_sum += waited;
+    if (waited > r -> stats.wait_us_max)
+      r -> stats.wait_us_max = waited;
+  }
+
+  return slot;
+}
+
+void frame_ring_release(frame_ring *r)
+{
+  atomic_store_explicit(&r -> held, 0, memory_order_release);
+  frame_ring_wake(&r -> space_waiting, r -> space_fd);
+}
@@ -10,345 +10,1219 @@
  */
 
 #include <unistd.h>
+#include <time.h>
 #include <pthread.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "led-detector.h"
+#include "led-parallel.h"
+#include "frame-record.h"
 
-#ifdef LOC_ENABLE_SAVE_IMAGE
-uint32_t led_detected;
-#endif /* LOC_ENABLE_SAVE_IMAGE */
+/* A detector of its own, for running several of them side by side. NULL when out of memory. */
+led_detector* led_detector_create(RASPITEX_STATE *state)
+{
+  led_detector *ld = (led_detector*)aligned_alloc(64, sizeof(led_detector));
 
+  if (ld && led_detector_init(ld, state) != 0)
+  {
+    free(ld);
+    ld = NULL;
+  }
+  return ld;
+}
 
-uint32_t led_found = 0;
+/* Stops the detector's threads once the frames queued to them are processed. */
+void led_detector_free(led_detector *ld)
+{
+  if (!ld)
+    return;
+  led_detector_destroy(ld);
+  free(ld);
+}
 
-void led_detector_init(led_detector *ld, RASPITEX_STATE *state)
+/* -1 when out of memory or eventfds, whatever was set up is destroyed again. */
+int led_detector_init(led_detector *ld, RASPITEX_STATE *state)
 {
+  int rc = 0;
+
+  rc |= log_ring_init(& ld -> log, LED_LOG_RING_LENGTH, stdout);
+  ld -> stream = NULL;
+  ld -> world = NULL;
+  ld -> recorder = NULL;
+  ld -> context = NULL;
+  ld -> led_detected = 0;
+#if DEBUG_LUMINENCE_THRESH
+  ld -> luminence_frames = 0;
+#endif /* DEBUG_LUMINENCE_THRESH */
   ld -> is_first_frame = 1;
-  ld -> minx = 0;
-  ld -> miny = 0;
-  ld -> maxx = 0;
-  ld -> maxy = 0;
   ld -> area = 0;
-  ld -> leds = NULL;
-  ld -> leds_queue_size = 0;
+  ld -> label_stack = (uint32_t*)malloc(FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint32_t));
+  /* At most 8 runs per 16-row column word, and one 8-connected blob per 2x2 pixels. */
+  ld -> runs = (led_run*)malloc((FRAME_WIDTH * FRAME_HEIGHT / 2) * sizeof(led_run));
+  ld -> run_parent = (uint32_t*)malloc((FRAME_WIDTH * FRAME_HEIGHT / 2) * sizeof(uint32_t));
+  ld -> blobs = (led_blob*)malloc((FRAME_WIDTH * FRAME_HEIGHT / 4) * sizeof(led_blob));
+  ld -> roi_integral = (uint32_t*)malloc((LED_ROI_GROUPS + 1) * LED_ROI_STRIDE * sizeof(uint32_t));
+  ld -> grid_cell_size = (state->led_find_radius > 0) ? state->led_find_radius : 1;
+  ld -> grid_width = (FRAME_WIDTH / ld -> grid_cell_size) + 1;
+  ld -> grid_height = (FRAME_HEIGHT / ld -> grid_cell_size) + 1;
+  ld -> grid = (uint32_t*)malloc(ld -> grid_width * ld -> grid_height * sizeof(uint32_t));
+  if (!ld -> label_stack || !ld -> runs || !ld -> run_parent || !ld -> blobs || !ld -> roi_integral || !ld -> grid)
+    rc = -1;
+  for (uint32_t i = 0; ld -> grid && i < ld -> grid_width * ld -> grid_height; i++)
+  {
+    ld -> grid[i] = LED_NONE;
+  }
+  ld -> grid_serial = 0;
+  /* The 3x3 cells around a point cover a quarter of the frame or more, few trackers fit and the walk costs less. */
+  ld -> grid_linear = (36 * ld -> grid_cell_size * ld -> grid_cell_size) >= (FRAME_WIDTH * FRAME_HEIGHT);
+  rc |= led_table_init(& ld -> trackers, (state->led_capacity > 0) ? state->led_capacity : LED_CAPACITY);
   ld -> led_find_radius = state->led_find_radius;
   ld -> led_blob_size = state->led_blob_size;
   ld -> led_radius = state->led_radius;
   ld -> one_zero_thresh = state->led_one_zero_thresh;
   ld -> led_identified = 0;
+  ld -> roi_circle = state->led_roi_circle;
+  ld -> roi_disk.masks = NULL;
+  if (ld -> roi_circle)
+    rc |= led_roi_circle_init(& ld -> roi_disk, ld -> led_radius);
+  ld -> has_prev_frame = 0;
+  ld -> frames_missed = 0;
+  ld -> frame_gaps = 0;
+  ld -> frame_backsteps = 0;
+  ld -> worker_running = 0;
+  ld -> rt_worker = state->rt_detector;
+  ld -> rt_decoder = state->rt_decoder;
+  rc |= frame_ring_init(& ld -> ring, LED_FRAME_RING_LENGTH, sizeof(led_frame_slot));
+  ld -> acquired = NULL;
+  ld -> ring.policy = state->led_drop_policy;
+  /* MinGW has no worker thread, an event loop does without one. */
+#ifndef __MINGW32__
+  ld -> inline_processing = state->event_loop;
+#else
+  ld -> inline_processing = 1;
+#endif
+  /* Blobs are only handed over by run labeling, and only a worker hands frames to the decoder. */
+#if LED_RUN_BLOBS
+  ld -> pipeline = state->led_pipeline && !ld -> inline_processing;
+#else
+  ld -> pipeline = 0;
+#endif
+  ld -> decoder_running = 0;
+  memset(ld -> stages, 0, sizeof(ld -> stages));
+  if (ld -> pipeline)
+    rc |= frame_ring_init(& ld -> stage_ring, LED_STAGE_RING_LENGTH, sizeof(led_stage_slot));
+  ld -> parallel = NULL;
+  if (state->led_decode_threads > 1 && rc == 0)
+  {
+    ld -> parallel = (led_parallel*)malloc(sizeof(led_parallel));
+    if (!ld -> parallel || led_parallel_init(ld -> parallel, ld, state->led_decode_threads) != 0)
+    {
+      free(ld -> parallel);
+      ld -> parallel = NULL;
+      rc = -1;
+    }
+  }
+
+  if (rc != 0)
+  {
+    led_detector_destroy(ld);
+    return -1;
+  }
+  return 0;
 }
 
 void led_detector_destroy(led_detector *ld)
 {
-  queue_clean(& ld -> leds);
+  if (ld -> worker_running)
+  {
+    frame_ring_close(& ld -> ring);
+    pthread_join(ld -> worker, NULL);
+    ld -> worker_running = 0;
+  }
+  log_ring_destroy(& ld -> log);
+  frame_ring_destroy(& ld -> ring);
+  if (ld -> pipeline)
+    frame_ring_destroy(& ld -> stage_ring);
+  if (ld -> parallel)
+  {
+    led_parallel_destroy(ld -> parallel);
+    free(ld -> parallel);
+    ld -> parallel = NULL;
+  }
+  led_table_destroy(& ld -> trackers);
+  free(ld -> label_stack);
+  free(ld -> runs);
+  free(ld -> run_parent);
+  free(ld -> blobs);
+  free(ld -> roi_integral);
+  led_roi_circle_destroy(& ld -> roi_disk);
+  free(ld -> grid);
+  ld -> label_stack = NULL;
+  ld -> runs = NULL;
+  ld -> run_parent = NULL;
+  ld -> blobs = NULL;
+  ld -> roi_integral = NULL;
+  ld -> grid = NULL;
 }
 
 
-void led_detector_flood_check(led_detector *ld, uint16_t x, uint16_t y)
+/* Clear pixel (x, y) in the packed frame, returns non zero if it was set. */
+static inline uint8_t led_detector_take_pixel(uint8_t *frame, uint16_t x, uint16_t y)
 {
   uint32_t index = ((y/16) * (FRAME_WIDTH*2)) + (x*2) + ((y%16)>7);
+  uint8_t bit = frame[index] & (1 << (y&7));
+
+  frame[index] &= ~bit;
+  return bit;
+}
+
+#define LABEL_PIXEL(x, y)   (((uint32_t)(x) << 16) | (y))
+
+/*
+ Label the 8-connected blob containing (x, y) and clear it from prev_bit_frame.
+ Pixels are cleared as they are pushed, so each pixel enters the stack at most
+ once: the stack never grows past FRAME_WIDTH * FRAME_HEIGHT entries and the
+ cost is bounded by the number of lit pixels.
+*/
+void led_detector_label_blob(led_detector *ld, uint16_t x, uint16_t y, led_blob *b)
+{
+  uint8_t *frame = ld -> prev_bit_frame;
+  uint32_t *stack = ld -> label_stack;
+  uint32_t top = 0;
 
-  uint8_t bit = ld -> prev_bit_frame[index] & (1 << (y&7));
+  b -> area = 0;
+  b -> sumx = 0;
+  b -> sumy = 0;
+  b -> minx = x;
+  b -> maxx = x;
+  b -> miny = y;
+  b -> maxy = y;
 
-  if (bit)
+  if (led_detector_take_pixel(frame, x, y))
   {
-    ld -> prev_bit_frame[index] &= ~bit;
-    //ld -> prev_bit_frame[index] = 0;
-    ld->area++;
-    ld->frame_ones++;
-    
-    /* Return if already found 1's in 1/2 of the total area */
-    //if (ld -> area > ((ld -> led_radius) * 2 * (ld -> led_radius) * 2 )/2)
-    //  return;
-    if (ld -> area > 10000)
-      return;
+    stack[top++] = LABEL_PIXEL(x, y);
+  }
+
+  while (top)
+  {
+    uint32_t p = stack[--top];
+    uint16_t px = p >> 16;
+    uint16_t py = p & 0xFFFF;
 
-    if (x < ld -> minx)
-      ld -> minx = x;
-    else if (x > ld -> maxx)
-      ld -> maxx = x;
-    if (y < ld -> miny)
-      ld -> miny = y;
-    else if (y > ld -> maxy)
-      ld -> maxy = y;
+    b -> area++;
+    b -> sumx += px;
+    b -> sumy += py;
 
+    if (px < b -> minx)
+      b -> minx = px;
+    else if (px > b -> maxx)
+      b -> maxx = px;
+    if (py < b -> miny)
+      b -> miny = py;
+    else if (py > b -> maxy)
+      b -> maxy = py;
 
-    if (y > 0)
+    uint16_t x1 = (px > 0) ? (px - 1) : 0;
+    uint16_t y1 = (py > 0) ? (py - 1) : 0;
+    uint16_t x2 = (px < (FRAME_WIDTH - 1)) ? (px + 1) : px;
+    uint16_t y2 = (py < (FRAME_HEIGHT - 1)) ? (py + 1) : py;
+
+    for (uint16_t ny = y1; ny <= y2; ny++)
     {
-      if (x > 0)
+      for (uint16_t nx = x1; nx <= x2; nx++)
       {
-        // top left
-        led_detector_flood_check(ld, x - 1, y - 1);
+        if (led_detector_take_pixel(frame, nx, ny))
+        {
+          stack[top++] = LABEL_PIXEL(nx, ny);
+        }
       }
+    }
+  }
+}
+
+#if (FRAME_WIDTH % LED_TILE_SIZE) || (FRAME_HEIGHT % LED_TILE_SIZE) || (LED_TILES_X > 64)
+#error "Frames must be made of 16x16 tiles, at most 64 of them per row group."
+#endif
+
+/* OR of the 16 column words (4 x 64 bits) of one tile. */
+static inline uint64_t led_detector_tile_bits(const uint64_t *tile)
+{
+#if defined(__ARM_NEON)
+  uint64x2_t a = vorrq_u64(vld1q_u64(tile), vld1q_u64(tile + 2));
 
-      // top centre
-      led_detector_flood_check(ld, x , y - 1);
+  return vgetq_lane_u64(a, 0) | vgetq_lane_u64(a, 1);
+#else
+  return tile[0] | tile[1] | tile[2] | tile[3];
+#endif
+}
 
-      if (x < (FRAME_WIDTH - 1))
+/* Occupancy of an already packed frame, for frames that did not come through led_detector_process. */
+void led_detector_frame_occupancy(led_frame_occupancy *occ, const uint8_t *bFrame)
+{
+  const uint64_t *tile = (const uint64_t*) bFrame;
+
+  occ -> ones = 0;
+  for (uint32_t g = 0; g < LED_TILES_Y; g++)
+  {
+    occ -> tiles[g] = 0;
+    for (uint32_t t = 0; t < LED_TILES_X; t++, tile += 4)
+    {
+      if (led_detector_tile_bits(tile))
       {
-        // top right
-        led_detector_flood_check(ld, x + 1, y - 1);
+        occ -> tiles[g] |= 1ull << t;
+        for (uint32_t k = 0; k < 4; k++)
+        {
+          occ -> ones += __builtin_popcountll(tile[k]);
+        }
       }
     }
+  }
+}
 
-    if (x > 0)
-    {
-      // left
-      led_detector_flood_check(ld, x - 1, y);
-    }
+/*
+ Two pass labeling over vertical runs. Only the tiles marked in the occupancy
+ map are walked, 64 bits (4 column words) at a time, using count-trailing-zeros
+ to visit only the non-empty columns. Every column word is split into runs,
+ each run is joined with the 8-connected runs of the previous column and of
+ the row group above, then the per-blob area, bounding box and centroid sums
+ are accumulated per run.
+ Blobs are left in blobs, ld->blobs or a stage slot's, in the order a pixel
+ scan would first reach them.
+ */
+uint32_t led_detector_label_runs(led_detector *ld, const uint8_t *bFrame, const led_frame_occupancy *occ, led_blob *blobs)
+{
+  return led_detector_label_groups(ld, bFrame, occ, 0, FRAME_HEIGHT/16, blobs, NULL);
+}
 
-    if (x < (FRAME_WIDTH - 1))
-    {
-      // right
-      led_detector_flood_check(ld, x + 1, y);
-    }
+/*
+ led_detector_label_runs over row groups [g1, g2) only. Runs are stored from
+ led_detector_group_runs(g1) and blobs from led_detector_group_blobs(g1), so
+ disjoint group ranges can be labeled at the same time; run labels are
+ absolute indices into blobs. The number of runs is left in *nruns.
+ */
+uint32_t led_detector_label_groups(led_detector *ld, const uint8_t *bFrame, const led_frame_occupancy *occ, uint32_t g1, uint32_t g2, led_blob *blobs_out, uint32_t *nruns)
+{
+  led_run *runs = ld -> runs;
+  uint32_t *parent = ld -> run_parent;
+  led_blob *out = blobs_out + led_detector_group_blobs(g1);
+  /* Run covering row 15 of each column, tagged with its row group + 1. */
+  /* Banked by row group parity so the current group does not overwrite the one above. */
+  uint16_t edge_group[2][FRAME_WIDTH];
+  uint32_t edge_run[2][FRAME_WIDTH];
+  uint32_t first = led_detector_group_runs(g1);
+  uint32_t n = first;
+  uint32_t blobs = 0;
+
+  memset(edge_group, 0, sizeof(edge_group));
 
-    if (y < (FRAME_HEIGHT - 1))
+  for (uint32_t g = g1; g < g2; g++)
+  {
+    /* Runs of the last non-empty column seen in this row group. */
+    uint32_t left_x = FRAME_WIDTH;
+    uint32_t left_start = 0;
+    uint32_t left_end = 0;
+    uint64_t tiles = occ -> tiles[g];
+
+    while (tiles)
     {
-      if (x > 0)
-      {
-        // bottom left
-        led_detector_flood_check(ld, x - 1, y + 1);
-      }
-      // bottom centre
-      led_detector_flood_check(ld, x, y + 1);
+      uint32_t t = __builtin_ctzll(tiles);
+      const uint64_t *tile = (const uint64_t*) bFrame + (((g * LED_TILES_X) + t) * 4);
 
-      if (x < (FRAME_WIDTH - 1))
+      tiles &= tiles - 1;
+
+      for (uint32_t k = 0; k < 4; k++)
       {
-        // bottom right
-        led_detector_flood_check(ld, x + 1, y + 1);
+        uint64_t v = tile[k];
+
+        while (v)
+        {
+          uint32_t c = __builtin_ctzll(v) >> 4;
+          uint32_t x = (t * LED_TILE_SIZE) + (k * 4) + c;
+          uint32_t w = (v >> (c * 16)) & 0xFFFF;
+          uint32_t start = n;
+
+          v &= ~(0xFFFFull << (c * 16));
+
+          while (w)
+          {
+            uint32_t s = __builtin_ctz(w);
+            uint32_t len = __builtin_ctz(~(w >> s));
+            uint32_t mask = ((1u << len) - 1) << s;
+            uint32_t grown = (mask | (mask << 1) | (mask >> 1)) & 0xFFFF;
+
+            w &= ~mask;
+
+            runs[n].x = x;
+            runs[n].group = g;
+            runs[n].mask = mask;
+            parent[n] = n;
+
+            /* Runs touching this one in the previous column. */
+            if (left_x + 1 == x)
+            {
+              for (uint32_t i = left_start; i < left_end; i++)
+              {
+                if (runs[i].mask & grown)
+                  led_run_union(parent, n, i);
+              }
+            }
+
+            /* Runs ending on the last row of the group above. */
+            if (g > g1 && (mask & 1))
+            {
+              uint32_t x1 = (x > 0) ? (x - 1) : 0;
+              uint32_t x2 = (x < (FRAME_WIDTH - 1)) ? (x + 1) : x;
+
+              for (uint32_t i = x1; i <= x2; i++)
+              {
+                if (edge_group[(g - 1) & 1][i] == g)
+                  led_run_union(parent, n, edge_run[(g - 1) & 1][i]);
+              }
+            }
+
+            n++;
+          }
+
+          /* The run covering row 15 is the last one extracted. */
+          if (runs[n - 1].mask & 0x8000)
+          {
+            edge_group[g & 1][x] = g + 1;
+            edge_run[g & 1][x] = n - 1;
+          }
+
+          left_x = x;
+          left_start = start;
+          left_end = n;
+        }
       }
     }
   }
 
+  for (uint32_t i = first; i < n; i++)
+  {
+    uint32_t r = led_run_find(parent, i);
+    uint32_t x = runs[i].x;
+    uint32_t y = (runs[i].group * 16) + __builtin_ctz(runs[i].mask);
+    uint32_t len = __builtin_popcount(runs[i].mask);
+    led_blob *b;
+
+    if (r == i)
+    {
+      runs[i].label = led_detector_group_blobs(g1) + blobs;
+      b = &out[blobs++];
+      b -> area = 0;
+      b -> sumx = 0;
+      b -> sumy = 0;
+      b -> minx = x;
+      b -> maxx = x;
+      b -> miny = y;
+      b -> maxy = y;
+    }
+    else
+    {
+      b = &blobs_out[runs[r].label];
+    }
+
+    b -> area += len;
+    b -> sumx += x * len;
+    b -> sumy += (y * len) + ((len * (len - 1)) / 2);
+
+    if (x < b -> minx)
+      b -> minx = x;
+    if (x > b -> maxx)
+      b -> maxx = x;
+    if (y < b -> miny)
+      b -> miny = y;
+    if ((y + len - 1) > b -> maxy)
+      b -> maxy = y + len - 1;
+  }
+
+  if (nruns)
+    *nruns = n - first;
+  return blobs;
 }
 
-void led_detector_check_and_add_led(led_detector *ld, uint16_t x, uint16_t y)
+void led_detector_add_blob(led_detector *ld, const led_blob *b)
 {
-  ld -> minx = x;
-  ld -> maxx = x;
-  ld -> miny = y;
-  ld -> maxy = y;
-  ld -> area = 0;
-
-  led_detector_flood_check(ld, x, y);
+  uint16_t x = (b -> minx + b -> maxx)/2;
+  uint16_t y = (b -> miny + b -> maxy)/2;
 
-  x = (ld -> minx + ld -> maxx)/2;
-  y = (ld -> miny + ld -> maxy)/2;
+  ld -> area = b -> area;
+  ld -> frame_ones += b -> area;
 
   if (ld -> area > ld -> led_blob_size)
   {
-    led_found = 0;
-    led *found = led_detector_find_led(ld, x, y);
+    led_table *t = &ld -> trackers;
+    uint32_t found = led_detector_find_led(ld, x, y);
     ld->frame_leds++;
-    if (!found)
+    if (found == LED_NONE)
     {
-      led *l = led_create_vals(ld, x, y);
-      led_detector_add_led(ld, l);
+      /* Dropped, and counted in trackers.exhausted, while the tracker table is full. */
+      led_detector_add_led(ld, x, y);
     } else {
-      found->x = (x + found->x)/2;
-      found->y = (y + found->y)/2;      
+      led_detector_move_led(ld, found, (x + t->x[found])/2, (y + t->y[found])/2);
     }
   } else {
     ld -> frame_noise++;
   }
+}
+
+void led_detector_check_and_add_led(led_detector *ld, uint16_t x, uint16_t y)
+{
+  led_blob b;
+
+  led_detector_label_blob(ld, x, y, &b);
+  led_detector_add_blob(ld, &b);
+}
+
+/* Keep the first two bytes of every RGBA pixel and note which 16x16 tiles have anything lit. */
+void led_detector_unpack_frame(uint8_t *bFrame, const uint8_t *readback, led_frame_occupancy *occ)
+{
+  uint16_t *dst = (uint16_t*) bFrame;
+
+  occ -> ones = 0;
+  for (int j = 0; j < LED_TILES_Y; j++) {
+    const uint8_t *src = readback + (j*FRAME_WIDTH*4);
+    uint64_t tiles = 0;
+
+    for (int t = 0; t < LED_TILES_X; t++) {
+      uint32_t lit = 0;
+
+      for (int i = 0; i < LED_TILE_SIZE; i++, src += 4) {
+        dst[i] = src[0] | (src[1] << 8);
+        lit |= dst[i];
+      }
+
+      if (lit) {
+        tiles |= 1ull << t;
+        for (int i = 0; i < LED_TILE_SIZE; i++) {
+          occ -> ones += __builtin_popcount(dst[i]);
+        }
+      }
+      dst += LED_TILE_SIZE;
+    }
+    occ -> tiles[j] = tiles;
+  }
+}
+
+/*
+ Take the frame's number and time, and let the trackers know about frames
+ missing before it. A number at or before the previous one, a camera
+ restart or recordings replayed back to back, is no gap, it is only counted.
+ */
+static void led_detector_begin_decode(led_detector *ld, const frame_info *finfo)
+{
+  uint32_t missed = 0;
+
+  if (ld -> has_prev_frame)
+  {
+    if ((int32_t)(finfo->frame_number - ld -> prev_frame_number) > 0)
+      missed = finfo->frame_number - ld -> prev_frame_number - 1;
+    else
+      ld -> frame_backsteps++;
+  }
+  if (missed)
+  {
+    ld -> frames_missed += missed;
+    ld -> frame_gaps++;
+  }
+  led_table_gap(& ld -> trackers, missed, finfo->frame_time - ld -> prev_frame_time);
+
+  ld -> frame_time = finfo->frame_time;
+  ld -> frame_number = finfo->frame_number;
+  ld -> prev_frame_number = finfo->frame_number;
+  ld -> prev_frame_time = finfo->frame_time;
+  ld -> has_prev_frame = 1;
+}
+
+static inline uint64_t led_detector_now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static inline void led_detector_stage_done(led_stage_stats *s, uint64_t t0)
+{
+  uint64_t busy = led_detector_now_us() - t0;
+
+  s -> frames++;
+  s -> busy_us_sum += busy;
+  if (busy > s -> busy_us_max)
+    s -> busy_us_max = busy;
+}
+
+/*
+ Decode stage of the pipeline: associate each labeled frame of the stage ring
+ with the trackers and decode it, in order, until the ring is closed. The
+ slot is held until the frame is decoded, the ROI sums read its bit frame.
+ */
+static void* led_detector_decode_worker(void *args)
+{
+  led_detector *ld = (led_detector *)args;
+  led_stage_slot *slot;
+
+  rt_thread_apply(& ld -> rt_decoder, "decoder", ld -> log.out);
+
+  while ((slot = (led_stage_slot*)frame_ring_wait(& ld -> stage_ring)))
+  {
+    uint64_t t0 = led_detector_now_us();
+
+    led_detector_begin_decode(ld, &slot -> info);
+    led_detector_detect_labeled(ld, slot -> bit_frame, &slot -> info.occupancy, slot -> blobs, slot -> blob_count);
+    led_detector_decode(ld, slot -> bit_frame);
+    frame_ring_release(& ld -> stage_ring);
+
+    led_detector_stage_done(& ld -> stages[LED_STAGE_DECODE], t0);
+  }
 
+  return NULL;
 }
 
-typedef struct frame_info_t {
-  double frame_time;
-  uint32_t frame_number;
-} frame_info;
+/*
+ Discovery stage of the pipeline: unpack the frame into a stage ring slot and
+ label it there, waiting for the decoder to free a slot when it is behind.
+ Labeling does not depend on the trackers, so it runs ahead by a frame while
+ association, which needs the previous frame's removals, stays with decoding.
+ */
+static void led_detector_discover(led_detector *ld, led_frame_slot *slot)
+{
+  led_stage_slot *out = (led_stage_slot*)frame_ring_acquire_wait(& ld -> stage_ring);
+  uint64_t t0 = led_detector_now_us();
+
+  if (!out)
+  {
+    frame_ring_release(& ld -> ring);
+    return;
+  }
 
-pthread_t thread;
-uint8_t diff_frame_queue[128][FRAME_HEIGHT * FRAME_WIDTH / 8];
-frame_info frame_info_queue[128];
-uint32_t fq_start = 0;
-uint32_t fq_end = 0;
-uint32_t fq_size = 0;
-uint8_t keep_alive;
+  out -> info = slot -> info;
+  led_detector_unpack_frame(out -> bit_frame, slot -> readback, &out -> info.occupancy);
+  frame_ring_release(& ld -> ring);
+  if (ld -> recorder)
+    frame_recorder_add(ld -> recorder, out -> bit_frame, out -> info.pts, out -> info.frame_number, out -> info.occupancy.ones);
 
-uint32_t led_detector_process_internal(led_detector *ld, uint8_t *diffFrame, frame_info *finfo);
+  out -> blob_count = 0;
+  if (out -> info.occupancy.ones)
+    out -> blob_count = led_detector_label_runs(ld, out -> bit_frame, &out -> info.occupancy, out -> blobs);
 
+  led_detector_stage_done(& ld -> stages[LED_STAGE_DISCOVER], t0);
+  frame_ring_publish(& ld -> stage_ring);
+}
+
+/* Unpack a claimed slot, hand it back and process the frame; the worker's job when it is not pipelined. */
+static void led_detector_process_slot(led_detector *ld, led_frame_slot *slot)
+{
+  uint64_t t0 = led_detector_now_us();
+  frame_info info = slot -> info;
+
+  led_detector_unpack_frame(ld -> bit_frame, slot -> readback, &info.occupancy);
+  frame_ring_release(& ld -> ring);
+  if (ld -> recorder)
+    frame_recorder_add(ld -> recorder, ld -> bit_frame, info.pts, info.frame_number, info.occupancy.ones);
+
+  led_detector_process_internal(ld, ld -> bit_frame, &info);
+  led_detector_stage_done(& ld -> stages[LED_STAGE_DISCOVER], t0);
+}
+
+/*
+ Consume the frame ring in order, sleeping while it is empty, until it is
+ closed. Each slot is unpacked straight from the readback memory, the one
+ copy a frame needs, and handed back before the frame is processed.
+ */
 void* led_detector_process_worker(void *args)
 {
   led_detector *ld = (led_detector *)args;
-  while (fq_size || keep_alive)
+  led_frame_slot *slot;
+
+  rt_thread_apply(& ld -> rt_worker, "detector", ld -> log.out);
+
+  if (ld -> pipeline && pthread_create(& ld -> decoder, NULL, led_detector_decode_worker, ld) == 0)
+    ld -> decoder_running = 1;
+
+  while ((slot = (led_frame_slot*)frame_ring_wait(& ld -> ring)))
   {
-    if (fq_size)
-    {
-      __sync_fetch_and_sub(&fq_size, 1);
-      led_detector_process_internal(ld, diff_frame_queue[fq_end], &frame_info_queue[fq_end]);
-      fq_end = (fq_end + 1) & 127;
-    } else {
-      usleep(1000);
-    }
+    if (ld -> decoder_running)
+      led_detector_discover(ld, slot);
+    else
+      led_detector_process_slot(ld, slot);
+  }
+
+  /* Let the decoder drain what was labeled. */
+  if (ld -> decoder_running)
+  {
+    frame_ring_close(& ld -> stage_ring);
+    pthread_join(ld -> decoder, NULL);
+    ld -> decoder_running = 0;
   }
 
   return NULL;
 }
 
+/* Process every queued frame on the calling thread, for an event loop or MinGW where there is no worker. */
+void led_detector_process_queued(led_detector *ld)
+{
+  led_frame_slot *slot;
+
+  while ((slot = (led_frame_slot*)frame_ring_take(& ld -> ring)))
+    led_detector_process_slot(ld, slot);
+}
+
 void led_detector_process_worker_thread(led_detector *ld)
 {
-  pthread_create(&thread, NULL, led_detector_process_worker, ld);
+  /* From here on the GL and detector threads only queue their output. */
+  log_ring_start(& ld -> log);
+  if (pthread_create(& ld -> worker, NULL, led_detector_process_worker, ld) == 0)
+    ld -> worker_running = 1;
 }
 
-uint32_t led_detector_process(led_detector *ld, uint8_t *bFrame, double frame_time, uint32_t frame_number)
+/*
+ Readback memory of the next frame, a free ring slot the GL thread reads
+ the frame into. When the worker is a whole ring behind, the ring's drop
+ policy decides: NULL and this frame is missed, the oldest queued frame is
+ missed instead, or the GL thread waits. Acquiring again before publishing
+ returns the same slot.
+ */
+uint8_t* led_detector_frame_acquire(led_detector *ld)
 {
-  if (fq_size < 127) {
-    int l = 0;
-    for (int j = 0; j < FRAME_HEIGHT/16; j++) {
-      for (int i = 0; i < FRAME_WIDTH*4; i+=4) {
-        diff_frame_queue[fq_start][l] = bFrame[i + (j*FRAME_WIDTH*4)];
-        diff_frame_queue[fq_start][l+1] = bFrame[i + 1 + (j*FRAME_WIDTH*4)];
-        l+=2;
-      }
-    }
+  uint32_t overwritten = ld -> ring.stats.overwritten;
+  led_frame_slot *slot = (led_frame_slot*)frame_ring_acquire(& ld -> ring);
 
-    frame_info_queue[fq_start].frame_time = frame_time;
-    frame_info_queue[fq_start].frame_number = frame_number;
-    fq_start = (fq_start + 1) & 127;
-    __sync_fetch_and_add(&fq_size, 1);
-  }
-  else
+  if (!slot || ld -> ring.stats.overwritten != overwritten)
   {
-    fprintf(stdout, "Missed %d\n", fq_start);
-    fflush(stdout);
+    log_printf(& ld -> log, "Missed %d\n", ld -> ring.stats.dropped + ld -> ring.stats.overwritten);
   }
-#ifndef __MINGW32__
-  if (keep_alive == 0) {
-    keep_alive = 1;
+
+  ld -> acquired = slot;
+  return slot ? slot -> readback : NULL;
+}
+
+/* Hand the acquired slot to the worker, nothing to do when led_detector_frame_acquire had none. */
+void led_detector_frame_publish(led_detector *ld, double frame_time, uint32_t frame_number)
+{
+  led_frame_slot *slot = ld -> acquired;
+
+  if (!slot)
+    return;
+  ld -> acquired = NULL;
+
+  /* Milliseconds back to the camera's microseconds, the trackers' clock wrapping at 32 bits. */
+  slot -> info.pts = (uint64_t)((frame_time * 1000.0) + 0.5);
+  slot -> info.frame_time = (uint32_t)slot -> info.pts;
+  slot -> info.frame_number = frame_number;
+  frame_ring_publish(& ld -> ring);
+
+  if (ld -> inline_processing)
+    led_detector_process_queued(ld);
+  else if (ld -> worker_running == 0)
     led_detector_process_worker_thread(ld);
+}
+
+/* Queue a frame read back into the caller's own buffer, at the cost of copying it into a slot. */
+uint32_t led_detector_process(led_detector *ld, uint8_t *bFrame, double frame_time, uint32_t frame_number)
+{
+  uint8_t *readback = led_detector_frame_acquire(ld);
+
+  if (readback) {
+    memcpy(readback, bFrame, LED_READBACK_BYTES);
+    led_detector_frame_publish(ld, frame_time, frame_number);
   }
-#else
-  led_detector_process_worker(ld);
-#endif
   return 0;
 }
 
-#if DEBUG_LUMINENCE_THRESH
-uint32_t frame_count = 0;
-uint32_t total_ones[32];
-#endif /* DEBUG_LUMINENCE_THRESH */
-
-void led_detector_detect_leds(led_detector *ld, uint8_t *bFrame)
+/* Start discovering a frame, zero when there is nothing to associate: the first frame, or nothing lit. */
+static uint32_t led_detector_begin_frame(led_detector *ld, uint8_t *bFrame, const led_frame_occupancy *occ)
 {
   const uint32_t bitframeLength =  (FRAME_HEIGHT * FRAME_WIDTH)/8;
-  uint32_t *curr, *worker;
-  //uint32_t *end;
   if (ld -> is_first_frame) {
     memcpy(ld -> prev_bit_frame, bFrame, bitframeLength);
     ld -> is_first_frame = 0;
-    return;
+    return 0;
   }
   
-  curr = (uint32_t*) bFrame;
-  worker = (uint32_t*) ld -> prev_bit_frame;
-
-  memcpy(worker, curr, bitframeLength);
-
   ld -> frame_ones = 0;
   ld -> frame_leds = 0;
   ld -> frame_noise = 0;
 
-  for (uint32_t i = 0; i < FRAME_HEIGHT; i+=16)
+  /* Nothing lit, nothing to discover. */
+  return occ -> ones != 0;
+}
+
+void led_detector_add_blobs(led_detector *ld, const led_blob *blobs, uint32_t count)
+{
+  for (uint32_t b = 0; b < count; b++)
   {
-    for (uint32_t j = 0; j < FRAME_WIDTH*2; j+=4)
+    led_detector_add_blob(ld, &blobs[b]);
+  }
+}
+
+/* led_detector_detect_leds for a frame whose blobs were already labeled, by the discovery stage. */
+void led_detector_detect_labeled(led_detector *ld, uint8_t *bFrame, const led_frame_occupancy *occ, const led_blob *blobs, uint32_t count)
+{
+  if (led_detector_begin_frame(ld, bFrame, occ))
+    led_detector_add_blobs(ld, blobs, count);
+}
+
+void led_detector_detect_leds(led_detector *ld, uint8_t *bFrame, const led_frame_occupancy *occ)
+{
+  if (!led_detector_begin_frame(ld, bFrame, occ))
+    return;
+
+#if LED_RUN_BLOBS
+  /* Runs are read straight from the frame, nothing is cleared so no working copy is needed. */
+  uint32_t blobs = ld -> parallel ? led_parallel_label(ld -> parallel, bFrame, occ) : led_detector_label_runs(ld, bFrame, occ, ld -> blobs);
+
+  led_detector_add_blobs(ld, ld -> blobs, blobs);
+#else
+  const uint32_t bitframeLength =  (FRAME_HEIGHT * FRAME_WIDTH)/8;
+  uint64_t *worker = (uint64_t*) ld -> prev_bit_frame;
+
+  memcpy(worker, bFrame, bitframeLength);
+
+  for (uint32_t g = 0; g < LED_TILES_Y; g++)
+  {
+    uint64_t tiles = occ -> tiles[g];
+
+    while (tiles)
     {
-      uint32_t word = *worker;
-      if (word)
+      uint32_t t = __builtin_ctzll(tiles);
+      uint64_t *tile = worker + (((g * LED_TILES_X) + t) * 4);
+
+      tiles &= tiles - 1;
+
+      for (uint32_t k = 0; k < 4; k++)
       {
-        for (uint32_t k = 0; k < 32; k++ )
+        /* Labeling clears the seed and its neighbours, so re-read the word after each blob. */
+        uint64_t word;
+
+        while ((word = tile[k]))
         {
-          word = *worker;
-          if (word & (1 << k ))
-          {
-            led_detector_check_and_add_led(ld, j/2 + k/16, i + k%16);
-          }
+          uint32_t b = __builtin_ctzll(word);
+          led_detector_check_and_add_led(ld, (t * LED_TILE_SIZE) + (k * 4) + (b >> 4), (g * 16) + (b & 15));
         }
       }
-      worker++;
     }
   }
+#endif /* LED_RUN_BLOBS */
 #if DEBUG_LUMINENCE_THRESH
-  if (frame_count == 32) {
+  if (ld -> luminence_frames == 32) {
+    char line[32 * 12];
+    int length = 0;
+
     for (int i = 0; i < 32; i++) {
-      fprintf(stdout, "%04d ", total_ones[i]);
+      length += snprintf(line + length, sizeof(line) - length, "%04d ", ld -> luminence_ones[i]);
     }
-    fprintf(stdout, "\n");
-    fflush(stdout);
-    frame_count = 0;
+    log_printf(& ld -> log, "%s\n", line);
+    ld -> luminence_frames = 0;
   }
-  total_ones[frame_count] = ld->frame_ones;
-  frame_count++;
+  ld -> luminence_ones[ld -> luminence_frames] = ld->frame_ones;
+  ld -> luminence_frames++;
 #endif /* DEBUG_LUMINENCE_THRESH */
   /* restore the original frame */
   //memcpy(ld -> prev_bit_frame, bFrame, bitframeLength);
 }
 
+/* Bounding box of tracker i, [x1, x2) x [y1, y2). */
+static inline void led_detector_roi_box(led_table *t, uint32_t i, uint32_t *x1, uint32_t *y1, uint32_t *x2, uint32_t *y2)
+{
+  uint32_t x = t -> x[i];
+  uint32_t y = t -> y[i];
+  uint32_t r = t -> led_radius[i];
+
+  *x1 = (x > r) ? (x - r) : 0;
+  *y1 = (y > r) ? (y - r) : 0;
+  *x2 = ((x + r) < FRAME_WIDTH  ) ? (x + r) : (FRAME_WIDTH);
+  *y2 = ((y + r) < FRAME_HEIGHT ) ? (y + r) : (FRAME_HEIGHT);
+}
+
+#if (LED_ROI_GROUPS > 63)
+#error "The covered group mask of led_detector_roi_sums holds at most 63 row groups."
+#endif
+
+/*
+ Count the 1's within led_radius of every tracker. Each row group of the
+ disk is one masked span of column words, up to twice the time of the
+ bounding square, see led_roi_count_circle.
+ */
+static void led_detector_roi_circle_sums(led_detector *ld, uint8_t *bFrame)
+{
+  led_table *t = &ld -> trackers;
+
+  for (uint32_t i = 0; i < t -> count; i++)
+  {
+    t -> sum[i] = led_roi_count_circle(bFrame, & ld -> roi_disk, t -> x[i], t -> y[i]);
+  }
+}
+
+/*
+ Count of tracker i alone, the same value led_detector_roi_sums leaves in
+ t->sum[i]. Only reads the detector, so several threads can count their own
+ trackers at once.
+ */
+uint32_t led_detector_roi_sum(led_detector *ld, const uint8_t *bFrame, uint32_t i)
+{
+  led_table *t = &ld -> trackers;
+  uint32_t x1, y1, x2, y2;
+
+  if (ld -> roi_circle)
+    return led_roi_count_circle(bFrame, & ld -> roi_disk, t -> x[i], t -> y[i]);
+
+  led_detector_roi_box(t, i, &x1, &y1, &x2, &y2);
+  return led_roi_count(bFrame, x1, y1, x2, y2);
+}
+
+/*
+ Count the 1's in every tracker's bounding box. A summed area table of the
+ column word popcounts is built over the 16-row groups that trackers' boxes
+ fully cover, so the whole groups of a box cost four lookups and only its
+ partial first and last group are counted with led_roi_count_span. Groups
+ no box fully covers are skipped and each run of covered groups starts its
+ own table at zero; a box never spans two runs so the differences stay
+ exact. When counting the boxes directly is cheaper than building the
+ table, see LED_ROI_SPAN_SPEEDUP, they are all counted directly instead.
+ */
+void led_detector_roi_sums(led_detector *ld, uint8_t *bFrame)
+{
+  led_table *t = &ld -> trackers;
+  uint32_t *sat = ld -> roi_integral;
+  uint64_t covered = 0;
+  uint32_t box_words = 0;
+  uint32_t x1, y1, x2, y2;
+
+  if (t -> count == 0)
+    return;
+
+  if (ld -> roi_circle)
+  {
+    led_detector_roi_circle_sums(ld, bFrame);
+    return;
+  }
+
+  /* Boxes that cover no whole group, every box at LED_RADIUS, gain nothing from the table and are counted right away. */
+  for (uint32_t i = 0; i < t -> count; i++)
+  {
+    uint32_t g1, g2;
+
+    led_detector_roi_box(t, i, &x1, &y1, &x2, &y2);
+    g1 = (y1 + 15) / 16;
+    g2 = y2 / 16;
+    if (g1 >= g2)
+    {
+      t -> sum[i] = led_roi_count(bFrame, x1, y1, x2, y2);
+      continue;
+    }
+    covered |= ((1ull << (g2 - g1)) - 1) << g1;
+    box_words += (x2 - x1) * (((y2 + 15) / 16) - (y1 / 16));
+  }
+
+  if (covered == 0)
+    return;
+
+  if (box_words <= (uint32_t)__builtin_popcountll(covered) * FRAME_WIDTH * LED_ROI_SPAN_SPEEDUP)
+  {
+    for (uint32_t i = 0; i < t -> count; i++)
+    {
+      led_detector_roi_box(t, i, &x1, &y1, &x2, &y2);
+      if (((y1 + 15) / 16) < (y2 / 16))
+        t -> sum[i] = led_roi_count(bFrame, x1, y1, x2, y2);
+    }
+    return;
+  }
+
+  while (covered)
+  {
+    uint32_t g = __builtin_ctzll(covered);
+    uint32_t end = g + __builtin_ctzll(~(covered >> g));
+
+    covered &= ~(((1ull << (end - g)) - 1) << g);
+
+    memset(sat + (g * LED_ROI_STRIDE), 0, LED_ROI_STRIDE * sizeof(uint32_t));
+    for (; g < end; g++)
+    {
+      const uint16_t *row = led_roi_group(bFrame, g);
+      const uint32_t *above = sat + (g * LED_ROI_STRIDE);
+      uint32_t *below = sat + ((g + 1) * LED_ROI_STRIDE);
+      uint32_t run = 0;
+
+      below[0] = 0;
+      for (uint32_t x = 0; x < FRAME_WIDTH; x++)
+      {
+        run += led_popcount8[row[x] & 0xFF] + led_popcount8[row[x] >> 8];
+        below[x + 1] = above[x + 1] + run;
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < t -> count; i++)
+  {
+    uint32_t g1, g2, sum;
+
+    led_detector_roi_box(t, i, &x1, &y1, &x2, &y2);
+    g1 = (y1 + 15) / 16;
+    g2 = y2 / 16;
+    if (g1 >= g2)
+      continue;
+
+    sum = sat[(g2 * LED_ROI_STRIDE) + x2] - sat[(g1 * LED_ROI_STRIDE) + x2]
+        - sat[(g2 * LED_ROI_STRIDE) + x1] + sat[(g1 * LED_ROI_STRIDE) + x1];
+    if (y1 % 16)
+      sum += led_roi_count_span(led_roi_group(bFrame, y1 / 16) + x1, x2 - x1, led_roi_row_mask(y1 % 16, 16));
+    if (y2 % 16)
+      sum += led_roi_count_span(led_roi_group(bFrame, g2) + x1, x2 - x1, led_roi_row_mask(0, y2 % 16));
+    t -> sum[i] = sum;
+  }
+}
+
 uint32_t led_detector_process_internal(led_detector *ld, uint8_t *diffFrame, frame_info *finfo)
 {
+  led_detector_begin_decode(ld, finfo);
+  led_detector_detect_leds(ld, diffFrame, &finfo->occupancy);
+
+  return led_detector_decode(ld, diffFrame);
+}
+
+/* Binary record of identified tracker i, world is NULL when it has no world coordinates. */
+static void led_detector_stream_led(led_detector *ld, uint32_t i, const float *world)
+{
+  led_table *t = &ld -> trackers;
+  uint32_t average = t->area_sum[i]/t->ones[i];
+  uint32_t thresh = t->one_zero_thresh[i];
+  detection_record r;
+
+  memset(&r, 0, sizeof(r));
+  r.id = t->id[i] & LED_DATA_MASK;
+  r.voltage = !!(t->id[i] & LED_DATA_MSB);
+  r.confidence = (average > thresh) ? (uint8_t)(((average - thresh) * 255) / average) : 0;
+  r.x = t->x[i];
+  r.y = t->y[i];
+  r.area = t->cold[i].area;
+  r.frame_number = ld -> frame_number;
+  r.frame_time = ld -> frame_time;
+  if (world)
+  {
+    memcpy(r.world, world, sizeof(r.world));
+    r.flags |= DETECTION_WORLD;
+  }
+  detection_stream_add(ld -> stream, &r);
+}
+
+/* Sum and decode the trackers over an associated frame, report the identified LEDs and retire the finished ones. */
+uint32_t led_detector_decode(led_detector *ld, uint8_t *diffFrame)
+{
+  led_table *t = &ld -> trackers;
   uint32_t count = 0;
-  ld -> frame_time = finfo->frame_time;
-  ld -> frame_number = finfo->frame_number;
-  led_detector_detect_leds(ld, diffFrame);
 #ifdef LOC_ENABLE_SAVE_IMAGE  
-  led_detected = 0;
+  ld -> led_detected = (t -> count > 0);
 #endif /* LOC_ENABLE_SAVE_IMAGE */
-  for(queue_node **n = &ld->leds; *n; ) {
-    led *l = (led*)(*n) -> data;
-#ifdef LOC_ENABLE_SAVE_IMAGE    
-    led_detected = 1;
-#endif /* LOC_ENABLE_SAVE_IMAGE */
-    if (! (l->id))
+
+  if (ld -> parallel)
+  {
+    led_parallel_decode(ld -> parallel, diffFrame);
+  }
+  else
+  {
+    led_detector_roi_sums(ld, diffFrame);
+    led_process(t, ld -> frame_time);
+  }
+
+  /* Report newest first. */
+  for (uint32_t i = t -> count; i-- > 0; )
+  {
+    if (t -> status[i] == 1)
     {
-      uint8_t valid = led_process(l, diffFrame, finfo->frame_time, ld->is_new_frame);
-      if (valid)
-      {
-        if (valid == 1) {
-          ld->led_identified = 1;
-          fprintf(stdout, "%d: (%d, %d, %d) - Area: %d, Average Area: %d, Frame: %d, Frame Noise: %d, qsize: %d\n", l->id & LED_DATA_MASK, l->id, l->x, l->y, l->area, l->area_sum/l->ones, l->start_frame_index, ld -> frame_noise, ld->leds_queue_size);
-          
-          fflush(stdout);
-          count++;
-        }
-        free(l);
-        queue_remove(n);
-        ld -> leds_queue_size -= 1;
-      }
+      led *l = &t -> cold[i];
+      float world[3];
+      int has_world = ld -> world && world_map_project(ld -> world, t->id[i] & LED_DATA_MASK, t->x[i], t->y[i], world) == 0;
+
+      ld->led_identified = 1;
+      if (has_world)
+        log_printf(& ld -> log, "%d: (%d, %d, %d) - Area: %d, Average Area: %d, Frame: %d, Frame Noise: %d, qsize: %d, World: (%.1f, %.1f, %.1f)\n", t->id[i] & LED_DATA_MASK, t->id[i], t->x[i], t->y[i], l->area, t->area_sum[i]/t->ones[i], l->start_frame_index, ld -> frame_noise, t->count, world[0], world[1], world[2]);
       else
-      {
-        n = &((*n) -> next);
-      }
+        log_printf(& ld -> log, "%d: (%d, %d, %d) - Area: %d, Average Area: %d, Frame: %d, Frame Noise: %d, qsize: %d\n", t->id[i] & LED_DATA_MASK, t->id[i], t->x[i], t->y[i], l->area, t->area_sum[i]/t->ones[i], l->start_frame_index, ld -> frame_noise, t->count);
+      if (ld -> stream)
+        led_detector_stream_led(ld, i, has_world ? world : NULL);
+      count++;
     }
   }
+  if (ld -> stream)
+    detection_stream_commit(ld -> stream);
+
+  led_detector_remove_leds(ld);
   
   return count;
 }
 
-uint8_t led_detector_add_led(led_detector *ld, led* d)
+static inline uint32_t led_detector_grid_cell(led_detector *ld, uint16_t x, uint16_t y)
 {
-    queue_add(&ld->leds, d);
-    ld -> leds_queue_size += 1;
-    return 0;
+  return ((y / ld -> grid_cell_size) * ld -> grid_width) + (x / ld -> grid_cell_size);
+}
+
+/* Tracker a was added after b, serials wrap and are only compared as differences. */
+#define led_detector_grid_newer(t, a, b) ((int32_t)((t) -> grid_serial[a] - (t) -> grid_serial[b]) > 0)
+
+/* Cell lists are kept newest first (highest grid_serial at the head). */
+static void led_detector_grid_insert(led_detector *ld, uint32_t i)
+{
+  led_table *t = &ld -> trackers;
+  uint32_t cell = led_detector_grid_cell(ld, t -> x[i], t -> y[i]);
+  uint32_t prev = LED_NONE;
+  uint32_t next = ld -> grid[cell];
+
+  /* New trackers go straight to the head, only a tracker moved in from another cell can walk. */
+  while (next != LED_NONE && led_detector_grid_newer(t, next, i))
+  {
+    prev = next;
+    next = t -> grid_next[next];
+  }
+
+  t -> grid_cell[i] = cell;
+  t -> grid_prev[i] = prev;
+  t -> grid_next[i] = next;
+  if (next != LED_NONE)
+    t -> grid_prev[next] = i;
+  if (prev != LED_NONE)
+    t -> grid_next[prev] = i;
+  else
+    ld -> grid[cell] = i;
+}
+
+static void led_detector_grid_remove(led_detector *ld, uint32_t i)
+{
+  led_table *t = &ld -> trackers;
+
+  if (t -> grid_prev[i] != LED_NONE)
+    t -> grid_next[t -> grid_prev[i]] = t -> grid_next[i];
+  else
+    ld -> grid[t -> grid_cell[i]] = t -> grid_next[i];
+  if (t -> grid_next[i] != LED_NONE)
+    t -> grid_prev[t -> grid_next[i]] = t -> grid_prev[i];
+}
+
+/* Point the cell list neighbours of a tracker that was moved to slot i at its new slot. */
+static void led_detector_grid_relink(led_detector *ld, uint32_t i)
+{
+  led_table *t = &ld -> trackers;
+
+  if (t -> grid_prev[i] != LED_NONE)
+    t -> grid_next[t -> grid_prev[i]] = i;
+  else
+    ld -> grid[t -> grid_cell[i]] = i;
+  if (t -> grid_next[i] != LED_NONE)
+    t -> grid_prev[t -> grid_next[i]] = i;
+}
+
+/* Start tracking an LED at (x, y), returns its slot or LED_NONE when the tracker table is full. */
+uint32_t led_detector_add_led(led_detector *ld, uint16_t x, uint16_t y)
+{
+  uint32_t i = led_create_vals(ld, x, y);
+
+  if (i != LED_NONE)
+  {
+    ld -> trackers.grid_serial[i] = ld -> grid_serial++;
+    led_detector_grid_insert(ld, i);
+  }
+  return i;
+}
+
+/*
+ Drop every tracker whose led_process status is non zero. The survivors are
+ packed down in order, so the table stays sorted oldest first and slot
+ indices stay below count.
+ */
+void led_detector_remove_leds(led_detector *ld)
+{
+  led_table *t = &ld -> trackers;
+  uint32_t n = 0;
+
+  for (uint32_t i = 0; i < t -> count; i++)
+  {
+    if (t -> status[i])
+    {
+      led_detector_grid_remove(ld, i);
+    }
+    else
+    {
+      if (n != i)
+      {
+        led_table_move(t, n, i);
+        led_detector_grid_relink(ld, n);
+      }
+      n++;
+    }
+  }
+  t -> count = n;
+}
+
+/* Trackers must only be moved through here so they stay in the right grid cell. */
+void led_detector_move_led(led_detector *ld, uint32_t i, uint16_t x, uint16_t y)
+{
+  led_table *t = &ld -> trackers;
+
+  t -> x[i] = x;
+  t -> y[i] = y;
+  if (led_detector_grid_cell(ld, x, y) != t -> grid_cell[i])
+  {
+    led_detector_grid_remove(ld, i);
+    led_detector_grid_insert(ld, i);
+  }
 }
 
 #define min_clamp(v, m) (((v) <= (m))?0:((v)-(m)))
 
-led* led_detector_find_led(led_detector *ld, uint16_t x, uint16_t y)
+/*
+ Find a tracker within led_find_radius of (x, y). Cells are led_find_radius
+ wide, so only the 3x3 cells around (x, y) can hold a match. When several
+ trackers match, the most recently added one wins, as it did when the whole
+ queue was walked from its head; cells are sorted newest first so each cell
+ walk stops at its first match or at the first tracker older than the best.
+ With grid_linear set the table is walked newest first instead.
+ */
+uint32_t led_detector_find_led(led_detector *ld, uint16_t x, uint16_t y)
 {
-  led* found = 0;
-  for(queue_node **n = &ld->leds; *n; n = &((*n) -> next))
+  led_table *t = &ld -> trackers;
+  uint32_t found = LED_NONE;
+  uint32_t cx, cy, x1, y1, x2, y2;
+
+  if (ld -> grid_linear)
+  {
+    for (uint32_t l = t -> count; l-- > 0; )
+    {
+      if ( (t -> x[l] + ld->led_find_radius) >= x &&
+           min_clamp(t -> x[l], ld->led_find_radius) <= x &&
+           (t -> y[l] + ld->led_find_radius) >= y &&
+           min_clamp(t -> y[l], ld->led_find_radius) <= y )
+        return l;
+    }
+    return LED_NONE;
+  }
+
+  cx = x / ld -> grid_cell_size;
+  cy = y / ld -> grid_cell_size;
+  x1 = (cx > 0) ? (cx - 1) : 0;
+  y1 = (cy > 0) ? (cy - 1) : 0;
+  x2 = (cx + 1 < ld -> grid_width) ? (cx + 1) : cx;
+  y2 = (cy + 1 < ld -> grid_height) ? (cy + 1) : cy;
+  for (uint32_t j = y1; j <= y2; j++)
   {
-    led* l = (led*) (*n) -> data;
-    if ( (l -> x + ld->led_find_radius) >= x &&
-         min_clamp(l -> x, ld->led_find_radius) <= x &&
-         (l -> y + ld->led_find_radius) >= y &&
-         min_clamp(l -> y, ld->led_find_radius) <= y )
+    for (uint32_t i = x1; i <= x2; i++)
     {
-      found = l;
-      break;
+      for (uint32_t l = ld -> grid[(j * ld -> grid_width) + i]; l != LED_NONE; l = t -> grid_next[l])
+      {
+        if (found != LED_NONE && led_detector_grid_newer(t, found, l))
+          break;
+
+        if ( (t -> x[l] + ld->led_find_radius) >= x &&
+             min_clamp(t -> x[l], ld->led_find_radius) <= x &&
+             (t -> y[l] + ld->led_find_radius) >= y &&
+             min_clamp(t -> y[l], ld->led_find_radius) <= y )
+        {
+          found = l;
+          break;
+        }
+      }
     }
   }
   return found;
 }
-
@@ -0,0 +1,295 @@
+/*
+ ============================================================================
+ Name        : led-parallel.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Stripe parallel LED labeling and decoding
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include "led-parallel.h"
+
+#define LED_JOB_QUIT      0
+#define LED_JOB_LABEL     1
+#define LED_JOB_DECODE    2
+
+static void led_parallel_decode_stripe(led_parallel *p, led_stripe *s)
+{
+  led_detector *ld = p -> ld;
+  led_table *t = &ld -> trackers;
+
+  for (uint32_t k = 0; k < s -> tracker_count; k++)
+  {
+    uint32_t i = s -> trackers[k];
+
+    t -> sum[i] = led_detector_roi_sum(ld, p -> frame, i);
+  }
+
+  led_process_list(t, ld -> frame_time, s -> trackers, s -> tracker_count);
+}
+
+static void led_parallel_run(led_parallel *p, led_stripe *s)
+{
+  if (p -> job == LED_JOB_LABEL)
+    s -> blobs = led_detector_label_groups(p -> ld, p -> frame, p -> occ, s -> g1, s -> g2, p -> ld -> blobs, &s -> runs);
+  else
+    led_parallel_decode_stripe(p, s);
+}
+
+static void* led_parallel_worker(void *args)
+{
+  led_stripe *s = (led_stripe *)args;
+  led_parallel *p = s -> parallel;
+
+  /* Not before the barriers and the stripes are set up. */
+  pthread_mutex_lock(&p -> gate);
+  pthread_mutex_unlock(&p -> gate);
+  for (;;)
+  {
+    pthread_barrier_wait(&p -> start);
+    if (p -> job == LED_JOB_QUIT)
+      break;
+    led_parallel_run(p, s);
+    pthread_barrier_wait(&p -> done);
+  }
+
+  return NULL;
+}
+
+/* Run job on every stripe, the calling thread taking the first one. */
+static void led_parallel_dispatch(led_parallel *p, uint32_t job)
+{
+  p -> job = job;
+  pthread_barrier_wait(&p -> start);
+  led_parallel_run(p, &p -> stripes[0]);
+  pthread_barrier_wait(&p -> done);
+}
+
+/*
+ Stripes for up to threads threads, the calling thread one of them. A
+ thread that cannot be created leaves the stripes to those that were,
+ the results are the same. -1 when out of memory.
+ */
+int led_parallel_init(led_parallel *p, led_detector *ld, uint32_t threads)
+{
+  const uint32_t groups = FRAME_HEIGHT / 16;
+  uint32_t started;
+
+  if (threads > LED_DECODE_THREADS_MAX)
+    threads = LED_DECODE_THREADS_MAX;
+  if (threads > groups)
+    threads = groups;
+
+  p -> ld = ld;
+  p -> blob_parent = (uint32_t*)malloc((FRAME_WIDTH * FRAME_HEIGHT / 4) * sizeof(uint32_t));
+  p -> blob_final = (uint32_t*)malloc((FRAME_WIDTH * FRAME_HEIGHT / 4) * sizeof(uint32_t));
+  p -> tracker_index = (uint32_t*)malloc(ld -> trackers.capacity * sizeof(uint32_t));
+  if (!p -> blob_parent || !p -> blob_final || !p -> tracker_index)
+  {
+    free(p -> blob_parent);
+    free(p -> blob_final);
+    free(p -> tracker_index);
+    return -1;
+  }
+
+  pthread_mutex_init(&p -> gate, NULL);
+  pthread_mutex_lock(&p -> gate);
+  for (uint32_t s = 0; s < threads; s++)
+    p -> stripes[s].parallel = p;
+  for (started = 1; started < threads; started++)
+  {
+    if (pthread_create(&p -> stripes[started].thread, NULL, led_parallel_worker, &p -> stripes[started]) != 0)
+      break;
+  }
+  threads = started;
+  p -> threads = threads;
+  pthread_barrier_init(&p -> start, NULL, threads);
+  pthread_barrier_init(&p -> done, NULL, threads);
+
+  for (uint32_t s = 0; s < threads; s++)
+  {
+    led_stripe *stripe = &p -> stripes[s];
+
+    stripe -> g1 = (s * groups) / threads;
+    stripe -> g2 = ((s + 1) * groups) / threads;
+    stripe -> runs = 0;
+    stripe -> blobs = 0;
+    stripe -> tracker_count = 0;
+    for (uint32_t g = stripe -> g1; g < stripe -> g2; g++)
+    {
+      p -> stripe_of_group[g] = s;
+    }
+  }
+  pthread_mutex_unlock(&p -> gate);
+
+  return 0;
+}
+
+void led_parallel_destroy(led_parallel *p)
+{
+  p -> job = LED_JOB_QUIT;
+  pthread_barrier_wait(&p -> start);
+  for (uint32_t s = 1; s < p -> threads; s++)
+  {
+    pthread_join(p -> stripes[s].thread, NULL);
+  }
+  pthread_barrier_destroy(&p -> start);
+  pthread_barrier_destroy(&p -> done);
+  pthread_mutex_destroy(&p -> gate);
+  free(p -> blob_parent);
+  free(p -> blob_final);
+  free(p -> tracker_index);
+  p -> blob_parent = NULL;
+  p -> blob_final = NULL;
+  p -> tracker_index = NULL;
+}
+
+/* Blob of run i, only root runs carry their blob's index. */
+static inline uint32_t led_parallel_run_blob(led_detector *ld, uint32_t i)
+{
+  return ld -> runs[led_run_find(ld -> run_parent, i)].label;
+}
+
+/*
+ led_detector_label_runs with each stripe labeled by its own thread. Blobs
+ a stripe border cuts through are then joined: the runs on the first row of
+ a stripe are matched against the runs on the last row of the stripe above,
+ exactly as the serial labeling joins consecutive row groups. Blob indices
+ grow in scan order across stripes and the lower index is kept as the root,
+ so compacting the stripes' blobs in index order leaves ld->blobs in the
+ same order, with the same sums, as led_detector_label_runs.
+ */
+uint32_t led_parallel_label(led_parallel *p, const uint8_t *bFrame, const led_frame_occupancy *occ)
+{
+  led_detector *ld = p -> ld;
+  led_run *runs = ld -> runs;
+  uint32_t *parent = p -> blob_parent;
+  uint32_t blobs = 0;
+
+  p -> frame = bFrame;
+  p -> occ = occ;
+  led_parallel_dispatch(p, LED_JOB_LABEL);
+
+  for (uint32_t s = 0; s < p -> threads; s++)
+  {
+    led_stripe *stripe = &p -> stripes[s];
+    uint32_t first = led_detector_group_blobs(stripe -> g1);
+
+    for (uint32_t b = first; b < first + stripe -> blobs; b++)
+    {
+      parent[b] = b;
+    }
+  }
+
+  for (uint32_t s = 1; s < p -> threads; s++)
+  {
+    led_stripe *above = &p -> stripes[s - 1];
+    led_stripe *below = &p -> stripes[s];
+    uint32_t a1 = led_detector_group_runs(above -> g1);
+    uint32_t b1 = led_detector_group_runs(below -> g1);
+    uint32_t g = below -> g1;
+
+    if (above -> runs == 0 || below -> runs == 0)
+      continue;
+
+    /* Runs are in row group order, those of the last group of a stripe come last. */
+    memset(p -> border, 0xFF, sizeof(p -> border));
+    for (uint32_t i = a1 + above -> runs; i-- > a1 && runs[i].group == g - 1; )
+    {
+      if (runs[i].mask & 0x8000)
+        p -> border[runs[i].x] = led_parallel_run_blob(ld, i);
+    }
+
+    for (uint32_t i = b1; i < b1 + below -> runs && runs[i].group == g; i++)
+    {
+      uint32_t x = runs[i].x;
+      uint32_t x1 = (x > 0) ? (x - 1) : 0;
+      uint32_t x2 = (x < (FRAME_WIDTH - 1)) ? (x + 1) : x;
+
+      if (!(runs[i].mask & 1))
+        continue;
+
+      for (uint32_t j = x1; j <= x2; j++)
+      {
+        if (p -> border[j] != LED_NONE)
+          led_run_union(parent, led_parallel_run_blob(ld, i), p -> border[j]);
+      }
+    }
+  }
+
+  /* A joined blob is folded into its root, which always comes first and has already been moved. */
+  for (uint32_t s = 0; s < p -> threads; s++)
+  {
+    led_stripe *stripe = &p -> stripes[s];
+    uint32_t first = led_detector_group_blobs(stripe -> g1);
+
+    for (uint32_t b = first; b < first + stripe -> blobs; b++)
+    {
+      uint32_t r = led_run_find(parent, b);
+
+      if (r == b)
+      {
+        p -> blob_final[b] = blobs;
+        ld -> blobs[blobs++] = ld -> blobs[b];
+      }
+      else
+      {
+        led_blob *dst = &ld -> blobs[p -> blob_final[r]];
+        const led_blob *src = &ld -> blobs[b];
+
+        dst -> area += src -> area;
+        dst -> sumx += src -> sumx;
+        dst -> sumy += src -> sumy;
+        if (src -> minx < dst -> minx)
+          dst -> minx = src -> minx;
+        if (src -> maxx > dst -> maxx)
+          dst -> maxx = src -> maxx;
+        if (src -> miny < dst -> miny)
+          dst -> miny = src -> miny;
+        if (src -> maxy > dst -> maxy)
+          dst -> maxy = src -> maxy;
+      }
+    }
+  }
+
+  return blobs;
+}
+
+/*
+ led_detector_roi_sums and led_process with the trackers split by the
+ stripe their centre is in. Each tracker is only touched by one thread and
+ the table is not reordered, so statuses come out as with one thread.
+ */
+void led_parallel_decode(led_parallel *p, const uint8_t *bFrame)
+{
+  led_detector *ld = p -> ld;
+  led_table *t = &ld -> trackers;
+  uint32_t offset = 0;
+
+  for (uint32_t s = 0; s < p -> threads; s++)
+  {
+    p -> stripes[s].tracker_count = 0;
+  }
+  for (uint32_t i = 0; i < t -> count; i++)
+  {
+    p -> stripes[p -> stripe_of_group[t -> y[i] / 16]].tracker_count++;
+  }
+  for (uint32_t s = 0; s < p -> threads; s++)
+  {
+    p -> stripes[s].trackers = p -> tracker_index + offset;
+    offset += p -> stripes[s].tracker_count;
+    p -> stripes[s].tracker_count = 0;
+  }
+
+  for (uint32_t i = 0; i < t -> count; i++)
+  {
+    led_stripe *s = &p -> stripes[p -> stripe_of_group[t -> y[i] / 16]];
+
+    s -> trackers[s -> tracker_count++] = i;
+  }
+
+  p -> frame = bFrame;
+  led_parallel_dispatch(p, LED_JOB_DECODE);
+}
@@ -0,0 +1,287 @@
+/*
+ ============================================================================
+ Name        : led-roi.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Exact count of lit pixels in a box of the packed bit frame,
+               NEON on ARM, AVX2 or SSSE3 on x86, a byte lookup table
+               everywhere else (the Pi Zero has no SIMD popcount)
+ ============================================================================
+ */
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+#include <stdlib.h>
+#include "led-roi.h"
+
+#define LED_POP2(n)   n, n + 1, n + 1, n + 2
+#define LED_POP4(n)   LED_POP2(n), LED_POP2(n + 1), LED_POP2(n + 1), LED_POP2(n + 2)
+#define LED_POP6(n)   LED_POP4(n), LED_POP4(n + 1), LED_POP4(n + 1), LED_POP4(n + 2)
+const uint8_t led_popcount8[256] = { LED_POP6(0), LED_POP6(1), LED_POP6(1), LED_POP6(2) };
+
+/* Popcount of one column word, an instruction where there is one, the table otherwise. */
+#if defined(__POPCNT__)
+#define led_roi_word_count(v)     ((uint32_t)__builtin_popcount(v))
+#else
+#define led_roi_word_count(v)     ((uint32_t)led_popcount8[(v) & 0xFF] + led_popcount8[(v) >> 8])
+#endif
+
+/*
+ Per architecture steps: load a vector of column words, add the popcount of
+ (words & masks) to the accumulator, and the final horizontal sum. NEON
+ accumulates per 16-bit lane, at most 16 per step, so a full row of columns
+ cannot overflow it.
+ */
+#if defined(__ARM_NEON)
+#define LED_ROI_VEC_WORDS  8
+typedef uint16x8_t led_roi_vec;
+#define led_roi_vec_zero()        vdupq_n_u16(0)
+#define led_roi_vec_load(p)       vld1q_u16(p)
+#define led_roi_vec_splat(m)      vdupq_n_u16(m)
+
+static inline led_roi_vec led_roi_vec_count(led_roi_vec acc, led_roi_vec v, led_roi_vec m)
+{
+  return vpadalq_u8(acc, vcntq_u8(vreinterpretq_u8_u16(vandq_u16(v, m))));
+}
+
+static inline uint32_t led_roi_vec_sum(led_roi_vec acc)
+{
+  uint64x2_t lanes = vpaddlq_u32(vpaddlq_u16(acc));
+  return vgetq_lane_u64(lanes, 0) + vgetq_lane_u64(lanes, 1);
+}
+#elif defined(__AVX2__)
+#define LED_ROI_VEC_WORDS  16
+typedef __m256i led_roi_vec;
+#define led_roi_vec_zero()        _mm256_setzero_si256()
+#define led_roi_vec_load(p)       _mm256_loadu_si256((const __m256i*)(p))
+#define led_roi_vec_splat(m)      _mm256_set1_epi16(m)
+
+/* Nibble lookup popcount, summed per 64-bit lane. */
+static inline led_roi_vec led_roi_vec_count(led_roi_vec acc, led_roi_vec v, led_roi_vec m)
+{
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low = _mm256_set1_epi8(0x0F);
+  __m256i c;
+
+  v = _mm256_and_si256(v, m);
+  c = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(v, low)),
+                      _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+  return _mm256_add_epi64(acc, _mm256_sad_epu8(c, _mm256_setzero_si256()));
+}
+
+static inline uint32_t led_roi_vec_sum(led_roi_vec acc)
+{
+  return _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) + _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+}
+#elif defined(__SSSE3__)
+#define LED_ROI_VEC_WORDS  8
+typedef __m128i led_roi_vec;
+#define led_roi_vec_zero()        _mm_setzero_si128()
+#define led_roi_vec_load(p)       _mm_loadu_si128((const __m128i*)(p))
+#define led_roi_vec_splat(m)      _mm_set1_epi16(m)
+
+/* Nibble lookup popcount, summed per 64-bit lane. */
+static inline led_roi_vec led_roi_vec_count(led_roi_vec acc, led_roi_vec v, led_roi_vec m)
+{
+  const __m128i lut = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m128i low = _mm_set1_epi8(0x0F);
+  __m128i c;
+
+  v = _mm_and_si128(v, m);
+  c = _mm_add_epi8(_mm_shuffle_epi8(lut, _mm_and_si128(v, low)),
+                   _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), low)));
+  return _mm_add_epi64(acc, _mm_sad_epu8(c, _mm_setzero_si128()));
+}
+
+static inline uint32_t led_roi_vec_sum(led_roi_vec acc)
+{
+  return _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+}
+#endif
+
+/* Number of 1's in (words[i] & mask) for the n column words starting at words. */
+uint32_t led_roi_count_span(const uint16_t *words, uint32_t n, uint16_t mask)
+{
+  uint32_t sum = 0;
+  uint32_t i = 0;
+
+#ifdef LED_ROI_VEC_WORDS
+  led_roi_vec m = led_roi_vec_splat(mask);
+  led_roi_vec acc = led_roi_vec_zero();
+
+  for (; i + LED_ROI_VEC_WORDS <= n; i += LED_ROI_VEC_WORDS)
+  {
+    acc = led_roi_vec_count(acc, led_roi_vec_load(words + i), m);
+  }
+  sum = led_roi_vec_sum(acc);
+#endif
+
+  for (; i < n; i++)
+  {
+    uint16_t v = words[i] & mask;
+    sum += led_roi_word_count(v);
+  }
+
+  return sum;
+}
+
+/* Number of 1's in (words[i] & masks[i]) for the n column words starting at words. */
+uint32_t led_roi_count_masked(const uint16_t *words, const uint16_t *masks, uint32_t n)
+{
+  uint32_t sum = 0;
+  uint32_t i = 0;
+
+#ifdef LED_ROI_VEC_WORDS
+  led_roi_vec acc = led_roi_vec_zero();
+
+  for (; i + LED_ROI_VEC_WORDS <= n; i += LED_ROI_VEC_WORDS)
+  {
+    acc = led_roi_vec_count(acc, led_roi_vec_load(words + i), led_roi_vec_load(masks + i));
+  }
+  sum = led_roi_vec_sum(acc);
+#endif
+
+  for (; i < n; i++)
+  {
+    uint16_t v = words[i] & masks[i];
+    sum += led_roi_word_count(v);
+  }
+
+  return sum;
+}
+
+/*
+ Number of 1's in columns [x1, x2) and rows [y1, y2). Each 16-row group the
+ box touches is one masked span of column words; only the first and last
+ group can have a partial row mask.
+ */
+uint32_t led_roi_count(const uint8_t *frame, uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2)
+{
+  uint32_t sum = 0;
+
+  if (x1 >= x2 || y1 >= y2)
+    return 0;
+
+  for (uint32_t g = y1 / 16; g * 16 < y2; g++)
+  {
+    uint32_t r1 = (g * 16 < y1) ? (y1 - (g * 16)) : 0;
+    uint32_t r2 = ((g + 1) * 16 > y2) ? (y2 - (g * 16)) : 16;
+
+    sum += led_roi_count_span(led_roi_group(frame, g) + x1, x2 - x1, led_roi_row_mask(r1, r2));
+  }
+
+  return sum;
+}
+
+/* One pixel at a time, the definition the faster counters are checked against. */
+uint32_t led_roi_count_reference(const uint8_t *frame, uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2)
+{
+  uint32_t sum = 0;
+
+  for (uint32_t y = y1; y < y2; y++)
+  {
+    for (uint32_t x = x1; x < x2; x++)
+    {
+      uint32_t index = ((y/16) * (FRAME_WIDTH*2)) + (x*2) + ((y%16)>7);
+      sum += (frame[index] >> (y & 7)) & 1;
+    }
+  }
+
+  return sum;
+}
+
+/*
+ Build the masks of a disk of radius r, the pixels within r of the centre
+ (dx*dx + dy*dy <= r*r). Column dx of the disk covers rows cy - h .. cy + h;
+ for each row phase p = cy % 16 those rows are cut into the 16-row groups
+ they fall in, relative to the group holding cy. -1 when out of memory.
+ */
+int led_roi_circle_init(led_roi_circle *c, uint16_t radius)
+{
+  int32_t r = radius;
+
+  c -> radius = radius;
+  c -> width = (2 * radius) + 1;
+  c -> groups = ((2 * radius) / 16) + 2;
+  c -> masks = (uint16_t*)calloc(16 * c -> groups * c -> width, sizeof(uint16_t));
+  if (!c -> masks)
+    return -1;
+
+  for (int32_t p = 0; p < 16; p++)
+  {
+    /* Floor division, p - r can be negative. */
+    int32_t g0 = (p - r >= 0) ? ((p - r) / 16) : -((r - p + 15) / 16);
+
+    c -> group0[p] = g0;
+    for (int32_t dx = -r; dx <= r; dx++)
+    {
+      int32_t h = 0;
+
+      while ((h + 1) * (h + 1) + (dx * dx) <= r * r)
+        h++;
+
+      for (int32_t row = p - h; row <= p + h; row++)
+      {
+        int32_t g = ((row >= 0) ? (row / 16) : -((15 - row) / 16)) - g0;
+
+        c -> masks[(((p * c -> groups) + g) * c -> width) + (dx + r)] |= 1 << (row - ((g + g0) * 16));
+      }
+    }
+  }
+  return 0;
+}
+
+void led_roi_circle_destroy(led_roi_circle *c)
+{
+  free(c -> masks);
+  c -> masks = NULL;
+}
+
+/*
+ Number of 1's within the disk c centred on (cx, cy), clipped to the frame.
+ The mask loads and the extra row group make it slower than the square
+ around it, bench-circle measures 0.5-1.0x of the square's speed.
+ */
+uint32_t led_roi_count_circle(const uint8_t *frame, const led_roi_circle *c, uint32_t cx, uint32_t cy)
+{
+  uint32_t p = cy % 16;
+  int32_t g0 = (int32_t)(cy / 16) + c -> group0[p];
+  uint32_t x1 = (cx > c -> radius) ? (cx - c -> radius) : 0;
+  uint32_t x2 = ((cx + c -> radius) < FRAME_WIDTH) ? (cx + c -> radius + 1) : FRAME_WIDTH;
+  const uint16_t *masks = c -> masks + (p * c -> groups * c -> width) + (x1 + c -> radius - cx);
+  uint32_t sum = 0;
+
+  for (int32_t k = 0; k < c -> groups; k++, masks += c -> width)
+  {
+    int32_t g = g0 + k;
+
+    if (g >= 0 && g < (FRAME_HEIGHT / 16))
+      sum += led_roi_count_masked(led_roi_group(frame, g) + x1, masks, x2 - x1);
+  }
+
+  return sum;
+}
+
+uint32_t led_roi_count_circle_reference(const uint8_t *frame, uint32_t cx, uint32_t cy, uint32_t r)
+{
+  uint32_t sum = 0;
+
+  for (int32_t y = (int32_t)cy - (int32_t)r; y <= (int32_t)(cy + r); y++)
+  {
+    for (int32_t x = (int32_t)cx - (int32_t)r; x <= (int32_t)(cx + r); x++)
+    {
+      if (x >= 0 && y >= 0 && x < FRAME_WIDTH && y < FRAME_HEIGHT &&
+          ((x - (int32_t)cx) * (x - (int32_t)cx)) + ((y - (int32_t)cy) * (y - (int32_t)cy)) <= (int32_t)(r * r))
+      {
+        sum += led_roi_count_reference(frame, x, y, x + 1, y + 1);
+      }
+    }
+  }
+
+  return sum;
+}
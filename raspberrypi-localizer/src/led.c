@@ -14,21 +14,88 @@
 #include <sys/types.h>
 #include <pthread.h>
 #include "configurations.h"
-#include "led.h" 
+#include "led-detector.h"
+
+/* Thresholds of led_process, in microseconds. */
+#define LED_TIME_US(ms)           ((uint32_t)((ms) * 1000))
+#define LED_BIT_END_TIME          LED_TIME_US(BIT_TRANSFER_TIME + 2*FRAME_TRANSFER_TIME + 10)
+#define LED_ON_END_TIME           LED_TIME_US(BIT_TRANSFER_TIME + 2*FRAME_TRANSFER_TIME + 10)
+#define LED_OFF_END_TIME          LED_TIME_US(BIT_TRANSFER_TIME + FRAME_TRANSFER_TIME + 10)
+#define LED_SHORT_ON_TIME         LED_TIME_US(2*FRAME_TRANSFER_TIME - 10)
+#define LED_ONE_DATA_TIME         LED_TIME_US(BIT_TRANSFER_TIME/2)
+#define LED_ZERO_DATA_TIME        LED_TIME_US(BIT_TRANSFER_TIME/2 + FRAME_TRANSFER_TIME)
+#define LED_HALF_BIT_TIME         LED_TIME_US(BIT_TRANSFER_TIME/2)
+
+#define LED_TABLE_ARRAYS(X) \
+  X(x) X(y) X(led_radius) X(one_zero_thresh) X(id) X(prev_frame_state) X(is_first_frame) \
+  X(raw_data) X(ones) X(area_sum) X(current_bit_start_time) X(prev_state_end_time) X(sum) X(status) \
+  X(grid_next) X(grid_prev) X(grid_cell) X(grid_serial) X(cold)
+
+/* -1 when an array could not be allocated, led_table_destroy frees the others. */
+int led_table_init(led_table *t, uint32_t capacity)
+{
+  int ok = 1;
+
+#define LED_TABLE_ALLOC(a) t -> a = malloc(capacity * sizeof(*t -> a)); ok &= (t -> a != NULL);
+  LED_TABLE_ARRAYS(LED_TABLE_ALLOC)
+#undef LED_TABLE_ALLOC
+  t -> count = 0;
+  t -> capacity = capacity;
+  t -> exhausted = 0;
+  t -> missed = 0;
+  t -> frame_step = 0;
+
+  return ok ? 0 : -1;
+}
+
+void led_table_destroy(led_table *t)
+{
+#define LED_TABLE_FREE(a) free(t -> a); t -> a = NULL;
+  LED_TABLE_ARRAYS(LED_TABLE_FREE)
+#undef LED_TABLE_FREE
+  t -> count = 0;
+  t -> capacity = 0;
+}
+
+/* Copy slot src over slot dst, the per frame sum and status included. */
+void led_table_move(led_table *t, uint32_t dst, uint32_t src)
+{
+#define LED_TABLE_MOVE(a) t -> a[dst] = t -> a[src];
+  LED_TABLE_ARRAYS(LED_TABLE_MOVE)
+#undef LED_TABLE_MOVE
+}
 
-void led_init_vals(led *l, uint16_t x, uint16_t y, uint16_t one_zero_thresh, uint16_t led_radius, uint16_t frame_number, double frame_time, uint32_t area)
+/*
+ Tell led_process that missed frames were lost between the previous frame and
+ the current one, gap_time microseconds apart. A flip seen now happened at one
+ of the missed frames or at this one, see led_gap_flip_time.
+ */
+void led_table_gap(led_table *t, uint32_t missed, uint32_t gap_time)
 {
-  l->x = x;
-  l->y = y;
-  l->area = area;
-  l->id = 0;
-  l->current_bit_start_time = frame_time;
-  l->transmission_start_time = frame_time;
-  l->prev_state_end_time = frame_time;
-  l->one_zero_thresh = one_zero_thresh;
-  l->led_radius = led_radius;
-  l->area_sum = one_zero_thresh;
-  l->ones = 1;
+  t -> missed = missed;
+  t -> frame_step = gap_time / (missed + 1);
+}
+
+void led_init_vals(led_table *t, uint32_t i, uint16_t x, uint16_t y, uint16_t one_zero_thresh, uint16_t led_radius, uint16_t frame_number, uint32_t frame_time, uint32_t area)
+{
+  led *l = &t -> cold[i];
+
+  t -> x[i] = x;
+  t -> y[i] = y;
+  t -> id[i] = 0;
+  t -> current_bit_start_time[i] = frame_time;
+  t -> prev_state_end_time[i] = frame_time;
+  t -> one_zero_thresh[i] = one_zero_thresh;
+  t -> led_radius[i] = led_radius;
+  t -> ones[i] = 1;
+  t -> is_first_frame[i] = 1;
+  t -> prev_frame_state[i] = 0;
+  t -> raw_data[i] = 0;
+  t -> status[i] = 0;
+  l -> area = area;
+  t -> area_sum[i] = one_zero_thresh;
+  l -> transmission_start_time = frame_time;
+  l -> start_frame_index = frame_number;
 #if DEBUG_LED  
   l->debug_buffer_index = 0;
   l->debug_prev_bit_index = 0;
@@ -38,17 +105,24 @@ void led_init_vals(led *l, uint16_t x, uint16_t y, uint16_t one_zero_thresh, uin
   memset(l->debug_buffer_indexes, 0, LED_BUFFER_LENGTH*3*4);
   
 #endif
-  l->start_frame_index = frame_number;
-  l->is_first_frame = 1;
-  l->raw_data = 0;
 }
 
-led* led_create_vals(led_detector *ld, uint16_t x, uint16_t y)
+/* Returns the new tracker slot, or LED_NONE when the table is full; the miss is counted in exhausted. */
+uint32_t led_create_vals(led_detector *ld, uint16_t x, uint16_t y)
 {
-  led *l = (led*)malloc(sizeof(led));
-  led_init_vals(l, x, y, ld->one_zero_thresh, ld->led_radius, ld->frame_number, ld->frame_time, ld->area);
+  led_table *t = &ld -> trackers;
+  uint32_t i = t -> count;
+
+  if (i == t -> capacity)
+  {
+    t -> exhausted++;
+    return LED_NONE;
+  }
+
+  t -> count++;
+  led_init_vals(t, i, x, y, ld->one_zero_thresh, ld->led_radius, ld->frame_number, ld->frame_time, ld->area);
   
-  return l;
+  return i;
 }
 
 #define GENPOLY 0x0017 /* x^4 + x^2 + x + 1 */
@@ -66,211 +140,201 @@ uint16_t led_calculate_checksum(uint16_t val)
   return val;
 }
 
-/* TODO: Replace with a lookup table based bit counter. */
-typedef struct bit_access_field_t {
-  uint8_t a0:1;
-  uint8_t a1:1;
-  uint8_t a2:1;
-  uint8_t a3:1;
-  uint8_t a4:1;
-  uint8_t a5:1;
-  uint8_t a6:1;
-  uint8_t a7:1;
-} bit_access_field;
-
-uint32_t led_get_roi_sum(led *l, uint8_t *frame, uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2)
+/*
+ Time of a flip seen right after missed frames. Manchester flips are half a
+ bit apart, or a whole bit, so of the missed frames and this one the flip is
+ put at the frame closest to that grid as counted from the previous flip.
+ */
+static inline uint32_t led_gap_flip_time(const led_table *t, uint32_t prev_flip, uint32_t frame_time)
 {
-  uint32_t sum = 0;
-  bit_access_field *sa;
+  uint32_t best = frame_time;
+  uint32_t best_off = LED_HALF_BIT_TIME;
 
-  for (uint32_t i = y1; i < y2 /*&& sum <= l->one_zero_thresh*/; i+=8)
+  for (uint32_t k = 0; k <= t -> missed && k <= LED_GAP_MAX_MISSED; k++)
   {
-    for (uint32_t j = x1; j < x2 /*&& sum <= l->one_zero_thresh*/; j++)
+    uint32_t flip = frame_time - (k * t -> frame_step);
+    uint32_t phase = (flip - prev_flip) % LED_HALF_BIT_TIME;
+    uint32_t off = (phase < LED_HALF_BIT_TIME - phase) ? phase : (LED_HALF_BIT_TIME - phase);
+
+    if (off < best_off)
     {
-      uint32_t index = (i/16 * (FRAME_WIDTH*2)) + j*2 + (i%16>7);
-      sa = (bit_access_field*) (frame + index);
-      sum += (sa->a0 + sa->a1 + sa->a2 + sa->a3 + sa->a4 + sa->a5 + sa->a6 + sa->a7);
+      best_off = off;
+      best = flip;
     }
   }
-
-  return sum;
+  return best;
 }
 
 /*
- Process LED bits sent using Manchester encoding.
-
-*/
-uint8_t led_process(led *l, uint8_t *frame, double frame_time, uint8_t is_new_frame)
+ One frame of tracker i; t is a local copy of the table so its array pointers stay in registers.
+ gap is a compile time constant, the flip time estimate is only built into the loop run after missed frames.
+ */
+static inline __attribute__((always_inline)) void led_process_one(const led_table *t, uint32_t i, uint32_t frame_time, const uint32_t gap)
 {
-  uint32_t sum;
-  uint32_t x1, y1, x2, y2;
-
-  uint8_t current_frame_state;
-  uint8_t status = 0;
-  uint32_t data = 0;
-  uint32_t checksum = 0;
-  uint8_t is_state_flip;
-
-  uint8_t state_based_end_transmission = 0;
-  uint8_t bit_based_end_transmission = 0;
-  
-  double state_elapsed_time;
-
-  /* If LED ID is already extracted, just return 1, indicating that no further action is needed. */
-  if (l->id)
-    return 1;
- 
+  const uint32_t *sums = t -> sum;
+  const uint16_t *thresh = t -> one_zero_thresh;
+  uint8_t  *prev_frame_state = t -> prev_frame_state;
+  uint8_t  *is_first_frame = t -> is_first_frame;
+  uint8_t  *status = t -> status;
+  uint32_t *raw_data = t -> raw_data;
+  uint32_t *ones = t -> ones;
+  uint32_t *area_sum = t -> area_sum;
+  uint32_t *bit_start = t -> current_bit_start_time;
+  uint32_t *state_end = t -> prev_state_end_time;
+
+  uint32_t sum = sums[i];
+  uint32_t prev = prev_frame_state[i];
+  uint32_t raw = raw_data[i];
 
-  /* Bounding box for the LED. Calculate using a square instead of a circle for the sake of performance. */
-  x1 = (l->x > l->led_radius) ? (l->x - l->led_radius) : 0;
-  y1 = (l->y > l->led_radius) ? (l->y - l->led_radius) : 0;
-
-  x2 = ((l->x + l->led_radius) < FRAME_WIDTH  ) ? (l->x + l->led_radius) :  (FRAME_WIDTH);
-  y2 = ((l->y + l->led_radius) < FRAME_HEIGHT ) ? (l->y + l->led_radius) :  (FRAME_HEIGHT);
-
-  /* Get the total number of 1's in the bounding box. */
-  sum = led_get_roi_sum(l, frame, x1, y1, x2, y2);
-  
   /*Threshold the number of 1's */
-  uint32_t thresh = (l->one_zero_thresh);
-  current_frame_state = sum > thresh;
+  uint32_t current = sum > thresh[i];
 
   /* Flag state flip as compared to previous frame. */
-  is_state_flip = (l->prev_frame_state != current_frame_state);
-  
-  bit_based_end_transmission = (frame_time - l->current_bit_start_time ) > (BIT_TRANSFER_TIME + 2*FRAME_TRANSFER_TIME_F + 10 );
-  
-  state_elapsed_time = frame_time - l->prev_state_end_time;
-
-  if (l->prev_frame_state) 
-  {
-    state_based_end_transmission = state_elapsed_time > (BIT_TRANSFER_TIME + 2*FRAME_TRANSFER_TIME_F + 10 );
-  } 
-  else 
-  {
-    state_based_end_transmission = state_elapsed_time > (BIT_TRANSFER_TIME + FRAME_TRANSFER_TIME_F + 10 );
-  }
-
-  if (is_state_flip)
-  {
-    if (!state_based_end_transmission && l->prev_frame_state) 
-    {
-      state_based_end_transmission = state_elapsed_time < (2*FRAME_TRANSFER_TIME_F - 10 );
-    } 
-    else 
-    {
-      // It is possible to have a single zero frame
-    }
-
-    l->prev_state_end_time = frame_time;
-  }
+  uint32_t is_state_flip = prev ^ current;
+
+  /* A flip right after missed frames is timed at its estimate. */
+  uint32_t event_time = frame_time;
+
+  if (gap)
+    event_time -= is_state_flip * (frame_time - led_gap_flip_time(t, state_end[i], frame_time));
+
+  /* Unsigned differences stay correct across the microsecond counter wrapping. */
+  uint32_t elapsed_time = event_time - bit_start[i];
+  uint32_t state_elapsed_time = event_time - state_end[i];
+
+  /* Force end of transmission if the current bit did not flip for too long. */
+  uint32_t bit_based_end_transmission = elapsed_time > LED_BIT_END_TIME;
+
+  /* A state held for too long, or a one that ended after a single frame, ends the transmission too. */
+  /* It is possible to have a single zero frame. */
+  uint32_t state_based_end_transmission = state_elapsed_time > (LED_OFF_END_TIME + prev * (LED_ON_END_TIME - LED_OFF_END_TIME));
+  state_based_end_transmission |= is_state_flip & prev & (state_elapsed_time < LED_SHORT_ON_TIME);
+  state_based_end_transmission &= ones[i] > 3;
+
+  /* Past LED_GAP_MAX_MISSED frames a whole half bit may be gone, end the message rather than mis-decode it. */
+  uint32_t gap_end_transmission = (t -> missed > LED_GAP_MAX_MISSED) & (raw != 0) & (is_first_frame[i] ^ 1);
+
+  /* Handle 1 and 0 differently as a 1 can overflow into a zero bit. */
+  /* The elapsed time determines if it is a data flip or an intermediate flip. */
+  /* Force process if end of transmission, never on the first frame, and don't wait for elapsed time on the very first flip. */
+  uint32_t is_data = elapsed_time > (LED_ZERO_DATA_TIME - current * (LED_ZERO_DATA_TIME - LED_ONE_DATA_TIME));
+  uint32_t is_bit = (is_first_frame[i] ^ 1) & (is_state_flip | bit_based_end_transmission) & ((raw == 0) | is_data);
+
+  /* Conditional updates as multiplies by the 0/1 flags. */
+  raw_data[i] = raw + is_bit * (raw + (current ^ 1));
+  bit_start[i] += is_bit * elapsed_time;
+  state_end[i] += is_state_flip * state_elapsed_time;
+  area_sum[i] += current * sum;
+  ones[i] += current;
+  prev_frame_state[i] = current;
+  is_first_frame[i] = 0;
+
+  /* 2 makes sure that the LED is removed from the table. */
+  status[i] = (((is_state_flip ^ 1) & bit_based_end_transmission) | state_based_end_transmission | gap_end_transmission) << 1;
+}
 
-  state_based_end_transmission = (state_based_end_transmission && (l->ones > 3));
+/* Checksum of tracker i once its preamble bit has arrived. */
+static inline void led_process_check(led_table *t, uint32_t i, uint32_t frame_time)
+{
+  uint8_t  *status = t -> status;
+  uint32_t *raw_data = t -> raw_data;
 
-  /* Force end of transmission if the current bit did not flip for three times the BIT_TRANSFER_TIME */
-  /* Can be determined after 2*BIT_TRANSFER_TIME, but use 2.5 to compensate for processing delay. */
-  uint8_t is_end_transmission = (!is_state_flip && bit_based_end_transmission) || state_based_end_transmission;
+  /* If the message has a preemble bit at the start  */
+  if (raw_data[i] & 0x100000) {
+    /* Decode data and checksum */
+    uint32_t data = (raw_data[i] >> 4) & 0xFFFF;
+    uint32_t checksum = raw_data[i] & 0xF;
 
-  /* Init status value to error in case of end of transmission. This will make sure that the LED node is removed from queue */
-  if (is_end_transmission) 
-  {
-    status = 2;
+    /* Verify checksum. */
+    if (data && led_calculate_checksum(data) == checksum) {
+      t -> id[i] = data;
+      status[i] = 1;
+    }
   }
 
 #if DEBUG_LED
+  led *l = &t -> cold[i];
+
   if (l->debug_buffer_index < (LED_BUFFER_LENGTH*3)) 
   {
-    l->debug_buffer[l->debug_buffer_index] = sum;
-    l->debug_buffer_time[l->debug_buffer_index] = (frame_time - l->current_bit_start_time);//frame_time;
-    l->debug_buffer_indexes[l->debug_buffer_index] = thresh;//current_frame_state;
+    l->debug_buffer[l->debug_buffer_index] = t -> sum[i];
+    l->debug_buffer_time[l->debug_buffer_index] = frame_time - l->transmission_start_time;
+    l->debug_buffer_indexes[l->debug_buffer_index] = t -> one_zero_thresh[i];
+    l->debug_prev_bit[l->debug_buffer_index] = raw_data[i] & 1;
   }
   else
   {
     fprintf(stdout,"overflow");
   }
-#endif
-  
-  /* Process bit flip. */
-  /* Force process if end of transmission. */
-  /* Force not to process if start of transmission. */
-  if (!l->is_first_frame && (is_state_flip || bit_based_end_transmission)) 
-  {
-    double elapsed_time = frame_time - l->current_bit_start_time;
-    uint8_t is_data = 0;
-    
-    /* Handle 1 and 0 differently as a 1 can overflow into a zero bit. */
-    /* The elapsed time determines if it is a data flip or an intermediate flip. */
-    if (current_frame_state == 1) {
-      is_data = elapsed_time > BIT_TRANSFER_TIME/2;
-    } else {
-      is_data = elapsed_time > (BIT_TRANSFER_TIME/2 + FRAME_TRANSFER_TIME_F);
-    }
 
-    /* If it is a data flip, record the data and adjust counters. */
-    /* Don't wait for elapsed time if its the very first flip.*/
-    if ((is_state_flip || bit_based_end_transmission) && ((l->raw_data == 0) || is_data)) {
-      l->raw_data <<= 1;
-      l->raw_data |= !current_frame_state;
-      l->current_bit_start_time = frame_time;
-#if DEBUG_LED
-      if (l->debug_buffer_index < (LED_BUFFER_LENGTH*3)) 
-      {
-        l->debug_prev_bit[l->debug_buffer_index] = !current_frame_state;
+  if (status[i] == 2 && raw_data[i]) 
+  {
+    if (l->debug_buffer_index > 80) {
+      for (int k=0;k<l->debug_buffer_index;k++) {
+        fprintf(stdout, "%4.0f %04d %04d %d\n", l->debug_buffer_time[k] / 1000.0, l->debug_buffer[k], l->debug_buffer_indexes[k], l->debug_prev_bit[k]);
       }
-#endif
-    } else {
-      // ignore
     }
-
-
-  }
-
-  if (current_frame_state) {
-    l->area_sum += sum;
-    l->ones++;
+    fprintf(stdout, "    status: %d - (%d, %d) - message frames: %d\n", status[i], t->x[i], t->y[i], l->debug_buffer_index);
+    fprintf(stdout, "    raw data: 0x%04x, data: 0x%04x, checksum: 0x%04x, calculated checksum: 0x%04x\n", 
+      raw_data[i], 
+      (raw_data[i] >> 4) & 0xFFFF,
+      raw_data[i] & 0xF, 
+      led_calculate_checksum((raw_data[i] >> 4) & 0xFFFF));
+
+    fflush(stdout);
   }
   
-  /* If the message has a preemble bit at the start  */
-  if (l->raw_data & 0x100000) {
-    
-    /* Decode data */
-    data = (l->raw_data >> 4) & 0xFFFF;
-    
-    /* Decode checksum */
-    checksum = l->raw_data & 0xF;
+  l->debug_buffer_index++;
+#endif
+}
 
-    /* Verify checksum. */
-    if (data && led_calculate_checksum(data) == checksum) {
-      l->id = data;
-      status = 1;
+/*
+ Process LED bits sent using Manchester encoding.
+ Runs one frame for every tracker in the table, t->sum holds each tracker's
+ count of 1's in its bounding box and the result is left in t->status:
+ 0 still receiving, 1 ID decoded into t->id, 2 end of transmission.
+ The per tracker update is written without branches so the compiler can
+ vectorize it; the checksum is only verified in a second pass for the few
+ trackers whose preamble bit has arrived.
+*/
+void led_process(led_table *t, uint32_t frame_time)
+{
+  const led_table v = *t;
+
+  if (v.missed)
+  {
+    for (uint32_t i = 0; i < v.count; i++)
+    {
+      led_process_one(&v, i, frame_time, 1);
     }
   }
-
-#if DEBUG_LED
-    if (status == 2 && l->raw_data) 
+  else
+  {
+    /* The table arrays never overlap. */
+#pragma GCC ivdep
+    for (uint32_t i = 0; i < v.count; i++)
     {
-      if (l->debug_buffer_index > 80) {
-        for (int i=0;i<l->debug_buffer_index;i++) {
-          fprintf(stdout, "%4.0f %04d %04d %d\n", l->debug_buffer_time[i], l->debug_buffer[i], l->debug_buffer_indexes[i], l->debug_prev_bit[i]);
-        }
-      }
-      fprintf(stdout, "    status: %d - (%d, %d) - message frames: %d, state_based_end_transmission: %d\n", status, l->x, l->y, l->debug_buffer_index, state_based_end_transmission);
-      fprintf(stdout, "    raw data: 0x%04x, data: 0x%04x, checksum: 0x%04x, calculated checksum: 0x%04x\n", 
-        l->raw_data, 
-        (l->raw_data >> 4) & 0xFFFF,
-        l->raw_data & 0xF, 
-        led_calculate_checksum((l->raw_data >> 4) & 0xFFFF));
-
-      fflush(stdout);
+      led_process_one(&v, i, frame_time, 0);
     }
-    
-    l->debug_buffer_index++;
-#endif
+  }
 
+  for (uint32_t i = 0; i < t -> count; i++)
+  {
+    led_process_check(t, i, frame_time);
+  }
+}
 
-  l->prev_frame_state = current_frame_state;
-  l->prev_frame_time = frame_time;
-  l->is_first_frame = 0; 
+/* led_process for the n trackers listed in index only, e.g. those of one screen stripe. */
+void led_process_list(led_table *t, uint32_t frame_time, const uint32_t *index, uint32_t n)
+{
+  const led_table v = *t;
 
-  return status;
+  for (uint32_t k = 0; k < n; k++)
+  {
+    if (v.missed)
+      led_process_one(&v, index[k], frame_time, 1);
+    else
+      led_process_one(&v, index[k], frame_time, 0);
+    led_process_check(t, index[k], frame_time);
+  }
 }
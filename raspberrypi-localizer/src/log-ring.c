@@ -0,0 +1,310 @@
+/*
+ ============================================================================
+ Name        : log-ring.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Lock-free multi producer / single consumer ring of log
+               records drained to a stream by a writer thread
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include "log-ring.h"
+
+int log_ring_init(log_ring *r, uint32_t capacity, FILE *out)
+{
+  uint32_t c = 1;
+
+  while (c < capacity)
+    c <<= 1;
+
+  memset(&r -> stats, 0, sizeof(r -> stats));
+  r -> capacity = c;
+  r -> records = (log_record*)aligned_alloc(64, (size_t)c * sizeof(log_record));
+  r -> out = out;
+  r -> tail = 0;
+  r -> offset = 0;
+  r -> running = 0;
+  r -> polled = 0;
+  atomic_init(&r -> head, 0);
+  atomic_init(&r -> waiting, 0);
+  atomic_init(&r -> closed, 0);
+  r -> wakeup_fd = eventfd(0, EFD_CLOEXEC);
+
+  if (r -> records)
+  {
+    for (uint32_t i = 0; i < c; i++)
+      atomic_init(&r -> records[i].sequence, i);
+  }
+
+  return (r -> records && r -> wakeup_fd >= 0) ? 0 : -1;
+}
+
+void log_ring_destroy(log_ring *r)
+{
+  log_ring_stop(r);
+  free(r -> records);
+  r -> records = NULL;
+  if (r -> wakeup_fd >= 0)
+    close(r -> wakeup_fd);
+  r -> wakeup_fd = -1;
+}
+
+static inline int log_ring_ready(log_ring *r)
+{
+  log_record *record = &r -> records[r -> tail & (r -> capacity - 1)];
+
+  return atomic_load_explicit(&record -> sequence, memory_order_acquire) == r -> tail + 1;
+}
+
+/* Write records out in order, flushing whenever the ring runs empty, until closed and drained. */
+static void* log_ring_writer(void *args)
+{
+  log_ring *r = (log_ring*)args;
+  uint64_t count;
+
+  for (;;)
+  {
+    uint32_t depth = atomic_load_explicit(&r -> head, memory_order_acquire) - r -> tail;
+
+    if (depth > r -> stats.depth_max)
+      r -> stats.depth_max = depth;
+
+    while (log_ring_ready(r))
+    {
+      log_record *record = &r -> records[r -> tail & (r -> capacity - 1)];
+
+      fwrite(record -> text, 1, record -> length, r -> out);
+      atomic_store_explicit(&record -> sequence, r -> tail + r -> capacity, memory_order_release);
+      r -> tail++;
+    }
+    fflush(r -> out);
+    r -> stats.flushes++;
+
+    if (atomic_load_explicit(&r -> closed, memory_order_acquire))
+    {
+      /* A producer between its claim and its text, it will not be long. */
+      if (atomic_load_explicit(&r -> head, memory_order_acquire) == r -> tail)
+        break;
+      sched_yield();
+      continue;
+    }
+
+    /* Pairs with the fence in log_ring_wake. */
+    atomic_store_explicit(&r -> waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (log_ring_ready(r) || atomic_load_explicit(&r -> closed, memory_order_acquire))
+    {
+      atomic_store_explicit(&r -> waiting, 0, memory_order_relaxed);
+      continue;
+    }
+    if (read(r -> wakeup_fd, &count, sizeof(count)) < 0)
+      atomic_store_explicit(&r -> waiting, 0, memory_order_relaxed);
+  }
+
+  return NULL;
+}
+
+static inline void log_ring_wake(log_ring *r)
+{
+  uint64_t one = 1;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&r -> waiting, memory_order_relaxed) &&
+      atomic_exchange_explicit(&r -> waiting, 0, memory_order_relaxed))
+  {
+    if (write(r -> wakeup_fd, &one, sizeof(one)) < 0)
+      return;
+  }
+}
+
+int log_ring_start(log_ring *r)
+{
+  if (r -> running)
+    return 0;
+
+  atomic_store_explicit(&r -> closed, 0, memory_order_relaxed);
+  if (pthread_create(&r -> writer, NULL, log_ring_writer, r) != 0)
+    return -1;
+  r -> running = 1;
+  return 0;
+}
+
+/* Queue lines for log_ring_drain, called by the owner's event loop. */
+void log_ring_start_polled(log_ring *r)
+{
+  if (r -> running)
+    return;
+
+  fflush(r -> out);
+  r -> polled = 1;
+  r -> running = 1;
+}
+
+/*
+ Write queued records to the stream's descriptor for as long as it takes
+ them without blocking: a pipe that polls writable has room for PIPE_BUF
+ bytes, so it is polled again after every PIPE_BUF bytes. Returns non zero
+ while records are left, the caller waits for the descriptor to become
+ writable and drains again.
+ */
+int log_ring_drain(log_ring *r)
+{
+  int fd = fileno(r -> out);
+  uint32_t budget = 0;
+
+  while (log_ring_ready(r))
+  {
+    log_record *record = &r -> records[r -> tail & (r -> capacity - 1)];
+    ssize_t n;
+
+    if (budget < (uint32_t)(record -> length - r -> offset))
+    {
+      struct pollfd p = { fd, POLLOUT, 0 };
+
+      if (poll(&p, 1, 0) <= 0 || !(p.revents & (POLLOUT | POLLERR | POLLHUP)))
+        return 1;
+      budget = PIPE_BUF;
+    }
+
+    n = write(fd, record -> text + r -> offset, record -> length - r -> offset);
+    if (n < 0)
+    {
+      if (errno == EAGAIN || errno == EINTR)
+        return 1;
+      /* The reader is gone, the line is lost like any other write to it. */
+      n = record -> length - r -> offset;
+    }
+    budget -= (n < budget) ? n : budget;
+    r -> offset += n;
+    if (r -> offset < record -> length)
+      continue;
+
+    r -> offset = 0;
+    atomic_store_explicit(&record -> sequence, r -> tail + r -> capacity, memory_order_release);
+    r -> tail++;
+  }
+
+  return 0;
+}
+
+/* Write out everything queued and join the writer. No other thread may be logging. */
+void log_ring_stop(log_ring *r)
+{
+  if (!r -> running)
+    return;
+
+  if (r -> polled)
+  {
+    struct pollfd p = { fileno(r -> out), POLLOUT, 0 };
+
+    while (log_ring_drain(r))
+      poll(&p, 1, -1);
+    r -> polled = 0;
+    r -> running = 0;
+    return;
+  }
+
+  atomic_store_explicit(&r -> closed, 1, memory_order_release);
+  atomic_store_explicit(&r -> waiting, 1, memory_order_relaxed);
+  log_ring_wake(r);
+  pthread_join(r -> writer, NULL);
+  r -> running = 0;
+}
+
+/*
+ Claim n consecutive records from the head. The writer frees records in
+ order, so when the last of them is free for its position all of them are.
+ */
+static inline int log_ring_claim(log_ring *r, uint32_t n, uint32_t *position)
+{
+  uint32_t head = atomic_load_explicit(&r -> head, memory_order_relaxed);
+
+  for (;;)
+  {
+    log_record *last = &r -> records[(head + n - 1) & (r -> capacity - 1)];
+    int32_t diff = (int32_t)(atomic_load_explicit(&last -> sequence, memory_order_acquire) - (head + n - 1));
+
+    if (diff == 0)
+    {
+      if (atomic_compare_exchange_weak_explicit(&r -> head, &head, head + n, memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+    {
+      return -1;
+    }
+    else
+    {
+      head = atomic_load_explicit(&r -> head, memory_order_relaxed);
+    }
+  }
+
+  *position = head;
+  return 0;
+}
+
+int log_vprintf(log_ring *r, const char *format, va_list args)
+{
+  char line[LOG_LINE_MAX];
+  int length = vsnprintf(line, sizeof(line), format, args);
+  uint32_t n, position;
+
+  if (length < 0)
+    return -1;
+  if (length >= LOG_LINE_MAX)
+  {
+    atomic_fetch_add_explicit(&r -> stats.truncated, 1, memory_order_relaxed);
+    length = LOG_LINE_MAX - 1;
+  }
+
+  if (!r -> running)
+  {
+    fwrite(line, 1, length, r -> out);
+    fflush(r -> out);
+    return length;
+  }
+
+  n = (length + LOG_RECORD_TEXT - 1) / LOG_RECORD_TEXT;
+  if (n == 0)
+    return 0;
+  if (n > r -> capacity || log_ring_claim(r, n, &position) != 0)
+  {
+    atomic_fetch_add_explicit(&r -> stats.overflows, 1, memory_order_relaxed);
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < n; i++)
+  {
+    log_record *record = &r -> records[(position + i) & (r -> capacity - 1)];
+    uint32_t offset = i * LOG_RECORD_TEXT;
+    uint32_t chunk = ((uint32_t)length - offset < LOG_RECORD_TEXT) ? ((uint32_t)length - offset) : LOG_RECORD_TEXT;
+
+    memcpy(record -> text, line + offset, chunk);
+    record -> length = (uint16_t)chunk;
+    atomic_store_explicit(&record -> sequence, position + i + 1, memory_order_release);
+  }
+  atomic_fetch_add_explicit(&r -> stats.lines, 1, memory_order_relaxed);
+
+  log_ring_wake(r);
+  return length;
+}
+
+int log_printf(log_ring *r, const char *format, ...)
+{
+  va_list args;
+  int length;
+
+  va_start(args, format);
+  length = log_vprintf(r, format, args);
+  va_end(args);
+  return length;
+}
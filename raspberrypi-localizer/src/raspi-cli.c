@@ -53,7 +53,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string.h>
 #include <memory.h>
 
+#if !defined(LOC_HOST_BUILD)
 #include "interface/vcos/vcos.h"
+#else
+#include <assert.h>
+#define vcos_assert(cond) assert(cond)
+#endif
 
 #include "raspi-cli.h"
 
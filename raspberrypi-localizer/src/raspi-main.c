@@ -68,6 +68,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "raspi-cam-control.h" 
 #include "raspi-cli.h"
 #include "raspi-tex.h"
+#include "frame-ring.h"
 
 #include <semaphore.h>
 #include <math.h>
@@ -164,6 +165,26 @@ static void display_valid_parameters(char *app_name);
 #define CommandImageBlur          11
 #define CommandImageResolution    12
 #define CommandVerbose            13
+#define CommandLedCapacity        14
+#define CommandLedRoiCircle       15
+#define CommandDecodeThreads      16
+#define CommandPipeline           17
+#define CommandDropPolicy         18
+#define CommandRtPreview          19
+#define CommandRtDetector         20
+#define CommandRtDecoder          21
+#define CommandLockMemory         22
+#define CommandEventLoop          23
+#define CommandStreamShm          24
+#define CommandStreamSocket       25
+#define CommandIntrinsics         26
+#define CommandExtrinsics         27
+#define CommandLedHeights         28
+#define CommandUplink             29
+#define CommandUplinkBaud         30
+#define CommandUplinkBudget       31
+#define CommandRecord             32
+#define CommandRecordSeconds      33
 
 static COMMAND_LIST cmdline_commands[] =
 {
@@ -180,7 +201,27 @@ static COMMAND_LIST cmdline_commands[] =
    { CommandOnPixelsInFrame,    "-on_pixels_in_frame",   "o",   "Maintained Number of On Pixels a Frame",  1},
    { CommandImageBlur,          "-blur",                 "u",   "Blur",  0},
    { CommandImageResolution,    "-resolution",           "res", "Resolution",  1},
-   { CommandVerbose,            "-verbose",              "v",   "Verbose", 0 }
+   { CommandVerbose,            "-verbose",              "v",   "Verbose", 0 },
+   { CommandLedCapacity,        "-led_capacity",         "lc",  "Maximum Number of Tracked LEDs",  1},
+   { CommandLedRoiCircle,       "-led_roi_circle",       "rc",  "Circular LED Region of Interest",  0},
+   { CommandDecodeThreads,      "-decode_threads",       "dt",  "Number of LED Decoding Threads",  1},
+   { CommandPipeline,           "-pipeline",             "pl",  "Decode LEDs on a Second Thread",  0},
+   { CommandDropPolicy,         "-drop_policy",          "dp",  "Full Frame Queue: newest, oldest or block",  1},
+   { CommandRtPreview,          "-rt_preview",           "rp",  "Preview Thread SCHED_FIFO priority[:cpu]",  1},
+   { CommandRtDetector,         "-rt_detector",          "rd",  "Detector Thread SCHED_FIFO priority[:cpu]",  1},
+   { CommandRtDecoder,          "-rt_decoder",           "rdc", "Decoder Thread SCHED_FIFO priority[:cpu]",  1},
+   { CommandLockMemory,         "-mlock",                "ml",  "Lock All Memory in RAM",  0},
+   { CommandEventLoop,          "-event_loop",           "el",  "Preview, Detection and Output on One Thread",  0},
+   { CommandStreamShm,          "-stream_shm",           "ss",  "Publish Identified LEDs to a Shared Memory Ring",  1},
+   { CommandStreamSocket,       "-stream_socket",        "su",  "Send Identified LEDs to a Unix Socket",  1},
+   { CommandIntrinsics,         "-intrinsics",           "ci",  "Intrinsic Parameters File for World Coordinates",  1},
+   { CommandExtrinsics,         "-extrinsics",           "ce",  "Extrinsic Parameters File for World Coordinates",  1},
+   { CommandLedHeights,         "-led_heights",          "lh",  "LED Heights File for World Coordinates",  1},
+   { CommandUplink,             "-uplink",               "ul",  "Serial Port to Send World Coordinates on",  1},
+   { CommandUplinkBaud,         "-uplink_baud",          "ub",  "Uplink Baud Rate",  1},
+   { CommandUplinkBudget,       "-uplink_budget",        "ug",  "Uplink Bytes per Second, 0 for the Baud Rate",  1},
+   { CommandRecord,             "-record",               "rec", "Record the Packed Frames to a File",  1},
+   { CommandRecordSeconds,      "-record_seconds",       "rs",  "Seconds of Frames to Preallocate the Recording for",  1}
 };
 
 static int cmdline_commands_size = sizeof(cmdline_commands) / sizeof(cmdline_commands[0]);
@@ -359,6 +400,107 @@ static int parse_cmdline(int argc, const char **argv, RASPISTILL_STATE *state)
         i++;
         state->raspitex_state.led_radius = atoi(argv[i]);
         break;
+
+      case CommandLedCapacity:
+        i++;
+        state->raspitex_state.led_capacity = atoi(argv[i]);
+        break;
+
+      case CommandLedRoiCircle:
+        state->raspitex_state.led_roi_circle = 1;
+        break;
+
+      case CommandDecodeThreads:
+        i++;
+        state->raspitex_state.led_decode_threads = atoi(argv[i]);
+        break;
+
+      case CommandPipeline:
+        state->raspitex_state.led_pipeline = 1;
+        break;
+
+      case CommandDropPolicy:
+        i++;
+        if (strcmp(argv[i], "oldest") == 0)
+          state->raspitex_state.led_drop_policy = FRAME_RING_DROP_OLDEST;
+        else if (strcmp(argv[i], "block") == 0)
+          state->raspitex_state.led_drop_policy = FRAME_RING_BLOCK;
+        else
+          state->raspitex_state.led_drop_policy = FRAME_RING_DROP_NEWEST;
+        break;
+
+      case CommandRtPreview:
+        i++;
+        valid = (rt_thread_parse(&state->raspitex_state.rt_preview, argv[i]) == 0);
+        break;
+
+      case CommandRtDetector:
+        i++;
+        valid = (rt_thread_parse(&state->raspitex_state.rt_detector, argv[i]) == 0);
+        break;
+
+      case CommandRtDecoder:
+        i++;
+        valid = (rt_thread_parse(&state->raspitex_state.rt_decoder, argv[i]) == 0);
+        break;
+
+      case CommandLockMemory:
+        state->raspitex_state.lock_memory = 1;
+        break;
+
+      case CommandEventLoop:
+        state->raspitex_state.event_loop = 1;
+        break;
+
+      case CommandStreamShm:
+        i++;
+        state->raspitex_state.stream_shm = argv[i];
+        break;
+
+      case CommandStreamSocket:
+        i++;
+        state->raspitex_state.stream_socket = argv[i];
+        break;
+
+      case CommandIntrinsics:
+        i++;
+        state->raspitex_state.intrinsics = argv[i];
+        break;
+
+      case CommandExtrinsics:
+        i++;
+        state->raspitex_state.extrinsics = argv[i];
+        break;
+
+      case CommandLedHeights:
+        i++;
+        state->raspitex_state.led_heights = argv[i];
+        break;
+
+      case CommandUplink:
+        i++;
+        state->raspitex_state.uplink = argv[i];
+        break;
+
+      case CommandUplinkBaud:
+        i++;
+        state->raspitex_state.uplink_baud = atoi(argv[i]);
+        break;
+
+      case CommandUplinkBudget:
+        i++;
+        state->raspitex_state.uplink_budget = atoi(argv[i]);
+        break;
+
+      case CommandRecord:
+        i++;
+        state->raspitex_state.record = argv[i];
+        break;
+
+      case CommandRecordSeconds:
+        i++;
+        state->raspitex_state.record_seconds = atoi(argv[i]);
+        break;
       
       case CommandCameraISO:
         i++;
@@ -808,6 +950,20 @@ int main(int argc, const char **argv)
       exit(EX_USAGE);
    }
 
+   if (state.raspitex_state.lock_memory)
+      rt_lock_memory(stderr);
+
+   /* The event loop takes the signals from a signalfd, every thread created from here on must leave them blocked. */
+   if (state.raspitex_state.event_loop)
+   {
+      sigset_t signals;
+
+      sigemptyset(&signals);
+      sigaddset(&signals, SIGINT);
+      sigaddset(&signals, SIGTERM);
+      pthread_sigmask(SIG_BLOCK, &signals, NULL);
+   }
+
    // Setup for sensor specific parameters
    set_sensor_defaults(&state);
 
@@ -852,9 +1008,13 @@ int main(int argc, const char **argv)
 
          vcos_assert(vcos_status == VCOS_SUCCESS);
 
-         /* If GL preview is requested then start the GL threads */
-         if (raspitex_start(&state.raspitex_state) != 0)
+         /* If GL preview is requested then start the GL threads, the event loop
+          * runs everything on this thread until a signal stops it instead */
+         if ((state.raspitex_state.event_loop ? raspitex_run(&state.raspitex_state) : raspitex_start(&state.raspitex_state)) != 0)
+         {
+            exit_code = EX_SOFTWARE;
             goto error;
+         }
 
          if (status != MMAL_SUCCESS)
          {
@@ -863,7 +1023,8 @@ int main(int argc, const char **argv)
          }
 
          {
-            wait_for_signal(&state);
+            if (!state.raspitex_state.event_loop)
+               wait_for_signal(&state);
             vcos_semaphore_delete(&callback_data.complete_semaphore);
          }
       }
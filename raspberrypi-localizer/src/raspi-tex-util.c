@@ -39,7 +39,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "raspi-tex-util.h"
 #include "raspi-tex.h"
-#include "led-detector.h"
+#include "configurations.h"
 #include <bcm_host.h>
 #include <GLES2/gl2.h>
 
@@ -325,10 +325,6 @@ int raspitexutil_do_update_texture(EGLDisplay display, EGLenum target,
    return 0;
 }
 
-extern led_detector g_led_dectector;
-int bg_available = 0;
-int bg_counter = 0;
-int bg_ready = 0;
 /**
  * Updates the Y plane texture to the specified MMAL buffer.
  * @param raspitex_state A pointer to the GL preview state.
@@ -344,22 +340,22 @@ int raspitexutil_update_texture(RASPITEX_STATE *raspitex_state,
             EGL_IMAGE_BRCM_MULTIMEDIA_Y, mm_buf,
             &raspitex_state->texture[0], &raspitex_state->egl_image);
 
-  if (bg_counter % 1200 == 120) {
-    bg_ready = 1;
+  /* The event loop refreshes the background from a timer. */
+  if (!raspitex_state->event_loop && raspitex_state->bg_counter % LED_BG_REFRESH_FRAMES == LED_BG_WARMUP_FRAMES) {
+    raspitex_state->bg_ready = 1;
   }
 
-  if (bg_ready /*&& g_led_dectector.leds_queue_size == 0*/) {
+  if (raspitex_state->bg_ready) {
     ret = raspitexutil_do_update_texture(raspitex_state->display,
                 EGL_IMAGE_BRCM_MULTIMEDIA_Y, mm_buf,
                 &raspitex_state->texture[1], &raspitex_state->egl_image);
-    fprintf(stdout, "updating bg\n");
-    fflush(stdout);
+    log_printf(raspitex_state->log, "updating bg\n");
 
-    bg_counter = 120;
-    bg_ready = 0;
-    bg_available = 1;
+    raspitex_state->bg_counter = LED_BG_WARMUP_FRAMES;
+    raspitex_state->bg_ready = 0;
+    raspitex_state->bg_available = 1;
   }
-  bg_counter++;
+  raspitex_state->bg_counter++;
 
   return ret;
 }
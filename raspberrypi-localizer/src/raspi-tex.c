@@ -43,7 +43,14 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 #include <GLES/gl.h>
@@ -196,7 +203,8 @@ static int preview_process_returned_bufs(RASPITEX_STATE* state)
             return rc;
          }
       }
-      usleep(0); // context switch
+      if (!state->event_loop)
+         usleep(0); // context switch
    }
 
    return rc;
@@ -217,6 +225,8 @@ static void *preview_worker(void *arg)
 
    vcos_log_trace("%s: port %p", VCOS_FUNCTION, preview_port);
 
+   rt_thread_apply(&state->rt_preview, "preview", stdout);
+
    rc = raspitexutil_create_native_window(state);
    if (rc != 0)
       goto end;
@@ -250,6 +260,7 @@ end:
       mmal_buffer_header_release(buf);
 
    /* Tear down GL */
+   sbpp_term(state);
    raspitexutil_gl_term(state);
    vcos_log_trace("Exiting preview worker");
    return NULL;
@@ -286,6 +297,14 @@ static void preview_output_cb(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf)
       buf -> dts = (int64_t)(f);
       mmal_queue_put(state->preview_queue, buf);
    }
+
+   if (state->frame_fd >= 0)
+   {
+      uint64_t one = 1;
+
+      if (write(state->frame_fd, &one, sizeof(one)) < 0)
+         vcos_log_trace("%s: frame event lost", port->name);
+   }
 }
 
 /* Registers a callback on the camera preview port to receive
@@ -385,6 +404,14 @@ int raspitex_init(RASPITEX_STATE *state)
    if (rc != 0)
       goto error;
 
+   state->frame_fd = -1;
+   if (state->event_loop)
+   {
+      state->frame_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if (state->frame_fd < 0)
+         goto error;
+   }
+
    return 0;
 
 error:
@@ -413,6 +440,12 @@ void raspitex_destroy(RASPITEX_STATE *state)
    if (state->is_ready)
      raspitexutil_destroy_native_window(state);
 
+   if (state->frame_fd >= 0)
+   {
+      close(state->frame_fd);
+      state->frame_fd = -1;
+   }
+
 }
 
 /* Initialise the GL / window state to sensible defaults.
@@ -424,6 +457,7 @@ void raspitex_destroy(RASPITEX_STATE *state)
 void raspitex_set_defaults(RASPITEX_STATE *state)
 {
    memset(state, 0, sizeof(*state));
+   state->frame_fd = -1;
    state->version_major = RASPITEX_VERSION_MAJOR;
    state->version_minor = RASPITEX_VERSION_MINOR;
    state->display = EGL_NO_DISPLAY;
@@ -439,10 +473,31 @@ void raspitex_set_defaults(RASPITEX_STATE *state)
    state->led_blob_size = LED_BLOB_SIZE;
    state->led_one_zero_thresh = LED_ONE_ZERO_THRESHOLD;
    state->led_find_radius = LED_FIND_RADIUS;
+   state->led_capacity = LED_CAPACITY;
+   state->led_decode_threads = LED_DECODE_THREADS;
    state->led_radius = LED_RADIUS;
+   state->led_roi_circle = LED_ROI_CIRCLE;
+   state->led_pipeline = LED_PIPELINE;
+   state->led_drop_policy = LED_DROP_POLICY;
+   state->lock_memory = 0;
+   state->event_loop = 0;
+   state->stream_shm = NULL;
+   state->stream_socket = NULL;
+   state->intrinsics = state->extrinsics = state->led_heights = NULL;
+   state->uplink = NULL;
+   state->uplink_baud = UPLINK_BAUD;
+   state->uplink_budget = 0;
+   state->record = NULL;
+   state->record_seconds = FRAME_RECORD_SECONDS;
+   state->rt_preview = state->rt_detector = state->rt_decoder = (rt_thread_config){0, 0, 0};
    state->number_of_images = 1;
    state->on_pixels_in_frame = FRAME_ONES_THRESH;
    state->enable_dynamic_luminence = 1;
+   state->bg_available = 0;
+   state->bg_ready = 0;
+   state->bg_counter = 0;
+   state->scene_state = NULL;
+   state->log = NULL;
 }
 
 /* Stops the rendering loop and destroys MMAL resources
@@ -474,8 +529,188 @@ int raspitex_start(RASPITEX_STATE *state)
          NULL, preview_worker, state);
 
    if (status != VCOS_SUCCESS)
+   {
       vcos_log_error("%s: Failed to start worker thread %d",
             VCOS_FUNCTION, status);
+      /* There is no thread for raspitex_stop to join. */
+      state->preview_stop = 1;
+   }
 
    return (status == VCOS_SUCCESS ? 0 : -1);
 }
+
+/* Arm a periodic timer, the first expiry after first_ms. -1 if it could not be. */
+static int raspitex_timer(uint32_t first_ms, uint32_t period_ms)
+{
+   struct itimerspec t;
+   int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+   if (fd < 0)
+      return -1;
+
+   t.it_value.tv_sec = first_ms / 1000;
+   t.it_value.tv_nsec = (first_ms % 1000) * 1000000L;
+   t.it_interval.tv_sec = period_ms / 1000;
+   t.it_interval.tv_nsec = (period_ms % 1000) * 1000000L;
+   if (timerfd_settime(fd, 0, &t, NULL) != 0)
+   {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+static int raspitex_watch(int epfd, int fd, uint32_t events)
+{
+   struct epoll_event e;
+
+   e.events = events;
+   e.data.fd = fd;
+   return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e);
+}
+
+/**
+ * Runs the preview, the detector and its output on the calling thread, the
+ * event loop alternative to raspitex_start on a single core. One epoll set
+ * takes the frame eventfd the camera callback signals, a signalfd for
+ * SIGINT / SIGTERM, timers for the report and the background refresh, and
+ * the output stream while the log has lines the stream did not take.
+ * Frames are processed inline as they arrive.
+ * @pre raspitex_init with event_loop set, raspitex_configure_preview_port.
+ * @pre SIGINT and SIGTERM blocked in every thread.
+ * @param state Pointer to the GL preview state.
+ * @return Zero once a signal or the end of the stream stopped it, -1 if
+ * it could not be set up, with whatever was torn down again.
+ */
+int raspitex_run(RASPITEX_STATE *state)
+{
+   MMAL_BUFFER_HEADER_T *buf;
+   struct epoll_event events[8];
+   sigset_t signals;
+   int epfd, signal_fd, report_fd, bg_fd, output_fd = -1;
+   uint8_t output_watched = 0, output_armed = 0;
+   int rc;
+
+   vcos_log_trace("%s", VCOS_FUNCTION);
+   rt_thread_apply(&state->rt_preview, "preview", stdout);
+
+   rc = raspitexutil_create_native_window(state);
+   if (rc == 0)
+      rc = sbpp_init(state);
+   if (rc != 0)
+   {
+      vcos_log_error("%s: Failed to set up the preview %d", VCOS_FUNCTION, rc);
+      state->preview_stop = 1;
+      sbpp_term(state);
+      raspitexutil_gl_term(state);
+      return -1;
+   }
+
+   sigemptyset(&signals);
+   sigaddset(&signals, SIGINT);
+   sigaddset(&signals, SIGTERM);
+   signal_fd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+   report_fd = raspitex_timer(LED_REPORT_INTERVAL_MS, LED_REPORT_INTERVAL_MS);
+   bg_fd = raspitex_timer(LED_BG_WARMUP_FRAMES * FRAME_TRANSFER_TIME, LED_BG_REFRESH_FRAMES * FRAME_TRANSFER_TIME);
+   epfd = epoll_create1(EPOLL_CLOEXEC);
+
+   if (signal_fd < 0 || report_fd < 0 || bg_fd < 0 || epfd < 0
+      || raspitex_watch(epfd, state->frame_fd, EPOLLIN) != 0
+      || raspitex_watch(epfd, signal_fd, EPOLLIN) != 0
+      || raspitex_watch(epfd, report_fd, EPOLLIN) != 0
+      || raspitex_watch(epfd, bg_fd, EPOLLIN) != 0)
+   {
+      vcos_log_error("%s: Failed to set up the event loop", VCOS_FUNCTION);
+      state->preview_stop = 1;
+      rc = -1;
+   }
+   else
+   {
+      /* Regular files cannot be watched, nor do they need to be: they never refuse a write. */
+      struct epoll_event e = { 0, { .fd = fileno(state->log->out) } };
+
+      log_ring_start_polled(state->log);
+      output_fd = e.data.fd;
+      output_watched = (epoll_ctl(epfd, EPOLL_CTL_ADD, output_fd, &e) == 0);
+   }
+
+   while (state->preview_stop == 0)
+   {
+      int n;
+
+      /* Send empty buffers to camera preview port */
+      while ((buf = mmal_queue_get(state->preview_pool->queue)) != NULL)
+      {
+         if (mmal_port_send_buffer(state->preview_port, buf) != MMAL_SUCCESS)
+            vcos_log_error("Failed to send buffer to %s", state->preview_port->name);
+      }
+
+      n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+      if (n < 0 && errno != EINTR)
+      {
+         vcos_log_error("%s: epoll_wait failed %d", VCOS_FUNCTION, errno);
+         state->preview_stop = 1;
+         rc = -1;
+      }
+      for (int i = 0; i < n; i++)
+      {
+         int fd = events[i].data.fd;
+         uint64_t count;
+
+         if (fd == state->frame_fd)
+         {
+            if (read(fd, &count, sizeof(count)) > 0 && preview_process_returned_bufs(state) != 0)
+            {
+               vcos_log_error("Preview error. Exiting.");
+               state->preview_stop = 1;
+            }
+         }
+         else if (fd == signal_fd)
+         {
+            struct signalfd_siginfo info;
+
+            if (read(fd, &info, sizeof(info)) == sizeof(info))
+               log_printf(state->log, "%u Signal Received.\n", info.ssi_signo);
+            state->preview_stop = 1;
+         }
+         else if (fd == report_fd)
+         {
+            if (read(fd, &count, sizeof(count)) > 0)
+               sbpp_report(state);
+         }
+         else if (fd == bg_fd)
+         {
+            if (read(fd, &count, sizeof(count)) > 0)
+               state->bg_ready = 1;
+         }
+      }
+
+      /* Wait for the stream to take more only while the log holds lines it refused. */
+      if (log_ring_drain(state->log) != output_armed && output_watched)
+      {
+         struct epoll_event e = { 0, { .fd = output_fd } };
+
+         output_armed = !output_armed;
+         e.events = output_armed ? EPOLLOUT : 0;
+         epoll_ctl(epfd, EPOLL_CTL_MOD, output_fd, &e);
+      }
+   }
+
+   if (epfd >= 0)
+      close(epfd);
+   if (signal_fd >= 0)
+      close(signal_fd);
+   if (report_fd >= 0)
+      close(report_fd);
+   if (bg_fd >= 0)
+      close(bg_fd);
+
+   /* Make sure all buffers are returned on exit */
+   while ((buf = mmal_queue_get(state->preview_queue)) != NULL)
+      mmal_buffer_header_release(buf);
+
+   /* Tear down GL, the last lines of the log are written out on the way */
+   sbpp_term(state);
+   raspitexutil_gl_term(state);
+   return rc;
+}
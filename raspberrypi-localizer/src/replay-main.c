@@ -0,0 +1,299 @@
+/*
+ ============================================================================
+ Name        : replay-main.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : localizer-replay, decodes recordings made with -record on
+               any machine, without the camera or GL. Each recording gets
+               a detector of its own and the recordings are spread over
+               -threads workers, so days of captures decode in minutes.
+ ============================================================================
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sysexits.h>
+#include "configurations.h"
+#include "raspi-cli.h"
+#include "raspi-tex.h"
+#include "world-map.h"
+#include "replay.h"
+
+#define CommandHelp               0
+#define CommandLedBlobSize        1
+#define CommandLedOneZeroTresh    2
+#define CommandLedFindRadius      3
+#define CommandLedRadius          4
+#define CommandLedCapacity        5
+#define CommandLedRoiCircle       6
+#define CommandDecodeThreads      7
+#define CommandIntrinsics         8
+#define CommandExtrinsics         9
+#define CommandLedHeights         10
+#define CommandThreads            11
+
+/* The detector's options are the localizer's, so a capture replays with the command line it was recorded with. */
+static COMMAND_LIST cmdline_commands[] =
+{
+  { CommandHelp,               "-help",                 "?",   "This help information", 0 },
+  { CommandLedBlobSize,        "-led_blob_size",        "b",   "LED Blob Size", 1 },
+  { CommandLedOneZeroTresh,    "-led_thresh",           "t",   "LED Threshld", 1 },
+  { CommandLedFindRadius,      "-led_find_radius",      "f",   "LED Find Radius",  1},
+  { CommandLedRadius,          "-led_radius",           "r",   "LED Radius",  1},
+  { CommandLedCapacity,        "-led_capacity",         "lc",  "Maximum Number of Tracked LEDs",  1},
+  { CommandLedRoiCircle,       "-led_roi_circle",       "rc",  "Circular LED Region of Interest",  0},
+  { CommandDecodeThreads,      "-decode_threads",       "dt",  "Number of LED Decoding Threads",  1},
+  { CommandIntrinsics,         "-intrinsics",           "ci",  "Intrinsic Parameters File for World Coordinates",  1},
+  { CommandExtrinsics,         "-extrinsics",           "ce",  "Extrinsic Parameters File for World Coordinates",  1},
+  { CommandLedHeights,         "-led_heights",          "lh",  "LED Heights File for World Coordinates",  1},
+  { CommandThreads,            "-threads",              "j",   "Recordings Decoded at Once, the CPUs by default",  1}
+};
+
+static int cmdline_commands_size = sizeof(cmdline_commands) / sizeof(cmdline_commands[0]);
+
+typedef struct replay_job_t {
+  const char    *path;
+  int           rc;
+  replay_stats  stats;
+} replay_job;
+
+typedef struct replay_context_t {
+  RASPITEX_STATE  state;
+  world_map       *world;
+  replay_job      *jobs;
+  uint32_t        count;
+  _Atomic uint32_t  next;
+} replay_context;
+
+static void display_valid_parameters(char *app_name)
+{
+  fprintf(stdout, "Decodes recordings made with -record as fast as the CPU allows\n\n");
+  fprintf(stdout, "usage: %s [options] recording...\n\n", app_name);
+  fprintf(stdout, "One recording is decoded to stdout, each of several to <recording>.log\n\n");
+
+  raspicli_display_help(cmdline_commands, cmdline_commands_size);
+
+  fprintf(stdout, "\n");
+}
+
+/* The localizer's defaults for the detector, see raspitex_set_defaults. */
+static void default_state(RASPITEX_STATE *state)
+{
+  memset(state, 0, sizeof(*state));
+  state->led_blob_size = LED_BLOB_SIZE;
+  state->led_one_zero_thresh = LED_ONE_ZERO_THRESHOLD;
+  state->led_find_radius = LED_FIND_RADIUS;
+  state->led_capacity = LED_CAPACITY;
+  state->led_decode_threads = LED_DECODE_THREADS;
+  state->led_radius = LED_RADIUS;
+  state->led_roi_circle = LED_ROI_CIRCLE;
+  /* Frames are decoded on the calling thread, there is no worker to pipeline. */
+  state->led_pipeline = 0;
+  state->event_loop = 1;
+}
+
+static int parse_cmdline(int argc, const char **argv, replay_context *ctx, int *threads)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    int command_id, num_parameters;
+
+    if (argv[i][0] != '-')
+    {
+      ctx->jobs[ctx->count++].path = argv[i];
+      continue;
+    }
+
+    command_id = raspicli_get_command_id(cmdline_commands, cmdline_commands_size, &argv[i][1], &num_parameters);
+    if (command_id == -1 || (num_parameters > 0 && i + 1 >= argc))
+    {
+      fprintf(stderr, "Invalid command line option (%s)\n", argv[i]);
+      return -1;
+    }
+
+    switch (command_id)
+    {
+    case CommandHelp:
+      display_valid_parameters(basename((char*)argv[0]));
+      return -1;
+
+    case CommandLedBlobSize:
+      ctx->state.led_blob_size = atoi(argv[++i]);
+      break;
+
+    case CommandLedOneZeroTresh:
+      ctx->state.led_one_zero_thresh = atoi(argv[++i]);
+      break;
+
+    case CommandLedFindRadius:
+      ctx->state.led_find_radius = atoi(argv[++i]);
+      break;
+
+    case CommandLedRadius:
+      ctx->state.led_radius = atoi(argv[++i]);
+      break;
+
+    case CommandLedCapacity:
+      ctx->state.led_capacity = atoi(argv[++i]);
+      break;
+
+    case CommandLedRoiCircle:
+      ctx->state.led_roi_circle = 1;
+      break;
+
+    case CommandDecodeThreads:
+      ctx->state.led_decode_threads = atoi(argv[++i]);
+      break;
+
+    case CommandIntrinsics:
+      ctx->state.intrinsics = argv[++i];
+      break;
+
+    case CommandExtrinsics:
+      ctx->state.extrinsics = argv[++i];
+      break;
+
+    case CommandLedHeights:
+      ctx->state.led_heights = argv[++i];
+      break;
+
+    case CommandThreads:
+      *threads = atoi(argv[++i]);
+      break;
+    }
+  }
+
+  if (ctx->count == 0)
+  {
+    display_valid_parameters(basename((char*)argv[0]));
+    return -1;
+  }
+  return 0;
+}
+
+/* Take the next recording until there are none left. */
+static void* replay_worker(void *args)
+{
+  replay_context *ctx = (replay_context*)args;
+  uint32_t i;
+
+  while ((i = atomic_fetch_add(&ctx->next, 1)) < ctx->count)
+  {
+    replay_job *job = &ctx->jobs[i];
+    RASPITEX_STATE state = ctx->state;
+    char *name = NULL;
+    FILE *out = stdout;
+
+    if (ctx->count > 1)
+    {
+      if (asprintf(&name, "%s.log", job->path) < 0 || !(out = fopen(name, "w")))
+      {
+        fprintf(stderr, "Could not open the log of %s\n", job->path);
+        free(name);
+        job->rc = -1;
+        continue;
+      }
+    }
+
+    job->rc = replay_recording(job->path, &state, ctx->world, out, &job->stats);
+    if (job->rc != 0)
+      fprintf(stderr, "Could not replay %s\n", job->path);
+    if (out != stdout)
+      fclose(out);
+    else
+      fflush(out);
+    free(name);
+  }
+
+  return NULL;
+}
+
+int main(int argc, const char **argv)
+{
+  replay_context ctx;
+  pthread_t *workers;
+  replay_stats total;
+  int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int started = 0, failed = 0;
+  double t0, seconds;
+
+  memset(&ctx, 0, sizeof(ctx));
+  default_state(&ctx.state);
+  ctx.jobs = (replay_job*)calloc(argc, sizeof(replay_job));
+  if (!ctx.jobs || parse_cmdline(argc, argv, &ctx, &threads) != 0)
+  {
+    free(ctx.jobs);
+    return EX_USAGE;
+  }
+
+  /* Loaded once, the detectors only read it. */
+  if (ctx.state.intrinsics || ctx.state.extrinsics || ctx.state.led_heights)
+  {
+    ctx.world = (world_map*)malloc(sizeof(world_map));
+    if (!ctx.world || world_map_load(ctx.world, ctx.state.intrinsics, ctx.state.extrinsics, ctx.state.led_heights) != 0)
+    {
+      free(ctx.world);
+      free(ctx.jobs);
+      return EX_DATAERR;
+    }
+  }
+
+  if (threads < 1)
+    threads = 1;
+  if ((uint32_t)threads > ctx.count)
+    threads = ctx.count;
+  workers = (pthread_t*)malloc(threads * sizeof(pthread_t));
+
+  t0 = replay_now_s();
+  for (int i = 0; i < threads; i++)
+  {
+    if (pthread_create(&workers[started], NULL, replay_worker, &ctx) == 0)
+      started++;
+  }
+  /* Without a thread of its own it is down to this one. */
+  if (started == 0)
+    replay_worker(&ctx);
+  for (int i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+  seconds = replay_now_s() - t0;
+
+  memset(&total, 0, sizeof(total));
+  for (uint32_t i = 0; i < ctx.count; i++)
+  {
+    replay_stats *s = &ctx.jobs[i].stats;
+
+    fprintf(stderr, "%s - frames: %u, dropped: %u, capture_s: %.1f, replay_s: %.2f, fps: %.0f, real_time: %.0fx\n",
+      ctx.jobs[i].path, s->frames, s->dropped, s->capture_us / 1e6, s->seconds,
+      s->seconds > 0 ? s->frames / s->seconds : 0, s->seconds > 0 ? (s->capture_us / 1e6) / s->seconds : 0);
+    if (s->dropped)
+      fprintf(stderr, "%s - %u frames were dropped while recording, their decode can differ from the live run\n", ctx.jobs[i].path, s->dropped);
+    total.frames += s->frames;
+    total.dropped += s->dropped;
+    total.capture_us += s->capture_us;
+    failed |= ctx.jobs[i].rc != 0;
+  }
+  if (ctx.count > 1)
+  {
+    fprintf(stderr, "total - recordings: %u, threads: %d, frames: %u, dropped: %u, capture_s: %.1f, replay_s: %.2f, fps: %.0f, real_time: %.0fx\n",
+      ctx.count, started ? started : 1, total.frames, total.dropped, total.capture_us / 1e6, seconds,
+      seconds > 0 ? total.frames / seconds : 0, seconds > 0 ? (total.capture_us / 1e6) / seconds : 0);
+  }
+
+  free(workers);
+  if (ctx.world)
+  {
+    world_map_destroy(ctx.world);
+    free(ctx.world);
+  }
+  free(ctx.jobs);
+  return failed ? EX_SOFTWARE : EX_OK;
+}
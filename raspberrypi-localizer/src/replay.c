@@ -0,0 +1,82 @@
+/*
+ ============================================================================
+ Name        : replay.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Recorded packed frames decoded on the calling thread, as
+               fast as the CPU allows
+ ============================================================================
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "led-detector.h"
+#include "frame-record.h"
+#include "replay.h"
+
+double replay_now_s(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+/*
+ Decode the recording at path with a detector of its own, configured by
+ state, its log written to out. -1 when the recording cannot be opened or
+ is cut short, what was decoded until then is in the log and stats.
+ */
+int replay_recording(const char *path, RASPITEX_STATE *state, const world_map *world, FILE *out, replay_stats *stats)
+{
+  frame_record f;
+  led_detector *ld;
+  frame_info info;
+  uint32_t count;
+  double t0;
+  int rc = 0;
+
+  memset(stats, 0, sizeof(*stats));
+  if (frame_record_open(&f, path) != 0)
+    return -1;
+  ld = led_detector_create(state);
+  if (!ld)
+  {
+    frame_record_close(&f);
+    return -1;
+  }
+  /* The log ring is never started, log_printf writes out on this thread. */
+  ld -> log.out = out;
+  ld -> world = world;
+
+  count = atomic_load(&f.header.count);
+  stats -> dropped = f.header.dropped;
+  t0 = replay_now_s();
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (frame_record_read(&f, i, ld -> bit_frame) != 0)
+    {
+      rc = -1;
+      break;
+    }
+    info.pts = f.index[i].pts;
+    info.frame_time = (uint32_t)info.pts;
+    info.frame_number = f.index[i].frame_number;
+    led_detector_frame_occupancy(&info.occupancy, ld -> bit_frame);
+    led_detector_process_internal(ld, ld -> bit_frame, &info);
+    stats -> frames++;
+  }
+  stats -> seconds = replay_now_s() - t0;
+  if (stats -> frames > 1)
+    stats -> capture_us = f.index[stats -> frames - 1].pts - f.index[0].pts;
+
+  led_detector_free(ld);
+  frame_record_close(&f);
+  return rc;
+}
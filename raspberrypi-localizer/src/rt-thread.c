@@ -0,0 +1,226 @@
+/*
+ ============================================================================
+ Name        : rt-thread.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : SCHED_FIFO, CPU affinity and mlockall for the capture and
+               detector threads, frame interval histogram
+ ============================================================================
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#ifndef __MINGW32__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+#include "configurations.h"
+#include "rt-thread.h"
+
+#ifndef CPU_SETSIZE
+#define CPU_SETSIZE 1024
+#endif
+
+/*
+ "priority[:cpu]", e.g. "50" or "50:2". A priority of 0 keeps the default
+ policy, so "0:3" only pins the thread to CPU 3.
+ */
+int rt_thread_parse(rt_thread_config *c, const char *arg)
+{
+  char *end;
+  long priority, cpu = 0;
+  uint8_t pinned = 0;
+
+  if (!arg)
+    return -1;
+
+  priority = strtol(arg, &end, 10);
+  if (end == arg || priority < 0 || priority > 99)
+    return -1;
+
+  if (*end == ':')
+  {
+    const char *s = end + 1;
+
+    cpu = strtol(s, &end, 10);
+    if (end == s || cpu < 0 || cpu >= CPU_SETSIZE)
+      return -1;
+    pinned = 1;
+  }
+  if (*end)
+    return -1;
+
+  c -> priority = (uint8_t)priority;
+  c -> pinned = pinned;
+  c -> cpu = (uint16_t)cpu;
+  return 0;
+}
+
+/*
+ Apply c to the calling thread. Returns 0 when everything asked for took
+ effect; whatever could not be applied is reported on out and left as is.
+ */
+int rt_thread_apply(const rt_thread_config *c, const char *name, FILE *out)
+{
+  int rc = 0;
+
+  if (!c -> priority && !c -> pinned)
+    return 0;
+
+#ifndef __MINGW32__
+  if (c -> pinned)
+  {
+    cpu_set_t set;
+    int err;
+
+    CPU_ZERO(&set);
+    CPU_SET(c -> cpu, &set);
+    if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+    {
+      fprintf(out, "%s: cannot run on cpu %u: %s\n", name, c -> cpu, strerror(err));
+      rc = -1;
+    }
+  }
+
+  if (c -> priority)
+  {
+    struct sched_param param;
+    int err;
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = c -> priority;
+    if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+    {
+      fprintf(out, "%s: cannot set SCHED_FIFO priority %u: %s\n", name, c -> priority, strerror(err));
+      rc = -1;
+    }
+  }
+
+  if (rc == 0)
+  {
+    if (c -> pinned)
+      fprintf(out, "%s: SCHED_%s priority %u, cpu %u\n", name, c -> priority ? "FIFO" : "OTHER", c -> priority, c -> cpu);
+    else
+      fprintf(out, "%s: SCHED_%s priority %u, any cpu\n", name, c -> priority ? "FIFO" : "OTHER", c -> priority);
+  }
+#else
+  fprintf(out, "%s: real-time scheduling is not supported on this platform\n", name);
+  rc = -1;
+#endif
+
+  fflush(out);
+  return rc;
+}
+
+/* Keep every page of the process, present and future, in RAM so no frame waits on a page fault. */
+int rt_lock_memory(FILE *out)
+{
+#ifndef __MINGW32__
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+  {
+    fprintf(out, "mlockall failed: %s\n", strerror(errno));
+    fflush(out);
+    return -1;
+  }
+  return 0;
+#else
+  fprintf(out, "mlockall is not supported on this platform\n");
+  fflush(out);
+  return -1;
+#endif
+}
+
+void rt_jitter_reset(rt_jitter *j)
+{
+  memset(j, 0, sizeof(*j));
+  j -> prev = -1;
+}
+
+/* Account the interval between the previous sample and time_ms. */
+void rt_jitter_add(rt_jitter *j, double time_ms)
+{
+  double d = time_ms - j -> prev;
+  int32_t bin;
+
+  if (j -> prev < 0)
+  {
+    j -> prev = time_ms;
+    return;
+  }
+  j -> prev = time_ms;
+
+  bin = (d > 0) ? (int32_t)(d / RT_JITTER_BIN_MS) : 0;
+  j -> bins[(bin < RT_JITTER_BINS) ? bin : (RT_JITTER_BINS - 1)]++;
+
+  if (j -> count == 0 || d < j -> min)
+    j -> min = d;
+  if (j -> count == 0 || d > j -> max)
+    j -> max = d;
+  j -> count++;
+  j -> sum += d;
+  j -> sum_sq += d * d;
+  j -> anomalies += (d < FRAME_INTERVAL_MIN || d > FRAME_INTERVAL_MAX);
+}
+
+/* One line without its end: summary, then "lo-hi:count" for every bin that is not empty. */
+int rt_jitter_format(const rt_jitter *j, const char *name, char *line, size_t size)
+{
+  double mean = j -> count ? (j -> sum / j -> count) : 0;
+  double var = j -> count ? ((j -> sum_sq / j -> count) - (mean * mean)) : 0;
+  size_t length;
+
+  length = snprintf(line, size, "%s - intervals: %u, mean_ms: %.2f, std_ms: %.2f, min_ms: %.2f, max_ms: %.2f, anomalies: %u, histogram_ms:",
+    name, j -> count, mean, (var > 0) ? sqrt(var) : 0, j -> min, j -> max, j -> anomalies);
+  for (uint32_t i = 0; i < RT_JITTER_BINS && length < size; i++)
+  {
+    if (!j -> bins[i])
+      continue;
+    if (i < RT_JITTER_BINS - 1)
+      length += snprintf(line + length, size - length, " %u-%u:%u", i * RT_JITTER_BIN_MS, (i + 1) * RT_JITTER_BIN_MS, j -> bins[i]);
+    else
+      length += snprintf(line + length, size - length, " %u+:%u", i * RT_JITTER_BIN_MS, j -> bins[i]);
+  }
+
+  return (length < size) ? (int)length : (int)size - 1;
+}
+
+void rt_jitter_print(const rt_jitter *j, const char *name, FILE *out)
+{
+  char line[RT_JITTER_LINE_MAX];
+
+  rt_jitter_format(j, name, line, sizeof(line));
+  fprintf(out, "%s\n", line);
+  fflush(out);
+}
+
+void rt_usage_get(rt_usage *u)
+{
+#ifndef __MINGW32__
+  struct rusage r;
+
+  getrusage(RUSAGE_SELF, &r);
+  u -> cpu_us = ((uint64_t)(r.ru_utime.tv_sec + r.ru_stime.tv_sec) * 1000000) + r.ru_utime.tv_usec + r.ru_stime.tv_usec;
+  u -> voluntary_switches = r.ru_nvcsw;
+  u -> involuntary_switches = r.ru_nivcsw;
+#else
+  memset(u, 0, sizeof(*u));
+#endif
+}
+
+/* One line without its end: CPU time and context switches per frame between two snapshots. */
+int rt_usage_format(const rt_usage *from, const rt_usage *to, uint32_t frames, const char *name, char *line, size_t size)
+{
+  double n = frames ? frames : 1;
+
+  return snprintf(line, size, "%s - frames: %u, cpu_us_per_frame: %.1f, voluntary_switches_per_frame: %.2f, involuntary_switches_per_frame: %.2f",
+    name, frames, (to -> cpu_us - from -> cpu_us) / n, (to -> voluntary_switches - from -> voluntary_switches) / n,
+    (to -> involuntary_switches - from -> involuntary_switches) / n);
+}
@@ -9,6 +9,7 @@
  Created     : Nov 26, 2018
  ============================================================================
  */
+#include <errno.h>
 #include "raspi-tex.h"
 #include "raspi-tex-util.h"
 #include <GLES2/gl2.h>
@@ -16,6 +17,8 @@
 #include <EGL/eglext.h>
 #include "lodepng.h"
 #include "led-detector.h"
+#include "uplink.h"
+#include "frame-record.h"
 #include "sbpp.h"
 
 
@@ -55,26 +58,59 @@ static const EGLint sbpp_egl_config_attribs[] =
    EGL_NONE
 };
 
-unsigned char *data;
+/* Frame interval histograms and the CPU time and context switches per frame since sbpp_init. */
+static void sbpp_log_report(sbpp_context *ctx)
+{
+  char line[RT_JITTER_LINE_MAX];
+  rt_usage now;
+
+  rt_jitter_format(&ctx->frame_interval, "frame_interval", line, sizeof(line));
+  log_printf(&ctx->detector->log, "%s\r\n", line);
+  rt_jitter_format(&ctx->frame_arrival, "frame_arrival", line, sizeof(line));
+  log_printf(&ctx->detector->log, "%s\r\n", line);
+  rt_usage_get(&now);
+  rt_usage_format(&ctx->usage, &now, ctx->current_frame, "process", line, sizeof(line));
+  log_printf(&ctx->detector->log, "%s\r\n", line);
+  if (ctx->detector->stream)
+  {
+    detection_stream_stats *st = &ctx->detector->stream->stats;
+
+    log_printf(&ctx->detector->log, "detection_stream - records: %u, batches: %u, clients: %u, socket_drops: %u\r\n",
+      st->records, st->batches, st->clients, st->socket_drops);
+  }
+  if (ctx->uplink)
+  {
+    uplink_stats *st = &ctx->uplink->stats;
+
+    log_printf(&ctx->detector->log, "uplink - frames: %u, bytes: %u, absolute: %u, deltas: %u, small_deltas: %u, heartbeats: %u, coalesced: %u, dropped: %u, lost: %u, write_errors: %u, refused: %u, unanswered: %u, rate: %u, new_latency_max_ms: %u\r\n",
+      atomic_load(&st->frames), atomic_load(&st->bytes), atomic_load(&st->absolute), atomic_load(&st->deltas), atomic_load(&st->small_deltas),
+      atomic_load(&st->heartbeats), atomic_load(&st->coalesced), atomic_load(&st->dropped), atomic_load(&st->lost), atomic_load(&st->write_errors),
+      atomic_load(&st->refused), atomic_load(&st->unanswered), atomic_load(&st->rate), atomic_load(&st->new_latency_max_ms));
+  }
+  if (ctx->recorder)
+  {
+    frame_recorder_stats *st = &ctx->recorder->stats;
+    uint32_t frames = atomic_load(&st->frames);
 
-int image_counter = 0;
+    log_printf(&ctx->detector->log, "frame_record - frames: %u, dropped: %u, full: %u, errors: %u, windows: %u, write_avg_us: %u, write_max_us: %u, remap_max_us: %u\r\n",
+      frames, ctx->recorder->ring.stats.dropped, atomic_load(&st->full), atomic_load(&st->errors), atomic_load(&st->windows),
+      (uint32_t)(atomic_load(&st->write_us_sum) / (frames ? frames : 1)), atomic_load(&st->write_us_max), atomic_load(&st->remap_us_max));
+  }
+}
 
-led_detector g_led_dectector;
+void sbpp_report(RASPITEX_STATE *state)
+{
+  sbpp_context *ctx = (sbpp_context*)state->scene_state;
 
-SETUP_FPS
+  if (ctx)
+    sbpp_log_report(ctx);
+}
 
 #if LOCALIZATION_DEBUG > 0
 
 
 #ifdef LOC_ENABLE_SAVE_IMAGE
-uint8_t  *image;
-uint8_t  *image_data;
-uint8_t  *image_array;
-uint32_t image_array_index;
-
-extern uint32_t led_detected;
-
-static void bits_to_bytes_diff(uint8_t *d, uint8_t *im)
+static void bits_to_bytes_diff(uint8_t *image_data, uint8_t *d, uint8_t *im)
 {
   int l = 0;
 
@@ -96,71 +132,83 @@ static void bits_to_bytes_diff(uint8_t *d, uint8_t *im)
 
 }
 
-static void bits_to_bytes_diff_array(int i, uint8_t *im) {
-  uint8_t *d = image_array + (i*((FRAME_HEIGHT * FRAME_WIDTH) / 4));
-  bits_to_bytes_diff(d, im);
+static void bits_to_bytes_diff_array(sbpp_context *ctx, int i, uint8_t *im) {
+  uint8_t *d = ctx->image_array + (i*((FRAME_HEIGHT * FRAME_WIDTH) / 4));
+  bits_to_bytes_diff(ctx->image_data, d, im);
 }
 
 
 
 #endif /* LOC_ENABLE_SAVE_IMAGE */
 
-uint32_t fq_endlist[128];
-
-void adjust_fps(const double req_interval) 
+void adjust_fps(sbpp_context *ctx, const double req_interval) 
 {
+    led_detector *ld = ctx->detector;
+    struct timespec now;
     double current_interval, avg_interval;
-    
-    // Initialize for 25 FPS
-    static double specific_interval = 40.0/1000.0;
-
-    clock_gettime(CLOCK_REALTIME, &__gettime_now); 
-    __time_difference.tv_sec = __gettime_now.tv_sec - __prev_time.tv_sec; 
-    __time_difference.tv_nsec = __gettime_now.tv_nsec - __prev_time.tv_nsec; 
-    current_interval = ((__time_difference.tv_sec * 1000000000.0) + __time_difference.tv_nsec)/1000000000.0;
-    __frames++; 
-    if ((__frames % __interval) == 0) {
-      __time_difference.tv_sec = __gettime_now.tv_sec - __start_time.tv_sec; 
-      __time_difference.tv_nsec = __gettime_now.tv_nsec - __start_time.tv_nsec; 
-      avg_interval = ((__time_difference.tv_sec * 1000000000.0) + __time_difference.tv_nsec)/1000000000.0; 
-
-      if (specific_interval > (25.0/1000.0))
-        specific_interval += ((req_interval - (avg_interval/__frames))) / 2.0;
+
+    clock_gettime(CLOCK_REALTIME, &now); 
+    current_interval = ((now.tv_sec - ctx->fps_prev.tv_sec) * 1000000000.0 + (now.tv_nsec - ctx->fps_prev.tv_nsec))/1000000000.0;
+    ctx->fps_frames++; 
+    if ((ctx->fps_frames % ctx->fps_interval) == 0) {
+      avg_interval = ((now.tv_sec - ctx->fps_start.tv_sec) * 1000000000.0 + (now.tv_nsec - ctx->fps_start.tv_nsec))/1000000000.0; 
+
+      if (ctx->specific_interval > (25.0/1000.0))
+        ctx->specific_interval += ((req_interval - (avg_interval/ctx->fps_frames))) / 2.0;
       else
-        specific_interval = 40.0/1000.0;
+        ctx->specific_interval = 40.0/1000.0;
 
-      fprintf(stdout, "%s - FPS: %lf, AvgTime: %lf, led_queue_size: %d, frame_leds: %d, frame_ones: %d, frame_noise: %d, luminence_thresh: %f\r\n",__msg, __frames/avg_interval, 1000.0*(avg_interval/__frames), g_led_dectector.leds_queue_size, g_led_dectector.frame_leds, g_led_dectector.frame_ones, g_led_dectector.frame_noise, ((RASPITEX_STATE *)g_led_dectector.context)->luminence_thresh);
-      fflush(stdout);
-      __frames = 0; 
-      __start_time = __gettime_now; 
+      log_printf(&ld->log, "%s - FPS: %lf, AvgTime: %lf, led_queue_size: %d, led_table_exhausted: %d, ring_depth: %u, ring_depth_max: %u, ring_dropped: %u, ring_overwritten: %u, frames_missed: %u, frame_gaps: %u, frame_backsteps: %u, ring_wait_avg_us: %u, log_overflows: %u, frame_leds: %d, frame_ones: %d, frame_noise: %d, luminence_thresh: %f\r\n",ctx->fps_msg, ctx->fps_frames/avg_interval, 1000.0*(avg_interval/ctx->fps_frames), ld->trackers.count, ld->trackers.exhausted, frame_ring_depth(&ld->ring), ld->ring.stats.depth_max, ld->ring.stats.dropped, ld->ring.stats.overwritten, ld->frames_missed, ld->frame_gaps, ld->frame_backsteps, (uint32_t)(ld->ring.stats.wait_us_sum / (ld->ring.stats.waits ? ld->ring.stats.waits : 1)), atomic_load(&ld->log.stats.overflows), ld->frame_leds, ld->frame_ones, ld->frame_noise, ((RASPITEX_STATE *)ld->context)->luminence_thresh);
+      if (ld->pipeline)
+      {
+        led_stage_stats *discover = &ld->stages[LED_STAGE_DISCOVER];
+        led_stage_stats *decode = &ld->stages[LED_STAGE_DECODE];
+
+        log_printf(&ld->log, "%s - discover_avg_us: %u, discover_max_us: %u, decode_avg_us: %u, decode_max_us: %u, stage_depth: %u, stage_depth_max: %u, stage_blocked: %u\r\n", ctx->fps_msg,
+          (uint32_t)(discover->busy_us_sum / (discover->frames ? discover->frames : 1)), discover->busy_us_max,
+          (uint32_t)(decode->busy_us_sum / (decode->frames ? decode->frames : 1)), decode->busy_us_max,
+          frame_ring_depth(&ld->stage_ring), ld->stage_ring.stats.depth_max, ld->stage_ring.stats.blocks);
+      }
+      sbpp_log_report(ctx);
+      ctx->fps_frames = 0; 
+      ctx->fps_start = now; 
     }
 
-    clock_gettime(CLOCK_REALTIME, &__prev_time); 
+    clock_gettime(CLOCK_REALTIME, &ctx->fps_prev); 
 }
 #endif /* LOCALIZATION_DEBUG > 0*/
 
-uint32_t  time_anomaly_counter = 0;
-double    prev_time = 0.0;
+static double sbpp_now_ms(void)
+{
+  struct timespec now;
 
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec * 1000.0) + (now.tv_nsec / 1000000.0);
+}
 
 static void process_framebuffer(RASPITEX_STATE *raspitex_state)
 {
-  static uint32_t current_frame = 0;
+  sbpp_context *ctx = (sbpp_context*)raspitex_state->scene_state;
+  led_detector *ld = ctx->detector;
   double current_time, delta_time;
-#ifdef LOC_ENABLE_SAVE_IMAGE  
-  static int cc = 0;
-#endif /* LOC_ENABLE_SAVE_IMAGE */
-  glReadPixels(0,0,FRAME_WIDTH,FRAME_HEIGHT/16, GL_RGBA , GL_UNSIGNED_BYTE, data);
+  uint8_t *readback = NULL;
+
+  /* Read straight into a free slot of the detector's frame ring, ctx->data only takes frames that are missed. */
+  if (raspitex_state->current_buf)
+    readback = led_detector_frame_acquire(ld);
+  if (!readback)
+    readback = ctx->data;
+  glReadPixels(0,0,FRAME_WIDTH,FRAME_HEIGHT/16, GL_RGBA , GL_UNSIGNED_BYTE, readback);
 
   if (raspitex_state->current_buf)
   {
 #if LOCALIZATION_DEBUG > 0
 #ifdef LOC_ENABLE_SAVE_IMAGE    
-    if (cc == 0) 
+    if (ctx->images_saved == 0) 
     {
-      uint8_t *d = image_array + (image_array_index*((FRAME_HEIGHT * FRAME_WIDTH) / 4));
-      image_array_index = (image_array_index + 1) % raspitex_state->number_of_images;
-      memcpy(d, data, ((FRAME_HEIGHT * FRAME_WIDTH) / 4));
+      uint8_t *d = ctx->image_array + (ctx->image_array_index*((FRAME_HEIGHT * FRAME_WIDTH) / 4));
+      ctx->image_array_index = (ctx->image_array_index + 1) % raspitex_state->number_of_images;
+      memcpy(d, readback, ((FRAME_HEIGHT * FRAME_WIDTH) / 4));
     }
     
 #endif /* LOC_ENABLE_SAVE_IMAGE */
@@ -168,36 +216,40 @@ static void process_framebuffer(RASPITEX_STATE *raspitex_state)
 
     current_time = raspitex_state->prev_buff_time;
 
-    delta_time = current_time - prev_time;
+    delta_time = current_time - ctx->prev_time;
+
+    rt_jitter_add(&ctx->frame_interval, current_time);
+    rt_jitter_add(&ctx->frame_arrival, sbpp_now_ms());
 
-    if (delta_time < 30 || delta_time > 50) 
+    if (delta_time < FRAME_INTERVAL_MIN || delta_time > FRAME_INTERVAL_MAX) 
     {
-      time_anomaly_counter++;
+      ctx->time_anomaly_counter++;
     }
     else
     {
-      time_anomaly_counter = 0;
+      ctx->time_anomaly_counter = 0;
     }
     
-    if (time_anomaly_counter > 100) 
+    if (ctx->time_anomaly_counter > 100) 
     {
-      fprintf(stdout, "Missed - Time anomaly\r\n");
-      fflush(stdout);
+      log_printf(&ld->log, "Missed - Time anomaly\r\n");
     }
 
     
-    prev_time = current_time;
+    ctx->prev_time = current_time;
     
-    g_led_dectector.is_new_frame = !!(raspitex_state->current_buf);
-    led_detector_process(&g_led_dectector, data, current_time, current_frame++);
+    ld->is_new_frame = !!(raspitex_state->current_buf);
+    if (readback != ctx->data)
+      led_detector_frame_publish(ld, current_time, ctx->current_frame);
+    ctx->current_frame++;
     
     
     if (raspitex_state->enable_dynamic_luminence) {
-      if (g_led_dectector.frame_noise > (raspitex_state->on_pixels_in_frame*1.25)) {
+      if (ld->frame_noise > (raspitex_state->on_pixels_in_frame*1.25)) {
         if (raspitex_state->luminence_thresh < LUMINENCE_THRESH_MAX) {
           raspitex_state->luminence_thresh += LUMINENCE_THRESH_DELTA;
         }
-      } else if (g_led_dectector.frame_noise < (raspitex_state->on_pixels_in_frame*0.75)) {
+      } else if (ld->frame_noise < (raspitex_state->on_pixels_in_frame*0.75)) {
         if (raspitex_state->luminence_thresh > LUMINENCE_THRESH_MIN) {
           raspitex_state->luminence_thresh -= LUMINENCE_THRESH_DELTA;
         }
@@ -206,22 +258,22 @@ static void process_framebuffer(RASPITEX_STATE *raspitex_state)
 
 #if LOCALIZATION_DEBUG > 0
 #ifdef LOC_ENABLE_SAVE_IMAGE
-    if ((g_led_dectector.led_identified == 1 || current_frame > 750)&& raspitex_state->save_image && current_frame > raspitex_state->save_image_warmup)
+    if ((ld->led_identified == 1 || ctx->current_frame > 750)&& raspitex_state->save_image && ctx->current_frame > raspitex_state->save_image_warmup)
     {
-      if (cc == 0) 
+      if (ctx->images_saved == 0) 
       {
         char fname[32];
         int i;
-        cc++;
+        ctx->images_saved = 1;
         for (i = 0; i < raspitex_state->number_of_images; i++) {
           unsigned error;
 
-          led_detected = 0;
+          ld->led_detected = 0;
 
           printf("Saving Image\n");
           sprintf(fname, "%03d.png", i); 
-          bits_to_bytes_diff_array(i, image);
-          error = lodepng_encode_file(fname, image, FRAME_WIDTH, FRAME_HEIGHT, LCT_GREY, BITS_PER_BYTE);
+          bits_to_bytes_diff_array(ctx, i, ctx->image);
+          error = lodepng_encode_file(fname, ctx->image, FRAME_WIDTH, FRAME_HEIGHT, LCT_GREY, BITS_PER_BYTE);
           if(error) {
             printf("errorin saving frame: %d\n",error);
           }
@@ -230,7 +282,7 @@ static void process_framebuffer(RASPITEX_STATE *raspitex_state)
       
     }
 #endif
-    adjust_fps(40.0/1000.0);
+    adjust_fps(ctx, 40.0/1000.0);
 #endif /* LOCALIZATION_DEBUG > 0 */
   }
 }
@@ -264,6 +316,8 @@ static char * loadshader(const char *filename) {
  */
 int sbpp_init(RASPITEX_STATE *state)
 {
+  sbpp_context *ctx;
+  const char *stream_shm = state->stream_shm;
   int rc;
   char *src;
   
@@ -282,40 +336,102 @@ int sbpp_init(RASPITEX_STATE *state)
   GLCHK(glUniform1i(sbpp_shader.uniform_locations[0], 0)); // tex unit
   GLCHK(glUseProgram(0));
 
-  data = malloc(FRAME_WIDTH*FRAME_HEIGHT/2);
+  ctx = (sbpp_context*)calloc(1, sizeof(sbpp_context));
+  if (!ctx)
+    return -1;
+  ctx->data = malloc(LED_READBACK_BYTES);
+  rt_jitter_reset(&ctx->frame_interval);
+  rt_jitter_reset(&ctx->frame_arrival);
+  rt_usage_get(&ctx->usage);
+  state->scene_state = ctx;
 #ifdef LOC_ENABLE_SAVE_IMAGE
-  image = malloc(FRAME_WIDTH*FRAME_HEIGHT*4);
-  image_data = malloc(FRAME_WIDTH*FRAME_HEIGHT*4);
-  image_array = malloc(FRAME_WIDTH*FRAME_HEIGHT*state->number_of_images);
-  image_array_index = 0;
+  ctx->image = malloc(FRAME_WIDTH*FRAME_HEIGHT*4);
+  ctx->image_data = malloc(FRAME_WIDTH*FRAME_HEIGHT*4);
+  ctx->image_array = malloc(FRAME_WIDTH*FRAME_HEIGHT*state->number_of_images);
+  ctx->image_array_index = 0;
 #endif /* LOC_ENABLE_SAVE_IMAGE */
   
   // Default parameters for ledDetector.
-  led_detector_init(&g_led_dectector, state);
+  ctx->detector = led_detector_create(state);
+  if (!ctx->detector)
+    return -1;
   
-  g_led_dectector.context = state;
+  ctx->detector->context = state;
+  state->log = &ctx->detector->log;
+
+  /* The uplink reads the shared memory ring, there is one even if -stream_shm is not given. */
+  if (state->uplink && !state->stream_shm)
+    stream_shm = UPLINK_SHM_NAME;
+  if (stream_shm || state->stream_socket)
+  {
+    ctx->detector->stream = detection_stream_open(stream_shm, state->stream_socket, DETECTION_STREAM_LENGTH, ctx->detector->trackers.capacity);
+    if (!ctx->detector->stream)
+    {
+      fprintf(stderr, "Could not open the detection stream (%s, %s)\n", stream_shm ? stream_shm : "-", state->stream_socket ? state->stream_socket : "-");
+      return -1;
+    }
+  }
+
+  if (state->intrinsics || state->extrinsics || state->led_heights)
+  {
+    ctx->world = (world_map*)malloc(sizeof(world_map));
+    if (!ctx->world)
+      return -1;
+    if (world_map_load(ctx->world, state->intrinsics, state->extrinsics, state->led_heights) != 0)
+    {
+      world_map_destroy(ctx->world);
+      free(ctx->world);
+      ctx->world = NULL;
+      return -1;
+    }
+    ctx->detector->world = ctx->world;
+  }
+
+  if (state->record)
+  {
+    ctx->recorder = frame_recorder_open(state->record, (state->record_seconds * 1000) / FRAME_TRANSFER_TIME);
+    if (!ctx->recorder)
+    {
+      fprintf(stderr, "Could not open the recording %s: %s\n", state->record, strerror(errno));
+      return -1;
+    }
+    ctx->detector->recorder = ctx->recorder;
+  }
 
-  START_FPS("Localizer", 100);
+  if (state->uplink)
+  {
+    ctx->uplink = uplink_open(state->uplink, state->uplink_baud, state->uplink_budget);
+    if (ctx->uplink)
+      ctx->uplink->log = &ctx->detector->log;
+    if (!ctx->uplink || uplink_start(ctx->uplink, stream_shm) != 0)
+    {
+      fprintf(stderr, "Could not start the uplink on %s\n", state->uplink);
+      return -1;
+    }
+  }
+
+  // Initialize for 25 FPS
+  ctx->specific_interval = 40.0/1000.0;
+  clock_gettime(CLOCK_REALTIME, &ctx->fps_start);
+  ctx->fps_prev = ctx->fps_start;
+  ctx->fps_frames = 0;
+  ctx->fps_interval = 100;
+  ctx->fps_msg = "Localizer";
 
   return rc;
 }
 
-extern int bg_available;
-int test = 0;
-
 /**
  * Draws a 2x2 grid with each shell showing the entire MMAL buffer from a
  * different EGL image target.
  */
 int sbpp_redraw(RASPITEX_STATE *raspitex_state)
 {
-  static int frame_counter = 0;
-
-  frame_counter++;
+  sbpp_context *ctx = (sbpp_context*)raspitex_state->scene_state;
 
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-if (test == 0 ) 
+if (ctx->shader_ready == 0 ) 
 {
     GLCHK(glUseProgram(sbpp_shader.program));
       GLCHK(glUniform1i(sbpp_shader.uniform_locations[0], 0)); // current unit
@@ -333,7 +449,7 @@ if (test == 0 )
       GLCHK(glVertexAttrib2f(sbpp_shader.attribute_locations[1], -0.5f, 0.5f));
 
       GLCHK(glUniform1f(sbpp_shader.uniform_locations[3], (float)FRAME_HEIGHT));
-      test = 1;
+      ctx->shader_ready = 1;
 }
       GLCHK(glUniform1f(sbpp_shader.uniform_locations[2], raspitex_state->luminence_thresh));
       GLCHK(glDrawArrays(GL_TRIANGLES, 0, 6));
@@ -346,7 +462,7 @@ if (0)
     GLCHK(glUseProgram(0));
 
 }
-  if (bg_available)
+  if (raspitex_state->bg_available)
     process_framebuffer(raspitex_state);
 
   return 0;
@@ -357,3 +473,37 @@ int sbpp_open(RASPITEX_STATE *state)
    state->is_ready = 1;
    return 0;
 }
+
+/* Stops the pipeline's detector, once the frames it has queued are processed, and frees the scene state. */
+void sbpp_term(RASPITEX_STATE *state)
+{
+  sbpp_context *ctx = (sbpp_context*)state->scene_state;
+  detection_stream *stream;
+
+  if (!ctx)
+    return;
+  /* After a failed sbpp_init only part of it is there. */
+  stream = NULL;
+  if (ctx->detector)
+  {
+    sbpp_log_report(ctx);
+    stream = ctx->detector->stream;
+  }
+  state->log = NULL;
+  /* It logs the Sleepy Pi's lines to the detector's log. */
+  uplink_close(ctx->uplink);
+  led_detector_free(ctx->detector);
+  frame_recorder_close(ctx->recorder);
+  detection_stream_close(stream);
+  if (ctx->world)
+  {
+    world_map_destroy(ctx->world);
+    free(ctx->world);
+  }
+  free(ctx->data);
+  free(ctx->image);
+  free(ctx->image_data);
+  free(ctx->image_array);
+  free(ctx);
+  state->scene_state = NULL;
+}
@@ -0,0 +1,751 @@
+/*
+ ============================================================================
+ Name        : uplink.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Batched, delta encoded world coordinates over the UART to
+               the Sleepy Pi, and the decoder of the other end
+ ============================================================================
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include "uplink.h"
+
+#define UPLINK_LEDS   (LED_DATA_MASK + 1)
+
+/* CRC-16/CCITT, polynomial 0x1021 from 0xFFFF, small enough for the Sleepy Pi to check bit by bit. */
+uint16_t uplink_crc(const uint8_t *data, uint32_t length)
+{
+  uint16_t crc = 0xFFFF;
+
+  for (uint32_t i = 0; i < length; i++)
+  {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int b = 0; b < 8; b++)
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+  }
+  return crc;
+}
+
+static speed_t uplink_speed(uint32_t baud)
+{
+  switch (baud)
+  {
+    case 1200:    return B1200;
+    case 2400:    return B2400;
+    case 4800:    return B4800;
+    case 9600:    return B9600;
+    case 19200:   return B19200;
+    case 38400:   return B38400;
+    case 57600:   return B57600;
+    case 115200:  return B115200;
+    case 230400:  return B230400;
+    default:      return B0;
+  }
+}
+
+static uint32_t uplink_now_ms(const uplink *u)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint32_t)(((t.tv_sec - u -> start.tv_sec) * 1000) + ((t.tv_nsec - u -> start.tv_nsec) / 1000000));
+}
+
+/*
+ The serial port at baud, 8N1 raw, or any other file to write frames to.
+ budget is the bytes/s the uplink may use on average, 0 for all of the
+ line rate. The Sleepy Pi's answers are only read from a serial port.
+ NULL if the device could not be set up.
+ */
+uplink* uplink_open(const char *device, uint32_t baud, uint32_t budget)
+{
+  uplink *u;
+  speed_t speed = uplink_speed(baud);
+  struct termios t;
+
+  if (speed == B0)
+  {
+    fprintf(stderr, "Unsupported uplink baud rate %u\n", baud);
+    return NULL;
+  }
+
+  u = (uplink*)calloc(1, sizeof(uplink));
+  if (!u)
+    return NULL;
+  u -> fd = open(device, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  u -> leds = (uplink_led*)calloc(UPLINK_LEDS, sizeof(uplink_led));
+  u -> pending = (uint16_t*)malloc(UPLINK_PENDING_MAX * sizeof(uint16_t));
+  u -> order = (uplink_order*)malloc(UPLINK_PENDING_MAX * sizeof(uplink_order));
+  u -> records = (detection_record*)malloc(LED_CAPACITY * sizeof(detection_record));
+  if (u -> fd < 0 || !u -> leds || !u -> pending || !u -> order || !u -> records)
+  {
+    uplink_close(u);
+    return NULL;
+  }
+
+  if (isatty(u -> fd))
+  {
+    if (tcgetattr(u -> fd, &t) != 0)
+    {
+      uplink_close(u);
+      return NULL;
+    }
+    cfmakeraw(&t);
+    t.c_cflag |= CLOCAL;
+    /* Reads return what has arrived, the answers are polled. */
+    t.c_cc[VMIN] = 0;
+    t.c_cc[VTIME] = 0;
+    cfsetispeed(&t, speed);
+    cfsetospeed(&t, speed);
+    if (tcsetattr(u -> fd, TCSANOW, &t) != 0)
+    {
+      uplink_close(u);
+      return NULL;
+    }
+    /* Answers to a previous run's frames. */
+    tcflush(u -> fd, TCIFLUSH);
+    u -> replies = 1;
+  }
+
+  /* 8N1 is 10 bits a byte. */
+  u -> line_rate = baud / 10;
+  u -> budget = (budget && budget < u -> line_rate) ? budget : u -> line_rate;
+  u -> window_bytes = (u -> budget * UPLINK_WINDOW_MS) / 1000;
+  if (u -> window_bytes < UPLINK_FRAME_MAX)
+    u -> window_bytes = UPLINK_FRAME_MAX;
+  u -> rate = u -> line_rate;
+  u -> tokens = UPLINK_FRAME_MAX;
+  atomic_store_explicit(&u -> stats.rate, u -> line_rate, memory_order_relaxed);
+  clock_gettime(CLOCK_MONOTONIC, &u -> start);
+  return u;
+}
+
+/* Coalesce one record of the detection stream into its LED's pending position. */
+void uplink_update(uplink *u, const detection_record *r, uint32_t now_ms)
+{
+  uplink_led *led;
+  float x, y;
+
+  if (!(r -> flags & DETECTION_WORLD))
+    return;
+
+  led = &u -> leds[r -> id & LED_DATA_MASK];
+  if (led -> state & UPLINK_LED_PENDING)
+  {
+    atomic_fetch_add_explicit(&u -> stats.coalesced, 1, memory_order_relaxed);
+  }
+  else
+  {
+    if (u -> pending_count == UPLINK_PENDING_MAX)
+    {
+      atomic_fetch_add_explicit(&u -> stats.dropped, 1, memory_order_relaxed);
+      return;
+    }
+    u -> pending[u -> pending_count++] = r -> id & LED_DATA_MASK;
+    led -> state |= UPLINK_LED_PENDING;
+    led -> seen_ms = now_ms;
+    /* The receiver may not have kept it that long. */
+    if ((led -> state & UPLINK_LED_KNOWN) && (now_ms - led -> sent_ms) > UPLINK_FORGET_MS)
+      led -> state &= ~UPLINK_LED_KNOWN;
+  }
+
+  /* Negative coordinates are clamped to 0 the way the wrapper did. */
+  x = (r -> world[0] * UPLINK_SCALE) + 0.5f;
+  y = (r -> world[1] * UPLINK_SCALE) + 0.5f;
+  led -> next_x = (x <= 0.0f) ? 0 : (x >= 65535.0f) ? 65535 : (uint16_t)x;
+  led -> next_y = (y <= 0.0f) ? 0 : (y >= 65535.0f) ? 65535 : (uint16_t)y;
+  led -> voltage = r -> voltage;
+}
+
+/*
+ Bytes the link takes now. queued is what the driver still has to send.
+ While the driver had bytes queued since the last call the link was busy
+ all along, and what it drained meanwhile is a sample of its rate.
+ Otherwise the estimate creeps back to the line rate.
+ */
+uint32_t uplink_pace(uplink *u, uint32_t now_ms, uint32_t queued)
+{
+  uint32_t dt = now_ms - u -> paced_ms;
+  double allowance;
+
+  if (dt == 0)
+    return (u -> tokens > queued) ? (uint32_t)(u -> tokens - queued) : 0;
+
+  if (u -> queued > 0 && queued > 0)
+  {
+    double drained = (double)u -> queued + u -> written - queued;
+
+    u -> rate += ((drained * 1000.0 / dt) - u -> rate) / 8;
+  }
+  else if (queued == 0)
+  {
+    u -> rate += (u -> line_rate - u -> rate) / 16;
+  }
+  if (u -> rate > u -> line_rate)
+    u -> rate = u -> line_rate;
+  if (u -> rate < 1.0)
+    u -> rate = 1.0;
+  atomic_store_explicit(&u -> stats.rate, (uint32_t)u -> rate, memory_order_relaxed);
+
+  u -> tokens += u -> rate * dt / 1000.0;
+  if (u -> tokens > UPLINK_FRAME_MAX + (u -> rate * UPLINK_TICK_MS / 1000.0))
+    u -> tokens = UPLINK_FRAME_MAX + (u -> rate * UPLINK_TICK_MS / 1000.0);
+
+  u -> paced_ms = now_ms;
+  u -> queued = queued;
+  u -> written = 0;
+
+  allowance = u -> tokens - queued;
+  return (allowance > 0) ? (uint32_t)allowance : 0;
+}
+
+/*
+ Bytes of the budget left now. Counted in UPLINK_TICK_MS slots over one
+ more than a window, so no UPLINK_WINDOW_MS, wherever it starts, gets more
+ than window_bytes. This and not a token bucket, whose burst would come on
+ top of a window's refill.
+ */
+static uint32_t uplink_window(uplink *u, uint32_t now_ms)
+{
+  uint32_t slot = now_ms / UPLINK_TICK_MS;
+  uint32_t steps = slot - u -> window_slot;
+
+  if (steps > UPLINK_WINDOW_SLOTS)
+    steps = UPLINK_WINDOW_SLOTS;
+  for (uint32_t i = 1; i <= steps; i++)
+  {
+    uint32_t *bytes = &u -> window[(u -> window_slot + i) % UPLINK_WINDOW_SLOTS];
+
+    u -> window_sum -= *bytes;
+    *bytes = 0;
+  }
+  u -> window_slot = slot;
+  return (u -> window_bytes > u -> window_sum) ? u -> window_bytes - u -> window_sum : 0;
+}
+
+/* Entry kind and size an LED would be sent with now. */
+static uint32_t uplink_entry(const uplink_led *led, int *dx, int *dy)
+{
+  *dx = (int)led -> next_x - led -> x;
+  *dy = (int)led -> next_y - led -> y;
+
+  if (!(led -> state & UPLINK_LED_KNOWN) || led -> deltas >= UPLINK_REFRESH)
+    return UPLINK_ABSOLUTE_BYTES;
+  if (*dx >= -4 && *dx <= 3 && *dy >= -4 && *dy <= 3)
+    return UPLINK_SMALL_DELTA_BYTES;
+  if (*dx >= -128 && *dx <= 127 && *dy >= -128 && *dy <= 127)
+    return UPLINK_DELTA_BYTES;
+  return UPLINK_ABSOLUTE_BYTES;
+}
+
+static int uplink_compare_order(const void *a, const void *b)
+{
+  uint64_t ka = ((const uplink_order*)a) -> key, kb = ((const uplink_order*)b) -> key;
+
+  return (ka > kb) - (ka < kb);
+}
+
+/*
+ Build the next frame from the pending LEDs into frame, at most allowance
+ and UPLINK_FRAME_MAX bytes. LEDs the receiver does not know go first,
+ oldest first, then the others by how long ago they were last sent. A
+ frame is only built once it can hold everything pending or is full, so
+ reports batch up while the budget refills. Its length, 0 if it has to
+ wait.
+ */
+uint32_t uplink_encode(uplink *u, uint8_t *frame, uint32_t allowance, uint32_t now_ms)
+{
+  uint32_t limit = (allowance < UPLINK_FRAME_MAX) ? allowance : UPLINK_FRAME_MAX;
+  uint32_t need = UPLINK_OVERHEAD, length = 3, kept = 0;
+  uint16_t crc;
+
+  u -> frame_entries = 0;
+  if (limit <= UPLINK_OVERHEAD)
+    return 0;
+
+  for (uint32_t i = 0; i < u -> pending_count; i++)
+  {
+    const uplink_led *led = &u -> leds[u -> pending[i]];
+    uint32_t age;
+    int dx, dy;
+
+    if (need < UPLINK_FRAME_MAX)
+      need += uplink_entry(led, &dx, &dy);
+    age = now_ms - ((led -> state & UPLINK_LED_KNOWN) ? led -> sent_ms : led -> seen_ms);
+    u -> order[i].key = ((uint64_t)(led -> state & UPLINK_LED_KNOWN) << 32) | (UINT32_MAX - age);
+    u -> order[i].id = u -> pending[i];
+  }
+  if (u -> pending_count == 0 || (need > limit && limit < UPLINK_FRAME_MAX))
+    return 0;
+
+  qsort(u -> order, u -> pending_count, sizeof(uplink_order), uplink_compare_order);
+  for (uint32_t i = 0; i < u -> pending_count; i++)
+  {
+    uint16_t id = u -> order[i].id;
+    uplink_led *led = &u -> leds[id];
+    uint16_t key = id | ((uint16_t)(led -> voltage & 1) << 15);
+    int dx, dy;
+    uint32_t size = uplink_entry(led, &dx, &dy);
+    uint8_t *p = frame + length;
+
+    /* A smaller entry further down may still fit. */
+    if (length + size + 2 > limit)
+    {
+      u -> pending[kept++] = id;
+      continue;
+    }
+
+    if (size == UPLINK_SMALL_DELTA_BYTES)
+    {
+      p[0] = UPLINK_SMALL_DELTA | ((dx + 4) << 3) | (dy + 4);
+      atomic_fetch_add_explicit(&u -> stats.small_deltas, 1, memory_order_relaxed);
+    }
+    else
+    {
+      p[0] = (size == UPLINK_DELTA_BYTES) ? UPLINK_DELTA : UPLINK_ABSOLUTE;
+    }
+    p[1] = key >> 8;
+    p[2] = key & 0xFF;
+    if (size == UPLINK_DELTA_BYTES)
+    {
+      p[3] = (uint8_t)(int8_t)dx;
+      p[4] = (uint8_t)(int8_t)dy;
+      led -> deltas++;
+      atomic_fetch_add_explicit(&u -> stats.deltas, 1, memory_order_relaxed);
+    }
+    else if (size == UPLINK_ABSOLUTE_BYTES)
+    {
+      p[3] = led -> next_x >> 8;
+      p[4] = led -> next_x & 0xFF;
+      p[5] = led -> next_y >> 8;
+      p[6] = led -> next_y & 0xFF;
+      led -> deltas = 0;
+      atomic_fetch_add_explicit(&u -> stats.absolute, 1, memory_order_relaxed);
+    }
+    else
+    {
+      led -> deltas++;
+    }
+    length += size;
+    u -> frame_ids[u -> frame_entries++] = id;
+
+    if (!(led -> state & UPLINK_LED_KNOWN) && (now_ms - led -> seen_ms) > atomic_load_explicit(&u -> stats.new_latency_max_ms, memory_order_relaxed))
+      atomic_store_explicit(&u -> stats.new_latency_max_ms, now_ms - led -> seen_ms, memory_order_relaxed);
+    led -> x = led -> next_x;
+    led -> y = led -> next_y;
+    led -> sent_ms = now_ms;
+    led -> state = (led -> state | UPLINK_LED_KNOWN) & ~UPLINK_LED_PENDING;
+  }
+  u -> pending_count = kept;
+
+  frame[0] = UPLINK_SYNC;
+  frame[1] = (uint8_t)(length - 3);
+  frame[2] = u -> sequence++;
+  crc = uplink_crc(frame + 1, length - 1);
+  frame[length++] = crc >> 8;
+  frame[length++] = crc & 0xFF;
+  return length;
+}
+
+static void uplink_write(uplink *u, const uint8_t *frame, uint32_t length, uint32_t now_ms)
+{
+  if (write(u -> fd, frame, length) != (ssize_t)length)
+    atomic_fetch_add_explicit(&u -> stats.write_errors, 1, memory_order_relaxed);
+  u -> tokens -= length;
+  u -> written += length;
+  u -> frame_ms = now_ms;
+  atomic_fetch_add_explicit(&u -> stats.frames, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&u -> stats.bytes, length, memory_order_relaxed);
+}
+
+/* The LEDs of an LED frame the receiver may not have got, pending again unless they are already. */
+static void uplink_resend(uplink *u, const uplink_sent *f, uint32_t now_ms)
+{
+  for (uint32_t i = 0; i < f -> count; i++)
+  {
+    uplink_led *led = &u -> leds[f -> ids[i]];
+
+    if (led -> state & UPLINK_LED_PENDING)
+      continue;
+    if (u -> pending_count == UPLINK_PENDING_MAX)
+    {
+      atomic_fetch_add_explicit(&u -> stats.dropped, 1, memory_order_relaxed);
+      continue;
+    }
+    u -> pending[u -> pending_count++] = f -> ids[i];
+    led -> state |= UPLINK_LED_PENDING;
+    led -> seen_ms = now_ms;
+  }
+}
+
+/*
+ The oldest frame in flight is lost. The receiver forgets every position
+ at the gap, so every LED goes whole again, and the deltas of the frames
+ after it were ignored, their LEDs go again with its own.
+ */
+static void uplink_lost(uplink *u, uint32_t now_ms)
+{
+  for (uint32_t i = 0; i < UPLINK_LEDS; i++)
+    u -> leds[i].state &= ~UPLINK_LED_KNOWN;
+  for (uint32_t k = 0; k < u -> sent_count; k++)
+    uplink_resend(u, &u -> sent[(u -> sent_first + k) % UPLINK_UNACKED], now_ms);
+  u -> sent_first = (u -> sent_first + 1) % UPLINK_UNACKED;
+  u -> sent_count--;
+}
+
+/* Value of the 2 hex digits at s, -1 if they are not. */
+static int uplink_hex_byte(const char *s)
+{
+  int value = 0;
+
+  for (int i = 0; i < 2; i++)
+  {
+    if (s[i] >= '0' && s[i] <= '9')
+      value = (value << 4) | (s[i] - '0');
+    else if (s[i] >= 'A' && s[i] <= 'F')
+      value = (value << 4) | (s[i] - 'A' + 10);
+    else
+      return -1;
+  }
+  return value;
+}
+
+/*
+ One line of the Sleepy Pi, an answer to the frame in flight with its
+ sequence or a message for the wrapper. The Sleepy Pi answers in order,
+ the frames in flight before the answered one lost their answers.
+ */
+static void uplink_reply(uplink *u, uint32_t now_ms)
+{
+  const char *line = u -> reply;
+  int sequence;
+  uint32_t k;
+
+  if (u -> reply_length >= 6 && line[0] == '0' && line[1] == '0' && (sequence = uplink_hex_byte(line + 4)) >= 0)
+  {
+    for (k = 0; k < u -> sent_count; k++)
+    {
+      if (u -> sent[(u -> sent_first + k) % UPLINK_UNACKED].sequence == sequence)
+        break;
+    }
+    /* Late for a frame already given up on, it has nothing to answer. */
+    if (k == u -> sent_count)
+      return;
+    for (; k > 0; k--)
+    {
+      atomic_fetch_add_explicit(&u -> stats.unanswered, 1, memory_order_relaxed);
+      uplink_lost(u, now_ms);
+    }
+    if (line[2] == '-')
+    {
+      atomic_fetch_add_explicit(&u -> stats.refused, 1, memory_order_relaxed);
+      uplink_lost(u, now_ms);
+    }
+    else
+    {
+      u -> sent_first = (u -> sent_first + 1) % UPLINK_UNACKED;
+      u -> sent_count--;
+    }
+  }
+  else if (u -> reply_length > 0 && u -> log)
+  {
+    log_printf(u -> log, "sleepy_pi - %s\r\n", line);
+  }
+}
+
+/* Feed n bytes the Sleepy Pi sent, and give up on the frames it did not answer in time. */
+void uplink_receive(uplink *u, const uint8_t *bytes, uint32_t n, uint32_t now_ms)
+{
+  for (uint32_t i = 0; i < n; i++)
+  {
+    if (bytes[i] == '\n')
+    {
+      u -> reply[u -> reply_length] = 0;
+      uplink_reply(u, now_ms);
+      u -> reply_length = 0;
+    }
+    else if (bytes[i] != '\r' && u -> reply_length < UPLINK_REPLY_MAX - 1)
+    {
+      u -> reply[u -> reply_length++] = (char)bytes[i];
+    }
+  }
+
+  while (u -> sent_count > 0 && (now_ms - u -> sent[u -> sent_first].ms) > UPLINK_ACK_MS)
+  {
+    atomic_fetch_add_explicit(&u -> stats.unanswered, 1, memory_order_relaxed);
+    uplink_lost(u, now_ms);
+  }
+}
+
+/*
+ Write the frames the link and the budget allow with queued bytes still in
+ the driver, or the heartbeat. Bytes written.
+ */
+uint32_t uplink_send(uplink *u, uint32_t now_ms, uint32_t queued)
+{
+  uint8_t frame[UPLINK_FRAME_MAX];
+  uint32_t allowance = uplink_pace(u, now_ms, queued);
+  uint32_t budget = uplink_window(u, now_ms);
+  uint32_t length, total = 0;
+
+  /* No more frames than the answers are kept for. */
+  while ((!u -> replies || u -> sent_count < UPLINK_UNACKED)
+    && (length = uplink_encode(u, frame, (allowance < budget) ? allowance : budget, now_ms)) > 0)
+  {
+    uplink_write(u, frame, length, now_ms);
+    u -> window[u -> window_slot % UPLINK_WINDOW_SLOTS] += length;
+    u -> window_sum += length;
+    if (u -> replies)
+    {
+      uplink_sent *f = &u -> sent[(u -> sent_first + u -> sent_count++) % UPLINK_UNACKED];
+
+      f -> ms = now_ms;
+      f -> sequence = frame[2];
+      f -> count = u -> frame_entries;
+      memcpy(f -> ids, u -> frame_ids, u -> frame_entries * sizeof(uint16_t));
+    }
+    allowance -= length;
+    budget -= length;
+    total += length;
+  }
+
+  if (total == 0 && (now_ms - u -> frame_ms) >= UPLINK_HEARTBEAT_MS && allowance >= UPLINK_OVERHEAD)
+  {
+    uint16_t crc;
+
+    frame[0] = UPLINK_SYNC;
+    frame[1] = 0;
+    frame[2] = u -> sequence;
+    crc = uplink_crc(frame + 1, 2);
+    frame[3] = crc >> 8;
+    frame[4] = crc & 0xFF;
+    uplink_write(u, frame, UPLINK_OVERHEAD, now_ms);
+    atomic_fetch_add_explicit(&u -> stats.heartbeats, 1, memory_order_relaxed);
+    total = UPLINK_OVERHEAD;
+  }
+  return total;
+}
+
+/*
+ uplink_send with the driver's queue, drivers that do not count it, a pty
+ for one, look idle. What the Sleepy Pi answered until now first.
+ */
+uint32_t uplink_pump(uplink *u, uint32_t now_ms)
+{
+  uint8_t bytes[256];
+  ssize_t n;
+  int queued = 0;
+
+  if (u -> replies)
+  {
+    while ((n = read(u -> fd, bytes, sizeof(bytes))) > 0)
+      uplink_receive(u, bytes, (uint32_t)n, now_ms);
+    uplink_receive(u, bytes, 0, now_ms);
+  }
+  if (ioctl(u -> fd, TIOCOUTQ, &queued) != 0 || queued < 0)
+    queued = 0;
+  return uplink_send(u, now_ms, (uint32_t)queued);
+}
+
+/* Read the detection stream and pump frames, waking up at least every UPLINK_TICK_MS, until closed. */
+static void* uplink_thread(void *args)
+{
+  uplink *u = (uplink*)args;
+
+  while (!atomic_load_explicit(&u -> closed, memory_order_acquire))
+  {
+    uint32_t n = detection_reader_read(&u -> reader, u -> records, LED_CAPACITY);
+    uint32_t now = uplink_now_ms(u);
+
+    for (uint32_t i = 0; i < n; i++)
+      uplink_update(u, &u -> records[i], now);
+    atomic_store_explicit(&u -> stats.lost, (uint32_t)u -> reader.lost, memory_order_relaxed);
+    uplink_pump(u, now);
+    if (n == 0)
+      detection_reader_wait(&u -> reader, UPLINK_TICK_MS);
+  }
+  return NULL;
+}
+
+/* Start reading the detection stream published to shm_name. */
+int uplink_start(uplink *u, const char *shm_name)
+{
+  if (detection_reader_open(&u -> reader, shm_name) != 0)
+    return -1;
+  atomic_store_explicit(&u -> closed, 0, memory_order_relaxed);
+  if (pthread_create(&u -> thread, NULL, uplink_thread, u) != 0)
+  {
+    detection_reader_close(&u -> reader);
+    return -1;
+  }
+  u -> running = 1;
+  return 0;
+}
+
+void uplink_close(uplink *u)
+{
+  if (!u)
+    return;
+
+  if (u -> running)
+  {
+    atomic_store_explicit(&u -> closed, 1, memory_order_release);
+    pthread_join(u -> thread, NULL);
+    detection_reader_close(&u -> reader);
+  }
+  if (u -> fd >= 0)
+    close(u -> fd);
+  free(u -> leds);
+  free(u -> pending);
+  free(u -> order);
+  free(u -> records);
+  free(u);
+}
+
+int uplink_decoder_init(uplink_decoder *d)
+{
+  memset(d, 0, sizeof(*d));
+  d -> sequence = -1;
+  d -> bases = (uplink_base*)calloc(UPLINK_LEDS, sizeof(uplink_base));
+  return d -> bases ? 0 : -1;
+}
+
+void uplink_decoder_destroy(uplink_decoder *d)
+{
+  free(d -> bases);
+  d -> bases = NULL;
+}
+
+/* Entries of a frame whose CRC checked out, into reports from count on. The new count. */
+static uint32_t uplink_decoder_frame(uplink_decoder *d, const uint8_t *payload, uint32_t length, uplink_report *reports, uint32_t count, uint32_t max)
+{
+  uint32_t i = 0;
+
+  while (i < length)
+  {
+    uint8_t tag = payload[i];
+    uint32_t size = (tag & UPLINK_SMALL_DELTA) ? UPLINK_SMALL_DELTA_BYTES
+                  : (tag == UPLINK_DELTA) ? UPLINK_DELTA_BYTES
+                  : (tag == UPLINK_ABSOLUTE) ? UPLINK_ABSOLUTE_BYTES : 0;
+    const uint8_t *p = payload + i;
+    uint16_t key, id;
+    uplink_base *b;
+
+    if (size == 0 || i + size > length)
+    {
+      d -> stats.malformed++;
+      break;
+    }
+    i += size;
+    key = (uint16_t)((p[1] << 8) | p[2]);
+    id = key & LED_DATA_MASK;
+    b = &d -> bases[id];
+
+    if (size == UPLINK_ABSOLUTE_BYTES)
+    {
+      b -> x = (uint16_t)((p[3] << 8) | p[4]);
+      b -> y = (uint16_t)((p[5] << 8) | p[6]);
+      b -> known = 1;
+    }
+    else if (!b -> known)
+    {
+      d -> stats.unknown++;
+      continue;
+    }
+    else if (size == UPLINK_DELTA_BYTES)
+    {
+      b -> x += (int8_t)p[3];
+      b -> y += (int8_t)p[4];
+    }
+    else
+    {
+      b -> x += ((tag >> 3) & 7) - 4;
+      b -> y += (tag & 7) - 4;
+    }
+
+    d -> stats.reports++;
+    if (count < max)
+    {
+      reports[count].id = id;
+      reports[count].voltage = key >> 15;
+      reports[count].x = b -> x;
+      reports[count].y = b -> y;
+      count++;
+    }
+  }
+  return count;
+}
+
+/*
+ Feed n received bytes, the positions of the frames they complete go to
+ reports, up to max of them. Bytes that do not start a frame with a good
+ CRC are skipped one at a time until one does. The number of reports.
+ */
+uint32_t uplink_decoder_push(uplink_decoder *d, const uint8_t *bytes, uint32_t n, uplink_report *reports, uint32_t max)
+{
+  uint32_t count = 0;
+
+  for (uint32_t k = 0; k < n; k++)
+  {
+    d -> buffer[d -> length++] = bytes[k];
+
+    while (d -> length > 0)
+    {
+      uint32_t total, drop = 1;
+
+      if (d -> buffer[0] == UPLINK_SYNC)
+      {
+        if (d -> length < 2)
+          break;
+        total = d -> buffer[1] + UPLINK_OVERHEAD;
+        if (d -> length < total)
+          break;
+
+        if (uplink_crc(d -> buffer + 1, total - 3) == (uint16_t)((d -> buffer[total - 2] << 8) | d -> buffer[total - 1]))
+        {
+          int32_t sequence = d -> buffer[2];
+
+          /* Deltas after a lost frame would apply to positions the receiver never got. Heartbeats use no sequence number. */
+          if (d -> buffer[1] == 0)
+          {
+            d -> stats.heartbeats++;
+          }
+          else
+          {
+            if (d -> sequence >= 0 && sequence != ((d -> sequence + 1) & 0xFF))
+            {
+              d -> stats.gaps += (sequence - d -> sequence - 1) & 0xFF;
+              for (uint32_t i = 0; i < UPLINK_LEDS; i++)
+                d -> bases[i].known = 0;
+            }
+            d -> sequence = sequence;
+          }
+          d -> stats.frames++;
+          count = uplink_decoder_frame(d, d -> buffer + 3, d -> buffer[1], reports, count, max);
+          drop = total;
+        }
+        else
+        {
+          d -> stats.crc_errors++;
+        }
+      }
+      if (drop == 1)
+        d -> stats.skipped++;
+      d -> length -= drop;
+      memmove(d -> buffer, d -> buffer + drop, d -> length);
+    }
+  }
+  return count;
+}
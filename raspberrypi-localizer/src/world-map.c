@@ -0,0 +1,449 @@
+/*
+ ============================================================================
+ Name        : world-map.c
+ Author      : HJ
+ Version     :
+ Copyright   : no strings attached
+ Description : Calibration files, the undistortion table and the per pixel
+               ray table projecting identified LEDs to world coordinates
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "world-map.h"
+
+/*
+ Next line of a calibration file holding numbers, up to max of its comma
+ separated values are parsed. The number of values, -1 at the end of the
+ file. Comments and empty lines are skipped.
+ */
+static int world_map_read_line(FILE *f, double *values, int max)
+{
+  char line[512];
+
+  while (fgets(line, sizeof(line), f))
+  {
+    char *p = line;
+    int n = 0;
+
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0)
+      continue;
+
+    while (n < max)
+    {
+      char *end;
+      double v = strtod(p, &end);
+
+      if (end == p)
+        break;
+      values[n++] = v;
+      p = end;
+      while (*p == ' ' || *p == '\t' || *p == ',')
+        p++;
+    }
+    return n;
+  }
+  return -1;
+}
+
+/* Rows of 3 values into m, 0 if all of them were there. */
+static int world_map_read_matrix(FILE *f, double *m, int rows)
+{
+  for (int i = 0; i < rows; i++)
+  {
+    if (world_map_read_line(f, m + (3 * i), 3) != 3)
+      return -1;
+  }
+  return 0;
+}
+
+static int world_map_invert(const double *a, double *inv)
+{
+  double det = a[0] * (a[4] * a[8] - a[5] * a[7])
+             - a[1] * (a[3] * a[8] - a[5] * a[6])
+             + a[2] * (a[3] * a[7] - a[4] * a[6]);
+
+  if (det == 0.0)
+    return -1;
+
+  inv[0] =  (a[4] * a[8] - a[5] * a[7]) / det;
+  inv[1] = -(a[1] * a[8] - a[2] * a[7]) / det;
+  inv[2] =  (a[1] * a[5] - a[2] * a[4]) / det;
+  inv[3] = -(a[3] * a[8] - a[5] * a[6]) / det;
+  inv[4] =  (a[0] * a[8] - a[2] * a[6]) / det;
+  inv[5] = -(a[0] * a[5] - a[2] * a[3]) / det;
+  inv[6] =  (a[3] * a[7] - a[4] * a[6]) / det;
+  inv[7] = -(a[0] * a[7] - a[1] * a[6]) / det;
+  inv[8] =  (a[0] * a[4] - a[1] * a[3]) / det;
+  return 0;
+}
+
+/* FNV-1a of the whole file, what the undistortion table cache is keyed by. */
+static uint64_t world_map_hash_file(FILE *f)
+{
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  int c;
+
+  rewind(f);
+  while ((c = fgetc(f)) != EOF)
+  {
+    hash ^= (uint8_t)c;
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+/*
+ Camera matrix, distortion coefficients and, when the wrapper has saved it,
+ the camera matrix inverse. The wrapper writes 5 coefficients,
+ calibrate_cameras all 8 of the rational model, the missing ones are 0.
+ */
+static int world_map_load_intrinsics(world_map *m, const char *name)
+{
+  FILE *f = fopen(name, "r");
+  int rc = -1;
+
+  if (!f)
+    return -1;
+  if (world_map_read_matrix(f, m -> camera_matrix, 3) == 0 && world_map_read_line(f, m -> distortion, WORLD_MAP_DISTORTION) >= 5)
+  {
+    rc = 0;
+    if (world_map_read_matrix(f, m -> camera_matrix_inv, 3) != 0)
+      rc = world_map_invert(m -> camera_matrix, m -> camera_matrix_inv);
+    m -> intrinsics_hash = world_map_hash_file(f);
+  }
+  fclose(f);
+  return rc;
+}
+
+/* Camera rotation, rows of 3, then the camera translation on one line. */
+static int world_map_load_extrinsics(world_map *m, const char *name)
+{
+  FILE *f = fopen(name, "r");
+  int rc = -1;
+
+  if (!f)
+    return -1;
+  if (world_map_read_matrix(f, m -> rotation, 3) == 0 && world_map_read_line(f, m -> translation, 3) == 3)
+    rc = 0;
+  fclose(f);
+  return rc;
+}
+
+static int world_map_compare_heights(const void *a, const void *b)
+{
+  return (int)((const world_led_height*)a) -> id - (int)((const world_led_height*)b) -> id;
+}
+
+/* "id, height" lines. */
+static int world_map_load_heights(world_map *m, const char *name)
+{
+  FILE *f = fopen(name, "r");
+  uint32_t capacity = 16;
+  double v[2];
+  int n;
+
+  if (!f)
+    return -1;
+  m -> heights = (world_led_height*)malloc(capacity * sizeof(world_led_height));
+  if (!m -> heights)
+  {
+    fclose(f);
+    return -1;
+  }
+  while ((n = world_map_read_line(f, v, 2)) >= 0)
+  {
+    if (n != 2)
+      continue;
+    if (m -> height_count == capacity)
+    {
+      /* The heights read so far stay in m for world_map_destroy when it fails. */
+      world_led_height *heights = (world_led_height*)realloc(m -> heights, capacity * 2 * sizeof(world_led_height));
+
+      if (!heights)
+      {
+        fclose(f);
+        return -1;
+      }
+      m -> heights = heights;
+      capacity *= 2;
+    }
+    m -> heights[m -> height_count].id = (uint16_t)v[0];
+    m -> heights[m -> height_count].height = (float)v[1];
+    m -> height_count++;
+  }
+  fclose(f);
+  qsort(m -> heights, m -> height_count, sizeof(world_led_height), world_map_compare_heights);
+  return 0;
+}
+
+/* Radial and tangential distortion of normalized camera coordinates, the model cv2 calibrates. */
+static void world_map_distortion(const double *k, double x, double y, double *radial, double *dx, double *dy)
+{
+  double r2 = (x * x) + (y * y);
+
+  *radial = (1.0 + (((((k[4] * r2) + k[1]) * r2) + k[0]) * r2)) / (1.0 + (((((k[7] * r2) + k[6]) * r2) + k[5]) * r2));
+  *dx = (2.0 * k[2] * x * y) + (k[3] * (r2 + (2.0 * x * x)));
+  *dy = (k[2] * (r2 + (2.0 * y * y))) + (2.0 * k[3] * x * y);
+}
+
+/* Pixel (x, y) to undistorted normalized camera coordinates, iterated the way cv2.undistortPoints does. */
+void world_map_undistort_point(const world_map *m, double x, double y, double *xn, double *yn)
+{
+  const double *ki = m -> camera_matrix_inv;
+  double w = (ki[6] * x) + (ki[7] * y) + ki[8];
+  double x0 = ((ki[0] * x) + (ki[1] * y) + ki[2]) / w;
+  double y0 = ((ki[3] * x) + (ki[4] * y) + ki[5]) / w;
+  double u = x0, v = y0;
+
+  for (int i = 0; i < WORLD_MAP_UNDISTORT_ITERATIONS; i++)
+  {
+    double radial, dx, dy;
+
+    world_map_distortion(m -> distortion, u, v, &radial, &dx, &dy);
+    u = (x0 - dx) / radial;
+    v = (y0 - dy) / radial;
+  }
+  *xn = u;
+  *yn = v;
+}
+
+/* Undistorted normalized camera coordinates to the pixel the lens images them at. */
+void world_map_distort_point(const world_map *m, double xn, double yn, double *x, double *y)
+{
+  const double *k = m -> camera_matrix;
+  double radial, dx, dy, u, v;
+
+  world_map_distortion(m -> distortion, xn, yn, &radial, &dx, &dy);
+  u = (xn * radial) + dx;
+  v = (yn * radial) + dy;
+  *x = (k[0] * u) + (k[1] * v) + k[2];
+  *y = (k[3] * u) + (k[4] * v) + k[5];
+}
+
+void world_map_build_undistortion(world_map *m)
+{
+  float *p = m -> undistorted;
+
+  for (uint32_t y = 0; y < FRAME_HEIGHT; y++)
+  {
+    for (uint32_t x = 0; x < FRAME_WIDTH; x++)
+    {
+      double xn, yn;
+
+      world_map_undistort_point(m, x, y, &xn, &yn);
+      p[0] = (float)xn;
+      p[1] = (float)yn;
+      p += 2;
+    }
+  }
+}
+
+/* 0 if name holds the table of this frame size and these intrinsic parameters. */
+int world_map_load_undistortion(world_map *m, const char *name)
+{
+  FILE *f = fopen(name, "rb");
+  world_map_cache_header h;
+  size_t n = FRAME_WIDTH * FRAME_HEIGHT * 2;
+  int rc = -1;
+
+  if (!f)
+    return -1;
+  if (fread(&h, sizeof(h), 1, f) == 1 && h.magic == WORLD_MAP_CACHE_MAGIC && h.version == WORLD_MAP_CACHE_VERSION
+    && h.width == FRAME_WIDTH && h.height == FRAME_HEIGHT && h.hash == m -> intrinsics_hash
+    && fread(m -> undistorted, sizeof(float), n, f) == n)
+    rc = 0;
+  fclose(f);
+  return rc;
+}
+
+/* Written next to name and renamed over it, a localizer starting meanwhile never reads half a table. */
+int world_map_save_undistortion(const world_map *m, const char *name)
+{
+  world_map_cache_header h;
+  size_t n = FRAME_WIDTH * FRAME_HEIGHT * 2;
+  char temp[1024];
+  FILE *f;
+  int rc = -1;
+
+  if (snprintf(temp, sizeof(temp), "%s.%d", name, (int)getpid()) >= (int)sizeof(temp))
+    return -1;
+  f = fopen(temp, "wb");
+  if (!f)
+    return -1;
+
+  memset(&h, 0, sizeof(h));
+  h.magic = WORLD_MAP_CACHE_MAGIC;
+  h.version = WORLD_MAP_CACHE_VERSION;
+  h.width = FRAME_WIDTH;
+  h.height = FRAME_HEIGHT;
+  h.hash = m -> intrinsics_hash;
+  if (fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(m -> undistorted, sizeof(float), n, f) == n)
+    rc = 0;
+  if (fclose(f) != 0)
+    rc = -1;
+  if (rc == 0 && rename(temp, name) != 0)
+    rc = -1;
+  if (rc != 0)
+    unlink(temp);
+  return rc;
+}
+
+/* Line of sight of undistorted normalized camera coordinates in world space, R * (xn, yn, 1). */
+static void world_map_los(const world_map *m, double xn, double yn, double *los)
+{
+  const double *r = m -> rotation;
+
+  for (int i = 0; i < 3; i++)
+    los[i] = (r[3 * i] * xn) + (r[(3 * i) + 1] * yn) + r[(3 * i) + 2];
+}
+
+void world_map_build_rays(world_map *m)
+{
+  const float *p = m -> undistorted;
+  float *ray = m -> rays;
+
+  for (uint32_t y = 0; y < FRAME_HEIGHT; y++)
+  {
+    for (uint32_t x = 0; x < FRAME_WIDTH; x++)
+    {
+      double los[3];
+
+      world_map_los(m, p[0], p[1], los);
+      p += 2;
+      /* A line of sight parallel to the planes of constant height never meets them. */
+      if (fabs(los[2]) < 1e-12)
+      {
+        ray[0] = ray[1] = NAN;
+      }
+      else
+      {
+        ray[0] = (float)(los[0] / los[2]);
+        ray[1] = (float)(los[1] / los[2]);
+      }
+      ray += 2;
+    }
+  }
+}
+
+/*
+ 0 once the three files are loaded and the ray table is built, otherwise
+ the reason is on stderr and the map still needs world_map_destroy. The
+ undistortion table comes from the cache next to the intrinsic parameters
+ when it is there and matches them, otherwise it is built and the cache
+ rewritten.
+ */
+int world_map_load(world_map *m, const char *intrinsics, const char *extrinsics, const char *heights)
+{
+  char cache[1024];
+
+  memset(m, 0, sizeof(*m));
+
+  if (!intrinsics || !extrinsics || !heights)
+  {
+    fprintf(stderr, "World coordinates need the intrinsic and extrinsic parameters and the LED heights\n");
+    return -1;
+  }
+  if (world_map_load_intrinsics(m, intrinsics) != 0)
+  {
+    fprintf(stderr, "Could not load the intrinsic parameters %s\n", intrinsics);
+    return -1;
+  }
+  if (world_map_load_extrinsics(m, extrinsics) != 0)
+  {
+    fprintf(stderr, "Could not load the extrinsic parameters %s\n", extrinsics);
+    return -1;
+  }
+  if (world_map_load_heights(m, heights) != 0)
+  {
+    fprintf(stderr, "Could not load the LED heights %s\n", heights);
+    return -1;
+  }
+
+  m -> undistorted = (float*)malloc(FRAME_WIDTH * FRAME_HEIGHT * 2 * sizeof(float));
+  m -> rays = (float*)malloc(FRAME_WIDTH * FRAME_HEIGHT * 2 * sizeof(float));
+  if (!m -> undistorted || !m -> rays)
+    return -1;
+
+  snprintf(cache, sizeof(cache), "%s%s", intrinsics, WORLD_MAP_CACHE_SUFFIX);
+  if (world_map_load_undistortion(m, cache) == 0)
+  {
+    m -> undistorted_cached = 1;
+  }
+  else
+  {
+    world_map_build_undistortion(m);
+    /* Not fatal, the next start builds the table again. */
+    if (world_map_save_undistortion(m, cache) != 0)
+      fprintf(stderr, "Could not write the undistortion table %s\n", cache);
+  }
+  world_map_build_rays(m);
+  return 0;
+}
+
+void world_map_destroy(world_map *m)
+{
+  free(m -> undistorted);
+  free(m -> rays);
+  free(m -> heights);
+  m -> undistorted = NULL;
+  m -> rays = NULL;
+  m -> heights = NULL;
+  m -> height_count = 0;
+}
+
+/* Height of LED id, or the default height of ID 0. 0 if either is known. */
+int world_map_height(const world_map *m, uint16_t id, float *height)
+{
+  world_led_height key = { id, 0 };
+  const world_led_height *h = (const world_led_height*)bsearch(&key, m -> heights, m -> height_count, sizeof(world_led_height), world_map_compare_heights);
+
+  if (!h && m -> height_count && m -> heights[0].id == 0)
+    h = &m -> heights[0];
+  if (!h)
+    return -1;
+  *height = h -> height;
+  return 0;
+}
+
+/* World X, Y, Z of LED id at pixel (x, y). 0 if its height is known and its line of sight meets that height. */
+int world_map_project(const world_map *m, uint16_t id, uint16_t x, uint16_t y, float *world)
+{
+  const float *ray;
+  float height, scale;
+
+  if (x >= FRAME_WIDTH || y >= FRAME_HEIGHT || world_map_height(m, id, &height) != 0)
+    return -1;
+
+  ray = m -> rays + (2 * ((y * FRAME_WIDTH) + x));
+  if (isnan(ray[0]))
+    return -1;
+
+  scale = height - (float)m -> translation[2];
+  world[0] = (float)m -> translation[0] + (scale * ray[0]);
+  world[1] = (float)m -> translation[1] + (scale * ray[1]);
+  world[2] = height;
+  return 0;
+}
+
+/* The wrapper's calculateWorldCoorinates after cv2.undistortPoints, in double precision and without the tables. */
+int world_map_project_reference(const world_map *m, double height, double x, double y, double *world)
+{
+  double los[3], xn, yn, scale;
+
+  world_map_undistort_point(m, x, y, &xn, &yn);
+  world_map_los(m, xn, yn, los);
+  if (los[2] == 0.0)
+    return -1;
+
+  scale = (height - m -> translation[2]) / los[2];
+  for (int i = 0; i < 3; i++)
+    world[i] = (los[i] * scale) + m -> translation[i];
+  return 0;
+}
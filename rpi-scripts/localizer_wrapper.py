@@ -3,12 +3,12 @@
 from subprocess import Popen, PIPE
 from numpy.linalg import inv
 import numpy as np
-import re
 import os
 import cv2
 import signal
 import sys
-import serial
+import socket
+import struct
 import time
 import threading
 import queue
@@ -34,45 +34,55 @@ def handle_action(cmd):
   elif cmd.startswith("03"):
     wifi_on()
 
-def uart_receiver():
-  global is_active
-  global lock
+def sleepyPiMessage(m):
   global sleepy_pi_logger
-  global serialHandle
-  
-  # Never stop the uart_receiver Thread
-  while True:
-    tlen = 0
-    with lock:
-      msg = ""
-      raw = []
-      while (serialHandle.inWaiting()>0):
-        rec = serialHandle.read(1)
-        tlen += 1
-        raw.append(rec)
-        msg += rec.decode('UTF-8')
-        time.sleep(0.001)
-        
-    if tlen > 0:
-      messages = msg.split("\r\n")
-      for m in messages:
-        if m.startswith("04") or m.startswith("05"):
-          sleepy_pi_logger.debug(m)
-        else:
-          sleepy_pi_logger.info(m)
-        if m.startswith("01"):
-          handle_action(m[2:])
-            
-    time.sleep(2)
 
-def run(command):
-  process = Popen(command.split(' '), stdout=PIPE, shell=False)
-  yield process
+  if m.startswith("04") or m.startswith("05"):
+    sleepy_pi_logger.debug(m)
+  else:
+    sleepy_pi_logger.info(m)
+  if m.startswith("01"):
+    handle_action(m[2:])
+
+def logLocalizerOutput(process):
+  global rpi_logger
+
+  # The localizer's text log, detections come in on the stream socket.
   while True:
-    line = process.stdout.readline().decode('UTF-8').rstrip()
+    line = process.stdout.readline().decode('UTF-8', 'replace').rstrip()
     if not line:
       break
-    yield line
+    # The uplink owns the UART, it passes on what the Sleepy Pi sends besides its answers.
+    if line.startswith(sleepyPiPrefix):
+      sleepyPiMessage(line[len(sleepyPiPrefix):])
+      continue
+    print ("%s" % line, flush = True)
+    rpi_logger.debug("%s" % line)
+
+def connectDetectionStream(path, process):
+  # The localizer creates the socket once the camera runs.
+  while process.poll() is None:
+    try:
+      sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+      sock.connect(path)
+      return sock
+    except OSError:
+      sock.close()
+      time.sleep(0.5)
+  return None
+
+def readDetections(sock):
+  # One message per frame, a detection_batch header and its detection_record's, see detection-stream.h.
+  while True:
+    message = sock.recv(batchFormat.size + 1024 * recordFormat.size)
+    if not message:
+      break
+    (magic, version, recordSize, count, frame) = batchFormat.unpack_from(message, 0)
+    if magic != DETECTION_MAGIC or version != DETECTION_VERSION or recordSize != recordFormat.size:
+      rpi_logger.critical("Unexpected detection stream message: magic %08x, version %d, record size %d." % (magic, version, recordSize))
+      break
+    for i in range(count):
+      yield recordFormat.unpack_from(message, batchFormat.size + i * recordFormat.size)
 
 def loadIntrinsicParameters( intrinsicParametersFile):
   cm = np.zeros(9, dtype = "float64")
@@ -279,8 +289,7 @@ def calculateExtrinsicParameters(ledImageCoordinates, ledWorldCoordinates, camer
     if status:
       if calibPointsCount == 4:
 
-        distortionCoefficients = None
-
+        # The localizer projects through undistorted rays, the extrinsics have to be fitted the same way.
         (status, rotationVector, translationVector)  = cv2.solvePnP(worldPoints, imagePoints, cameraMatrix, distortionCoefficients)
 
         if (status):
@@ -318,32 +327,6 @@ def setupIntrinsicCalibration(intrinsicParametersFile):
   return (status, cameraMatrix, cameraMatrixInv, distortionCoefficients)
 
   
-def parseImageCoordinates(line):
-  status = True
-  id = None
-  p = None
-  x = None
-  y = None
-  ts = None
-  errors = None
-  qsize = None
-  
-  try:
-    result = pattern.match(line)
-    if result:
-      id = int(result.group(1))
-      p = int(result.group(2))
-      x  = int(result.group(3))
-      y  = int(result.group(4))
-      ts  = float(result.group(5))
-      errors  = int(result.group(6))
-      qsize  = int(result.group(7))
-  except:
-    status = False
-  
-  return (status, id, p, x, y, ts, errors, qsize)
-
-  
 def setupExtrinsicCalibration(extrinsicParametersFile, ledImageCoordinates, ledWorldCoordinates, cameraMatrix, distortionCoefficients):
   global rpi_logger
   status = True
@@ -369,60 +352,40 @@ def addImageLed(ledImageCoordinates, id, x, y):
 def addWorldLed(ledWorldCoordinates, id, x, y, z):
   ledWorldCoordinates[id] = np.array([x, y, z], dtype = "float64")
 
-def calculateWorldCoorinates(x, y, height, cameraMatrix, cameraMatrixInv, distortionCoefficients, cameraRotation, cameraTranslation):
-
-    status = True
-    X = None
-    Y = None
-    Z = None
-
-    try:
-
-      inputPoints = np.array([[[x, y]]], dtype = "float64")
-      
-      #undistortedPoints = cv2.undistortPoints(inputPoints, cameraMatrix, distortionCoefficients) # No distortion coefficients, so no need to undistort
-      undistortedPoints = inputPoints
-
-      los = np.zeros((3, 1), dtype = "float64") 
+def startLocalizer(base_folder, localizerArgs, worldCoordinates):
+  global localizerProcess
+  global rpi_logger
 
-      # Initially put the pixel coordinates in the los varaible.
-      los[0] = undistortedPoints[0][0][0]
-      los[1] = undistortedPoints[0][0][1]
-      los[2] = 1
+  # The uplink's empty frames are the Sleepy Pi's heartbeat, it runs before the calibration too.
+  localizerBin = base_folder + "localizer " + localizerArgs + " -stream_socket " + detectionSocket + " " + uplinkArgs
+  if worldCoordinates:
+    # The localizer projects the LEDs to world coordinates itself, and sends them to the Sleepy Pi.
+    localizerBin += " -intrinsics " + intrinsicParametersFile + " -extrinsics " + extrinsicParametersFile + " -led_heights " + ledHeightsFile
 
-      los = np.matmul(cameraMatrixInv, los)
+  localizerProcess = Popen(localizerBin.split(' '), stdout=PIPE, shell=False)
+  rpi_logger.warning("localizer process started.")
+  output_thread = threading.Thread(target=logLocalizerOutput, args=(localizerProcess,))
+  output_thread.start()
 
-      # Apply camera rotation to the line of sight vector.
-      los = np.matmul(cameraRotation, los)
+  return connectDetectionStream(detectionSocket, localizerProcess)
 
-      # Calculate scale to take projection of the LOS vector on the z=0 plane.
-      scale = (-1*cameraTranslation[2] + height)/los[2]
-      scaledLOS = np.multiply( los, scale)
-      point3D = scaledLOS + cameraTranslation
+def stopLocalizer(sock):
+  global localizerProcess
+  global rpi_logger
 
-      X = point3D[0]
-      Y = point3D[1]
-      Z = point3D[2]
-    except:
-      status = False
+  if sock is not None:
+    sock.close()
+  if localizerProcess is not None:
+    localizerProcess.send_signal(signal.SIGINT)
+    rpi_logger.critical("Terminating localization process.")
+    time.sleep(3)
+    localizerProcess.kill()
+    localizerProcess = None
 
-    return (status, X, Y, Z)
-    
-def getLedHeight(id, ledHeights):
-  if id in ledHeights:
-    return ledHeights[id]
-  elif 0 in ledHeights:
-    return ledHeights[0]
-  else:
-    return None
-  
-def reportLedCoordinatesToUART(cameraMatrix, cameraMatrixInv, distortionCoefficients, extrinsicParametersFile, ledWorldCoordinatesFile, ledHeights, base_folder, localizerArgs):
-  global localizerProcess
-  global data_to_send
+def reportLedCoordinatesToUART(cameraMatrix, distortionCoefficients, extrinsicParametersFile, ledWorldCoordinatesFile, base_folder, localizerArgs):
   global rpi_logger
 
   status = True
-  ledWorldCoordinatesLoaded = False
   ledWorldCoordinates = None
   ledImageCoordinates = {}
 
@@ -432,82 +395,49 @@ def reportLedCoordinatesToUART(cameraMatrix, cameraMatrixInv, distortionCoeffici
     rpi_logger.warning("Loaded extrinsicParametersFile: %s." % extrinsicParametersFile)
   else:
     rpi_logger.critical("Could not load extrinsicParametersFile: %s." % extrinsicParametersFile)
-          
-  localizerBin = base_folder + "localizer " + localizerArgs
-    
-  for line in run(localizerBin):
-    if localizerProcess is None:
-      localizerProcess = line
-      rpi_logger.warning("localizer process started.")
-      continue
-    if line is None:
+
+  while True:
+    sock = startLocalizer(base_folder, localizerArgs, externalCalibrationDone)
+    if sock is None:
       rpi_logger.critical("Error in localizer process.")
-      break
+      stopLocalizer(sock)
+      return False
 
-    (status, id, p, x, y, ts, errors, qsize) = parseImageCoordinates(line)
-    
-    if (not status):
-      rpi_logger.critical("Error in parseImageCoordinates.")
-      break
-    
-    if (id is None):
-      print ("%s" % line, flush = True)
-      rpi_logger.debug("%s" % line);
-      continue
+    restart = False
+    for (sequence, id, voltage, confidence, x, y, area, frame, frameTime, timestamp, X, Y, Z, flags) in readDetections(sock):
+      p = id | (voltage << 15)
 
-    print ("Detected: %s" % line, flush = True)
-    rpi_logger.warning("Detected: %s" % line);
-    
-    if (externalCalibrationDone):
-      #getLedHeight
-      height = getLedHeight(id, ledHeights)
-
-      if height is None:
-        rpi_logger.error("Error in getting height for LED: %d - (%d, %d)." % (id, x, y))
-        continue
-
-      # Convert image coordnates to world coordinates
-      (status, X, Y, Z) = calculateWorldCoorinates(x, y, height, cameraMatrix, cameraMatrixInv, distortionCoefficients, cameraRotation, cameraTranslation)
-
-      if (not status):
-        rpi_logger.error("Error in calculating coordinates of LED: %d - (%d, %d)." % (id, x, y))
-        continue
-
-
-      # Print the coordinates to the UART
-      # Convert to binary
-      idid = p.to_bytes(2, byteorder='big', signed=False) 
-      if (X < 0):
-        # rpi_logger.info("Clamping X to zero: X = %d" % int(X*10 + 0.5))
-        X = 0
-      if (Y < 0):
-        # rpi_logger.info("Clamping Y to zero: Y = %d" % int(Y*10 + 0.5))
-        Y = 0
-      xx = (int(X*10 + 0.5)).to_bytes(2, byteorder='big', signed=False) 
-      yy = (int(Y*10 + 0.5)).to_bytes(2, byteorder='big', signed=False) 
-      send_data = idid + xx + yy
-      if data_to_send.full():
-        data_to_send.get()
-      data_to_send.put({"id": id , "data": send_data, "time": datetime.datetime.fromtimestamp(ts).strftime('%Y-%m-%d %H:%M:%S')})
-      print("%04d: (%f, %f, %f), (%08d, %08d, %08d)" % (id, X, Y, Z, int(X*10 + 0.5), int(Y*10 + 0.5), int(Z*10 + 0.5)), flush = True)
-      rpi_logger.warning("%04d: (%f, %f, %f), (%08d, %08d, %08d)" % (id, X, Y, Z, int(X*10 + 0.5), int(Y*10 + 0.5), int(Z*10 + 0.5)))
+      line = "%d: (%d, %d, %d) - Area: %d, Frame: %d, Confidence: %d" % (id, p, x, y, area, frame, confidence)
+      print ("Detected: %s" % line, flush = True)
+      rpi_logger.warning("Detected: %s" % line);
       
-    else:
-      addImageLed(ledImageCoordinates, id, x, y)
-      print("LED - %04d: (%08d, %08d)" % (id, int(x), int(y)), flush = True)
-      rpi_logger.debug("LED - %04d: (%08d, %08d)" % (id, int(x), int(y)))
-      if (len(ledImageCoordinates) >= 4):
-        (status, ledWorldCoordinates) = loadLedWorldCoordinates(ledWorldCoordinatesFile)
-        if (status):
-          (externalCalibrationDone, cameraRotation, cameraTranslation) = setupExtrinsicCalibration(extrinsicParametersFile, ledImageCoordinates, ledWorldCoordinates, cameraMatrix, distortionCoefficients)
-        else:
-          rpi_logger.error ("Faild to load ledWorldCoordinatesFile %s." % ledWorldCoordinatesFile)
-      
-  if localizerProcess is not None:
-    localizerProcess.send_signal(signal.SIGINT)
-    rpi_logger.critical("Terminating localization process.")
-    time.sleep(3)
-    localizerProcess.kill()
+      if (externalCalibrationDone):
+        if not (flags & DETECTION_WORLD):
+          rpi_logger.error("Error in calculating coordinates of LED: %d - (%d, %d)." % (id, x, y))
+          continue
+
+        # The localizer's uplink sends the coordinates to the UART.
+        print("%04d: (%f, %f, %f), (%08d, %08d, %08d)" % (id, X, Y, Z, int(X*10 + 0.5), int(Y*10 + 0.5), int(Z*10 + 0.5)), flush = True)
+        rpi_logger.warning("%04d: (%f, %f, %f), (%08d, %08d, %08d)" % (id, X, Y, Z, int(X*10 + 0.5), int(Y*10 + 0.5), int(Z*10 + 0.5)))
+        
+      else:
+        addImageLed(ledImageCoordinates, id, x, y)
+        print("LED - %04d: (%08d, %08d)" % (id, int(x), int(y)), flush = True)
+        rpi_logger.debug("LED - %04d: (%08d, %08d)" % (id, int(x), int(y)))
+        if (len(ledImageCoordinates) >= 4):
+          (status, ledWorldCoordinates) = loadLedWorldCoordinates(ledWorldCoordinatesFile)
+          if (status):
+            (externalCalibrationDone, cameraRotation, cameraTranslation) = setupExtrinsicCalibration(extrinsicParametersFile, ledImageCoordinates, ledWorldCoordinates, cameraMatrix, distortionCoefficients)
+            if externalCalibrationDone:
+              # Restart the localizer with the calibration it projects the LEDs with.
+              restart = True
+              break
+          else:
+            rpi_logger.error ("Faild to load ledWorldCoordinatesFile %s." % ledWorldCoordinatesFile)
+
+    stopLocalizer(sock)
+    if not restart:
+      break
 
   return status
     
@@ -551,32 +481,6 @@ def signal_handler(sig, frame):
   rpi_logger.warning("signal_handler()")
   cleanup()
 
-def uart_sender():
-  global data_to_send
-  global is_active
-  global lock
-  global rpi_logger
-  
-  while is_active:
-    ct = 0
-    while ct < 5 and not data_to_send.empty():
-      ct += 1
-      d = data_to_send.get()
-      
-      data = d["data"]
-      rpi_logger.debug("Sending data:: time: %s, ID: %d, Data Length: %d" % (d["time"], d["id"], len(data)))
-      
-      with lock:
-        serialHandle.write(data)
-    
-    if ct == 0:
-      d = (int(65535)).to_bytes(2, byteorder='little', signed=False)
-      data = d + d + d
-      with lock:
-        serialHandle.write(data)
-    
-    time.sleep(10)
-
 def setup_logs():
   global sleepy_pi_logger
   global rpi_logger
@@ -600,10 +504,6 @@ def setup_logs():
 
 
 def main():
-  global pattern
-  global format
-  global data_to_send
-  global lock
   global sleepy_pi_logger
   global rpi_logger
   global ledHeightsFile
@@ -611,7 +511,6 @@ def main():
   global ledWorldCoordinatesFile
   global extrinsicParametersFile
   global localizerArgs
-  global serialHandle
 
   setup_logs()
   sleepy_pi_logger.setLevel(logging.INFO)
@@ -641,34 +540,10 @@ def main():
     
   os.system("killall -9 localizer")
   
-  pattern = re.compile(format)
-  
-  data_to_send = queue.Queue(50)
-  
-  lock = threading.Lock()
-  
-  serialHandle = serial.Serial('/dev/ttyS0', 9600)
-  
-  if serialHandle is not None:
-    print("Serial Handle opened successfully.")
-    rpi_logger.warning("Serial Handle opened successfully.")
-  else:
-    print("Error in opening serial handle.")
-    rpi_logger.critical("Error in opening serial handle.")
-    exit()
-  
-  sender_thread = threading.Thread(target=uart_sender)
-  receiver_thread = threading.Thread(target=uart_receiver)
-
-  sender_thread.start()
-  receiver_thread.start()
-
-  status = reportLedCoordinatesToUART(cmx, cmxi, dc, extrinsicParametersFile, ledWorldCoordinatesFile, ledHeights, base_folder, localizerArgs)
+  # The localizer's uplink owns /dev/ttyS0, the Sleepy Pi's messages come in on its output.
+  status = reportLedCoordinatesToUART(cmx, dc, extrinsicParametersFile, ledWorldCoordinatesFile, base_folder, localizerArgs)
   
   cleanup();
-
-  sender_thread.join()
-  receiver_thread.join()
   
   if (not status):
     print("Error while executing localization.")
@@ -676,14 +551,15 @@ def main():
   
   
 localizerProcess = None
-pattern = None
-format = r"(\d+): \((\d+), (\d+), (\d+)\).*Timeshift: (\-?\d+\.?\d*).*errors: (\d+).*qsize: (\d+)"
-data_to_send = None
-lock = None
+# detection_batch and detection_record of detection-stream.h, version 2.
+DETECTION_MAGIC = 0x5344454C
+DETECTION_VERSION = 2
+DETECTION_WORLD = 0x1
+batchFormat = struct.Struct("<IHHII")
+recordFormat = struct.Struct("<IHBBHHIIIQfffI")
 is_active = True
 sleepy_pi_logger = None
 rpi_logger = None
-serialHandle = None
 
 base_folder             = "/home/pi/localization/"
 ledHeightsFile          = base_folder + "ledHeightsFile.txt"
@@ -691,6 +567,11 @@ intrinsicParametersFile = base_folder + "intrinsicParametersFile.txt"
 ledWorldCoordinatesFile = base_folder + "ledWorldCoordinatesFile.txt"
 extrinsicParametersFile = base_folder + "extrinsicParametersFile.txt"
 localizerArgs           = "-b 10 -t 2 -l 0.1 -f 50 -r 50"
+detectionSocket         = "/tmp/localizer.sock"
+# The Sleepy Pi forwards 30 bytes to the mote at a time, every 10 s.
+uplinkArgs              = "-uplink /dev/ttyS0 -uplink_baud 9600 -uplink_budget 3"
+# Lines the uplink read from the Sleepy Pi, see uplink.h.
+sleepyPiPrefix          = "sleepy_pi - "
   
 if __name__ == '__main__':
   main()
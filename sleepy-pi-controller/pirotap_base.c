@@ -57,6 +57,25 @@
 /* ID Range: 1 - 32766                                              */
 /* X/Y Unit: Deci-Meter with respect to real-world origin.          */
 /*                                                                  */
+/* The localizer's uplink sends them in frames instead, see         */
+/* raspberrypi-localizer/inc/uplink.h:                              */
+/*                                                                  */
+/* ----------------------------------------------------------       */
+/* | 0xA5   | Length | Sequence | Entries        | CRC16   |       */
+/* ----------------------------------------------------------       */
+/* | 1 Byte | 1 Byte | 1 Byte   | Length Bytes   | 2 Bytes |       */
+/* ----------------------------------------------------------       */
+/*                                                                  */
+/* Length: up to 25, the whole frame fits the 30 bytes of Data.     */
+/* CRC16 : CCITT, 0x1021 from 0xFFFF over Length to the Entries.    */
+/* Frames with a good CRC are forwarded whole, the far end decodes  */
+/* the delta encoded entries. Empty frames are heartbeats, they     */
+/* are neither forwarded nor answered and use no sequence number,   */
+/* not even with a bad CRC. Every other frame is answered with 00,  */
+/* the window left or -1 when it was not taken, and the frame's     */
+/* sequence in 2 hex digits, 0017A3 V7 or 00-1A4 V7. On -1 the      */
+/* uplink sends its LEDs again.                                     */
+/*                                                                  */
 /********************************************************************/
 /*                                                                  */
 /* SleepyPi -> VersaSense                                           */
@@ -87,10 +106,14 @@
 
 #define DEBUG_MESSAGES          1
 
+#define UPLINK_SYNC             0xA5      // First byte of a frame of the localizer's uplink
+#define UPLINK_OVERHEAD         5         // Sync, length, sequence and CRC
+
 // Buffers 
 uint8_t to_mote[32];
 uint8_t from_rpi[32];
 uint8_t to_rpi[64];
+const char hex_digits[] = "0123456789ABCDEF";
 
 
 uint8_t uptime;
@@ -280,6 +303,22 @@ void loop()
   
 }
 
+// CRC-16/CCITT of an uplink frame, polynomial 0x1021 from 0xFFFF
+uint16_t uplink_crc(const uint8_t *data, uint8_t length)
+{
+  uint16_t crc = 0xFFFF;
+
+  for (uint8_t i = 0; i < length; i++)
+  {
+    crc ^= (uint16_t)data[i] << 8;
+    for (uint8_t b = 0; b < 8; b++)
+    {
+      crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+    }
+  }
+  return crc;
+}
+
 // Reads a block of data from the serial port
 void receiveData()
 {
@@ -288,6 +327,7 @@ void receiveData()
   bool          complete_packet   = true;
   bool          can_wait_more     = false;
   uint8_t       from_rpi_index = 0;
+  uint8_t       frame_length   = 0;
   
   uint8_t       ack_buffer[6];
   uint8_t       incomingByte;
@@ -310,7 +350,21 @@ void receiveData()
       {
         overrun = true;
       }
-      if (from_rpi_index == 6) 
+      if (from_rpi[0] == UPLINK_SYNC)
+      {
+        // An uplink frame, complete once its length is in
+        if (from_rpi_index == 2)
+        {
+          frame_length = from_rpi[1] + UPLINK_OVERHEAD;
+          if (frame_length > 32)
+          {
+            // Not a frame the mote could take, or a 6 byte record of ID 0x25xx
+            overrun = true;
+            break;
+          }
+        }
+      }
+      else if (from_rpi_index == 6) 
       {
         // Ignore heartbeat message
         if ((*((uint16_t*)from_rpi) == ((uint16_t)0xFFFF))) 
@@ -364,7 +418,23 @@ void receiveData()
       break;
     }
     
-    complete_packet = ((from_rpi_index % 6) == 0);
+    if (frame_length)
+    {
+      // One frame at a time, the next one is read on the next loop
+      complete_packet = (from_rpi_index >= frame_length);
+      if (complete_packet)
+      {
+        break;
+      }
+    }
+    else if (from_rpi_index > 0 && from_rpi[0] == UPLINK_SYNC)
+    {
+      complete_packet = false;
+    }
+    else
+    {
+      complete_packet = ((from_rpi_index % 6) == 0);
+    }
     current_time = millis();
     
     if ((current_time - start_time) > 50) 
@@ -375,8 +445,35 @@ void receiveData()
   }
   
 
+  if (frame_length)
+  {
+    // Heartbeats go unanswered even with a bad CRC, and so do frames cut before their sequence
+    if (from_rpi[1] > 0 && from_rpi_index > 2)
+    {
+      // Forward frames with a good CRC whole, the far end checks the sequence
+      if (overrun || from_rpi_index != frame_length
+        || uplink_crc(from_rpi + 1, frame_length - 3) != (((uint16_t)from_rpi[frame_length - 2] << 8) | from_rpi[frame_length - 1])
+        || frame_length > (32 - packet_position))
+      {
+        ack_buffer[0] = '-';
+        ack_buffer[1] = '1';
+      }
+      else
+      {
+        memcpy(to_mote+packet_position, from_rpi, frame_length);
+        packet_position += frame_length;
+        window_size = 32 - packet_position;
+        ack_buffer[0] = (window_size/10) + '0';
+        ack_buffer[1] = (window_size%10) + '0';
+      }
+      // The frame's sequence, the uplink matches the answer to it
+      ack_buffer[2] = hex_digits[from_rpi[2] >> 4];
+      ack_buffer[3] = hex_digits[from_rpi[2] & 0x0F];
+      send_message_to_pi(0, (char*)ack_buffer, 4);
+    }
+  }
   // Only send forward if received complete 6 bytes packets
-  if (written && ((from_rpi_index % 6) == 0))
+  else if (written && ((from_rpi_index % 6) == 0))
   {
     if (overrun || from_rpi_index > (32 - packet_position))
     {